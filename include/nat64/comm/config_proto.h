@@ -32,6 +32,7 @@ enum config_mode {
 	MODE_SESSION,
 	MODE_FILTERING,
 	MODE_TRANSLATE,
+	MODE_TABLES,
 };
 
 enum config_operation {
@@ -40,7 +41,7 @@ enum config_operation {
 	OP_ADD,
 	OP_REMOVE,
 
-	/* The following apply when mode is filtering or translate. */
+	/* The following apply when mode is filtering, translate or tables. */
 	#define SKB_HEAD_ROOM_MASK		(1 << 0)
 	#define SKB_TAIL_ROOM_MASK		(1 << 1)
 	#define RESET_TCLASS_MASK		(1 << 2)
@@ -58,6 +59,13 @@ enum config_operation {
 	#define ICMP_TIMEOUT_MASK		(1 << 4)
 	#define TCP_EST_TIMEOUT_MASK	(1 << 5)
 	#define TCP_TRANS_TIMEOUT_MASK 	(1 << 6)
+
+	#define MAX_LOAD_MASK			(1 << 0)
+	#define MIN_LOAD_MASK			(1 << 1)
+	#define CLEANER_BATCH_MASK		(1 << 2)
+	#define UDP_SLOTS_MASK			(1 << 3)
+	#define TCP_SLOTS_MASK			(1 << 4)
+	#define ICMP_SLOTS_MASK			(1 << 5)
 };
 
 /**
@@ -89,6 +97,16 @@ struct session_entry_us {
 	u_int8_t l4_proto;
 };
 
+/**
+ * A pool6 prefix, from the eyes of userspace ("us" stands for userspace).
+ *
+ * See pool6.h for the fields' doc.
+ */
+struct pool6_entry_us {
+	struct ipv6_prefix prefix;
+	struct ipv4_prefix pool4;
+};
+
 /**
  * Configuration for the "Filtering and Updating" module.
  */
@@ -177,6 +195,107 @@ struct translate_config {
 	__u16 *mtu_plateaus;
 };
 
+/**
+ * What the session cleaners have been up to, since the module was loaded.
+ * All of the shards' cleaners are added together.
+ */
+struct cleaner_stats {
+	/** Number of times a cleaner ran. */
+	__u64 runs;
+	/** Number of times a cleaner ran out of batch and let go of its lock mid-run. */
+	__u64 yields;
+	/** Number of expired sessions the cleaners deleted. */
+	__u64 sessions;
+	/** Duration of the latest run, in nanoseconds. */
+	__u64 last_ns;
+	/** Duration of the longest run, in nanoseconds. */
+	__u64 max_ns;
+	/** Added duration of all the runs, in nanoseconds. */
+	__u64 total_ns;
+};
+
+/**
+ * Memory usage of the arena the BIB or session entries are allocated from.
+ */
+struct cache_stats {
+	/** Size of each object, in bytes (including the padding that aligns it to cache lines). */
+	__u32 object_size;
+	/** Number of objects the arena can currently hold (allocated or not). */
+	__u64 capacity;
+	/** Number of objects currently allocated. */
+	__u64 in_use;
+	/** Number of objects allocated since the module was loaded. */
+	__u64 allocs;
+	/** Number of allocations that failed since the module was loaded. */
+	__u64 failures;
+	/** Number of free objects the arena tries to keep at hand, so it can grow ahead of demand. */
+	__u32 reserve_size;
+	/** Number of objects which had to be taken from the reserve since the module was loaded. */
+	__u64 reserve_draws;
+	/** Number of objects CPUs had to take from other NUMA nodes since the module was loaded. */
+	__u64 remote_draws;
+};
+
+/**
+ * Counters of the CPUs' pool4 caches ("magazines"), which let most borrows and returns of transport
+ * addresses skip the pool's lock.
+ */
+struct magazine_stats {
+	/** Borrows and returns the CPUs' caches handled on their own since the module was loaded. */
+	__u64 hits;
+	/** Borrows and returns which had to go to the pool since the module was loaded. */
+	__u64 misses;
+	/** Number of transport addresses currently sitting in the caches. */
+	__u64 cached;
+};
+
+/**
+ * Size limits of the tables of one protocol. Both have to be powers of two.
+ */
+struct table_slots {
+	/** The tables never have less slots than this (and get this many as soon as they're used). */
+	__u32 min;
+	/** The tables never have more slots than this, no matter how many entries they hold. */
+	__u32 max;
+};
+
+/**
+ * Configuration for the BIB and session hash tables.
+ */
+struct tables_config {
+	/**
+	 * The tables grow when they hold more than this many entries per 100 slots (ie. this is the
+	 * maximum load factor, as a percentage).
+	 */
+	__u16 max_load;
+	/**
+	 * The tables shrink when they hold less than this many entries per 100 slots. Zero means the
+	 * tables should never shrink.
+	 * Has to be less than half of "max_load", otherwise the tables would resize back and forth.
+	 */
+	__u16 min_load;
+	/**
+	 * Maximum number of expired sessions the session cleaner deletes before letting go of the
+	 * locks (and the CPU) for a while. Cannot be zero.
+	 */
+	__u16 cleaner_batch;
+	/**
+	 * Size limits of the UDP, TCP and ICMP tables. If the sessions are sharded, the session limits
+	 * are split evenly between the shards.
+	 */
+	struct table_slots udp_slots;
+	struct table_slots tcp_slots;
+	struct table_slots icmp_slots;
+	/** Read-only; ignored by updates. */
+	struct cleaner_stats cleaner_stats;
+	/** Read-only; ignored by updates. */
+	struct cache_stats bib_cache;
+	/** Read-only; ignored by updates. */
+	struct cache_stats session_cache;
+	/** Read-only; ignored by updates. */
+	struct magazine_stats pool4_magazines;
+};
+
 
 struct request_hdr {
 	__u32 length;
@@ -190,6 +309,8 @@ union request_pool6 {
 	} display;
 	struct {
 		struct ipv6_prefix prefix;
+		/** Ignored by removals. */
+		struct ipv4_prefix pool4;
 	} update;
 };
 
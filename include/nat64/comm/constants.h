@@ -75,6 +75,39 @@
 #define SESSION_TIMER_INTERVAL (10 * 1000)
 
 
+/* -- BIB and Session hash tables -- */
+
+/**
+ * The tables grow when they hold more than this many values per 100 slots.
+ * (ie. this is a percentage of the load factor.)
+ */
+#define TABLES_DEF_MAX_LOAD 100
+/** The tables shrink when they hold less than this many values per 100 slots. */
+#define TABLES_DEF_MIN_LOAD 10
+/** The session cleaner takes a break after deleting this many expired sessions. */
+#define TABLES_DEF_CLEANER_BATCH 1024
+/**
+ * New flows per second the BIB and session entries set aside for memory pressure should be able to
+ * hold out for. (Each new flow needs at most one BIB entry and one session entry.)
+ */
+#define TABLES_DEF_RESERVE_RATE 1024
+/**
+ * Bounds to the number of slots of a BIB or session table (of each of them; every protocol has two
+ * BIB tables and two session tables per shard). Slot counts have to be powers of two.
+ */
+#define TABLES_MIN_SLOTS 64
+#define TABLES_MAX_SLOTS (1 << 24)
+/** Default size limits of the UDP tables. The lower one is also their size once they're used. */
+#define TABLES_DEF_UDP_MIN_SLOTS 1024
+#define TABLES_DEF_UDP_MAX_SLOTS (1 << 20)
+/** Default size limits of the TCP tables. */
+#define TABLES_DEF_TCP_MIN_SLOTS 1024
+#define TABLES_DEF_TCP_MAX_SLOTS (1 << 20)
+/** Default size limits of the ICMP tables. Pings are rarer and shorter-lived than the others. */
+#define TABLES_DEF_ICMP_MIN_SLOTS 256
+#define TABLES_DEF_ICMP_MAX_SLOTS (64 * 1024)
+
+
 /* -- ICMP constants missing from icmp.h and icmpv6.h. -- */
 
 /** Code 0 for ICMP messages of type ICMP_PARAMETERPROB. */
@@ -17,6 +17,11 @@ int str_to_bool(const char *str, bool *bool_out);
 int str_to_u8(const char *str, __u8 *u8_out, __u8 min, __u8 max);
 int str_to_u16(const char *str, __u16 *u16_out, __u16 min, __u16 max);
 int str_to_u16_array(const char *str, __u16 **array_out, __u16 *array_len_out);
+int str_to_u32(const char *str, __u32 *u32_out, __u32 min, __u32 max);
+/**
+ * Parses "str" as two comma-separated integers (eg. "1024,65536"), each within "min" and "max".
+ */
+int str_to_u32_pair(const char *str, __u32 *first_out, __u32 *second_out, __u32 min, __u32 max);
 /**
  * Converts "str" to a IPv4 address. Stores the result in "result".
  *
@@ -34,6 +39,7 @@ int str_to_addr6(const char *str, struct in6_addr *result);
 int str_to_addr4_port(const char *str, struct ipv4_tuple_address *addr_out);
 int str_to_addr6_port(const char *str, struct ipv6_tuple_address *addr_out);
 int str_to_prefix(const char *str, struct ipv6_prefix *prefix_out);
+int str_to_prefix4(const char *str, struct ipv4_prefix *prefix_out);
 
 void print_code_msg(enum error_code code, char *success_msg);
 
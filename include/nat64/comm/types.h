@@ -81,6 +81,12 @@ enum error_code {
 	ERR_POOL4_REINSERT = 1021,
 	ERR_BIB_NOT_FOUND = 1022,
 	ERR_BIB_REINSERT = 1023,
+	ERR_LOAD_LIMITS = 1024,
+	ERR_CLEANER_BATCH = 1025,
+	ERR_POOL6_FULL = 1026,
+	ERR_TABLE_SLOTS = 1027,
+	ERR_POOL6_REINSERT = 1028,
+	ERR_POOL6_SUBSET = 1029,
 
 	/* IPv6 header iterator */
 	ERR_INVALID_ITERATOR = 2000,
@@ -89,12 +95,21 @@ enum error_code {
 	ERR_POOL6_EMPTY = 2200,
 	/* Pool4 */
 	ERR_POOL4_EMPTY = 2300,
+	ERR_POOL4_SELECT = 2301,
+	ERR_POOL4_BLOCK_SIZE = 2302,
+	ERR_POOL4_DETERM = 2303,
 	/* BIB */
 	ERR_INCOMPLETE_INDEX_BIB = 2400,
 	/* Session */
 	ERR_SESSION_NOT_FOUND = 2500,
 	ERR_SESSION_BIBLESS = 2501,
 	ERR_INCOMPLETE_REMOVE = 2502,
+	ERR_PORT_REUSE_SHARDED = 2503,
+
+	/* RSS */
+	ERR_RSS_CONFIG = 2600,
+	/* Deterministic NAT */
+	ERR_DETERM_CONFIG = 2700,
 
 	/* Incoming */
 	ERR_CONNTRACK = 4000,
@@ -165,6 +180,16 @@ struct ipv6_prefix {
 	__u8 len;
 };
 
+/**
+ * An IPv4 network (eg. a range of pool4 addresses).
+ */
+struct ipv4_prefix {
+	/** IPv4 prefix. */
+	struct in_addr address;
+	/** Number of bits from "addr" which represent the network. Zero means "all of IPv4". */
+	__u8 len;
+};
+
 struct tuple_addr {
 	union {
 		struct in_addr ipv4;
@@ -198,15 +223,22 @@ bool ipv6_pair_equals(struct ipv6_pair *pair_1, struct ipv6_pair *pair_2);
 bool ipv6_prefix_equals(struct ipv6_prefix *expected, struct ipv6_prefix *actual);
 
 /**
- * All of these functions compute a 16-bit hash identifier out of the parameter and return it.
+ * All of these functions compute a 32-bit hash identifier out of the parameter and return it.
+ * The hash is keyed, so outsiders who don't know "seed" cannot predict which objects will collide.
+ *
+ * The IPv4 pair hash ignores the remote port, because the session module needs to look up entries
+ * by that partial key.
  *
  * @param addr object you want a hash from.
+ * @param seed secret value which perturbs the result; usually random.
  * @return hash code of "addr".
  */
-__u16 ipv4_tuple_addr_hashcode(struct ipv4_tuple_address *addr);
-__u16 ipv6_tuple_addr_hashcode(struct ipv6_tuple_address *addr);
-__u16 ipv4_pair_hashcode(struct ipv4_pair *pair);
-__u16 ipv6_pair_hashcode(struct ipv6_pair *pair);
+__u32 ipv4_addr_hashcode(struct in_addr *addr, __u32 seed);
+__u32 ipv6_addr_hashcode(struct in6_addr *addr, __u32 seed);
+__u32 ipv4_tuple_addr_hashcode(struct ipv4_tuple_address *addr, __u32 seed);
+__u32 ipv6_tuple_addr_hashcode(struct ipv6_tuple_address *addr, __u32 seed);
+__u32 ipv4_pair_hashcode(struct ipv4_pair *pair, __u32 seed);
+__u32 ipv6_pair_hashcode(struct ipv6_pair *pair, __u32 seed);
 
 bool is_icmp6_info(__u8 type);
 bool is_icmp6_error(__u8 type);
@@ -11,6 +11,8 @@
 
 #include <linux/spinlock.h>
 #include "nat64/comm/types.h"
+#include "nat64/comm/config_proto.h"
+#include "nat64/mod/entry_cache.h"
 
 
 /**
@@ -27,43 +29,125 @@ struct bib_entry {
 
 	/** Should the entry never expire? */
 	bool is_static;
+	/**
+	 * Might other entries be bound to the same IPv4 transport address? (see bib_get_shared_port().)
+	 * Shared entries are not indexed by IPv4; they can only be reached from the IPv4 side through
+	 * their sessions.
+	 */
+	bool is_shared;
 
-	/** Session entries related to this BIB. */
-	struct list_head sessions;
+	/** This entry's handle in the BIB entry arena (see entry_cache.h). */
+	__u32 handle;
+	/**
+	 * Handle of the first session entry related to this BIB (ENTRY_NULL if there are none). The
+	 * rest are chained through their "next_in_bib" fields (see session_first_of_bib()).
+	 */
+	__u32 sessions;
+
+	/** Chains this entry with the rest from the same slot of the IPv4 index (see bib.c). */
+	struct hlist_node ipv4_hook;
+	/** Chains this entry with the rest from the same slot of the IPv6 index (see bib.c). */
+	struct hlist_node ipv6_hook;
+	/** Defers the release of the entry until lockless readers are done with it. */
+	struct rcu_head rcu;
 };
 
 
+/** Number of locks the BIB and session entries are spread over. Has to be a power of two. */
+#define BIB_LOCKS 256
+
 /**
- * Synchronizes the use of both BIB and Session.
- * This is global because:
- * - Locking of BIB and session needs to be performed outside of both of them (because we sometimes
- * decide whether or not to insert based on whether it's already on the table).
- * - The BIB and Session databases are inter-dependent (bib entries point to session entries and
- * vice-versa), which really makes a mess out of filtering if each has its own lock and the entries
- * are private.
+ * Returns the lock which synchronizes the use of the BIB entry whose IPv6 transport address is
+ * "address", along with all of its sessions. (The remote IPv6 transport address of every session
+ * is its BIB entry's IPv6 transport address, so sessions can find their lock too.)
+ *
+ * Locking of BIB and session needs to be performed outside of both of them, because we sometimes
+ * decide whether or not to insert based on whether it's already on the table, and because the BIB
+ * and Session databases are inter-dependent (bib entries point to session entries and vice-versa).
+ * Packets from different BIB entries usually map to different locks, though, so new flows can be
+ * created in parallel.
+ *
+ * The exception are the entries of deterministic subscribers (see determ.h), which all share their
+ * subscriber's lock. Their IPv4 transport addresses come from a range the subscriber does not share
+ * with anyone, so holding that lock is enough to pick one safely.
+ *
+ * Lock ordering: never hold more than one of these locks at a time. The IPv4 pool's lock, the
+ * hash tables' internal locks and the locks of the per-node index (see bib_get_host_ipv4()) can be
+ * taken while holding one, but not the other way around.
+ *
+ * Lookups do not need any of these locks; they can run in RCU read-side critical sections instead.
+ * Anything which adds, removes or modifies entries (other than refreshing a session's lifetime)
+ * still has to hold the entry's lock, and removed entries have to be released using bib_kfree_rcu().
+ */
+spinlock_t *bib_get_lock(struct ipv6_tuple_address *address);
+/**
+ * Returns the index (from zero to BIB_LOCKS - 1) of the lock bib_get_lock() returns for "address".
  */
-extern spinlock_t bib_session_lock;
+unsigned int bib_get_lock_index(struct ipv6_tuple_address *address);
+/**
+ * Returns the lock whose index is "index" (see bib_get_lock_index()).
+ */
+spinlock_t *bib_get_lock_by_index(unsigned int index);
+
 
+/**
+ * Enables or disables port reuse. Call before the hooks are registered.
+ *
+ * In port reuse mode, a UDP or TCP transport address (T, t) the IPv4 pool has no room left for can
+ * be shared by several BIB entries, as long as none of their sessions go to the same remote
+ * transport address (Z, z). The IPv4 side of a session (Z, z, T, t) is therefore still unique, and
+ * IPv4 packets find their BIB entry through their session.
+ * The price is that shared entries (see bib_entry.is_shared) no longer accept packets from IPv4
+ * nodes they haven't opened sessions to, and that a new session can be refused because another
+ * entry already talks to the same (Z, z) from the same (T, t).
+ */
+void bib_set_port_reuse(bool enabled);
+/**
+ * Returns whether port reuse is enabled (see bib_set_port_reuse()).
+ */
+bool bib_port_reuse_enabled(void);
 
 /**
  * Initializes the three tables (UDP, TCP and ICMP).
  * Call during initialization for the remaining functions to work properly.
+ *
+ * @param reserve number of free BIB entries to keep at hand, so the arena can grow ahead of demand.
  */
-int bib_init(void);
+int bib_init(unsigned int reserve);
 
 /**
  * Adds "entry" to the BIB table whose layer-4 protocol is "protocol".
  * Expects all fields from "entry" to have been initialized.
  *
  * Because never in this project is required otherwise, assumes the entry is not yet on the table.
+ * Assumes the entry's lock is held (see bib_get_lock()).
  *
  * @param entry row to be added to the table.
  * @param protocol identifier of the table to add "entry" to. Should be either IPPROTO_UDP,
  *		IPPROTO_TCP or IPPROTO_ICMP from linux/in.h.
- * @return whether the entry could be inserted or not. It will not be inserted if some dynamic
- *		memory allocation failed.
+ * @return whether the entry could be inserted or not. Fails if the arguments are invalid, or if
+ *		there is no memory to index the entry. Failures might happen after some of the indexes
+ *		published the entry, so it has to be released using bib_kfree_rcu().
  */
 int bib_add(struct bib_entry *entry, u_int8_t l4protocol);
+/**
+ * Locks the IPv6 node "address" (using spin_lock_bh()), so nobody else can give it its first BIB
+ * entry in the meantime.
+ * Because the BIB locks are per transport address, two of the node's first flows could otherwise
+ * both see it has no entries, and be bound to different IPv4 addresses. Whoever finds the node
+ * empty is therefore expected to lock it, look again (bib_get_host_ipv4()), and keep the lock until
+ * its entry has been added using bib_add_host_locked().
+ *
+ * Can be taken while holding a BIB lock, but not the other way around.
+ *
+ * @return the lock the caller has to release.
+ */
+spinlock_t *bib_lock_host(struct in6_addr *address);
+/**
+ * Same as bib_add(), except it assumes the lock of the entry's node is also held (see
+ * bib_lock_host()).
+ */
+int bib_add_host_locked(struct bib_entry *entry, u_int8_t l4protocol);
 
 /**
  * Returns the BIB entry from the "l4protocol" table whose IPv4 side (address and port) is
@@ -73,9 +157,25 @@ int bib_add(struct bib_entry *entry, u_int8_t l4protocol);
  * @param l4protocol identifier of the table to retrieve the entry from. Should be either
  *		IPPROTO_UDP, IPPROTO_TCP or IPPROTO_ICMP from linux/in.h.
  * @return the BIB entry from the "l4protocol" table whose IPv4 side (address and port) is
- *		"address". Returns NULL if there is no such an entry.
+ *		"address". Returns NULL if there is no such an entry. Shared entries (see
+ *		bib_entry.is_shared) are never returned; look up their sessions instead.
  */
 struct bib_entry *bib_get_by_ipv4(struct ipv4_tuple_address *address, u_int8_t l4protocol);
+/**
+ * Same as bib_get_by_ipv4(), except it also locks the entry (using spin_lock_bh()).
+ * IPv4 packets need this because they do not know their entry's IPv6 address (and therefore its
+ * lock) until they find it.
+ *
+ * @param address address and port you want the BIB entry for.
+ * @param l4protocol identifier of the table to retrieve the entry from. Should be either
+ *		IPPROTO_UDP, IPPROTO_TCP or IPPROTO_ICMP from linux/in.h.
+ * @param result the BIB entry from the "l4protocol" table whose IPv4 side is "address" will be
+ *		placed here.
+ * @return the lock the caller has to release once done with "result". NULL if there is no such an
+ *		entry, in which case nothing is locked.
+ */
+spinlock_t *bib_lock_by_ipv4(struct ipv4_tuple_address *address, u_int8_t l4protocol,
+		struct bib_entry **result);
 /**
  * Returns the BIB entry from the "l4protocol" table whose IPv6 side (address and port) is
  * "address".
@@ -87,7 +187,22 @@ struct bib_entry *bib_get_by_ipv4(struct ipv4_tuple_address *address, u_int8_t l
  *		"address". Returns NULL if there is no such an entry.
  */
 struct bib_entry *bib_get_by_ipv6(struct ipv6_tuple_address *address, u_int8_t l4protocol);
-struct bib_entry *bib_get_by_ipv6_only(struct in6_addr *address, u_int8_t l4protocol);
+/**
+ * Writes in "result" the IPv4 address the IPv6 node "address" is paired with; that is, the one its
+ * first BIB entry (of any protocol) was bound to. Its later entries are meant to be bound to the
+ * same address ("address pooling paired", RFC 4787 section 4.1).
+ *
+ * This is a single lookup in an index of nodes, so it costs the same regardless of the number of
+ * entries the node has. No locks are needed.
+ *
+ * @return whether "address" has any BIB entries. "result" is only written if it does.
+ */
+bool bib_get_host_ipv4(struct in6_addr *address, struct in_addr *result);
+/**
+ * Returns the number of BIB entries the IPv6 node "address" has in the "l4protocol" table.
+ * No locks are needed, though the answer might be outdated by the time the caller sees it.
+ */
+unsigned int bib_count_by_ipv6(struct in6_addr *address, u_int8_t l4protocol);
 
 /**
  * Returns the BIB entry you'd expect from the "tuple" tuple.
@@ -114,22 +229,93 @@ struct bib_entry *bib_get(struct tuple *tuple);
  */
 bool bib_remove(struct bib_entry *entry, u_int8_t l4protocol);
 
+/**
+ * Port reuse: registers "address", which was just borrowed from the IPv4 pool, as a transport
+ * address several BIB entries can share. The entry it is meant for is its first user.
+ *
+ * @return result status (< 0 on error). On error, "address" can still be used exclusively.
+ */
+int bib_add_shared_port(u_int8_t l4protocol, struct ipv4_tuple_address *address);
+/**
+ * Port reuse: adds a user to "address", if it is shared (see bib_add_shared_port()).
+ *
+ * @return whether "address" is shared, and therefore can be used by one more entry.
+ */
+bool bib_get_shared_port(u_int8_t l4protocol, struct ipv4_tuple_address *address);
+/**
+ * Port reuse: reverts bib_add_shared_port() or bib_get_shared_port().
+ *
+ * @return whether that was the last user of "address", in which case the caller is expected to
+ *		return it to the IPv4 pool.
+ */
+bool bib_put_shared_port(u_int8_t l4protocol, struct ipv4_tuple_address *address);
+/**
+ * Call once "entry" has been removed from its table. Returns whether its IPv4 transport address
+ * should go back to the IPv4 pool; that is, unless it is shared and other entries still use it.
+ */
+bool bib_release_port(struct bib_entry *entry, u_int8_t l4protocol);
+/**
+ * Returns the lock which serializes the creation of sessions whose local IPv4 transport address is
+ * "address", if it is shared. The BIB locks are not enough for that, since every entry which shares
+ * the address has its own.
+ * Can be taken while holding a BIB lock, but not the other way around.
+ */
+spinlock_t *bib_get_port_lock(struct ipv4_tuple_address *address);
+
 /**
  * Empties the BIB tables, freeing any memory being used by them.
  * Call during destruction to avoid memory leaks.
  */
 void bib_destroy(void);
 
+/**
+ * Changes the load factor thresholds at which the BIB tables grow and shrink.
+ *
+ * @param max_load the tables grow when they hold more than this many entries per 100 slots.
+ * @param min_load the tables shrink when they hold less than this many entries per 100 slots.
+ */
+void bib_set_load_limits(__u16 max_load, __u16 min_load);
+
+/**
+ * Changes the number of slots the "l4protocol" BIB tables are allowed to have. The tables don't
+ * allocate anything until their first entry is inserted.
+ *
+ * @param min_slots the tables never shrink below this, and grow to it as soon as they're used.
+ * @param max_slots the tables never grow beyond this.
+ * @return result status (< 0 on error; see SET_SIZE_LIMITS in hash_table.c).
+ */
+int bib_set_size_limits(u_int8_t l4protocol, __u32 min_slots, __u32 max_slots);
+
 /**
  * Helper function, intended to initialize a BIB entry.
  * The entry is generated IN DYNAMIC MEMORY (if you end up not inserting it to a BIB table, you need
- * to kfree it).
+ * to bib_kfree() it).
  */
 struct bib_entry *bib_create(struct ipv4_tuple_address *ipv4, struct ipv6_tuple_address *ipv6,
 		bool is_static);
 
 /**
- * Asume que el candado ya se reservó.
+ * Returns "entry" to the BIB entry cache right away. Only for entries nobody else can be looking at
+ * (eg. ones which were never handed to bib_add()).
+ * Its session list has to be empty.
+ */
+void bib_kfree(struct bib_entry *entry);
+
+/**
+ * Returns "entry" to the BIB entry cache once the lockless readers are done with it. Meant for
+ * entries which were just removed from the tables.
+ * Its session list has to be empty.
+ */
+void bib_kfree_rcu(struct bib_entry *entry);
+
+/**
+ * Copies the BIB entry cache's counters to "result".
+ */
+void bib_get_cache_stats(struct cache_stats *result);
+
+/**
+ * Reserva los candados internos de la tabla por su cuenta; no hace falta reservar ningún otro.
+ * "func" corre con uno de ellos reservado, así que no debe dormir ni modificar la tabla.
  */
 int bib_for_each(__u8 l4protocol, int (*func)(struct bib_entry *, void *), void *arg);
 
@@ -0,0 +1,84 @@
+#ifndef _NF_NAT64_DETERM_H
+#define _NF_NAT64_DETERM_H
+
+/**
+ * @file
+ * Deterministic NAT64 (along the lines of RFC 7422).
+ *
+ * The IPv6 side is split into subscribers, each of them a prefix of "subscriber_len" bits within
+ * "prefix6" (eg. the /56s of a /40). The IPv4 side is a range of addresses ("prefix4"), and the
+ * ports from DETERM_MIN_PORT upwards of each address are split into ranges of "ports" ports.
+ * Subscriber number s gets range number s / A of address number s % A, A being the number of
+ * addresses, so consecutive subscribers are spread over the addresses first.
+ *
+ * Because the mapping is a formula, it can be computed in both directions without any state or
+ * locking, and the NAT64 does not need to log which subscriber used which transport address.
+ * Subscribers which do not fit in the IPv4 range are not mapped; they are served by pool4 instead.
+ *
+ * The IPv4 range must not overlap with pool4, so pool4 refuses its addresses. This module has to be
+ * initialized first.
+ *
+ * @author Alberto Leiva
+ */
+
+#include <linux/types.h>
+#include "nat64/comm/types.h"
+
+
+/** The deterministic ranges start here. Lower ports are left alone, as RFC 6146 suggests. */
+#define DETERM_MIN_PORT 1024
+
+/** The IPv4 side of a subscriber. */
+struct determ_range {
+	/** The subscriber's IPv4 address. */
+	struct in_addr addr;
+	/** The first port of the subscriber's range. */
+	__u16 first;
+	/** Number of ports in the range. */
+	__u16 count;
+};
+
+/**
+ * Readies the rest of this module for future use.
+ * If "prefix6" is NULL or empty, the deterministic mode is disabled.
+ *
+ * @param prefix6 the IPv6 prefix the subscribers belong to (eg. "2001:db8::/40").
+ * @param subscriber_len length of each subscriber's prefix; no more than 32 bits longer than
+ *		"prefix6"'s.
+ * @param prefix4 the IPv4 addresses the subscribers are mapped to (eg. "192.0.2.0/24").
+ * @param ports number of ports each subscriber gets.
+ * @return result status (< 0 on error).
+ */
+int determ_init(char *prefix6, unsigned int subscriber_len, char *prefix4, unsigned int ports);
+/**
+ * Frees resources allocated by this module.
+ */
+void determ_destroy(void);
+
+/**
+ * Returns whether the deterministic mode was configured.
+ */
+bool determ_is_enabled(void);
+
+/**
+ * Writes in "index" the number of the subscriber "addr" belongs to, if it is mapped.
+ */
+bool determ_get_subscriber(struct in6_addr *addr, __u32 *index);
+/**
+ * Computes the IPv4 address and port range the subscriber "addr" belongs to is mapped to.
+ *
+ * @return zero on success, -ESRCH if "addr" is not a mapped subscriber.
+ */
+int determ_get_range(struct in6_addr *addr, struct determ_range *result);
+/**
+ * Computes the prefix of the subscriber "addr" is mapped from.
+ *
+ * @return zero on success, -ESRCH if "addr" does not belong to any subscriber's range.
+ */
+int determ_get_prefix(struct ipv4_tuple_address *addr, struct ipv6_prefix *result);
+/**
+ * Returns whether "addr" is one of the deterministic IPv4 addresses.
+ */
+bool determ_contains4(struct in_addr *addr);
+
+#endif /* _NF_NAT64_DETERM_H */
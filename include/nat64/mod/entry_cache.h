@@ -0,0 +1,152 @@
+#ifndef _NF_NAT64_ENTRY_CACHE_H
+#define _NF_NAT64_ENTRY_CACHE_H
+
+/**
+ * @file
+ * An arena for the BIB and session entries, which also keeps count of what it hands out.
+ *
+ * One entry of each kind is created and destroyed for every short-lived flow, so they get their own
+ * allocator instead of kmalloc()'s general purpose one. Objects are carved out of large chunks of
+ * memory and identified by 32-bit handles (their index in the arena, plus one), which is what the
+ * entries use to link to each other; a handle is half the size of a pointer and never needs to be
+ * patched when memory moves, because it doesn't.
+ *
+ * Released objects are chained through their first four bytes, so the free lists cost nothing.
+ * Each CPU keeps a small list of its own; objects are moved between it and the shared list in
+ * batches, so most allocations and releases don't touch the shared lock.
+ * The counters are per-CPU as well, so keeping them doesn't bounce cache lines around either.
+ *
+ * The shared list is actually one list per NUMA node, and every chunk is allocated from the
+ * node whose list it feeds. CPUs refill from their own node's list and drain to it, so the objects
+ * a CPU works with are usually local to it. A CPU only takes objects from other nodes when its own
+ * node cannot provide any.
+ *
+ * vmalloc() cannot be called from the packet path, so the arena is grown in the background: a
+ * number of free objects (the reserve, split between the nodes which have CPUs) is kept in the
+ * shared lists, and whenever a node's falls below its share, more chunks are requested from process
+ * context. If the packet path still runs out, it tries to get a chunk from the page allocator on
+ * its own before giving up.
+ *
+ * Chunks are only returned to the kernel when the whole cache is destroyed, which also means that
+ * tearing down a table doesn't require releasing its entries one by one.
+ *
+ * @author Alberto Leiva
+ */
+
+#include <linux/types.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include "nat64/comm/config_proto.h"
+
+
+/** The handle that doesn't identify any object (the arena's "NULL"). */
+#define ENTRY_NULL 0
+
+/** One CPU's share of an entry cache's counters and free objects. */
+struct entry_cache_cpu {
+	/** Objects this CPU allocated. */
+	unsigned long allocs;
+	/** Objects this CPU released (not necessarily the ones it allocated). */
+	unsigned long frees;
+	/** Allocations that failed on this CPU. */
+	unsigned long failures;
+	/** Objects this CPU took from its node's free list while it was below the reserve. */
+	unsigned long reserve_draws;
+	/** Objects this CPU had to take from other nodes, because its own had none left. */
+	unsigned long remote_draws;
+
+	/** First object of this CPU's free list (ENTRY_NULL if it's empty). */
+	__u32 free_head;
+	/** Last object of this CPU's free list (meaningless if it's empty). */
+	__u32 free_tail;
+	/** Length of this CPU's free list. */
+	unsigned int free_count;
+};
+
+/** One NUMA node's share of an entry cache's free objects. */
+struct entry_cache_node {
+	/** Protects this node's free list. */
+	spinlock_t lock;
+	/** First object of this node's free list (ENTRY_NULL if it's empty). */
+	__u32 free_head;
+	/** Length of this node's free list. */
+	unsigned int free_count;
+	/** The node grows whenever its free list gets down to this many objects. */
+	unsigned int reserve_size;
+	/** Requests chunks from process context, where vmalloc() is allowed. */
+	struct work_struct grow_work;
+
+	/** The node this structure stands for. */
+	int nid;
+	struct entry_cache *cache;
+};
+
+struct entry_cache {
+	/** Size of the objects, in bytes (including padding). */
+	unsigned int size;
+	/** Each chunk holds 2^chunk_shift objects. */
+	unsigned int chunk_shift;
+	/** The memory the objects are carved from. Only the first "chunk_count" slots are used. */
+	void **chunks;
+	/** Number of chunks allocated so far. */
+	unsigned int chunk_count;
+	/** Length of "chunks"; the cache will not grow beyond this many chunks. */
+	unsigned int max_chunks;
+	/** Protects the chunk list. Never taken before a node's lock. */
+	spinlock_t lock;
+
+	/** The free lists, indexed by NUMA node. */
+	struct entry_cache_node **nodes;
+
+	const char *name;
+	struct entry_cache_cpu __percpu *cpus;
+};
+
+/**
+ * Readies "cache" for use.
+ *
+ * @param name name of the cache, as seen in the log.
+ * @param size size of the objects, in bytes. Has to be at least four.
+ * @param hwcache_align whether the objects should start at cache line boundaries. Prevents
+ *		objects from sharing lines, at the cost of the padding. Small, numerous objects which are
+ *		rarely written by more than one CPU at a time are better off packed.
+ * @param reserve number of free objects the cache tries to always have at hand, between all the
+ *		nodes. The initial chunks are sized after it. Can be zero.
+ * @return result status (< 0 on error).
+ */
+int entry_cache_init(struct entry_cache *cache, const char *name, size_t size,
+		bool hwcache_align, unsigned int reserve);
+
+/**
+ * Releases "cache", along with every object still allocated from it. No RCU callbacks which
+ * touch its objects may be pending (see rcu_barrier()).
+ */
+void entry_cache_destroy(struct entry_cache *cache);
+
+/**
+ * Returns a new object from "cache" (NULL if there's no memory left), and writes its handle in
+ * "handle". The object is not zeroed.
+ * Can be called from atomic context.
+ */
+void *entry_cache_alloc(struct entry_cache *cache, __u32 *handle);
+/**
+ * Returns the object identified by "handle" to "cache".
+ */
+void entry_cache_free(struct entry_cache *cache, __u32 handle);
+
+/**
+ * Returns the object identified by "handle", which must not be ENTRY_NULL.
+ */
+static inline void *entry_cache_get(struct entry_cache *cache, __u32 handle)
+{
+	__u32 index = handle - 1;
+	__u32 mask = (1U << cache->chunk_shift) - 1;
+	return cache->chunks[index >> cache->chunk_shift] + (index & mask) * cache->size;
+}
+
+/**
+ * Copies "cache"'s counters to "result".
+ */
+void entry_cache_get_stats(struct entry_cache *cache, struct cache_stats *result);
+
+#endif /* _NF_NAT64_ENTRY_CACHE_H */
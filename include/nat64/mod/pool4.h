@@ -5,6 +5,15 @@
  * @file
  * The pool of IPv4 addresses (and their ports).
  *
+ * Each CPU keeps a small cache ("magazine") of transport addresses per kind of port, which it fills
+ * and empties in batches. Borrows and returns are served from there when possible, so most of them
+ * don't touch the pool's lock.
+ *
+ * Optionally, the pool can also lend ports in blocks (Port Block Allocation): the first time an
+ * IPv6 node needs a port of some kind, it is given a block of them (all from the same IPv4
+ * address), and its subsequent flows take their ports from there. The block is given back once all
+ * of its ports are. This way, the pool (and its log) only hears about blocks.
+ *
  * @author Alberto Leiva
  */
 
@@ -14,6 +23,26 @@
 #include "nat64/comm/config_proto.h"
 
 
+/**
+ * Ways pool4_get_any() can choose the IPv4 address it lends a port from.
+ * Only addresses which still have compatible ports are considered, so every mode takes constant
+ * time regardless of how exhausted the pool is.
+ */
+enum pool4_select {
+	/** Take turns ("round-robin"). */
+	POOL4_SELECT_ROUND_ROBIN,
+	/**
+	 * Prefer the address with the most compatible ports left ("least-loaded"). This is
+	 * approximated by choosing the better of two random candidates.
+	 */
+	POOL4_SELECT_LEAST_LOADED,
+	/**
+	 * Hash the IPv6 source address ("source-hash"), so each IPv6 node keeps getting the same IPv4
+	 * address while it has ports left. Falls back to round robin otherwise.
+	 */
+	POOL4_SELECT_SOURCE_HASH,
+};
+
 /**
  * Readies the rest of this module for future use.
  *
@@ -27,9 +56,29 @@ int pool4_init(char *addr_strs[], int addr_count);
  */
 void pool4_destroy(void);
 
+/**
+ * Changes the way pool4_get_any() chooses addresses.
+ *
+ * @param name "round-robin", "least-loaded" or "source-hash" (see enum pool4_select). NULL means
+ *		the default (round robin).
+ * @return result status (< 0 on error).
+ */
+int pool4_set_select(char *name);
+/**
+ * Enables Port Block Allocation, or disables it if "size" is zero.
+ * Only meant to be called before anything is borrowed.
+ *
+ * @param size number of ports each block should hold. Has to be a power of two, from 2 to
+ *		BITS_PER_LONG. Blocks are "size" consecutive compatible ports (so UDP ports are two units
+ *		apart), starting at a multiple of "size".
+ * @return result status (< 0 on error).
+ */
+int pool4_set_block_size(unsigned int size);
+
 /**
  * Inserts the "address" address (along with its 64k ports) into the "l4protocol" pool.
  * These elements will then become borrowable through the pool_get_* functions.
+ * Addresses from the deterministic range (see determ.h) are rejected.
  */
 int pool4_register(struct in_addr *address);
 /**
@@ -45,10 +94,21 @@ int pool4_remove(struct in_addr *address);
  * 'Compatible' means same parity and range. See RFC 6146 section 3.5.1.1 for more details on this
  * port hack.
  *
+ * The address is chosen as pool4_set_select() says. "source" is the IPv6 node the transport address
+ * is meant for; it can be NULL if it's not known.
+ *
+ * If RSS awareness is enabled (see rss.h) and "remote" is not NULL, prefers a transport address
+ * such that the IPv4 packets from "remote" towards it will be received by the current CPU.
+ *
+ * If blocks are enabled and "source" is not NULL, the port comes from one of "source"'s blocks
+ * instead, and none of the above applies. Loose ports are only lent if there are no whole blocks
+ * left.
+ *
  * @return whether there was something available (and compatible) in the pool. if "false", "result"
  *		will point to garbage.
  */
-bool pool4_get_any(u_int8_t l4protocol, __be16 port, struct ipv4_tuple_address *result);
+bool pool4_get_any(u_int8_t l4protocol, __be16 port, struct in6_addr *source,
+		struct ipv4_tuple_address *remote, struct ipv4_tuple_address *result);
 /**
  * Reserves and returns a transport address from the "l4protocol" pool.
  * The address's IPv4 address will be "address.address" and its port will be 'compatible' with
@@ -60,18 +120,31 @@ bool pool4_get_any(u_int8_t l4protocol, __be16 port, struct ipv4_tuple_address *
  *		Will return NULL if there's nothing available (and compatible) in the pool.
  *		This resulting object will be stored in the heap. If you never return it (by means of
  *		pool4_return()), you're expected to kfree it once you're done with it.
+ *
+ * "source" and "remote" are used as in pool4_get_any(); only the port is chosen with them in mind,
+ * though.
  */
 bool pool4_get_similar(u_int8_t l4protocol, struct ipv4_tuple_address *address,
+		struct in6_addr *source, struct ipv4_tuple_address *remote,
 		struct ipv4_tuple_address *result);
 
 bool pool4_get(u_int8_t l4protocol, struct ipv4_tuple_address *address);
 /**
  * Don't sweat it too much if this function fails; the user might have removed the address from the
  * pool.
+ * Deterministic transport addresses (see determ.h) are accepted and ignored.
  */
 bool pool4_return(u_int8_t l4protocol, struct ipv4_tuple_address *address);
 
+/**
+ * Returns whether "address" is one of the NAT64's IPv4 addresses: either part of the pool, or one
+ * of the deterministic ones (see determ.h).
+ */
 bool pool4_contains(struct in_addr *address);
+/**
+ * Copies the counters of the CPUs' caches to "result".
+ */
+void pool4_get_magazine_stats(struct magazine_stats *result);
 int pool4_for_each(int (*func)(struct in_addr *, void *), void * arg);
 
 #endif /* _NF_NAT64_POOL4_H */
@@ -5,23 +5,109 @@
  * @file
  * The pool of IPv6 addresses.
  *
+ * The pool is a set of RFC 6052 prefixes. An address belongs to the prefix which matches the most
+ * bits of it, so prefixes can be nested.
+ *
+ * Readers see an immutable snapshot of the pool: a binary trie whose single-child paths are
+ * compressed into one node, published by RCU. Every configuration change builds a new snapshot and
+ * swaps it in, so lookups (one per packet, usually more) never take a lock and never wait for the
+ * configuration.
+ *
+ * Each prefix can also be given a subset of pool4 to mask its flows with, so different prefixes
+ * (eg. different customers) can be translated into different IPv4 addresses.
+ *
  * @author Alberto Leiva
  */
 
 #include <linux/types.h>
 #include <linux/in6.h>
+#include <asm/byteorder.h>
 #include "nat64/comm/types.h"
 #include "nat64/comm/config_proto.h"
 
 
+/** Largest pool4 subset a prefix can have, expressed as a prefix length. */
+#define POOL6_SUBSET_MIN_LEN 24
+
+/** What the pool knows about one of its prefixes. */
+struct pool6_entry {
+	/** The prefix itself. Its length is one of POOL6_PREFIX_LENGTHS. */
+	struct ipv6_prefix prefix;
+	/** The prefix's index (see pool6_get_by_index()). */
+	__u8 index;
+	/**
+	 * The pool4 addresses the flows towards "prefix" should be masked with. Length zero means any
+	 * of them.
+	 */
+	struct ipv4_prefix pool4;
+};
+
+/**
+ * Readies the rest of this module for future use.
+ *
+ * @param pref_strs array of strings denoting the prefixes the pool should start with. Each one can
+ *		be followed by "=" and the prefix's pool4 subset (eg. "64:ff9b::/96=192.0.2.0/24").
+ * @param pref_count size of the "pref_strs" array. If zero, the pool starts with POOL6_DEF.
+ * @return result status (< 0 on error).
+ */
 int pool6_init(char *pref_strs[], int pref_count);
+/**
+ * Frees resources allocated by the pool.
+ */
 void pool6_destroy(void);
 
-int pool6_register(struct ipv6_prefix *prefix);
+/**
+ * Adds "prefix" to the pool.
+ *
+ * @param pool4 "prefix"'s pool4 subset. NULL (or length zero) means all of pool4.
+ * @return result status (< 0 on error).
+ */
+int pool6_register(struct ipv6_prefix *prefix, struct ipv4_prefix *pool4);
 int pool6_remove(struct ipv6_prefix *prefix);
 
 bool pool6_contains(struct in6_addr *address);
+/**
+ * Copies to "result" the prefix from the pool "address" belongs to.
+ *
+ * @return whether "address" belongs to the pool.
+ */
+bool pool6_get(struct in6_addr *address, struct pool6_entry *result);
+/**
+ * Returns (in "prefix") the prefix from the pool "address" belongs to, along with its index.
+ * The index keeps referring to that prefix for as long as the module is loaded, even if it's
+ * removed from the pool, so it can be stored instead of the prefix (see pool6_get_by_index()).
+ *
+ * @return whether "address" belongs to the pool.
+ */
+bool pool6_get_index(struct in6_addr *address, struct ipv6_prefix *prefix, __u8 *index);
+/**
+ * Returns the prefix pool6_get_index() identified by "index". Needs no locks.
+ */
+struct ipv6_prefix *pool6_get_by_index(__u8 index);
+/**
+ * Copies to "out" the oldest prefix of the pool.
+ */
 bool pool6_peek(struct ipv6_prefix *out);
-int pool6_for_each(int (*func)(struct ipv6_prefix *, void *), void * arg);
+/**
+ * Copies to "out" the prefix whose flows can be masked with the pool4 address "addr". If several
+ * can, the one with the smallest subset wins (the oldest, if that's a tie).
+ * Meant for IPv4 nodes starting conversations, since their packets don't say which prefix they
+ * should be seen through.
+ */
+bool pool6_peek_by_pool4(struct in_addr *addr, struct ipv6_prefix *out);
+/**
+ * Calls "func" for every prefix of the pool, oldest first. "func" runs in an RCU read-side
+ * critical section, so it cannot sleep.
+ */
+int pool6_for_each(int (*func)(struct pool6_entry *, void *), void * arg);
+
+/**
+ * Returns whether "addr" belongs to "prefix".
+ */
+static inline bool ipv4_prefix_contains(struct ipv4_prefix *prefix, struct in_addr *addr)
+{
+	__u32 mask = prefix->len ? (~0U << (32 - prefix->len)) : 0;
+	return ((be32_to_cpu(prefix->address.s_addr) ^ be32_to_cpu(addr->s_addr)) & mask) == 0;
+}
 
 #endif /* _NF_NAT64_POOL6_H */
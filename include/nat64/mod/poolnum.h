@@ -1,27 +1,102 @@
 #ifndef _NF_NAT64_POOLNUM_H
 #define _NF_NAT64_POOLNUM_H
 
+/**
+ * @file
+ * A pool of numbers (ports or ICMP identifiers) which can be borrowed and returned.
+ *
+ * The pool is a bitmap with one bit per value (set if the value is available), plus a summary
+ * bitmap which has one bit per word of the first one (set if the word has any available values).
+ * Querying, borrowing or returning a specific value is a single bit operation, and finding any
+ * available value takes at most a couple of word searches, no matter how crowded the pool is.
+ *
+ * Random borrows start looking at a pseudorandom value and take the first available one from there
+ * on (wrapping around). The starting points are produced by a small keyed block cipher (a Feistel
+ * network) which encrypts a counter, so they visit every value in an unpredictable order without
+ * the order having to be stored anywhere.
+ *
+ * Pools are cheap until they are used: the bitmaps and the key are only created when the first
+ * value is borrowed. Until then, every value is available.
+ *
+ * The pool is not thread-safe; its users are expected to serialize access to it.
+ *
+ * @author Alberto Leiva
+ */
+
 #include <linux/types.h>
 
 struct poolnum {
-	u16 *array;
-	u32 count;
-	/** The index of the next value that will be retrieved, if the pool still has values. */
-	u32 next;
-	/** The slot where the next returned value will be placed in, but only if next is ahead. */
-	u32 returned;
 	/**
-	 * Whether next is ahead of returned. If they point to the same slot, this will tell whether
-	 * the pool is exhausted or if nothing has been retrieved.
+	 * Bit i is set if the value "min + i * step" is available.
+	 * NULL if nothing has been borrowed yet, in which case everything is available.
 	 */
-	bool next_is_ahead;
+	unsigned long *bitmap;
+	/** Bit i is set if the word "bitmap[i]" is nonzero. */
+	unsigned long *summary;
+	/** Length of "bitmap", in words. */
+	u32 words;
+
+	/** Smallest value in the pool. */
+	u16 min;
+	/** Distance between consecutive values in the pool. */
+	u16 step;
+	/** Number of values the pool was created with. */
+	u32 count;
+	/** Number of values which are currently available. */
+	u32 free_count;
+
+	/** Key of the permutation which decides where random borrows start looking. */
+	u32 key;
+	/** Plaintext of the next random borrow's starting point. */
+	u32 cursor;
+	/** The permutation works on numbers of 2 * "half_bits" bits. */
+	u8 half_bits;
 };
 
+/**
+ * Readies "pool" to hand out the values from "min" to "max" (both included), jumping "step" values
+ * at a time. Every value is initially available.
+ * Doesn't allocate anything; that's postponed until the first borrow.
+ */
 int poolnum_init(struct poolnum *pool, u16 min, u16 max, u16 step);
 void poolnum_destroy(struct poolnum *pool);
 
+/**
+ * Borrows a random available value from "pool". Returns -ESRCH if there are none left, and -ENOMEM
+ * if this is the first borrow and the pool's memory could not be allocated.
+ */
 int poolnum_get_any(struct poolnum *pool, u16 *result);
+/**
+ * Borrows the first available value from "pool" for which "matches" returns true.
+ * Gives up (returning -ESRCH) after testing "max_attempts" values, so the caller can fall back to
+ * poolnum_get_any().
+ */
+int poolnum_get_matching(struct poolnum *pool, bool (*matches)(u16, void *), void *arg,
+		u32 max_attempts, u16 *result);
+/**
+ * Borrows "value" from "pool". Returns false if it doesn't belong to the pool, is already taken, or
+ * the pool's memory could not be allocated.
+ */
 bool poolnum_get(struct poolnum *pool, u16 value);
+/**
+ * Borrows "size" consecutive values from "pool" (consecutive in the pool's terms; they are "step"
+ * apart). "size" has to be a power of two no larger than BITS_PER_LONG, and the block starts at a
+ * multiple of "size" (counting from the pool's first value), so blocks never overlap.
+ * The block is chosen at random. Its first value is written in "result"; the values are returned
+ * one by one, through poolnum_return().
+ *
+ * @return zero on success, -ESRCH if there's no such block available, -ENOMEM if this is the first
+ *		borrow and the pool's memory could not be allocated.
+ */
+int poolnum_get_block(struct poolnum *pool, unsigned int size, u16 *result);
+/**
+ * Returns whether "value" belongs to "pool" and is available.
+ */
+bool poolnum_is_free(struct poolnum *pool, u16 value);
+/**
+ * Gives "value" back to "pool". Returns -EINVAL if it doesn't belong to the pool or was not
+ * borrowed.
+ */
 int poolnum_return(struct poolnum *pool, u16 value);
 
 #endif /* _NF_NAT64_POOLNUM_H */
@@ -0,0 +1,63 @@
+#ifndef _NF_NAT64_RSS_H
+#define _NF_NAT64_RSS_H
+
+/**
+ * @file
+ * A model of the Receive Side Scaling the IPv4 NIC applies to incoming traffic.
+ *
+ * Given the NIC's Toeplitz key and indirection table, this module predicts which CPU will receive
+ * a given IPv4 packet. The IPv4 pool uses this to choose (T, t) transport addresses whose replies
+ * will be handled by the same CPU that created the flow.
+ *
+ * TCP and UDP packets are assumed to be hashed by both addresses and ports (for UDP, that's
+ * "ethtool -N <iface> rx-flow-hash udp4 sdfn"); ICMP packets by their addresses only.
+ *
+ * @author Alberto Leiva
+ */
+
+#include <linux/types.h>
+#include "nat64/comm/types.h"
+
+
+/** Maximum length of the Toeplitz key, in bytes. */
+#define RSS_KEY_MAX_LEN 52
+/** Maximum number of entries in the indirection table. */
+#define RSS_INDIR_MAX_LEN 512
+
+/**
+ * Readies the rest of this module for future use.
+ * If either "key" or "indirection" is empty, RSS awareness is disabled.
+ *
+ * @param key the NIC's Toeplitz key, as printed by "ethtool -x" (eg. "6d:5a:56:da:...").
+ * @param indirection the NIC's indirection table, except each entry is the CPU the corresponding
+ *		queue is served by (rather than the queue itself).
+ * @param indirection_len length of "indirection".
+ * @return result status (< 0 on error).
+ */
+int rss_init(char *key, int *indirection, int indirection_len);
+
+/**
+ * Frees resources allocated by this module.
+ */
+void rss_destroy(void);
+
+/**
+ * Returns whether a key and an indirection table were configured.
+ */
+bool rss_is_enabled(void);
+
+/**
+ * Returns the Toeplitz hash the NIC would compute for an IPv4 packet from "src" to "dst".
+ * The ports are ignored if "l4protocol" is ICMP.
+ */
+__u32 rss_hash_ipv4(struct ipv4_tuple_address *src, struct ipv4_tuple_address *dst,
+		u_int8_t l4protocol);
+
+/**
+ * Returns the CPU that would receive an IPv4 packet from "src" to "dst", or -1 if RSS awareness is
+ * disabled.
+ */
+int rss_get_cpu_ipv4(struct ipv4_tuple_address *src, struct ipv4_tuple_address *dst,
+		u_int8_t l4protocol);
+
+#endif /* _NF_NAT64_RSS_H */
@@ -10,67 +10,128 @@
  */
 
 #include "nat64/comm/types.h"
+#include "nat64/comm/config_proto.h"
 #include "nat64/mod/bib.h"
 
 
+/**
+ * Identifies the timeout a session's lifetime was last computed from.
+ * Every session which shares it lives for the same amount of time after its last refresh, so
+ * keeping them in refresh order (see session_set_lifetime()) also keeps them in expiration order.
+ */
+enum session_timer_type {
+	/** UDP sessions (config.to.udp). */
+	SESSION_TIMER_UDP = 0,
+	/** Established TCP sessions (config.to.tcp_est). */
+	SESSION_TIMER_TCP_EST,
+	/** Transitory TCP sessions (config.to.tcp_trans). */
+	SESSION_TIMER_TCP_TRANS,
+	/** TCP sessions waiting for the IPv6 side of a simultaneous open (TCP_INCOMING_SYN). */
+	SESSION_TIMER_TCP_SYN,
+	/** ICMP sessions (config.to.icmp). */
+	SESSION_TIMER_ICMP,
+	/** Number of timer types; not a valid value. */
+	SESSION_TIMER_COUNT,
+};
+
 /**
  * A row, intended to be part of one of the session tables.
  * The mapping between the connections, as perceived by both sides (IPv4 vs IPv6).
  *
+ * Most of the connection's addresses can be derived from the rest, so they are not stored (there
+ * can be millions of these). Use session_get_ipv4() and session_get_ipv6() to get all of them:
+ * - The IPv6 remote transport address (X', x) is the BIB's IPv6 transport address.
+ * - The IPv4 local transport address (T, t) is the BIB's IPv4 transport address.
+ * - The IPv6 local address (Y') is "remote4"'s address, embedded in a pool6 prefix (RFC 6052).
+ * - The IPv6 local port (y) is "remote4"'s port (or x, in the case of ICMP).
+ *
  * Please note that modifications to this structure may need to cascade to config_proto.h.
  */
 struct session_entry {
-	/** IPv6 version of the connection. */
-	struct ipv6_pair ipv6;
-	/** IPv4 version of the connection. */
-	struct ipv4_pair ipv4;
-
-	/** Millisecond (from the epoch) this session should expire in, if still inactive. */
-	unsigned int dying_time;
-
 	/**
-	 * Owner bib of this session. Used for quick access during removal.
-	 * (when the session dies, the BIB might have to die too.)
+	 * Owner bib of this session. Provides half of the session's addresses, and is also used for
+	 * quick access during removal (when the session dies, the BIB might have to die too).
+	 * Never changes, and has to outlive the session.
+	 * (A pointer rather than a handle, since every lookup dereferences it.)
 	 */
 	struct bib_entry *bib;
-	/**
-	 * Chains this session with the rest from the same BIB (see bib_entry.session_entries).
-	 * Used by the BIB to know whether it should commit suicide or not.
-	 */
-	struct list_head entries_from_bib;
-	/**
-	 * Chains this session with the rest (see all_sessions, defined in nf_nat_session.h).
-	 * Used for iterating while looking for expired sessions.
-	 */
-	struct list_head all_sessions;
+	/** The IPv4 node's address and port being used in the connection (Z, z). */
+	struct ipv4_tuple_address remote4;
+
+	/** Millisecond (from the epoch) this session should expire in, if still inactive. */
+	unsigned int dying_time;
+	/** The timeout "dying_time" was computed from; also identifies the expiration queue. */
+	u_int8_t timer_type;
 	/**
 	 * Transport protocol of the table this entry is in.
 	 * Used to know which table the session should be removed from when expired.
 	 */
 	u_int8_t l4_proto;
-
 	/** Current TCP state.
 	 * 	Each STE represents a state machine
 	 */
 	u_int8_t state;
+	/** The pool6 prefix Y' is made of (see pool6_get_by_index()). */
+	__u8 prefix_index;
+
+	/** This entry's handle in the session entry arena (see entry_cache.h). */
+	__u32 handle;
+	/**
+	 * Chain this session with the rest from the same BIB (see bib_entry.sessions); ENTRY_NULL at
+	 * the ends. Used by the BIB to know whether it should commit suicide or not.
+	 */
+	__u32 prev_in_bib;
+	__u32 next_in_bib;
+	/**
+	 * Chain this session with the rest from the same expiration queue (see session.c), which is
+	 * kept in "dying_time" order; ENTRY_NULL at the ends. Used to find the expired sessions
+	 * without visiting the rest.
+	 * Both are the session's own handle while it is not in the tables.
+	 */
+	__u32 prev_in_queue;
+	__u32 next_in_queue;
+
+	/** Chains this entry with the rest from the same slot of the IPv4 index (see session.c). */
+	struct hlist_node ipv4_hook;
+	/** Chains this entry with the rest from the same slot of the IPv6 index (see session.c). */
+	struct hlist_node ipv6_hook;
+	/** Defers the release of the entry until lockless readers are done with it. */
+	struct rcu_head rcu;
 };
 
 
 /**
  * Initializes the three tables (UDP, TCP and ICMP).
  * Call during initialization for the remaining functions to work properly.
+ * Assumes bib_init() has already been called.
+ *
+ * @param session_expired_callback decides the fate of the sessions whose lifetime expires.
+ * @param sharded if "true", the tables are partitioned into as many shards as CPUs instead of being
+ *		global. Each shard holds the sessions of a fixed subset of the BIB locks (see
+ *		bib_get_lock()), and has its own tables and expiration timer. This is hash partitioning:
+ *		the CPU which handles a packet is usually not the one its shard's cleaner runs on, so
+ *		packets still touch other CPUs' shards. Lookups by IPv4 have to consult the BIB to find the
+ *		shard, too.
+ * @param reserve number of free session entries to keep at hand, so the arena can grow ahead of
+ *		demand.
  */
-int session_init(bool (*session_expired_callback)(struct session_entry *));
+int session_init(bool (*session_expired_callback)(struct session_entry *), bool sharded,
+		unsigned int reserve);
 
 /**
  * Adds "entry" to the session table whose layer-4 protocol is "entry->protocol".
- * Expects all fields but the list_heads from "entry" to have been initialized.
+ * Expects "entry" to have been created by session_create().
  *
  * Because never in this project is required otherwise, assumes the entry is not yet on the table.
+ * Assumes the lock of the entry's BIB is held (see bib_get_lock()).
  *
  * @param entry row to be added to the table.
- * @return whether the entry could be inserted or not. It will not be inserted
- *		if some dynamic memory allocation failed.
+ * @return whether the entry could be inserted or not. Fails if the arguments are invalid, if
+ *		there is no memory to index the entry, or with -EEXIST if the entry's BIB is shared and
+ *		another entry bound to the same IPv4 transport address already has a session with the same
+ *		remote IPv4 transport address (see bib_set_port_reuse()).
+ *		Failures might happen after one of the indexes published the entry, so it has to be
+ *		released using session_kfree_rcu().
  */
 int session_add(struct session_entry *entry);
 
@@ -82,9 +143,20 @@ int session_add(struct session_entry *entry);
  * @param l4protocol identifier of the table to retrieve the entry from. Should be either
  *		IPPROTO_UDP, IPPROTO_TCP or IPPROTO_ICMP from linux/in.h.
  * @return the Session entry from the "l4protocol" table whose IPv4 side (both addresses and posts)
- *		is "address". Returns NULL if there is no such an entry.
+ *		is "address". Returns NULL if there is no such an entry (which includes the case in which
+ *		there is no BIB entry for "pair->local").
  */
 struct session_entry *session_get_by_ipv4(struct ipv4_pair *pair, u_int8_t l4protocol);
+/**
+ * Same as session_get_by_ipv4(), except it also locks the session's BIB entry (using
+ * spin_lock_bh()). This is how IPv4 packets reach shared BIB entries (see bib_set_port_reuse()),
+ * which bib_lock_by_ipv4() cannot find.
+ *
+ * @return the lock the caller has to release once done with "result". NULL if there is no such a
+ *		session, in which case nothing is locked.
+ */
+spinlock_t *session_lock_by_ipv4(struct ipv4_pair *pair, u_int8_t l4protocol,
+		struct session_entry **result);
 /**
  * Returns the Session entry from the "l4protocol" table whose IPv6 side (both addresses and ports)
  * is "pair".
@@ -102,6 +174,10 @@ struct session_entry *session_get_by_ipv6(struct ipv6_pair *pair, u_int8_t l4pro
  *
  * That is, looks ups the session entry by both source and destination addresses.
  *
+ * Like the other getters, this can be called either while holding the session's BIB lock (see
+ * bib_get_lock()) or inside an RCU read-side critical section. In the latter case, the result is
+ * only valid until rcu_read_unlock().
+ *
  * @param tuple summary of the packet. Describes the session you need.
  * @return the session entry you'd expect from the "tuple" tuple.
  *		returns null if no entry could be found.
@@ -141,13 +217,115 @@ bool session_remove(struct session_entry *entry);
  */
 void session_destroy(void);
 
+/**
+ * Marks "session" as active: it will expire "ttl" milliseconds from now unless it is refreshed
+ * again. If the session is in the tables, it is also moved to the tail of its expiration queue.
+ *
+ * Every session refreshed with the same "type" has to be given the same "ttl" (config changes
+ * aside), since the cleaner relies on the order of the queue to stop at the first session which
+ * has not expired.
+ *
+ * Can be called either while holding the session's BIB lock or inside an RCU read-side critical
+ * section.
+ *
+ * @param session the session that was just used.
+ * @param ttl the session's new lifetime, in milliseconds.
+ * @param type the timeout "ttl" was taken from.
+ */
+void session_set_lifetime(struct session_entry *session, unsigned int ttl,
+		enum session_timer_type type);
+
+/**
+ * Changes the number of expired sessions the cleaners handle before taking a break (and letting go
+ * of their BIB lock).
+ */
+void session_set_cleaner_batch(unsigned int batch);
+
+/**
+ * Copies the cleaners' statistics to "result".
+ */
+void session_get_cleaner_stats(struct cleaner_stats *result);
+
+/**
+ * Changes the load factor thresholds at which the session tables grow and shrink.
+ *
+ * @param max_load the tables grow when they hold more than this many entries per 100 slots.
+ * @param min_load the tables shrink when they hold less than this many entries per 100 slots.
+ */
+void session_set_load_limits(__u16 max_load, __u16 min_load);
+
+/**
+ * Changes the number of slots the "l4protocol" session tables are allowed to have. If the tables
+ * are sharded, the limits are split evenly between the shards (no shard gets less than
+ * TABLES_MIN_SLOTS, though).
+ *
+ * @param min_slots the tables never shrink below this, and grow to it as soon as they're used.
+ * @param max_slots the tables never grow beyond this.
+ * @return result status (< 0 on error; see SET_SIZE_LIMITS in hash_table.c).
+ */
+int session_set_size_limits(u_int8_t l4protocol, __u32 min_slots, __u32 max_slots);
+
 /**
  * Helper function, intended to initialize a Session entry.
  * The entry is generated IN DYNAMIC MEMORY (if you end up not inserting it to a Session table, you
- * need to kfree it).
+ * need to session_kfree() it).
+ *
+ * @param bib the BIB entry the session belongs to. Provides (X', x) and (T, t).
+ * @param remote4 the IPv4 node's transport address (Z, z).
+ * @param local6 the IPv4 node's address, as seen from the IPv6 side (Y'). Has to be "remote4"'s
+ *		address embedded in one of pool6's prefixes.
+ * @param l4protocol transport protocol of the connection.
+ * @return the new session, or NULL if it could not be allocated or "local6" is not "remote4" under
+ *		one of pool6's prefixes.
+ */
+struct session_entry *session_create(struct bib_entry *bib, struct ipv4_tuple_address *remote4,
+		struct in6_addr *local6, u_int8_t l4protocol);
+
+/**
+ * Copies "session"'s IPv4 transport addresses to "result".
+ * Has to be called while holding the session's BIB lock or within an RCU read-side critical
+ * section.
+ */
+void session_get_ipv4(struct session_entry *session, struct ipv4_pair *result);
+/**
+ * Copies "session"'s IPv6 transport addresses to "result".
+ * Has to be called while holding the session's BIB lock or within an RCU read-side critical
+ * section.
+ */
+void session_get_ipv6(struct session_entry *session, struct ipv6_pair *result);
+
+/**
+ * Adds "session" to its BIB's list of sessions.
+ * Assumes the lock of the session's BIB is held (see bib_get_lock()).
+ */
+void session_link_to_bib(struct session_entry *session);
+/**
+ * Removes "session" from its BIB's list of sessions.
+ * Assumes the lock of the session's BIB is held (see bib_get_lock()).
+ */
+void session_unlink_from_bib(struct session_entry *session);
+/**
+ * Returns the first session of "bib"'s list, or NULL if the BIB has no sessions.
+ * Assumes the lock of "bib" is held (see bib_get_lock()).
+ */
+struct session_entry *session_first_of_bib(struct bib_entry *bib);
+
+/**
+ * Returns "entry" to the session entry cache right away. Only for entries nobody else can be
+ * looking at (eg. ones which were never handed to session_add()).
+ */
+void session_kfree(struct session_entry *entry);
+
+/**
+ * Returns "entry" to the session entry cache once the lockless readers are done with it. Meant for
+ * entries which were just removed from the tables.
+ */
+void session_kfree_rcu(struct session_entry *entry);
+
+/**
+ * Copies the session entry cache's counters to "result".
  */
-struct session_entry *session_create(struct ipv4_pair *ipv4, struct ipv6_pair *ipv6,
-		u_int8_t l4protocol);
+void session_get_cache_stats(struct cache_stats *result);
 
 int session_for_each(__u8 l4protocol, int (*func)(struct session_entry *, void *), void *arg);
 
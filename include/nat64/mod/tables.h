@@ -0,0 +1,36 @@
+#ifndef _NF_NAT64_TABLES_H
+#define _NF_NAT64_TABLES_H
+
+/**
+ * @file
+ * Runtime configuration of the BIB and session hash tables.
+ * The values are kept here and pushed to the BIB and session modules whenever they change.
+ */
+
+#include "nat64/comm/config_proto.h"
+
+
+/**
+ * Initializes this module. Sets the default configuration and hands it to the BIB and session
+ * tables, so call it after bib_init() and session_init().
+ * The "*_slots" arguments are the initial size limits of each protocol's tables.
+ */
+int tables_init(struct table_slots *udp_slots, struct table_slots *tcp_slots,
+		struct table_slots *icmp_slots);
+/**
+ * Terminates this module.
+ */
+void tables_destroy(void);
+
+/**
+ * Copies the current configuration of the tables to "clone".
+ */
+int clone_tables_config(struct tables_config *clone);
+/**
+ * Updates the fields "operation" flags as modified (see *_MASK in config_proto.h), and applies them
+ * to the BIB and session tables.
+ */
+int set_tables_config(__u32 operation, struct tables_config *new_config);
+
+
+#endif /* _NF_NAT64_TABLES_H */
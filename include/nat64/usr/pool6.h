@@ -5,7 +5,7 @@
 
 
 int pool6_display(void);
-int pool6_add(struct ipv6_prefix *prefix);
+int pool6_add(struct ipv6_prefix *prefix, struct ipv4_prefix *pool4);
 int pool6_remove(struct ipv6_prefix *prefix);
 
 
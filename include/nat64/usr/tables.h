@@ -0,0 +1,18 @@
+#ifndef _TABLES_H
+#define _TABLES_H
+
+#include <linux/types.h>
+#include "nat64/comm/config_proto.h"
+
+
+#define MAX_LOAD_OPT	"maxLoad"
+#define MIN_LOAD_OPT	"minLoad"
+#define CLEANER_BATCH_OPT	"cleanerBatch"
+#define UDP_SLOTS_OPT	"udpSlots"
+#define TCP_SLOTS_OPT	"tcpSlots"
+#define ICMP_SLOTS_OPT	"icmpSlots"
+
+int tables_request(__u32 operation, struct tables_config *config);
+
+
+#endif /* _TABLES_H */
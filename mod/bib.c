@@ -1,5 +1,7 @@
 #include "nat64/mod/bib.h"
 #include "nat64/comm/types.h"
+#include "nat64/mod/entry_cache.h"
+#include "nat64/mod/determ.h"
 
 #include <linux/module.h>
 #include <linux/printk.h>
@@ -7,6 +9,9 @@
 #include <linux/list.h>
 #include <linux/in.h>
 #include <linux/in6.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/cache.h>
 
 
 /********************************************
@@ -20,7 +25,8 @@
 #define HTABLE_NAME ipv4_table
 #define KEY_TYPE struct ipv4_tuple_address
 #define VALUE_TYPE struct bib_entry
-#define GENERATE_FOR_EACH
+#define NODE_MEMBER ipv4_hook
+#define KEY_MEMBER ipv4
 #include "hash_table.c"
 
 /*
@@ -30,6 +36,33 @@
 #define HTABLE_NAME ipv6_table
 #define KEY_TYPE struct ipv6_tuple_address
 #define VALUE_TYPE struct bib_entry
+#define NODE_MEMBER ipv6_hook
+#define KEY_MEMBER ipv6
+#define GENERATE_FOR_EACH
+#define FREE_VALUE bib_kfree
+#include "hash_table.c"
+
+/** A transport address several BIB entries are bound to (see bib_add_shared_port()). */
+struct bib_port {
+	struct ipv4_tuple_address addr;
+	/** Number of BIB entries bound to "addr" (or about to be). */
+	unsigned int users;
+
+	/** Chains the port with the rest from the same slot of its "port_table". */
+	struct hlist_node hook;
+	struct rcu_head rcu;
+};
+
+/*
+ * Hash table; indexes the shared ports by transport address.
+ * (this code generates the "port_table" structure and related functions used below).
+ */
+#define HTABLE_NAME port_table
+#define KEY_TYPE struct ipv4_tuple_address
+#define VALUE_TYPE struct bib_port
+#define NODE_MEMBER hook
+#define KEY_MEMBER addr
+#define HASH_TABLE_SIZE 256
 #include "hash_table.c"
 
 /**
@@ -37,12 +70,48 @@
  * Holds two hash tables, one for each indexing need (IPv4 and IPv6).
  */
 struct bib_table {
-	/** Indexes entries by IPv4. */
+	/** Indexes entries by IPv4. Shared entries are left out (see bib_entry.is_shared). */
 	struct ipv4_table ipv4;
 	/** Indexes entries by IPv6. */
 	struct ipv6_table ipv6;
+	/** The transport addresses shared entries are bound to. */
+	struct port_table ports;
+	/** This table's slot in the hosts' "counts" arrays. */
+	unsigned int host_slot;
 };
 
+/**
+ * What the BIB tables know about an IPv6 node, regardless of protocol.
+ * Exists for as long as the node has at least one BIB entry in any of the tables, so the address
+ * its flows are paired to can be found without knowing any of its ports.
+ */
+struct bib_host {
+	/** The node. */
+	struct in6_addr addr;
+	/**
+	 * The IPv4 address the node's first entry was bound to. Entries created later are meant to be
+	 * bound to it as well (see bib_get_host_ipv4()).
+	 */
+	struct in_addr ipv4;
+	/** Number of entries the node has in each table (see bib_table.host_slot). */
+	unsigned int counts[3];
+
+	/** Chains the host with the rest from the same slot of "host_table". */
+	struct hlist_node hook;
+	struct rcu_head rcu;
+};
+
+/*
+ * Hash table; indexes the hosts by IPv6 address.
+ * (this code generates the "host_table" structure and related functions used below).
+ */
+#define HTABLE_NAME host_table
+#define KEY_TYPE struct in6_addr
+#define VALUE_TYPE struct bib_host
+#define NODE_MEMBER hook
+#define KEY_MEMBER addr
+#include "hash_table.c"
+
 /** The BIB table for UDP connections. */
 static struct bib_table bib_udp;
 /** The BIB table for TCP connections. */
@@ -50,7 +119,38 @@ static struct bib_table bib_tcp;
 /** The BIB table for ICMP connections. */
 static struct bib_table bib_icmp;
 
-DEFINE_SPINLOCK(bib_session_lock);
+/** A BIB lock, alone in its cache line so CPUs holding neighbouring locks do not fight over it. */
+struct bib_lock {
+	spinlock_t lock;
+} ____cacheline_aligned_in_smp;
+
+/** Protect the BIB entries and their sessions (see bib_get_lock()). */
+static struct bib_lock bib_locks[BIB_LOCKS];
+/** Random value the lock index is keyed with, so nobody can choose to pile up on one lock. */
+static __u32 lock_seed;
+/** The BIB entries are allocated from here. */
+static struct entry_cache entry_cache;
+
+/** The nodes which have BIB entries. */
+static struct host_table host_table;
+
+#define HOST_LOCKS 64
+/**
+ * Protect the hosts' counters, and the creation of their first entries (see bib_lock_host()). Each
+ * host is protected by the one its address hashes to (see get_host_lock()). Can be taken while
+ * holding a BIB lock, but not the other way around.
+ */
+static struct bib_lock host_locks[HOST_LOCKS];
+
+/** Whether new dynamic entries can share their IPv4 transport address (see bib_set_port_reuse()). */
+static bool port_reuse;
+
+#define PORT_LOCKS 64
+/**
+ * Protect the shared ports' user counts, and the creation of their sessions (see
+ * bib_get_port_lock()). Can be taken while holding a BIB lock, but not the other way around.
+ */
+static struct bib_lock port_locks[PORT_LOCKS];
 
 /********************************************
  * Private (helper) functions.
@@ -75,28 +175,141 @@ static int get_bib_table(u_int8_t l4protocol, struct bib_table **result)
 	return -EINVAL;
 }
 
+static void bib_rcu_free(struct rcu_head *rcu)
+{
+	entry_cache_free(&entry_cache, container_of(rcu, struct bib_entry, rcu)->handle);
+}
+
+static spinlock_t *get_host_lock(struct in6_addr *addr)
+{
+	return &host_locks[ipv6_addr_hashcode(addr, lock_seed) & (HOST_LOCKS - 1)].lock;
+}
+
+/**
+ * Accounts "entry" (which is being added to "table") in its node's host.
+ * Creates the host if this is the node's first entry.
+ *
+ * @param locked whether the caller already holds the host's lock (see bib_lock_host()).
+ */
+static int host_add(struct bib_entry *entry, struct bib_table *table, bool locked)
+{
+	struct in6_addr *addr = &entry->ipv6.address;
+	spinlock_t *lock = get_host_lock(addr);
+	struct bib_host *host;
+	int error = 0;
+
+	if (!locked)
+		spin_lock_bh(lock);
+	rcu_read_lock();
+
+	host = host_table_get(&host_table, addr);
+	if (!host) {
+		host = kmalloc(sizeof(*host), GFP_ATOMIC);
+		if (!host) {
+			log_err(ERR_ALLOC_FAILED, "Could not allocate a BIB host.");
+			error = -ENOMEM;
+			goto end;
+		}
+		host->addr = *addr;
+		host->ipv4 = entry->ipv4.address;
+		memset(host->counts, 0, sizeof(host->counts));
+
+		error = host_table_put(&host_table, &host->addr, host);
+		if (error) {
+			kfree(host);
+			goto end;
+		}
+	}
+	host->counts[table->host_slot]++;
+
+end:
+	rcu_read_unlock();
+	if (!locked)
+		spin_unlock_bh(lock);
+	return error;
+}
+
+/**
+ * Reverts host_add(). Deletes the host if "entry" was its node's last entry.
+ */
+static void host_remove(struct bib_entry *entry, struct bib_table *table)
+{
+	struct in6_addr *addr = &entry->ipv6.address;
+	spinlock_t *lock = get_host_lock(addr);
+	struct bib_host *host;
+	int i;
+
+	spin_lock_bh(lock);
+	rcu_read_lock();
+
+	host = host_table_get(&host_table, addr);
+	if (!host || host->counts[table->host_slot] == 0) {
+		log_crit(ERR_INCOMPLETE_INDEX_BIB, "Programming error: The host of %pI6c lost count of "
+				"its BIB entries.", addr);
+		goto end;
+	}
+
+	host->counts[table->host_slot]--;
+	for (i = 0; i < ARRAY_SIZE(host->counts); i++)
+		if (host->counts[i] != 0)
+			goto end;
+
+	host_table_remove(&host_table, &host->addr, false, false);
+	kfree_rcu(host, rcu);
+	/* Fall through. */
+
+end:
+	rcu_read_unlock();
+	spin_unlock_bh(lock);
+}
+
 /*******************************
  * Public functions.
  *******************************/
 
-int bib_init(void)
+int bib_init(unsigned int reserve)
 {
 	struct bib_table *tables[] = { &bib_udp, &bib_tcp, &bib_icmp };
 	int i, error;
 
+	error = entry_cache_init(&entry_cache, "nat64_bib_entries", sizeof(struct bib_entry), true,
+			reserve);
+	if (error)
+		return error;
+
+	BUILD_BUG_ON((BIB_LOCKS & (BIB_LOCKS - 1)) != 0);
+	for (i = 0; i < BIB_LOCKS; i++)
+		spin_lock_init(&bib_locks[i].lock);
+	BUILD_BUG_ON((HOST_LOCKS & (HOST_LOCKS - 1)) != 0);
+	for (i = 0; i < HOST_LOCKS; i++)
+		spin_lock_init(&host_locks[i].lock);
+	BUILD_BUG_ON((PORT_LOCKS & (PORT_LOCKS - 1)) != 0);
+	for (i = 0; i < PORT_LOCKS; i++)
+		spin_lock_init(&port_locks[i].lock);
+	get_random_bytes(&lock_seed, sizeof(lock_seed));
+
+	error = host_table_init(&host_table, ipv6_addr_equals, ipv6_addr_hashcode);
+	if (error)
+		return error;
+
 	for (i = 0; i < ARRAY_SIZE(tables); i++) {
+		tables[i]->host_slot = i;
 		error = ipv4_table_init(&tables[i]->ipv4, ipv4_tuple_addr_equals, ipv4_tuple_addr_hashcode);
 		if (error)
 			return error;
 		error = ipv6_table_init(&tables[i]->ipv6, ipv6_tuple_addr_equals, ipv6_tuple_addr_hashcode);
 		if (error)
 			return error;
+		error = port_table_init(&tables[i]->ports, ipv4_tuple_addr_equals,
+				ipv4_tuple_addr_hashcode);
+		if (error)
+			return error;
 	}
 
 	return 0;
 }
 
-int bib_add(struct bib_entry *entry, u_int8_t l4protocol)
+static int add_entry(struct bib_entry *entry, u_int8_t l4protocol, bool host_locked)
 {
 	struct bib_table *table;
 	int error;
@@ -109,16 +322,45 @@ int bib_add(struct bib_entry *entry, u_int8_t l4protocol)
 	if (error)
 		return error;
 
-	error = ipv4_table_put(&table->ipv4, &entry->ipv4, entry);
-	if (error)
-		return error;
-	error = ipv6_table_put(&table->ipv6, &entry->ipv6, entry);
-	if (error) {
-		ipv4_table_remove(&table->ipv4, &entry->ipv4, false, false);
-		return error;
+	if (!entry->is_shared) {
+		error = ipv4_table_put(&table->ipv4, &entry->ipv4, entry);
+		if (error)
+			return error;
 	}
+	error = ipv6_table_put(&table->ipv6, &entry->ipv6, entry);
+	if (error)
+		goto ipv6_failure;
+	error = host_add(entry, table, host_locked);
+	if (error)
+		goto host_failure;
 
 	return 0;
+
+host_failure:
+	ipv6_table_remove(&table->ipv6, &entry->ipv6, false, false);
+	/* Fall through. */
+
+ipv6_failure:
+	if (!entry->is_shared)
+		ipv4_table_remove(&table->ipv4, &entry->ipv4, false, false);
+	return error;
+}
+
+int bib_add(struct bib_entry *entry, u_int8_t l4protocol)
+{
+	return add_entry(entry, l4protocol, false);
+}
+
+spinlock_t *bib_lock_host(struct in6_addr *address)
+{
+	spinlock_t *lock = get_host_lock(address);
+	spin_lock_bh(lock);
+	return lock;
+}
+
+int bib_add_host_locked(struct bib_entry *entry, u_int8_t l4protocol)
+{
+	return add_entry(entry, l4protocol, true);
 }
 
 struct bib_entry *bib_get_by_ipv4(struct ipv4_tuple_address *address, u_int8_t l4protocol)
@@ -133,6 +375,46 @@ struct bib_entry *bib_get_by_ipv4(struct ipv4_tuple_address *address, u_int8_t l
 	return ipv4_table_get(&table->ipv4, address);
 }
 
+spinlock_t *bib_lock_by_ipv4(struct ipv4_tuple_address *address, u_int8_t l4protocol,
+		struct bib_entry **result)
+{
+	struct ipv6_tuple_address ipv6;
+	struct bib_entry *bib;
+	spinlock_t *lock;
+	bool locked;
+
+	do {
+		rcu_read_lock();
+		bib = bib_get_by_ipv4(address, l4protocol);
+		if (bib)
+			ipv6 = bib->ipv6;
+		rcu_read_unlock();
+
+		if (!bib)
+			return NULL;
+
+		lock = bib_get_lock(&ipv6);
+		spin_lock_bh(lock);
+
+		/*
+		 * The entry might have died (and its address#port been reused) before we got the lock.
+		 * If another entry took its place, it isn't ours to look at, hence the RCU.
+		 */
+		rcu_read_lock();
+		bib = bib_get_by_ipv4(address, l4protocol);
+		locked = bib && ipv6_tuple_addr_equals(&bib->ipv6, &ipv6);
+		rcu_read_unlock();
+
+		if (locked) {
+			*result = bib;
+			return lock;
+		}
+		spin_unlock_bh(lock);
+	} while (bib);
+
+	return NULL;
+}
+
 struct bib_entry *bib_get_by_ipv6(struct ipv6_tuple_address *address, u_int8_t l4protocol)
 {
 	struct bib_table *table;
@@ -145,29 +427,35 @@ struct bib_entry *bib_get_by_ipv6(struct ipv6_tuple_address *address, u_int8_t l
 	return ipv6_table_get(&table->ipv6, address);
 }
 
-struct bib_entry *bib_get_by_ipv6_only(struct in6_addr *address, u_int8_t l4protocol)
+bool bib_get_host_ipv4(struct in6_addr *address, struct in_addr *result)
+{
+	struct bib_host *host;
+
+	rcu_read_lock();
+	host = host_table_get(&host_table, address);
+	if (host)
+		*result = host->ipv4;
+	rcu_read_unlock();
+
+	return host != NULL;
+}
+
+unsigned int bib_count_by_ipv6(struct in6_addr *address, u_int8_t l4protocol)
 {
 	struct bib_table *table;
-	__u16 hash_code;
-	struct hlist_node *current_node;
-	struct ipv6_tuple_address address_full;
-	struct ipv6_table_key_value *keyvalue;
+	struct bib_host *host;
+	unsigned int result = 0;
 
-	if (!address)
-		return NULL;
 	if (get_bib_table(l4protocol, &table) != 0)
-		return NULL;
+		return 0;
 
-	address_full.address = *address; /* Port doesn't matter; won't be used by the hash function. */
-	hash_code = table->ipv6.hash_function(&address_full) % ARRAY_SIZE(table->ipv6.table);
+	rcu_read_lock();
+	host = host_table_get(&host_table, address);
+	if (host)
+		result = host->counts[table->host_slot];
+	rcu_read_unlock();
 
-	hlist_for_each(current_node, &table->ipv6.table[hash_code]) {
-		keyvalue = list_entry(current_node, struct ipv6_table_key_value, nodes);
-		if (ipv6_addr_equals(address, &keyvalue->key->address))
-			return keyvalue->value;
-	}
-
-	return NULL;
+	return result;
 }
 
 struct bib_entry *bib_get(struct tuple *tuple)
@@ -206,13 +494,18 @@ bool bib_remove(struct bib_entry *entry, u_int8_t l4protocol)
 		return false;
 
 	/* Free the memory from both tables. */
-	removed_from_ipv4 = ipv4_table_remove(&table->ipv4, &entry->ipv4, false, false);
+	removed_from_ipv4 = entry->is_shared
+			|| ipv4_table_remove(&table->ipv4, &entry->ipv4, false, false);
 	removed_from_ipv6 = ipv6_table_remove(&table->ipv6, &entry->ipv6, false, false);
 
-	if (removed_from_ipv4 && removed_from_ipv6)
+	if (removed_from_ipv4 && removed_from_ipv6) {
+		host_remove(entry, table);
 		return true;
+	}
 	if (!removed_from_ipv4 && !removed_from_ipv6)
 		return false;
+	if (entry->is_shared && !removed_from_ipv6)
+		return false;
 
 	/* Why was it not indexed by both tables? Programming error. */
 	log_crit(ERR_INCOMPLETE_INDEX_BIB, "Programming error: Weird BIB removal: ipv4:%d; ipv6:%d.",
@@ -228,30 +521,209 @@ void bib_destroy(void)
 	log_debug("Emptying the BIB tables...");
 	/*
 	 * The keys needn't be released because they're part of the values.
-	 * The values need to be released only in one of the tables because both tables point to the
-	 * same values.
+	 * Neither do the values, one by one; they all go away along with the arena.
 	 */
 	for (i = 0; i < ARRAY_SIZE(tables); i++) {
-		ipv4_table_empty(&tables[i]->ipv4, false, false);
-		ipv6_table_empty(&tables[i]->ipv6, false, true);
+		ipv4_table_destroy(&tables[i]->ipv4, false, false);
+		ipv6_table_destroy(&tables[i]->ipv6, false, false);
 	}
+	/* The hosts' and ports' keys are part of them as well. */
+	host_table_destroy(&host_table, false, true);
+	for (i = 0; i < ARRAY_SIZE(tables); i++)
+		port_table_destroy(&tables[i]->ports, false, true);
+
+	/* Wait for the RCU callbacks which still want to touch the arena. */
+	rcu_barrier();
+	entry_cache_destroy(&entry_cache);
+}
+
+unsigned int bib_get_lock_index(struct ipv6_tuple_address *address)
+{
+	__u32 subscriber;
+	__u32 hash;
+
+	if (determ_get_subscriber(&address->address, &subscriber))
+		return jhash_1word(subscriber, lock_seed) & (BIB_LOCKS - 1);
+
+	hash = jhash2(address->address.s6_addr32, 4, lock_seed);
+	return jhash_2words(hash, address->l4_id, lock_seed) & (BIB_LOCKS - 1);
+}
+
+spinlock_t *bib_get_lock_by_index(unsigned int index)
+{
+	return &bib_locks[index & (BIB_LOCKS - 1)].lock;
+}
+
+spinlock_t *bib_get_lock(struct ipv6_tuple_address *address)
+{
+	return bib_get_lock_by_index(bib_get_lock_index(address));
+}
+
+spinlock_t *bib_get_port_lock(struct ipv4_tuple_address *address)
+{
+	return &port_locks[ipv4_tuple_addr_hashcode(address, lock_seed) & (PORT_LOCKS - 1)].lock;
+}
+
+void bib_set_port_reuse(bool enabled)
+{
+	port_reuse = enabled;
+}
+
+bool bib_port_reuse_enabled(void)
+{
+	return port_reuse;
+}
+
+int bib_add_shared_port(u_int8_t l4protocol, struct ipv4_tuple_address *address)
+{
+	struct bib_table *table;
+	struct bib_port *port;
+	spinlock_t *lock;
+	int error;
+
+	error = get_bib_table(l4protocol, &table);
+	if (error)
+		return error;
+
+	port = kmalloc(sizeof(*port), GFP_ATOMIC);
+	if (!port) {
+		log_err(ERR_ALLOC_FAILED, "Could not allocate a shared port.");
+		return -ENOMEM;
+	}
+	port->addr = *address;
+	port->users = 1;
+
+	/* The port was just borrowed from the pool, so nobody else can be adding it. */
+	lock = bib_get_port_lock(address);
+	spin_lock_bh(lock);
+	error = port_table_put(&table->ports, &port->addr, port);
+	spin_unlock_bh(lock);
+
+	if (error)
+		kfree(port);
+	return error;
+}
+
+bool bib_get_shared_port(u_int8_t l4protocol, struct ipv4_tuple_address *address)
+{
+	struct bib_table *table;
+	struct bib_port *port;
+	spinlock_t *lock;
+
+	if (get_bib_table(l4protocol, &table) != 0)
+		return false;
+
+	lock = bib_get_port_lock(address);
+	spin_lock_bh(lock);
+	rcu_read_lock();
+	port = port_table_get(&table->ports, address);
+	if (port)
+		port->users++;
+	rcu_read_unlock();
+	spin_unlock_bh(lock);
+
+	return port != NULL;
+}
+
+bool bib_put_shared_port(u_int8_t l4protocol, struct ipv4_tuple_address *address)
+{
+	struct bib_table *table;
+	struct bib_port *port;
+	spinlock_t *lock;
+	bool last = false;
+
+	if (get_bib_table(l4protocol, &table) != 0)
+		return false;
+
+	lock = bib_get_port_lock(address);
+	spin_lock_bh(lock);
+	rcu_read_lock();
+
+	port = port_table_get(&table->ports, address);
+	if (!port) {
+		log_crit(ERR_INCOMPLETE_INDEX_BIB, "Programming error: %pI4#%u is not a shared port.",
+				&address->address, address->l4_id);
+		goto end;
+	}
+
+	port->users--;
+	if (port->users == 0) {
+		port_table_remove(&table->ports, &port->addr, false, false);
+		kfree_rcu(port, rcu);
+		last = true;
+	}
+	/* Fall through. */
+
+end:
+	rcu_read_unlock();
+	spin_unlock_bh(lock);
+	return last;
+}
+
+bool bib_release_port(struct bib_entry *entry, u_int8_t l4protocol)
+{
+	return !entry->is_shared || bib_put_shared_port(l4protocol, &entry->ipv4);
+}
+
+void bib_set_load_limits(__u16 max_load, __u16 min_load)
+{
+	struct bib_table *tables[] = { &bib_udp, &bib_tcp, &bib_icmp };
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(tables); i++) {
+		ipv4_table_set_load_limits(&tables[i]->ipv4, max_load, min_load);
+		ipv6_table_set_load_limits(&tables[i]->ipv6, max_load, min_load);
+	}
+}
+
+int bib_set_size_limits(u_int8_t l4protocol, __u32 min_slots, __u32 max_slots)
+{
+	struct bib_table *table;
+	int error;
+
+	error = get_bib_table(l4protocol, &table);
+	if (error)
+		return error;
+
+	error = ipv4_table_set_size_limits(&table->ipv4, min_slots, max_slots);
+	if (error)
+		return error;
+	return ipv6_table_set_size_limits(&table->ipv6, min_slots, max_slots);
 }
 
 struct bib_entry *bib_create(struct ipv4_tuple_address *ipv4, struct ipv6_tuple_address *ipv6,
 		bool is_static)
 {
-	struct bib_entry *result = kmalloc(sizeof(struct bib_entry), GFP_ATOMIC);
+	__u32 handle;
+	struct bib_entry *result = entry_cache_alloc(&entry_cache, &handle);
 	if (!result)
 		return NULL;
 
+	result->handle = handle;
+	result->sessions = ENTRY_NULL;
 	result->ipv4 = *ipv4;
 	result->ipv6 = *ipv6;
 	result->is_static = is_static;
-	INIT_LIST_HEAD(&result->sessions);
+	result->is_shared = false;
 
 	return result;
 }
 
+void bib_kfree(struct bib_entry *entry)
+{
+	entry_cache_free(&entry_cache, entry->handle);
+}
+
+void bib_kfree_rcu(struct bib_entry *entry)
+{
+	call_rcu(&entry->rcu, bib_rcu_free);
+}
+
+void bib_get_cache_stats(struct cache_stats *result)
+{
+	entry_cache_get_stats(&entry_cache, result);
+}
+
 int bib_for_each(__u8 l4protocol, int (*func)(struct bib_entry *, void *), void *arg)
 {
 	struct bib_table *table;
@@ -261,7 +733,8 @@ int bib_for_each(__u8 l4protocol, int (*func)(struct bib_entry *, void *), void
 	if (error)
 		return error;
 
-	return ipv4_table_for_each(&table->ipv4, func, arg);
+	/* The IPv6 index is the one which has every entry (see bib_entry.is_shared). */
+	return ipv6_table_for_each(&table->ipv6, func, arg);
 }
 
 bool bib_entry_equals(struct bib_entry *bib_1, struct bib_entry *bib_2)
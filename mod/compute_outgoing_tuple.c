@@ -2,9 +2,11 @@
 #include "nat64/mod/rfc6052.h"
 #include "nat64/mod/pool6.h"
 #include "nat64/mod/bib.h"
+#include "nat64/mod/session.h"
 
 #include <linux/icmp.h>
 #include <linux/icmpv6.h>
+#include <linux/rcupdate.h>
 
 
 static bool switch_l4_proto(u_int8_t proto_in, u_int8_t *proto_out)
@@ -26,6 +28,57 @@ static bool switch_l4_proto(u_int8_t proto_in, u_int8_t *proto_out)
 	}
 }
 
+/**
+ * Returns the BIB entry "in" belongs to. Shared entries (see bib_set_port_reuse()) are not indexed
+ * by IPv4, so IPv4 packets might have to find theirs through the session.
+ * Has to be called within an RCU read-side critical section.
+ */
+static struct bib_entry *get_bib(struct tuple *in)
+{
+	struct bib_entry *bib;
+	struct session_entry *session;
+
+	bib = bib_get(in);
+	if (bib || in->l3_proto != PF_INET || !bib_port_reuse_enabled())
+		return bib;
+
+	session = session_get(in);
+	return session ? session->bib : NULL;
+}
+
+/**
+ * Copies to "result" the pool6 prefix "in"'s IPv4 node is seen through, in the IPv6 side.
+ * IPv6 packets say it themselves. For IPv4 packets, it is the one the session was created with.
+ * Has to be called within an RCU read-side critical section.
+ */
+static bool get_prefix(struct tuple *in, struct bib_entry *bib, struct ipv6_prefix *result)
+{
+	struct pool6_entry entry;
+	struct session_entry *session;
+
+	switch (in->l3_proto) {
+	case PF_INET6:
+		if (!pool6_get(&in->dst.addr.ipv6, &entry))
+			break;
+		*result = entry.prefix;
+		return true;
+
+	case PF_INET:
+		session = session_get(in);
+		if (session) {
+			*result = *pool6_get_by_index(session->prefix_index);
+			return true;
+		}
+		/* ICMP errors don't always have sessions. */
+		if (pool6_peek_by_pool4(&bib->ipv4.address, result))
+			return true;
+		break;
+	}
+
+	log_err(ERR_POOL6_EMPTY, "The IPv6 pool has no prefix for the packet. Cannot translate.");
+	return false;
+}
+
 static bool tuple5(struct tuple *in, struct tuple *out)
 {
 	struct bib_entry *bib;
@@ -33,17 +86,14 @@ static bool tuple5(struct tuple *in, struct tuple *out)
 
 	log_debug("Step 3: Computing the Outgoing Tuple");
 
-	if (!pool6_peek(&prefix)) {
-		log_err(ERR_POOL6_EMPTY, "The IPv6 pool is empty. Cannot translate.");
-		return false;
-	}
-
-	spin_lock_bh(&bib_session_lock);
-	bib = bib_get(in);
+	rcu_read_lock();
+	bib = get_bib(in);
 	if (!bib) {
 		log_crit(ERR_MISSING_BIB, "Could not find the BIB entry we just created/updated!");
 		goto lock_fail;
 	}
+	if (!get_prefix(in, bib, &prefix))
+		goto lock_fail;
 
 	switch (in->l3_proto) {
 	case PF_INET6:
@@ -73,13 +123,13 @@ static bool tuple5(struct tuple *in, struct tuple *out)
 		goto lock_fail;
 	}
 
-	spin_unlock_bh(&bib_session_lock);
+	rcu_read_unlock();
 	log_debug("Done step 3.");
 	log_tuple(out);
 	return true;
 
 lock_fail:
-	spin_unlock_bh(&bib_session_lock);
+	rcu_read_unlock();
 	return false;
 }
 
@@ -90,17 +140,14 @@ static bool tuple3(struct tuple *in, struct tuple *out)
 
 	log_debug("Step 3: Computing the Outgoing Tuple");
 
-	if (!pool6_peek(&prefix)) {
-		log_err(ERR_POOL6_EMPTY, "The IPv6 pool is empty. Cannot translate.");
-		return false;
-	}
-
-	spin_lock_bh(&bib_session_lock);
-	bib = bib_get(in);
+	rcu_read_lock();
+	bib = get_bib(in);
 	if (!bib) {
 		log_crit(ERR_MISSING_BIB, "Could not find the BIB entry we just created/updated!");
 		goto lock_fail;
 	}
+	if (!get_prefix(in, bib, &prefix))
+		goto lock_fail;
 
 	switch (in->l3_proto) {
 	case PF_INET6:
@@ -128,13 +175,13 @@ static bool tuple3(struct tuple *in, struct tuple *out)
 		goto lock_fail;
 	}
 
-	spin_unlock_bh(&bib_session_lock);
+	rcu_read_unlock();
 	log_tuple(out);
 	log_debug("Done step 3.");
 	return true;
 
 lock_fail:
-	spin_unlock_bh(&bib_session_lock);
+	rcu_read_unlock();
 	return false;
 }
 
@@ -8,6 +8,7 @@
 #include "nat64/mod/static_routes.h"
 #include "nat64/mod/filtering_and_updating.h"
 #include "nat64/mod/translate_packet.h"
+#include "nat64/mod/tables.h"
 
 #include <linux/kernel.h>
 #include <linux/module.h>
@@ -86,10 +87,15 @@ static int respond_ack(struct nlmsghdr *nl_hdr_in)
 }
 */
 
-static int pool6_entry_to_userspace(struct ipv6_prefix *prefix, void *arg)
+static int pool6_entry_to_userspace(struct pool6_entry *entry, void *arg)
 {
 	struct out_stream *stream = (struct out_stream *) arg;
-	stream_write(stream, prefix, sizeof(*prefix));
+	struct pool6_entry_us entry_us;
+
+	entry_us.prefix = entry->prefix;
+	entry_us.pool4 = entry->pool4;
+	stream_write(stream, &entry_us, sizeof(entry_us));
+
 	return 0;
 }
 
@@ -118,7 +124,8 @@ static int handle_pool6_config(struct nlmsghdr *nl_hdr, struct request_hdr *nat6
 
 	case OP_ADD:
 		log_debug("Adding a prefix to the IPv6 pool.");
-		return respond_error(nl_hdr, pool6_register(&request->update.prefix));
+		error = pool6_register(&request->update.prefix, &request->update.pool4);
+		return respond_error(nl_hdr, error);
 
 	case OP_REMOVE:
 		log_debug("Removing a prefix from the IPv6 pool.");
@@ -204,9 +211,7 @@ static int handle_bib_config(struct nlmsghdr *nl_hdr, struct request_hdr *nat64_
 		}
 
 		stream_init(stream, nl_socket, nl_hdr);
-		spin_lock_bh(&bib_session_lock);
 		error = bib_for_each(request->l4_proto, bib_entry_to_userspace, stream);
-		spin_unlock_bh(&bib_session_lock);
 		stream_close(stream);
 
 		kfree(stream);
@@ -231,8 +236,8 @@ static int session_entry_to_userspace(struct session_entry *entry, void *arg)
 	struct out_stream *stream = (struct out_stream *) arg;
 	struct session_entry_us entry_us;
 
-	entry_us.ipv6 = entry->ipv6;
-	entry_us.ipv4 = entry->ipv4;
+	session_get_ipv6(entry, &entry_us.ipv6);
+	session_get_ipv4(entry, &entry_us.ipv4);
 	entry_us.dying_time = entry->dying_time - jiffies_to_msecs(jiffies);
 	entry_us.l4_proto = entry->l4_proto;
 
@@ -257,9 +262,7 @@ static int handle_session_config(struct nlmsghdr *nl_hdr, struct request_hdr *na
 		}
 
 		stream_init(stream, nl_socket, nl_hdr);
-		spin_lock_bh(&bib_session_lock);
 		error = session_for_each(request->l4_proto, session_entry_to_userspace, stream);
-		spin_unlock_bh(&bib_session_lock);
 		stream_close(stream);
 
 		kfree(stream);
@@ -331,6 +334,26 @@ static int handle_translate_config(struct nlmsghdr *nl_hdr, struct request_hdr *
 	}
 }
 
+static int handle_tables_config(struct nlmsghdr *nl_hdr, struct request_hdr *nat64_hdr,
+		struct tables_config *request)
+{
+	struct tables_config clone;
+	int error;
+
+	if (nat64_hdr->operation == 0) {
+		log_debug("Returning the tables' options.");
+
+		error = clone_tables_config(&clone);
+		if (error)
+			return respond_error(nl_hdr, error);
+
+		return respond_setcfg(nl_hdr, &clone, sizeof(clone));
+	} else {
+		log_debug("Updating the tables' options.");
+		return respond_error(nl_hdr, set_tables_config(nat64_hdr->operation, request));
+	}
+}
+
 /**
  * Gets called by "netlink_rcv_skb" when the userspace application wants to interact with us.
  *
@@ -371,6 +394,9 @@ static int handle_netlink_message(struct sk_buff *skb_in, struct nlmsghdr *nl_hd
 	case MODE_TRANSLATE:
 		error = handle_translate_config(nl_hdr, nat64_hdr, request);
 		break;
+	case MODE_TABLES:
+		error = handle_tables_config(nl_hdr, nat64_hdr, request);
+		break;
 	default:
 		log_err(ERR_UNKNOWN_OP, "Unknown configuration mode: %d", nat64_hdr->mode);
 		error = respond_error(nl_hdr, -EINVAL);
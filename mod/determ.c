@@ -0,0 +1,182 @@
+#include "nat64/mod/determ.h"
+
+#include <linux/kernel.h>
+#include <linux/inet.h>
+#include <net/ipv6.h>
+
+
+/** Whether the deterministic mode was configured. Nothing below is meaningful otherwise. */
+static bool enabled;
+/** The IPv6 prefix the subscribers belong to. */
+static struct ipv6_prefix prefix6;
+/** Length of each subscriber's prefix. */
+static __u8 subscriber_len;
+/** The first IPv4 address, in host byte order. */
+static __u32 addr4_first;
+/** Number of IPv4 addresses. */
+static __u32 addr4_count;
+/** Number of ports each subscriber gets. */
+static __u16 range_size;
+/** Number of subscribers each IPv4 address can serve. */
+static __u32 ranges_per_addr;
+/** Subscribers from this number onwards are not mapped, because the IPv4 range is too small. */
+static __u64 mapped_count;
+
+
+/**
+ * Returns the "len" bits (no more than 32) from "addr" which start at bit "offset".
+ */
+static __u32 get_bits(struct in6_addr *addr, unsigned int offset, unsigned int len)
+{
+	unsigned int word = offset / 32;
+	__u64 window;
+
+	if (len == 0)
+		return 0;
+
+	/* The bits are within this word and the next one. */
+	window = (__u64) be32_to_cpu(addr->s6_addr32[word]) << 32;
+	if (word < 3)
+		window |= be32_to_cpu(addr->s6_addr32[word + 1]);
+
+	return (window >> (64 - offset % 32 - len)) & ((1ULL << len) - 1);
+}
+
+/**
+ * Writes "value" in the "len" bits from "addr" which start at bit "offset". Those bits are assumed
+ * to be zero.
+ */
+static void set_bits(struct in6_addr *addr, unsigned int offset, unsigned int len, __u32 value)
+{
+	unsigned int i, bit;
+
+	for (i = 0; i < len; i++) {
+		if (value & (1U << (len - 1 - i))) {
+			bit = offset + i;
+			addr->s6_addr[bit / 8] |= 0x80 >> (bit % 8);
+		}
+	}
+}
+
+int determ_init(char *prefix6_str, unsigned int sub_len, char *prefix4_str, unsigned int ports)
+{
+	struct in_addr addr4;
+	struct in6_addr addr6;
+	const char *slash_pos;
+	__u8 prefix4_len;
+	__u64 subscriber_count;
+
+	enabled = false;
+
+	if (!prefix6_str || !*prefix6_str)
+		return 0; /* The deterministic mode was not requested. */
+
+	if (in6_pton(prefix6_str, -1, (u8 *) &addr6, '/', &slash_pos) != 1 || *slash_pos != '/'
+			|| kstrtou8(slash_pos + 1, 0, &prefix6.len) != 0
+			|| prefix6.len > 128) {
+		log_err(ERR_PARSE_PREFIX, "IPv6 prefix is malformed: %s.", prefix6_str);
+		return -EINVAL;
+	}
+	if (!prefix4_str || in4_pton(prefix4_str, -1, (u8 *) &addr4, '/', &slash_pos) != 1
+			|| *slash_pos != '/' || kstrtou8(slash_pos + 1, 0, &prefix4_len) != 0
+			|| prefix4_len == 0 || prefix4_len > 32) {
+		log_err(ERR_DETERM_CONFIG, "The deterministic IPv4 prefix is malformed: %s.",
+				prefix4_str ? prefix4_str : "(null)");
+		return -EINVAL;
+	}
+	if (sub_len < prefix6.len || sub_len > 128 || sub_len - prefix6.len > 32) {
+		log_err(ERR_DETERM_CONFIG, "Subscriber prefixes cannot be /%u within a /%u.", sub_len,
+				prefix6.len);
+		return -EINVAL;
+	}
+	if (ports == 0 || ports > 65536 - DETERM_MIN_PORT) {
+		log_err(ERR_DETERM_CONFIG, "Subscribers cannot have %u ports each.", ports);
+		return -EINVAL;
+	}
+
+	/* Ignore the host bits, if the user wrote any. */
+	ipv6_addr_prefix(&prefix6.address, &addr6, prefix6.len);
+	subscriber_len = sub_len;
+	addr4_count = 1U << (32 - prefix4_len);
+	addr4_first = be32_to_cpu(addr4.s_addr) & ~(addr4_count - 1);
+	range_size = ports;
+	ranges_per_addr = (65536 - DETERM_MIN_PORT) / ports;
+
+	subscriber_count = 1ULL << (subscriber_len - prefix6.len);
+	mapped_count = (__u64) addr4_count * ranges_per_addr;
+	if (mapped_count < subscriber_count) {
+		log_info("Only %llu of the %llu subscribers fit in the deterministic IPv4 range. The rest "
+				"will be served by pool4.", mapped_count, subscriber_count);
+	} else {
+		mapped_count = subscriber_count;
+	}
+
+	enabled = true;
+	return 0;
+}
+
+void determ_destroy(void)
+{
+	enabled = false;
+}
+
+bool determ_is_enabled(void)
+{
+	return enabled;
+}
+
+bool determ_get_subscriber(struct in6_addr *addr, __u32 *index)
+{
+	__u32 result;
+
+	if (!enabled || !ipv6_prefix_equal(&prefix6.address, addr, prefix6.len))
+		return false;
+
+	result = get_bits(addr, prefix6.len, subscriber_len - prefix6.len);
+	if (result >= mapped_count)
+		return false;
+
+	*index = result;
+	return true;
+}
+
+int determ_get_range(struct in6_addr *addr, struct determ_range *result)
+{
+	__u32 index;
+
+	if (!determ_get_subscriber(addr, &index))
+		return -ESRCH;
+
+	result->addr.s_addr = cpu_to_be32(addr4_first + index % addr4_count);
+	result->first = DETERM_MIN_PORT + (index / addr4_count) * range_size;
+	result->count = range_size;
+	return 0;
+}
+
+int determ_get_prefix(struct ipv4_tuple_address *addr, struct ipv6_prefix *result)
+{
+	__u32 range;
+	__u64 index;
+
+	if (!determ_contains4(&addr->address) || addr->l4_id < DETERM_MIN_PORT)
+		return -ESRCH;
+
+	range = (addr->l4_id - DETERM_MIN_PORT) / range_size;
+	if (range >= ranges_per_addr)
+		return -ESRCH;
+	index = (__u64) range * addr4_count + (be32_to_cpu(addr->address.s_addr) - addr4_first);
+	if (index >= mapped_count)
+		return -ESRCH;
+
+	result->address = prefix6.address;
+	set_bits(&result->address, prefix6.len, subscriber_len - prefix6.len, index);
+	result->len = subscriber_len;
+	return 0;
+}
+
+bool determ_contains4(struct in_addr *addr)
+{
+	if (!enabled)
+		return false;
+	return be32_to_cpu(addr->s_addr) - addr4_first < addr4_count;
+}
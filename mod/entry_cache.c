@@ -0,0 +1,442 @@
+#include "nat64/mod/entry_cache.h"
+
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/vmalloc.h>
+#include <linux/gfp.h>
+#include <linux/mm.h>
+#include <linux/log2.h>
+#include <linux/cache.h>
+#include <linux/bottom_half.h>
+#include <linux/slab.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+#include <linux/numa.h>
+
+#include "nat64/comm/types.h"
+
+
+/**
+ * Size of the chunks the objects are carved from, in bytes. Big enough for the chunks to be
+ * few, small enough to still be found by the page allocator in atomic context.
+ */
+#define CHUNK_SIZE (64 * 1024)
+/** Upper limit to the number of objects a cache can hold. Bounds the chunk table. */
+#define MAX_OBJECTS (1 << 25)
+/** Objects are moved between the per-CPU free lists and the nodes' this many at a time. */
+#define CPU_BATCH 32
+
+static __u32 *next_free(struct entry_cache *cache, __u32 handle)
+{
+	return entry_cache_get(cache, handle);
+}
+
+static size_t chunk_bytes(struct entry_cache *cache)
+{
+	return ((size_t) cache->size) << cache->chunk_shift;
+}
+
+/**
+ * Adds "chunk" to "cache"'s chunk list. Returns the handle of its first object, or ENTRY_NULL if
+ * the cache cannot grow any further.
+ * The chunk's objects are not free yet; see push_chunk().
+ */
+static __u32 register_chunk(struct entry_cache *cache, void *chunk)
+{
+	__u32 first = ENTRY_NULL;
+
+	spin_lock_bh(&cache->lock);
+	if (cache->chunk_count < cache->max_chunks) {
+		first = (cache->chunk_count << cache->chunk_shift) + 1;
+		cache->chunks[cache->chunk_count] = chunk;
+		cache->chunk_count++;
+	}
+	spin_unlock_bh(&cache->lock);
+
+	return first;
+}
+
+/**
+ * Adds the objects of the chunk whose first object is "first" to "node"'s free list.
+ * Assumes the node's lock is held (or that nobody else can see the cache yet).
+ */
+static void push_chunk(struct entry_cache *cache, struct entry_cache_node *node, __u32 first)
+{
+	__u32 count = 1U << cache->chunk_shift;
+	__u32 i;
+
+	for (i = 0; i < count - 1; i++)
+		*next_free(cache, first + i) = first + i + 1;
+	*next_free(cache, first + count - 1) = node->free_head;
+	node->free_head = first;
+	node->free_count += count;
+}
+
+static void free_chunk(struct entry_cache *cache, void *chunk)
+{
+	if (is_vmalloc_addr(chunk))
+		vfree(chunk);
+	else
+		free_pages((unsigned long) chunk, get_order(chunk_bytes(cache)));
+}
+
+static bool needs_to_grow(struct entry_cache *cache, struct entry_cache_node *node)
+{
+	return node->free_count <= node->reserve_size && cache->chunk_count < cache->max_chunks;
+}
+
+/**
+ * Allocates a chunk from "node" and adds its objects to the node's free list.
+ * Runs in process context. Returns false if the cache could not grow.
+ */
+static bool grow(struct entry_cache *cache, struct entry_cache_node *node)
+{
+	void *chunk;
+	__u32 first;
+
+	chunk = vmalloc_node(chunk_bytes(cache), node->nid);
+	if (!chunk)
+		return false;
+
+	first = register_chunk(cache, chunk);
+	if (first == ENTRY_NULL) {
+		vfree(chunk);
+		return false;
+	}
+
+	spin_lock_bh(&node->lock);
+	push_chunk(cache, node, first);
+	spin_unlock_bh(&node->lock);
+	return true;
+}
+
+/**
+ * Allocates a chunk, preferably from the "nid" node, without sleeping. Returns NULL on failure.
+ */
+static void *alloc_chunk_atomic(struct entry_cache *cache, int nid)
+{
+	struct page *page;
+
+	if (!node_state(nid, N_NORMAL_MEMORY))
+		nid = NUMA_NO_NODE;
+	page = alloc_pages_node(nid, GFP_ATOMIC | __GFP_NOWARN, get_order(chunk_bytes(cache)));
+	return page ? page_address(page) : NULL;
+}
+
+/**
+ * Tops a node's free list up to its reserve. Runs in process context, so it can vmalloc().
+ */
+static void grow_work_fn(struct work_struct *work)
+{
+	struct entry_cache_node *node = container_of(work, struct entry_cache_node, grow_work);
+
+	do {
+		if (!grow(node->cache, node)) {
+			log_debug("Could not grow the %s cache on node %d.", node->cache->name, node->nid);
+			return;
+		}
+	} while (needs_to_grow(node->cache, node));
+}
+
+/**
+ * Creates the "nid" node's free list, and fills it with "reserve" objects.
+ */
+static int init_node(struct entry_cache *cache, int nid, unsigned int reserve)
+{
+	struct entry_cache_node *node;
+	int mem_nid = node_state(nid, N_NORMAL_MEMORY) ? nid : NUMA_NO_NODE;
+
+	node = kzalloc_node(sizeof(*node), GFP_KERNEL, mem_nid);
+	if (!node) {
+		log_err(ERR_ALLOC_FAILED, "Could not allocate node %d of the %s cache.", nid,
+				cache->name);
+		return -ENOMEM;
+	}
+
+	spin_lock_init(&node->lock);
+	node->free_head = ENTRY_NULL;
+	node->reserve_size = reserve;
+	INIT_WORK(&node->grow_work, grow_work_fn);
+	node->nid = nid;
+	node->cache = cache;
+	cache->nodes[nid] = node;
+
+	/* Memory-only nodes are only drawn from if everything else fails, so they start empty. */
+	if (!node_state(nid, N_CPU))
+		return 0;
+
+	while (node->free_count <= reserve) {
+		if (!grow(cache, node)) {
+			log_err(ERR_ALLOC_FAILED, "Could not reserve %u objects for the %s cache on node %d.",
+					reserve, cache->name, nid);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+int entry_cache_init(struct entry_cache *cache, const char *name, size_t size,
+		bool hwcache_align, unsigned int reserve)
+{
+	unsigned int per_chunk, node_reserve;
+	int nid, error;
+
+	memset(cache, 0, sizeof(*cache));
+	size = ALIGN(size, hwcache_align ? L1_CACHE_BYTES : sizeof(void *));
+	per_chunk = (size < CHUNK_SIZE) ? rounddown_pow_of_two(CHUNK_SIZE / size) : 1;
+
+	cache->size = size;
+	cache->chunk_shift = ilog2(per_chunk);
+	cache->max_chunks = MAX_OBJECTS / per_chunk;
+	cache->name = name;
+	spin_lock_init(&cache->lock);
+
+	cache->cpus = alloc_percpu(struct entry_cache_cpu);
+	if (!cache->cpus) {
+		log_err(ERR_ALLOC_FAILED, "Could not allocate the counters of the %s cache.", name);
+		return -ENOMEM;
+	}
+
+	cache->chunks = vzalloc(cache->max_chunks * sizeof(*cache->chunks));
+	if (!cache->chunks) {
+		log_err(ERR_ALLOC_FAILED, "Could not allocate the chunk table of the %s cache.", name);
+		error = -ENOMEM;
+		goto failure;
+	}
+
+	cache->nodes = kcalloc(nr_node_ids, sizeof(*cache->nodes), GFP_KERNEL);
+	if (!cache->nodes) {
+		log_err(ERR_ALLOC_FAILED, "Could not allocate the node list of the %s cache.", name);
+		error = -ENOMEM;
+		goto failure;
+	}
+
+	/* Memory-only nodes get no reserve, since no CPU asks them for objects first. */
+	node_reserve = DIV_ROUND_UP(reserve, max(num_node_state(N_CPU), 1));
+	for_each_node(nid) {
+		error = init_node(cache, nid, node_state(nid, N_CPU) ? node_reserve : 0);
+		if (error)
+			goto failure;
+	}
+
+	return 0;
+
+failure:
+	entry_cache_destroy(cache);
+	return error;
+}
+
+void entry_cache_destroy(struct entry_cache *cache)
+{
+	unsigned int i;
+	int nid;
+
+	if (cache->nodes) {
+		for_each_node(nid)
+			if (cache->nodes[nid])
+				cancel_work_sync(&cache->nodes[nid]->grow_work);
+	}
+
+	if (cache->chunks) {
+		for (i = 0; i < cache->chunk_count; i++)
+			free_chunk(cache, cache->chunks[i]);
+		vfree(cache->chunks);
+	}
+	if (cache->nodes) {
+		for_each_node(nid)
+			kfree(cache->nodes[nid]);
+		kfree(cache->nodes);
+	}
+	if (cache->cpus)
+		free_percpu(cache->cpus);
+
+	cache->chunks = NULL;
+	cache->chunk_count = 0;
+	cache->nodes = NULL;
+	cache->cpus = NULL;
+}
+
+/**
+ * Moves a batch of objects from "node"'s free list to "cpu"'s, which is assumed to be empty.
+ * Returns the number of objects moved. Assumes the node's lock is held.
+ */
+static unsigned int take_batch(struct entry_cache *cache, struct entry_cache_node *node,
+		struct entry_cache_cpu *cpu)
+{
+	unsigned int count, i;
+	__u32 last;
+
+	count = min(node->free_count, (unsigned int) CPU_BATCH);
+	if (count == 0)
+		return 0;
+
+	last = node->free_head;
+	for (i = 1; i < count; i++)
+		last = *next_free(cache, last);
+
+	cpu->free_head = node->free_head;
+	cpu->free_tail = last;
+	cpu->free_count = count;
+	node->free_head = *next_free(cache, last);
+	*next_free(cache, last) = ENTRY_NULL;
+	node->free_count -= count;
+
+	return count;
+}
+
+/**
+ * Moves a batch of objects to "cpu"'s free list, which is assumed to be empty. They come from the
+ * CPU's own node if at all possible.
+ * Returns false if there was nothing to move.
+ */
+static bool refill(struct entry_cache *cache, struct entry_cache_cpu *cpu)
+{
+	struct entry_cache_node *node = cache->nodes[numa_node_id()];
+	struct entry_cache_node *other;
+	unsigned int count;
+	void *chunk;
+	__u32 first;
+	int nid;
+
+	spin_lock(&node->lock);
+
+	if (node->free_count == 0 && cache->chunk_count < cache->max_chunks) {
+		/* The background worker fell behind; don't drop the packet if it can be helped. */
+		chunk = alloc_chunk_atomic(cache, node->nid);
+		if (chunk) {
+			first = register_chunk(cache, chunk);
+			if (first != ENTRY_NULL)
+				push_chunk(cache, node, first);
+			else
+				free_chunk(cache, chunk);
+		}
+	}
+
+	count = take_batch(cache, node, cpu);
+	if (needs_to_grow(cache, node)) {
+		cpu->reserve_draws += count;
+		schedule_work(&node->grow_work);
+	}
+
+	spin_unlock(&node->lock);
+
+	if (count)
+		return true;
+
+	/* Remote objects are slower, but better than dropping the packet. */
+	for_each_node(nid) {
+		other = cache->nodes[nid];
+		if (other == node)
+			continue;
+
+		spin_lock(&other->lock);
+		count = take_batch(cache, other, cpu);
+		spin_unlock(&other->lock);
+
+		if (count) {
+			cpu->remote_draws += count;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Moves a batch of objects from "cpu"'s free list back to its node's, so CPUs which release more
+ * than they allocate don't hoard the cache. The ones that were released last are kept, since they
+ * are the most likely to still be cached.
+ */
+static void drain(struct entry_cache *cache, struct entry_cache_cpu *cpu)
+{
+	struct entry_cache_node *node = cache->nodes[numa_node_id()];
+	__u32 last_kept = cpu->free_head;
+	__u32 first_given;
+	unsigned int given = cpu->free_count - CPU_BATCH;
+	unsigned int i;
+
+	for (i = 1; i < CPU_BATCH; i++)
+		last_kept = *next_free(cache, last_kept);
+	first_given = *next_free(cache, last_kept);
+	*next_free(cache, last_kept) = ENTRY_NULL;
+
+	spin_lock(&node->lock);
+	*next_free(cache, cpu->free_tail) = node->free_head;
+	node->free_head = first_given;
+	node->free_count += given;
+	spin_unlock(&node->lock);
+
+	cpu->free_tail = last_kept;
+	cpu->free_count = CPU_BATCH;
+}
+
+void *entry_cache_alloc(struct entry_cache *cache, __u32 *handle)
+{
+	struct entry_cache_cpu *cpu;
+	void *result = NULL;
+
+	local_bh_disable();
+	cpu = this_cpu_ptr(cache->cpus);
+
+	if (cpu->free_count == 0 && !refill(cache, cpu)) {
+		cpu->failures++;
+		goto end;
+	}
+
+	*handle = cpu->free_head;
+	result = entry_cache_get(cache, *handle);
+	cpu->free_head = *((__u32 *) result);
+	cpu->free_count--;
+	cpu->allocs++;
+	/* Fall through. */
+
+end:
+	local_bh_enable();
+	return result;
+}
+
+void entry_cache_free(struct entry_cache *cache, __u32 handle)
+{
+	struct entry_cache_cpu *cpu;
+
+	local_bh_disable();
+	cpu = this_cpu_ptr(cache->cpus);
+
+	*next_free(cache, handle) = cpu->free_head;
+	if (cpu->free_count == 0)
+		cpu->free_tail = handle;
+	cpu->free_head = handle;
+	cpu->free_count++;
+	cpu->frees++;
+
+	if (cpu->free_count >= 2 * CPU_BATCH)
+		drain(cache, cpu);
+
+	local_bh_enable();
+}
+
+void entry_cache_get_stats(struct entry_cache *cache, struct cache_stats *result)
+{
+	struct entry_cache_cpu *cpu;
+	__u64 frees = 0;
+	int i, nid;
+
+	memset(result, 0, sizeof(*result));
+	if (!cache->cpus || !cache->nodes)
+		return;
+
+	result->object_size = cache->size;
+	for_each_node(nid)
+		result->reserve_size += cache->nodes[nid]->reserve_size;
+	result->capacity = ((__u64) cache->chunk_count) << cache->chunk_shift;
+	for_each_possible_cpu(i) {
+		cpu = per_cpu_ptr(cache->cpus, i);
+		result->allocs += cpu->allocs;
+		result->failures += cpu->failures;
+		result->reserve_draws += cpu->reserve_draws;
+		result->remote_draws += cpu->remote_draws;
+		frees += cpu->frees;
+	}
+	result->in_use = result->allocs - frees;
+}
@@ -4,9 +4,13 @@
 #include "nat64/mod/rfc6052.h"
 #include "nat64/mod/pool4.h"
 #include "nat64/mod/pool6.h"
+#include "nat64/mod/rss.h"
+#include "nat64/mod/determ.h"
 #include "nat64/mod/send_packet.h"
 
 #include <linux/skbuff.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
 #include <linux/ip.h>
 #include <linux/ipv6.h>
 #include <linux/tcp.h>
@@ -19,6 +23,11 @@
 static struct filtering_config config;
 static DEFINE_SPINLOCK(config_lock);
 
+/** Port reuse: number of shared ports a new BIB entry tries before giving up on an address. */
+#define SHARE_ATTEMPTS 8
+/** Keys the choices made after the source address (eg. shared ports), so nobody can predict them. */
+static __u32 alloc_seed;
+
 /** Esto se llama al insertar el módulo y se encarga de poner los valores por defecto
  *  
  *  @return zero: if initialization ran fine, nonzero: otherwhise. */
@@ -36,6 +45,8 @@ int filtering_init(void)
     config.drop_icmp6_info = FILT_DEF_FILTER_ICMPV6_INFO;
 
     spin_unlock_bh(&config_lock);
+
+    get_random_bytes(&alloc_seed, sizeof(alloc_seed));
     
     return 0;
 } 
@@ -111,15 +122,58 @@ int set_filtering_config(__u32 operation, struct filtering_config *new_config)
     return error;
 } 
 
-static void update_session_lifetime(struct session_entry *session_entry_p, unsigned int *timeout)
+static void update_session_lifetime(struct session_entry *session_entry_p,
+        enum session_timer_type type)
 {
     unsigned int ttl;
 
     spin_lock_bh(&config_lock);
-    ttl = *timeout;
+    switch (type)
+    {
+        case SESSION_TIMER_UDP:
+            ttl = config.to.udp;
+            break;
+        case SESSION_TIMER_TCP_EST:
+            ttl = config.to.tcp_est;
+            break;
+        case SESSION_TIMER_TCP_TRANS:
+            ttl = config.to.tcp_trans;
+            break;
+        case SESSION_TIMER_TCP_SYN:
+            ttl = TCP_INCOMING_SYN;
+            break;
+        default:
+            ttl = config.to.icmp;
+            break;
+    }
     spin_unlock_bh(&config_lock);
 
-    session_entry_p->dying_time = jiffies_to_msecs(jiffies) + 1000 * ttl;
+    session_set_lifetime(session_entry_p, 1000 * ttl, type);
+}
+
+/**
+ * Fast path for packets which belong to an already established connection: if "tuple"'s session
+ * exists, refreshes its lifetime without taking its BIB lock.
+ *
+ * A session's existence implies both its BIB entry and the permission to let the packet through, so
+ * there is nothing else to check or to create.
+ *
+ * @param[in]   tuple   Tuple of the incoming packet.
+ * @param[in]   type    The timeout the session's new lifetime should be taken from.
+ * @return  true if the session was found and refreshed, false if the caller has to take the slow
+ *      path.
+ */
+static bool refresh_session_lockless(struct tuple *tuple, enum session_timer_type type)
+{
+    struct session_entry *session_entry_p;
+
+    rcu_read_lock();
+    session_entry_p = session_get(tuple);
+    if (session_entry_p)
+        update_session_lifetime(session_entry_p, type);
+    rcu_read_unlock();
+
+    return session_entry_p != NULL;
 }
 
 static bool filter_icmpv6_info(void)
@@ -187,86 +241,340 @@ static void transport_address_ipv6(struct in6_addr addr, __u16 l4_id, struct ipv
     ta->l4_id = l4_id;
 }
 
-/** Allocate from IPv4 pool a new transport address for TCP & UDP.
+static bool extract_ipv4(struct in6_addr *src, struct in_addr *dst);
+
+/** Compute the IPv4 transport address the replies to the packet will come from, so the IPv4 pool
+ *  can choose a transport address whose replies will be received by this CPU.
  *
- *  RFC6146 - Sec. 3.5.1.1
+ * @param[in]   tuple   Packet's tuple containg the destination address (Y', y).
+ * @param[out]  remote  The destination's IPv4 transport address (Z(Y'), y).
+ * @return  "remote" if the IPv4 pool can use it, NULL otherwise.
+ */
+static struct ipv4_tuple_address *get_ipv4_remote(struct tuple *tuple,
+        struct ipv4_tuple_address *remote)
+{
+    if ( !rss_is_enabled() )
+        return NULL;
+    if ( !extract_ipv4(&tuple->dst.addr.ipv6, &remote->address) )
+        return NULL;
+    remote->l4_id = tuple->dst.l4_id;
+
+    return remote;
+}
+
+/** Compute a transport address from the source's deterministic range (see determ.h).
+ *  Nobody else uses the range, and the BIB lock held by the caller is shared by all of the
+ *  subscriber's BIB entries, so this only has to avoid the subscriber's other flows.
  *
  * @param[in]   tuple       Packet's tuple containg the source address.
  * @param[in]   protocol    In what protocolo we should look at?
- * @param[out]  new_ipv4_transport_address  New transport address obtained from the PROTOCOL's pool.
- * @return  true if everything went OK, false otherwise.
+ * @param[in]   range       The source's range.
+ * @param[out]  result      The new transport address.
+ * @return  true if the range had a port left, false otherwise.
  */
-static bool allocate_ipv4_transport_address(struct tuple *tuple, u_int8_t protocol,
-        struct ipv4_tuple_address *result)
+static bool allocate_deterministic(struct tuple *tuple, u_int8_t protocol,
+        struct determ_range *range, struct ipv4_tuple_address *result)
+{
+    unsigned int offset, i;
+    bool taken;
+
+    result->address = range->addr;
+
+    /* Start where the source port says, so most flows are settled on the first try. */
+    offset = tuple->src.l4_id % range->count;
+    for (i = 0; i < range->count; i++) {
+        result->l4_id = range->first + offset;
+
+        rcu_read_lock();
+        taken = ( bib_get_by_ipv4(result, protocol) != NULL );
+        rcu_read_unlock();
+        if ( !taken )
+            return true;
+
+        offset = (offset + 1 < range->count) ? (offset + 1) : 0;
+    }
+
+    log_warning("%pI6c ran out of deterministic ports.", &tuple->src.addr.ipv6);
+    return false;
+}
+
+/** What share_ipv4_transport_address() needs to know about the new BIB entry. */
+struct share_args {
+    /** Packet's tuple, containing the source (X', x). */
+    struct tuple *tuple;
+    u_int8_t protocol;
+    /** The destination (Z, z); no other entry may be talking to it from the chosen port. */
+    struct ipv4_tuple_address remote;
+    /** The addresses the port may belong to (see struct pool6_entry). */
+    struct ipv4_prefix *subset;
+    /** The chosen transport address. */
+    struct ipv4_tuple_address *result;
+};
+
+/** Compute the "attempt"th port the new BIB entry might share.
+ *  The port is in the same range as x, and UDP keeps its parity too (RFC 6146 - Sec. 3.5.1.1).
+ */
+static __u16 share_candidate(struct share_args *args, unsigned int attempt)
+{
+    __u16 port = args->tuple->src.l4_id;
+    __u32 random;
+    __u16 result;
+
+    random = jhash_3words(ipv6_addr_hashcode(&args->tuple->src.addr.ipv6, alloc_seed), port,
+            attempt, alloc_seed);
+    result = ( port < 1024 ) ? (random % 1024) : (1024 + random % (65536 - 1024));
+    if ( args->protocol == IPPROTO_UDP )
+        result = (result & ~1) | (port & 1);
+
+    return result;
+}
+
+/** Bind the new BIB entry to one of the transport addresses of "addr" other entries are already
+ *  bound to, as long as none of them are talking to the packet's destination from it.
+ *  (The session table has the final word on that; see session_add().)
+ *
+ * @param[in]   args    The new BIB entry.
+ * @param[in]   addr    The IPv4 address the port should belong to.
+ * @return  true if a port could be joined, false otherwise.
+ */
+static bool share_ipv4_transport_address(struct share_args *args, struct in_addr *addr)
 {
-    struct bib_entry *bib_entry_t;
+    struct ipv4_pair pair;
+    unsigned int i;
+    bool taken;
 
-    /* Check if the BIB has a previous entry from the same IPv6 source address (X’) */
-    bib_entry_t = bib_get_by_ipv6_only( &tuple->src.addr.ipv6, protocol );
+    pair.remote = args->remote;
+    pair.local.address = *addr;
 
-    if ( bib_entry_t != NULL )
+    for ( i = 0; i < SHARE_ATTEMPTS; i++ )
     {
-    	/* Use the same IPv4 address (T). */
-        struct ipv4_tuple_address temp;
-        transport_address_ipv4(bib_entry_t->ipv4.address, tuple->src.l4_id, &temp);
-        return pool4_get_similar(protocol, &temp, result);
+        pair.local.l4_id = share_candidate(args, i);
+
+        rcu_read_lock();
+        taken = ( session_get_by_ipv4(&pair, args->protocol) != NULL );
+        rcu_read_unlock();
+
+        if ( !taken && bib_get_shared_port(args->protocol, &pair.local) )
+        {
+            *args->result = pair.local;
+            return true;
+        }
     }
-    else
+
+    return false;
+}
+
+/** pool4_for_each() callback; tries to share a port of "addr". Returns nonzero on success. */
+static int share_on_address(struct in_addr *addr, void *void_args)
+{
+    struct share_args *args = void_args;
+
+    if ( !ipv4_prefix_contains(args->subset, addr) )
+        return 0;
+    return share_ipv4_transport_address(args, addr) ? 1 : 0;
+}
+
+/** Borrow a transport address from "subset" (the part of pool4 the destination's prefix is
+ *  masked with; see struct pool6_entry).
+ *  The address selection mode is not honored here; the addresses are walked starting from one the
+ *  source decides, so different nodes don't all pile up on the first one.
+ *
+ * @param[in]   tuple       Packet's tuple containg the source address.
+ * @param[in]   protocol    In what protocolo we should look at?
+ * @param[in]   subset      The addresses the transport address may belong to.
+ * @param[in]   remote      The destination, for the IPv4 pool's RSS awareness (can be NULL).
+ * @param[out]  result      The new transport address.
+ * @return  true if the subset had a compatible port left, false otherwise.
+ */
+static bool allocate_from_subset(struct tuple *tuple, u_int8_t protocol,
+        struct ipv4_prefix *subset, struct ipv4_tuple_address *remote,
+        struct ipv4_tuple_address *result)
+{
+    struct ipv4_tuple_address candidate;
+    __u32 first = be32_to_cpu(subset->address.s_addr);
+    __u32 count = 1U << (32 - subset->len);
+    __u32 offset, i;
+
+    offset = ipv6_addr_hashcode(&tuple->src.addr.ipv6, alloc_seed) & (count - 1);
+    candidate.l4_id = tuple->src.l4_id;
+
+    for ( i = 0; i < count; i++ )
     {
-    	/* create a new BIB entry and ask the IPv4 pool for a new IPv4 address. */
-        return pool4_get_any(protocol, tuple->src.l4_id, result);
+        candidate.address.s_addr = cpu_to_be32(first + ((offset + i) & (count - 1)));
+        if ( !pool4_contains(&candidate.address) )
+            continue;
+        if ( pool4_get_similar(protocol, &candidate, &tuple->src.addr.ipv6, remote, result) )
+            return true;
     }
+
+    return false;
 }
 
 /** Obtains a IPv4 transport address, looking for IPv4 address previously asigned
- *  to the Source's machine, search in the BIBs: TCP, UDP & ICMP.
+ *  to the Source's machine, in any of the BIBs: TCP, UDP & ICMP.
+ *  If the destination's prefix has a pool4 subset, the address has to belong to it.
+ *
+ *  In port reuse mode (see bib_set_port_reuse()), UDP and TCP transport addresses are lent to be
+ *  shared, and if the pool has none left, the new entry shares one with other entries.
+ *
+ *  RFC6146 - Sec. 3.5.1.1 and 3.5.2.3
  *
- *  RFC6146 - Sec. 3.5.2.3
- * 
  * @param[in]   tuple       Packet's tuple containg the source address.
- * @param[in]   protocol    In what protocolo we should look at FIRST?
- * @param[out]  new_ipv4_transport_address  New transport address obtained from the PROTOCOL's pool.
- * @return  true if everything went OK, false otherwise.
+ * @param[in]   protocol    In what protocolo we should look at?
+ * @param[out]  result      New transport address obtained from the PROTOCOL's pool.
+ * @param[out]  shared      Whether other BIB entries can be bound to "result" as well.
+ * @param[out]  host_lock   If the source had no BIB entries, its lock (see bib_lock_host()), which
+ *                          is held until the new entry is added (see add_bib()). NULL otherwise.
+ * @return  true if everything went OK, false otherwise. Nothing is left locked on failure.
  */
-static bool allocate_ipv4_transport_address_digger(struct tuple *tuple, u_int8_t protocol,
-        struct ipv4_tuple_address *result)
-{ 
-    unsigned char ii = 0;
-    u_int8_t proto[] = {IPPROTO_TCP, IPPROTO_UDP, IPPROTO_ICMP};
-    struct in_addr *address = NULL;
+static bool allocate_ipv4_transport_address(struct tuple *tuple, u_int8_t protocol,
+        struct ipv4_tuple_address *result, bool *shared, spinlock_t **host_lock)
+{
+    struct in_addr address;
+    struct ipv4_tuple_address temp;
+    struct ipv4_tuple_address remote_buffer;
+    struct ipv4_tuple_address *remote = get_ipv4_remote(tuple, &remote_buffer);
+    struct determ_range range;
+    struct pool6_entry prefix;
+    struct share_args args;
+    bool found_host;
+
+    *shared = false;
+    *host_lock = NULL;
+
+    /* Mapped subscribers always get the same address, so the pool needn't be consulted. */
+    if ( determ_get_range(&tuple->src.addr.ipv6, &range) == 0 )
+        return allocate_deterministic(tuple, protocol, &range, result);
+
+    /* The destination's prefix might restrict the addresses we can use. */
+    if ( !pool6_get(&tuple->dst.addr.ipv6, &prefix) )
+        prefix.pool4.len = 0;
 
     /*  If there exists another BIB entry in any of the BIBs that
         contains the same IPv6 source address (S’) and maps it to an IPv4
         address (T), then use (T) as the BIB IPv4 address for this new
         entry. Otherwise, use any IPv4 address assigned to the IPv4
         interface. */
-    
-    /*  Look in the three BIB tables for a previous packet from the same origin (S'),
-     *  we will do this anyway. */
-    for (ii = 0 ; ii < 3 ; ii++)
+    found_host = bib_get_host_ipv4(&tuple->src.addr.ipv6, &address);
+    if ( !found_host )
     {
-        struct bib_entry *bib_entry_p;
-        
-        bib_entry_p = bib_get_by_ipv6_only(&tuple->src.addr.ipv6, proto[ii]);
-        if (bib_entry_p != NULL)
-        {
-            address = &bib_entry_p->ipv4.address;
-            break; /* We found one entry! */
-        }
+        /* Make sure the source's other first flows don't pick a different address meanwhile. */
+        *host_lock = bib_lock_host(&tuple->src.addr.ipv6);
+        found_host = bib_get_host_ipv4(&tuple->src.addr.ipv6, &address);
     }
-    
-    if ( address != NULL )
+    found_host = found_host && ipv4_prefix_contains(&prefix.pool4, &address);
+    if ( found_host )
     {
-        /* Use the same address */
-        struct ipv4_tuple_address temp;
-        transport_address_ipv4(*address, tuple->src.l4_id, &temp);
-        return pool4_get_similar(protocol, &temp, result);
+        /* Use the same IPv4 address (T). */
+        transport_address_ipv4(address, tuple->src.l4_id, &temp);
+        if ( pool4_get_similar(protocol, &temp, &tuple->src.addr.ipv6, remote, result) )
+            goto lent;
+    }
+    else if ( prefix.pool4.len != 0 )
+    {
+        if ( allocate_from_subset(tuple, protocol, &prefix.pool4, remote, result) )
+            goto lent;
     }
     else
     {
-        /* Use whichever address */
-        return pool4_get_any(protocol, tuple->src.l4_id, result);
+        /* create a new BIB entry and ask the IPv4 pool for a new IPv4 address. */
+        if ( pool4_get_any(protocol, tuple->src.l4_id, &tuple->src.addr.ipv6, remote, result) )
+            goto lent;
     }
+
+    /* The pool has run out of ports; maybe somebody will share theirs. */
+    if ( !bib_port_reuse_enabled() || protocol == IPPROTO_ICMP )
+        goto failure;
+    if ( !extract_ipv4(&tuple->dst.addr.ipv6, &args.remote.address) )
+        goto failure;
+    args.tuple = tuple;
+    args.protocol = protocol;
+    args.remote.l4_id = tuple->dst.l4_id;
+    args.subset = &prefix.pool4;
+    args.result = result;
+
+    if ( found_host )
+        *shared = share_ipv4_transport_address(&args, &address);
+    else
+        *shared = ( pool4_for_each(share_on_address, &args) > 0 );
+    if ( *shared )
+        return true;
+    /* Fall through. */
+
+failure:
+    if ( *host_lock != NULL )
+    {
+        spin_unlock_bh(*host_lock);
+        *host_lock = NULL;
+    }
+    return false;
+
+lent:
+    /* If the port cannot be shared after all, the entry will simply keep it to itself. */
+    if ( bib_port_reuse_enabled() && protocol != IPPROTO_ICMP )
+        *shared = ( bib_add_shared_port(protocol, result) == 0 );
+    return true;
+}
+
+/** Add the new BIB entry "bib" to its table, and release the lock of its node if
+ *  allocate_ipv4_transport_address() took it.
+ *
+ * @return  result status, as in bib_add().
+ */
+static int add_bib(struct bib_entry *bib, u_int8_t protocol, spinlock_t *host_lock)
+{
+    int error;
+
+    if ( host_lock == NULL )
+        return bib_add(bib, protocol);
+
+    error = bib_add_host_locked(bib, protocol);
+    spin_unlock_bh(host_lock);
+    return error;
+}
+
+/** Lock the BIB entry an IPv4 UDP or TCP packet is headed to.
+ *  Shared entries (see bib_set_port_reuse()) can only be reached through their sessions.
+ *
+ * @param[in]   tuple   Tuple of the incoming packet; its destination is (T,t).
+ * @param[out]  bib     The BIB entry.
+ * @return  the lock to release once done with "bib". NULL if there is no such entry, in which case
+ *          nothing is locked.
+ */
+static spinlock_t *lock_bib_by_ipv4(struct tuple *tuple, struct bib_entry **bib)
+{
+    struct ipv4_pair pair;
+    struct session_entry *session;
+    spinlock_t *lock;
+
+    transport_address_ipv4(tuple->dst.addr.ipv4, tuple->dst.l4_id, &pair.local);
+    lock = bib_lock_by_ipv4(&pair.local, tuple->l4_proto, bib);
+    if ( lock != NULL || !bib_port_reuse_enabled() )
+        return lock;
+
+    transport_address_ipv4(tuple->src.addr.ipv4, tuple->src.l4_id, &pair.remote);
+    lock = session_lock_by_ipv4(&pair, tuple->l4_proto, &session);
+    if ( lock != NULL )
+        *bib = session->bib;
+    return lock;
+}
+
+/** Derive the deterministic subscriber an IPv4 packet is headed to, without looking at the BIB.
+ *
+ * @param[in]   tuple   Tuple of the incoming packet; its destination is deterministic.
+ * @return  true if the destination belongs to some subscriber's range, false otherwise.
+ */
+static bool determ_accepts(struct tuple *tuple)
+{
+    struct ipv4_tuple_address destination;
+    struct ipv6_prefix subscriber;
+
+    transport_address_ipv4(tuple->dst.addr.ipv4, tuple->dst.l4_id, &destination);
+    if ( determ_get_prefix(&destination, &subscriber) != 0 )
+        return false;
+
+    log_debug("Packet is headed to subscriber %pI6c/%u.", &subscriber.address, subscriber.len);
+    return true;
 }
 
 /** Determine if a packet is IPv4 .
@@ -387,6 +695,7 @@ static bool send_probe_packet(struct session_entry *entry)
     struct tcphdr *th;
     struct ipv6hdr *iph;
     struct sk_buff* skb;
+    struct ipv6_pair pair6;
 
     unsigned int l3_hdr_len = sizeof(*iph);
     unsigned int l4_hdr_len = sizeof(*th);
@@ -409,12 +718,13 @@ static bool send_probe_packet(struct session_entry *entry)
     iph->payload_len = l4_hdr_len;
     iph->nexthdr = IPPROTO_TCP;
     iph->hop_limit = 64; /* TODO (warning) set this value during send_packet_ipv6 using dst? */
-    iph->saddr = entry->ipv6.local.address;
-    iph->daddr = entry->ipv6.remote.address;
+    session_get_ipv6(entry, &pair6);
+    iph->saddr = pair6.local.address;
+    iph->daddr = pair6.remote.address;
 
     th = tcp_hdr(skb);
-    th->source = cpu_to_be16(entry->ipv6.local.l4_id);
-    th->dest = cpu_to_be16(entry->ipv6.remote.l4_id);
+    th->source = cpu_to_be16(pair6.local.l4_id);
+    th->dest = cpu_to_be16(pair6.remote.l4_id);
     th->seq = htonl(0);
     th->ack_seq = htonl(0);
     th->res1 = 0;
@@ -444,17 +754,18 @@ static bool send_probe_packet(struct session_entry *entry)
 
 static bool extract_ipv4(struct in6_addr *src, struct in_addr *dst)
 {
-    struct ipv6_prefix prefix;
-    if ( !pool6_peek(&prefix) )
+    struct pool6_entry entry;
+    if ( !pool6_get(src, &entry) )
         return false;
 
-    return addr_6to4(src, &prefix, dst);
+    return addr_6to4(src, &entry.prefix, dst);
 }
 
-static bool append_ipv4(struct in_addr *src, struct in6_addr *dst)
+/** Compute the IPv6 representation of "src", as seen by the IPv6 nodes masked with "local" (T). */
+static bool append_ipv4(struct in_addr *src, struct in_addr *local, struct in6_addr *dst)
 {
     struct ipv6_prefix prefix;
-    if ( !pool6_peek(&prefix) )
+    if ( !pool6_peek_by_pool4(local, &prefix) )
         return false;
 
     return addr_4to6(src, &prefix, dst);
@@ -486,23 +797,30 @@ static int ipv6_udp(struct sk_buff *skb, struct tuple *tuple)
     struct ipv4_tuple_address bib_ipv4_addr;
     struct in_addr destination_as_ipv4;
     struct ipv6_tuple_address source;
-    struct ipv4_pair pair4;
-    struct ipv6_pair pair6;
+    struct ipv4_tuple_address remote4;
     u_int8_t protocol = IPPROTO_UDP;
     bool bib_is_local = false;
+    bool shared;
+    spinlock_t *lock;
+    spinlock_t *host_lock;
     
+    if ( refresh_session_lockless(tuple, SESSION_TIMER_UDP) )
+        return NF_ACCEPT;
+
     /* Pack source address into transport address */
     transport_address_ipv6( tuple->src.addr.ipv6, tuple->src.l4_id, &source );
 
     /* Check if a previous BIB entry exist, look for IPv6 source transport address (X’,x). */
-    spin_lock_bh(&bib_session_lock);
+    lock = bib_get_lock( &source );
+    spin_lock_bh(lock);
     bib_entry_p = bib_get_by_ipv6( &source, protocol );
 
     /* If not found, try to create a new one. */
     if ( bib_entry_p == NULL )
     {
         /* Find a similar transport address (T, t) */
-        if ( !allocate_ipv4_transport_address(tuple, protocol, &bib_ipv4_addr) )
+        if ( !allocate_ipv4_transport_address(tuple, protocol, &bib_ipv4_addr, &shared,
+                &host_lock) )
         {
             log_warning("Could not 'allocate' a compatible transport address for the packet.");
             goto bib_failure;
@@ -513,18 +831,25 @@ static int ipv6_udp(struct sk_buff *skb, struct tuple *tuple)
         if ( bib_entry_p == NULL )
         {
             log_err(ERR_ALLOC_FAILED, "Failed to allocate a BIB entry.");
+            if ( host_lock != NULL )
+                spin_unlock_bh(host_lock);
+            if ( !shared || bib_put_shared_port(protocol, &bib_ipv4_addr) )
+                pool4_return(protocol, &bib_ipv4_addr);
             goto bib_failure;
         }
+        bib_entry_p->is_shared = shared;
 
         bib_is_local = true;
 
         apply_policies();
 
         /* Add the BIB entry */
-        if ( bib_add(bib_entry_p, protocol) != 0 )
+        if ( add_bib(bib_entry_p, protocol, host_lock) != 0 )
         {
-        	kfree(bib_entry_p);
             log_err(ERR_ADD_BIB_FAILED, "Could not add the BIB entry to the table.");
+            if ( bib_release_port(bib_entry_p, protocol) )
+                pool4_return(protocol, &bib_entry_p->ipv4);
+            bib_kfree_rcu(bib_entry_p);
             goto bib_failure;
         }
     }
@@ -544,14 +869,10 @@ static int ipv6_udp(struct sk_buff *skb, struct tuple *tuple)
         }
 
         /* Create the session entry */
-        pair6.remote.address = tuple->src.addr.ipv6; /* X' */
-        pair6.remote.l4_id = tuple->src.l4_id; /* x */
-        pair6.local.address = tuple->dst.addr.ipv6; /* Y' */
-        pair6.local.l4_id = tuple->dst.l4_id; /* y */
-        pair4.local = bib_entry_p->ipv4; /* (T, t) */
-        pair4.remote.address = destination_as_ipv4; /* Z or Z(Y’) */
-        pair4.remote.l4_id = tuple->dst.l4_id; /* z or y */
-        session_entry_p = session_create(&pair4, &pair6, protocol);
+        /* (X', x) and (T, t) are the BIB's; (Y', y) is derived from (Z, z). */
+        remote4.address = destination_as_ipv4; /* Z or Z(Y’) */
+        remote4.l4_id = tuple->dst.l4_id; /* z or y */
+        session_entry_p = session_create(bib_entry_p, &remote4, &tuple->dst.addr.ipv6, protocol);
         if ( session_entry_p == NULL )
         {
             log_err(ERR_ALLOC_FAILED, "Failed to allocate a session entry.");
@@ -563,32 +884,32 @@ static int ipv6_udp(struct sk_buff *skb, struct tuple *tuple)
         /* Add the session entry */
         if ( session_add(session_entry_p) != 0 )
         {
-        	kfree(session_entry_p);
+        	session_kfree_rcu(session_entry_p);
             log_err(ERR_ADD_SESSION_FAILED, "Could not add the session entry to the table.");
             goto session_failure;
         }
 
         /* Cross-reference them. */
-        session_entry_p->bib = bib_entry_p;
-        list_add(&session_entry_p->entries_from_bib, &bib_entry_p->sessions);
+        session_link_to_bib(session_entry_p);
     }
     
     /* Reset session entry's lifetime. */
-    update_session_lifetime(session_entry_p, &config.to.udp); 
-    spin_unlock_bh(&bib_session_lock);
+    update_session_lifetime(session_entry_p, SESSION_TIMER_UDP); 
+    spin_unlock_bh(lock);
 
     return NF_ACCEPT;
 
 session_failure:
     if ( bib_is_local ) {
         bib_remove(bib_entry_p, protocol);
-        pool4_return(protocol, &bib_entry_p->ipv4);
-        kfree(bib_entry_p);
+        if ( bib_release_port(bib_entry_p, protocol) )
+            pool4_return(protocol, &bib_entry_p->ipv4);
+        bib_kfree_rcu(bib_entry_p);
     }
     /* Fall through. */
 
 bib_failure:
-    spin_unlock_bh(&bib_session_lock);
+    spin_unlock_bh(lock);
     /* This is specified in section 3.5.1.1. */
     icmpv6_send(skb, ICMPV6_DEST_UNREACH, ICMPV6_ADDR_UNREACH, 0);
     return NF_DROP;
@@ -607,28 +928,25 @@ static int ipv4_udp(struct sk_buff* skb, struct tuple *tuple)
     struct bib_entry *bib_entry_p;
     struct session_entry *session_entry_p;
     struct in6_addr source_as_ipv6;
-    struct ipv4_tuple_address destination;
-    struct ipv4_pair pair4;
-    struct ipv6_pair pair6;
+    struct ipv4_tuple_address remote4;
     u_int8_t protocol = IPPROTO_UDP;
+    spinlock_t *lock;
     /*
 	 * We don't want to call icmp_send() while the spinlock is held, so this will tell whether and
 	 * what should be sent.
 	 */
 	int icmp_error = -1;
 
-    /* Pack source address into transport address */
-    transport_address_ipv4( tuple->dst.addr.ipv4, tuple->dst.l4_id, &destination );
-
-    spin_lock_bh(&bib_session_lock);
+    if ( refresh_session_lockless(tuple, SESSION_TIMER_UDP) )
+        return NF_ACCEPT;
 
     /* Check if a previous BIB entry exist, look for IPv4 destination transport address (T,t). */
-    bib_entry_p = bib_get_by_ipv4( &destination, protocol );
-    if ( bib_entry_p == NULL )
+    lock = lock_bib_by_ipv4( tuple, &bib_entry_p );
+    if ( lock == NULL )
     {
         log_warning("There is no BIB entry for the incoming IPv4 UDP packet.");
-        icmp_error = ICMP_HOST_UNREACH;
-        goto failure;
+        icmp_send(skb, ICMP_DEST_UNREACH, ICMP_HOST_UNREACH, 0);
+        return NF_DROP;
     }
     
     /* If we're applying address-dependent filtering in the IPv4 interface, */
@@ -644,8 +962,8 @@ static int ipv4_udp(struct sk_buff* skb, struct tuple *tuple)
     
     if ( session_entry_p == NULL )
     {
-        /* Translate address */
-        if ( !append_ipv4(&tuple->src.addr.ipv4, &source_as_ipv6) ) /* Y’(W) */
+        /* Translate address: Y’(W) */
+        if ( !append_ipv4(&tuple->src.addr.ipv4, &tuple->dst.addr.ipv4, &source_as_ipv6) )
         {
             log_err(ERR_APPEND_FAILED, "Could not translate the packet's address.");
             icmp_error = ICMP_HOST_UNREACH;
@@ -653,14 +971,10 @@ static int ipv4_udp(struct sk_buff* skb, struct tuple *tuple)
         }
 
         /* Create the session entry */
-        pair6.remote = bib_entry_p->ipv6; /* (X', x) */
-        pair6.local.address = source_as_ipv6; /* Y’(W) */
-        pair6.local.l4_id = tuple->src.l4_id; /* w */
-        pair4.local.address = tuple->dst.addr.ipv4; /* T */
-        pair4.local.l4_id = tuple->dst.l4_id; /* t */
-        pair4.remote.address = tuple->src.addr.ipv4; /* W */
-        pair4.remote.l4_id = tuple->src.l4_id; /* w */
-        session_entry_p = session_create(&pair4, &pair6, protocol);
+        /* (X', x) and (T, t) are the BIB's; (Y', y) is derived from (W, w). */
+        remote4.address = tuple->src.addr.ipv4; /* W */
+        remote4.l4_id = tuple->src.l4_id; /* w */
+        session_entry_p = session_create(bib_entry_p, &remote4, &source_as_ipv6, protocol);
         if ( session_entry_p == NULL )
         {
         	log_err(ERR_ALLOC_FAILED, "Failed to allocate a session entry.");
@@ -673,25 +987,24 @@ static int ipv4_udp(struct sk_buff* skb, struct tuple *tuple)
         /* Add the session entry */
         if ( session_add(session_entry_p) != 0 )
         {
-        	kfree(session_entry_p);
+        	session_kfree_rcu(session_entry_p);
         	log_err(ERR_ADD_SESSION_FAILED, "Could not add the session entry to the table.");
         	icmp_error = ICMP_HOST_UNREACH;
 			goto failure;
         }
 
         /* Cross-reference them. */
-		session_entry_p->bib = bib_entry_p;
-		list_add(&session_entry_p->entries_from_bib, &bib_entry_p->sessions);
+		session_link_to_bib(session_entry_p);
     }
     
     /* Reset session entry's lifetime. */
-    update_session_lifetime(session_entry_p, &config.to.udp);
-    spin_unlock_bh(&bib_session_lock);
+    update_session_lifetime(session_entry_p, SESSION_TIMER_UDP);
+    spin_unlock_bh(lock);
         
     return NF_ACCEPT;
 
 failure:
-    spin_unlock_bh(&bib_session_lock);
+    spin_unlock_bh(lock);
 
     /*
 	 * This is is not specified most of the time, but I assume we're supposed to do it, in order
@@ -718,10 +1031,12 @@ static int ipv6_icmp6(struct sk_buff *skb, struct tuple *tuple)
     struct ipv4_tuple_address bib_ipv4_addr;
     struct in_addr destination_as_ipv4;
     struct ipv6_tuple_address source;
-    struct ipv4_pair pair4;
-    struct ipv6_pair pair6;
+    struct ipv4_tuple_address remote4;
     u_int8_t protocol = IPPROTO_ICMP;
     bool bib_is_local = false;
+    bool shared;
+    spinlock_t *lock;
+    spinlock_t *host_lock;
     
     if ( filter_icmpv6_info() )
     {
@@ -729,18 +1044,22 @@ static int ipv6_icmp6(struct sk_buff *skb, struct tuple *tuple)
         return NF_DROP;
     }
 
+    if ( refresh_session_lockless(tuple, SESSION_TIMER_ICMP) )
+        return NF_ACCEPT;
+
     /* Pack source address into transport address */
     transport_address_ipv6( tuple->src.addr.ipv6, tuple->icmp_id, &source );
     
     /* Search for an ICMPv6 Query BIB entry that matches the (X’,i1) pair. */
-    spin_lock_bh(&bib_session_lock);
+    lock = bib_get_lock( &source );
+    spin_lock_bh(lock);
     bib_entry_p = bib_get_by_ipv6( &source, protocol );
 
     /* If not found, try to create a new one. */
     if ( bib_entry_p == NULL )
     {
         /* Look in the BIB tables for a previous packet from the same origin (X') */
-    	if ( !allocate_ipv4_transport_address_digger(tuple, protocol, &bib_ipv4_addr) )
+    	if ( !allocate_ipv4_transport_address(tuple, protocol, &bib_ipv4_addr, &shared, &host_lock) )
         {
         	log_warning("Could not 'allocate' a compatible transport address for the packet.");
             goto bib_failure;
@@ -750,20 +1069,27 @@ static int ipv6_icmp6(struct sk_buff *skb, struct tuple *tuple)
         bib_entry_p = bib_create(&bib_ipv4_addr, &source, false);
         if ( bib_entry_p == NULL )
         {
-        	log_err(ERR_ALLOC_FAILED, "Failed to allocate a BIB entry.");
-        	goto bib_failure;
+            log_err(ERR_ALLOC_FAILED, "Failed to allocate a BIB entry.");
+            if ( host_lock != NULL )
+                spin_unlock_bh(host_lock);
+            if ( !shared || bib_put_shared_port(protocol, &bib_ipv4_addr) )
+                pool4_return(protocol, &bib_ipv4_addr);
+            goto bib_failure;
         }
+        bib_entry_p->is_shared = shared;
 
         bib_is_local = true;
 
         apply_policies();
 
         /* Add the new BIB entry */
-        if ( bib_add(bib_entry_p, protocol) != 0 )
+        if ( add_bib(bib_entry_p, protocol, host_lock) != 0 )
         {
-        	kfree(bib_entry_p);
-        	log_err(ERR_ADD_BIB_FAILED, "Could not add the BIB entry to the table.");
-        	goto bib_failure;
+            log_err(ERR_ADD_BIB_FAILED, "Could not add the BIB entry to the table.");
+            if ( bib_release_port(bib_entry_p, protocol) )
+                pool4_return(protocol, &bib_entry_p->ipv4);
+            bib_kfree_rcu(bib_entry_p);
+            goto bib_failure;
         }
     }
 
@@ -783,14 +1109,10 @@ static int ipv6_icmp6(struct sk_buff *skb, struct tuple *tuple)
         }
 
         /* Create the session entry */
-        pair6.remote.address = tuple->src.addr.ipv6;      /* (X') */
-        pair6.remote.l4_id = tuple->icmp_id;              /* (i1) */
-        pair6.local.address = tuple->dst.addr.ipv6;       /* (Y') */
-        pair6.local.l4_id = tuple->icmp_id;               /* (i1) */
-        pair4.local = bib_entry_p->ipv4;                  /* (T, i2) */
-        pair4.remote.address = destination_as_ipv4;       /* (Z(Y’)) */
-        pair4.remote.l4_id = bib_entry_p->ipv4.l4_id;     /* (i2) */
-        session_entry_p = session_create(&pair4, &pair6, protocol);
+        /* (X', i1) and (T, i2) are the BIB's; (Y', i1) is derived from them and Z. */
+        remote4.address = destination_as_ipv4;       /* (Z(Y’)) */
+        remote4.l4_id = bib_entry_p->ipv4.l4_id;     /* (i2) */
+        session_entry_p = session_create(bib_entry_p, &remote4, &tuple->dst.addr.ipv6, protocol);
         if ( session_entry_p == NULL )
         {
         	log_err(ERR_ALLOC_FAILED, "Failed to allocate a session entry.");
@@ -802,32 +1124,32 @@ static int ipv6_icmp6(struct sk_buff *skb, struct tuple *tuple)
         /* Add the session entry */
         if ( session_add(session_entry_p) != 0 )
         {
-        	kfree(session_entry_p);
+        	session_kfree_rcu(session_entry_p);
         	log_err(ERR_ADD_SESSION_FAILED, "Could not add the session entry to the table.");
             goto session_failure;
         }
 
         /* Cross-reference them. */
-        session_entry_p->bib = bib_entry_p;
-        list_add(&session_entry_p->entries_from_bib, &bib_entry_p->sessions);
+        session_link_to_bib(session_entry_p);
     }
     
     /* Reset session entry's lifetime. */
-    update_session_lifetime(session_entry_p, &config.to.icmp);
-    spin_unlock_bh(&bib_session_lock);
+    update_session_lifetime(session_entry_p, SESSION_TIMER_ICMP);
+    spin_unlock_bh(lock);
 
     return NF_ACCEPT;
 
 session_failure:
     if ( bib_is_local ) {
         bib_remove(bib_entry_p, protocol);
-        pool4_return(protocol, &bib_entry_p->ipv4);
-        kfree(bib_entry_p);
+        if ( bib_release_port(bib_entry_p, protocol) )
+            pool4_return(protocol, &bib_entry_p->ipv4);
+        bib_kfree_rcu(bib_entry_p);
     }
     /* Fall through. */
 
 bib_failure:
-    spin_unlock_bh(&bib_session_lock);
+    spin_unlock_bh(lock);
     /*
      * This is is not specified, but I assume we're supposed to do it, since otherwise this entire
      * thing is so similar to UDP.
@@ -849,27 +1171,28 @@ static int ipv4_icmp4(struct sk_buff* skb, struct tuple *tuple)
     struct session_entry *session_entry_p;
     struct in6_addr source_as_ipv6;
     struct ipv4_tuple_address destination;
-    struct ipv4_pair pair4;
-    struct ipv6_pair pair6;
+    struct ipv4_tuple_address remote4;
     u_int8_t protocol = IPPROTO_ICMP;
+    spinlock_t *lock;
     /*
      * We don't want to call icmp_send() while the spinlock is held, so this will tell whether and
      * what should be sent.
      */
     int icmp_error = -1;
     
+    if ( refresh_session_lockless(tuple, SESSION_TIMER_ICMP) )
+        return NF_ACCEPT;
+
     /* Pack source address into transport address */
     transport_address_ipv4( tuple->dst.addr.ipv4, tuple->icmp_id, &destination );
     
-    spin_lock_bh(&bib_session_lock);
-
     /* Find the packet's BIB entry. */
-    bib_entry_p = bib_get_by_ipv4( &destination, protocol );
-    if ( bib_entry_p == NULL )
+    lock = bib_lock_by_ipv4( &destination, protocol, &bib_entry_p );
+    if ( lock == NULL )
     {
         log_warning("There is no BIB entry for the incoming IPv4 ICMP packet.");
-        icmp_error = ICMP_HOST_UNREACH;
-        goto failure;
+        icmp_send(skb, ICMP_DEST_UNREACH, ICMP_HOST_UNREACH, 0);
+        return NF_DROP;
     }
 
     /* If we're applying address-dependent filtering in the IPv4 interface, */
@@ -885,8 +1208,8 @@ static int ipv4_icmp4(struct sk_buff* skb, struct tuple *tuple)
     
     if ( session_entry_p == NULL )
     {
-        /* Translate the address */
-        if ( !append_ipv4(&tuple->src.addr.ipv4, &source_as_ipv6) ) /* Y’(Z) */
+        /* Translate the address: Y’(Z) */
+        if ( !append_ipv4(&tuple->src.addr.ipv4, &tuple->dst.addr.ipv4, &source_as_ipv6) )
         {
         	log_err(ERR_APPEND_FAILED, "Could not translate the packet's address.");
         	icmp_error = ICMP_HOST_UNREACH;
@@ -894,14 +1217,10 @@ static int ipv4_icmp4(struct sk_buff* skb, struct tuple *tuple)
         }
 
         /* Create the session entry. */
-        pair6.remote = bib_entry_p->ipv6; /* X', i1 */
-        pair6.local.address = source_as_ipv6; /* Y'(Z) */
-        pair6.local.l4_id = bib_entry_p->ipv6.l4_id; /* i1 */
-        pair4.local.address = tuple->dst.addr.ipv4; /* T */
-        pair4.local.l4_id = tuple->icmp_id; /* i2 */
-        pair4.remote.address = tuple->src.addr.ipv4; /* Z */
-        pair4.remote.l4_id = tuple->icmp_id; /* i2 */
-        session_entry_p = session_create(&pair4, &pair6, protocol);
+        /* (X', i1) and (T, i2) are the BIB's; (Y'(Z), i1) is derived from them and Z. */
+        remote4.address = tuple->src.addr.ipv4; /* Z */
+        remote4.l4_id = tuple->icmp_id; /* i2 */
+        session_entry_p = session_create(bib_entry_p, &remote4, &source_as_ipv6, protocol);
         if ( session_entry_p == NULL )
         {
         	log_err(ERR_ALLOC_FAILED, "Failed to allocate a session entry.");
@@ -914,25 +1233,24 @@ static int ipv4_icmp4(struct sk_buff* skb, struct tuple *tuple)
         /* Add the session entry */
         if ( session_add(session_entry_p) != 0 )
         {
-        	kfree(session_entry_p);
+        	session_kfree_rcu(session_entry_p);
         	log_err(ERR_ADD_SESSION_FAILED, "Could not add the session entry to the table.");
         	icmp_error = ICMP_HOST_UNREACH;
         	goto failure;
         }
 
         /* Cross-reference them. */
-		session_entry_p->bib = bib_entry_p;
-		list_add(&session_entry_p->entries_from_bib, &bib_entry_p->sessions);
+		session_link_to_bib(session_entry_p);
     }
 
     /* Reset session entry's lifetime. */
-    update_session_lifetime(session_entry_p, &config.to.icmp);
-    spin_unlock_bh(&bib_session_lock);
+    update_session_lifetime(session_entry_p, SESSION_TIMER_ICMP);
+    spin_unlock_bh(lock);
 
     return NF_ACCEPT;
 
 failure:
-    spin_unlock_bh(&bib_session_lock);
+    spin_unlock_bh(lock);
 
 	/*
 	 * Sending an ICMP error is not specified, but I assume we're supposed to do it, since
@@ -969,10 +1287,11 @@ static bool tcp_closed_v6_syn(struct sk_buff* skb, struct tuple *tuple)
 	struct ipv6_tuple_address source;
 	struct ipv4_tuple_address bib_ipv4_addr;
 	struct in_addr destination_as_ipv4;
-	struct ipv6_pair pair6;
-	struct ipv4_pair pair4;
+	struct ipv4_tuple_address remote4;
 	u_int8_t protocol = IPPROTO_TCP;
 	bool bib_is_local = false;
+	bool shared;
+	spinlock_t *host_lock;
 
 	/* Pack source address into transport address */
 	transport_address_ipv6(tuple->src.addr.ipv6, tuple->src.l4_id, &source);
@@ -983,7 +1302,8 @@ static bool tcp_closed_v6_syn(struct sk_buff* skb, struct tuple *tuple)
 	/* If bib does not exist, try to create a new one, */
 	if (bib_entry_p == NULL) {
 		/* Obtain a new BIB IPv4 transport address (T,t), put it in new_ipv4_transport_address. */
-		if (!allocate_ipv4_transport_address_digger(tuple, protocol, &bib_ipv4_addr)) {
+		if (!allocate_ipv4_transport_address(tuple, protocol, &bib_ipv4_addr, &shared,
+				&host_lock)) {
 			log_warning("Could not 'allocate' a compatible transport address for the packet.");
 			goto bib_failure;
 		}
@@ -992,16 +1312,24 @@ static bool tcp_closed_v6_syn(struct sk_buff* skb, struct tuple *tuple)
 		bib_entry_p = bib_create(&bib_ipv4_addr, &source, false);
 		if (bib_entry_p == NULL) {
 			log_err(ERR_ALLOC_FAILED, "Failed to allocate a BIB entry.");
+			if (host_lock)
+				spin_unlock_bh(host_lock);
+			if (!shared || bib_put_shared_port(protocol, &bib_ipv4_addr))
+				pool4_return(protocol, &bib_ipv4_addr);
 			goto bib_failure;
 		}
+		bib_entry_p->is_shared = shared;
 
 		bib_is_local = true;
 
 		apply_policies();
 
 		/* Add the new BIB entry */
-		if (bib_add(bib_entry_p, protocol) != 0) {
+		if (add_bib(bib_entry_p, protocol, host_lock) != 0) {
 			log_err(ERR_ADD_BIB_FAILED, "Could not add the BIB entry to the table.");
+			if (bib_release_port(bib_entry_p, protocol))
+				pool4_return(protocol, &bib_entry_p->ipv4);
+			bib_kfree_rcu(bib_entry_p);
 			goto bib_failure;
 		}
 	}
@@ -1015,42 +1343,38 @@ static bool tcp_closed_v6_syn(struct sk_buff* skb, struct tuple *tuple)
 	}
 
 	/* Create the session entry. */
-	pair6.remote.address = tuple->src.addr.ipv6; /* X' */
-	pair6.remote.l4_id = tuple->src.l4_id; /* x */
-	pair6.local.address = tuple->dst.addr.ipv6; /* Y' */
-	pair6.local.l4_id = tuple->dst.l4_id; /* y */
-	pair4.local = bib_entry_p->ipv4; /* (T, t) */
-	pair4.remote.address = destination_as_ipv4; /* Z or Z(Y’) */
-	pair4.remote.l4_id = tuple->dst.l4_id; /* z or y */
-
-	session_entry_p = session_create(&pair4, &pair6, protocol);
+	/* (X', x) and (T, t) are the BIB's; (Y', y) is derived from (Z, z). */
+	remote4.address = destination_as_ipv4; /* Z or Z(Y’) */
+	remote4.l4_id = tuple->dst.l4_id; /* z or y */
+
+	session_entry_p = session_create(bib_entry_p, &remote4, &tuple->dst.addr.ipv6, protocol);
 	if (session_entry_p == NULL) {
 		log_err(ERR_ALLOC_FAILED, "Failed to allocate a session entry.");
 		goto session_failure;
 	}
 
-	update_session_lifetime(session_entry_p, &config.to.tcp_trans);
+	update_session_lifetime(session_entry_p, SESSION_TIMER_TCP_TRANS);
 	session_entry_p->state = V6_INIT;
 
 	apply_policies();
 
 	if (session_add(session_entry_p) != 0) {
-		kfree(session_entry_p);
+		session_kfree_rcu(session_entry_p);
 		log_err(ERR_ADD_SESSION_FAILED, "Could not add the session entry to the table.");
 		goto session_failure;
 	}
 
 	/* Cross-reference them. */
-	session_entry_p->bib = bib_entry_p;
-	list_add(&session_entry_p->entries_from_bib, &bib_entry_p->sessions);
+	session_link_to_bib(session_entry_p);
 
 	return true;
 
 session_failure:
 	if (bib_is_local) {
 		bib_remove(bib_entry_p, protocol);
-		pool4_return(protocol, &bib_entry_p->ipv4);
-		kfree(bib_entry_p);
+		if (bib_release_port(bib_entry_p, protocol))
+			pool4_return(protocol, &bib_entry_p->ipv4);
+		bib_kfree_rcu(bib_entry_p);
 	}
 	/* Fall through. */
 
@@ -1066,8 +1390,7 @@ static bool tcp_closed_v4_syn(struct sk_buff* skb, struct tuple *tuple)
 	struct session_entry *session_entry_p = NULL;
 	struct ipv4_tuple_address destination;
 	struct in6_addr ipv6_local;
-	struct ipv6_pair pair6;
-	struct ipv4_pair pair4;
+	struct ipv4_tuple_address remote4;
 	u_int8_t protocol = IPPROTO_TCP;
 
 	if (drop_external_connections()) {
@@ -1079,7 +1402,7 @@ static bool tcp_closed_v4_syn(struct sk_buff* skb, struct tuple *tuple)
 	transport_address_ipv4(tuple->dst.addr.ipv4, tuple->dst.l4_id, &destination);
 
 	/* Translate address */
-	if (!append_ipv4(&tuple->src.addr.ipv4, &ipv6_local)) { /* Y'(Y) */
+	if (!append_ipv4(&tuple->src.addr.ipv4, &tuple->dst.addr.ipv4, &ipv6_local)) { /* Y'(Y) */
 		log_err(ERR_APPEND_FAILED, "Could not translate the packet's address.");
 		goto failure;
 	}
@@ -1088,80 +1411,47 @@ static bool tcp_closed_v4_syn(struct sk_buff* skb, struct tuple *tuple)
 	bib_entry_p = bib_get_by_ipv4(&destination, protocol);
 
 	if (bib_entry_p == NULL) {
-		/* Try to create a new session entry anyway! */
-		unsigned int temp = TCP_INCOMING_SYN;
-
 		log_warning("Unknown TCP connections started from the IPv4 side is still unsupported. "
 				"Dropping packet...");
-		goto failure;
-
-		/*
-		 * Side:   <-------- IPv6 -------->  N  <------- IPv4 ------->
-		 * Packet: dest(X',x) <--- src(Y',y) A  dest(X,x) <-- src(Y,y)
-		 * NAT64:  remote              local T  local           remote
-		 */
-
-		/* Create the session entry */
-		/* pair6.remote = Not_Available; (X', x) INTENTIONALLY LEFT UNSPECIFIED! */
-		pair6.local.address = ipv6_local; /* (Y', y) */
-		pair6.local.l4_id = tuple->src.l4_id;
-		pair4.local.address = tuple->dst.addr.ipv4; /* (X, x)  (T, t) */
-		pair4.local.l4_id = tuple->dst.l4_id;
-		pair4.remote.address = tuple->src.addr.ipv4; /* (Z(Y’),y) or (Z, z) */
-		pair4.remote.l4_id = tuple->src.l4_id;
-
-		session_entry_p = session_create(&pair4, &pair6, protocol);
-		if (session_entry_p == NULL) {
-			log_err(ERR_ALLOC_FAILED, "Failed to allocate a session entry.");
-			goto failure;
-		}
-
-		session_entry_p->state = V4_INIT;
-		update_session_lifetime(session_entry_p, &temp);
-
 		/* TODO (later) store the packet.
 		 *          The result is that the NAT64 will not drop the packet based on the filtering,
 		 *          nor create a BIB entry.  Instead, the NAT64 will only create the Session
 		 *          Table Entry and store the packet. The motivation for this is to support
-		 *          simultaneous open of TCP connections. */
+		 *          simultaneous open of TCP connections. Sessions cannot exist without a BIB
+		 *          entry, so this will need one as well. */
+		goto failure;
+	}
 
-	} else {
+	/*
+	 * BIB entry exists; create the session entry.
+	 * (X', x) and (T, t) are the BIB's; (Y', y) is derived from (Z, z).
+	 */
+	remote4.address = tuple->src.addr.ipv4; /* (Z(Y’),y) or (Z, z) */
+	remote4.l4_id = tuple->src.l4_id;
 
-		/* BIB entry exists; create the session entry. */
-		pair6.remote = bib_entry_p->ipv6; /* (X', x) */
-		pair6.local.address = ipv6_local; /* (Y', y) */
-		pair6.local.l4_id = tuple->src.l4_id;
-		pair4.local.address = tuple->dst.addr.ipv4; /* (X, x)  (T, t) */
-		pair4.local.l4_id = tuple->dst.l4_id;
-		pair4.remote.address = tuple->src.addr.ipv4; /* (Z(Y’),y) or (Z, z) */
-		pair4.remote.l4_id = tuple->src.l4_id;
-
-		session_entry_p = session_create(&pair4, &pair6, protocol);
-		if (session_entry_p == NULL) {
-			log_err(ERR_ALLOC_FAILED, "Failed to allocate a session entry.");
-			goto failure;
-		}
+	session_entry_p = session_create(bib_entry_p, &remote4, &ipv6_local, protocol);
+	if (session_entry_p == NULL) {
+		log_err(ERR_ALLOC_FAILED, "Failed to allocate a session entry.");
+		goto failure;
+	}
 
-		session_entry_p->state = V4_INIT;
-		if (address_dependent_filtering()) {
-			unsigned int temp = TCP_INCOMING_SYN;
-			update_session_lifetime(session_entry_p, &temp);
-		} else {
-			update_session_lifetime(session_entry_p, &config.to.tcp_trans);
-		}
+	session_entry_p->state = V4_INIT;
+	if (address_dependent_filtering()) {
+		update_session_lifetime(session_entry_p, SESSION_TIMER_TCP_SYN);
+	} else {
+		update_session_lifetime(session_entry_p, SESSION_TIMER_TCP_TRANS);
 	}
 
 	apply_policies();
 
 	if (session_add(session_entry_p) != 0) {
-		kfree(session_entry_p);
+		session_kfree_rcu(session_entry_p);
 		log_err(ERR_ADD_SESSION_FAILED, "Could not add the session entry to the table.");
 		goto failure;
 	}
 
 	/* Cross-reference them. */
-	session_entry_p->bib = bib_entry_p;
-	list_add(&session_entry_p->entries_from_bib, &bib_entry_p->sessions);
+	session_link_to_bib(session_entry_p);
 
 	return true;
 
@@ -1226,7 +1516,7 @@ static bool tcp_v4_init_state_handle(struct sk_buff* skb, struct session_entry *
 {
     if ( packet_is_v6_syn(skb) )
     {
-        update_session_lifetime(session_entry_p, &config.to.tcp_est);
+        update_session_lifetime(session_entry_p, SESSION_TIMER_TCP_EST);
         session_entry_p->state = ESTABLISHED;
     } /* else, the state remains unchanged. */
 
@@ -1244,12 +1534,12 @@ static bool tcp_v6_init_state_handle(struct sk_buff* skb, struct session_entry *
 {
     if (packet_is_v4_syn(skb))
     {
-        update_session_lifetime(session_entry_p, &config.to.tcp_est);
+        update_session_lifetime(session_entry_p, SESSION_TIMER_TCP_EST);
         session_entry_p->state = ESTABLISHED;
     }
     else if (packet_is_v6_syn(skb))
     {
-        update_session_lifetime(session_entry_p, &config.to.tcp_trans);
+        update_session_lifetime(session_entry_p, SESSION_TIMER_TCP_TRANS);
     } /* else, the state remains unchanged */
     
     return true;
@@ -1274,12 +1564,12 @@ static bool tcp_established_state_handle(struct sk_buff* skb, struct session_ent
     }
     else if ( packet_is_v4_rst(skb) ||  packet_is_v6_rst(skb) )
     {
-        update_session_lifetime(session_entry_p, &config.to.tcp_trans);
+        update_session_lifetime(session_entry_p, SESSION_TIMER_TCP_TRANS);
         session_entry_p->state = TRANS;
     }
     else
     {
-        update_session_lifetime(session_entry_p, &config.to.tcp_est);
+        update_session_lifetime(session_entry_p, SESSION_TIMER_TCP_EST);
     }
 
     return true;
@@ -1296,12 +1586,12 @@ static bool tcp_v4_fin_rcv_state_handle(struct sk_buff* skb, struct session_entr
 {
     if ( packet_is_v6_fin(skb) )
     {
-        update_session_lifetime(session_entry_p, &config.to.tcp_trans);
+        update_session_lifetime(session_entry_p, SESSION_TIMER_TCP_TRANS);
         session_entry_p->state = V4_FIN_V6_FIN_RCV;
     }
     else
     {
-        update_session_lifetime(session_entry_p, &config.to.tcp_est);
+        update_session_lifetime(session_entry_p, SESSION_TIMER_TCP_EST);
     }
     return true;
 }
@@ -1317,12 +1607,12 @@ static bool tcp_v6_fin_rcv_state_handle(struct sk_buff* skb, struct session_entr
 {
     if ( packet_is_v4_fin(skb) )
     {        
-        update_session_lifetime(session_entry_p, &config.to.tcp_trans);
+        update_session_lifetime(session_entry_p, SESSION_TIMER_TCP_TRANS);
         session_entry_p->state = V4_FIN_V6_FIN_RCV;
     }
     else
     {
-        update_session_lifetime(session_entry_p, &config.to.tcp_est);
+        update_session_lifetime(session_entry_p, SESSION_TIMER_TCP_EST);
     }
     return true;
 }
@@ -1351,7 +1641,7 @@ static bool tcp_trans_state_handle(struct sk_buff *skb, struct session_entry *se
 {
     if ( !packet_is_v4_rst(skb) && !packet_is_v6_rst(skb) )
     {
-        update_session_lifetime(session_entry_p, &config.to.tcp_est);
+        update_session_lifetime(session_entry_p, SESSION_TIMER_TCP_EST);
         session_entry_p->state = ESTABLISHED;
     }
 
@@ -1408,6 +1698,34 @@ bool session_expired(struct session_entry *session_entry_p)
 	}
 }
 
+/**
+ * Handles the TCP packets from IPv4 whose destination is not mapped by any BIB entry.
+ * Does what tcp_closed_state_handle() would, except it doesn't need a lock, since there is no BIB
+ * entry to protect.
+ *
+ * @param[in]   tuple   Tuple of the incoming packet.
+ * @return  NF_DROP, always.
+ */
+static int tcp_ipv4_no_bib(struct sk_buff* skb, struct tuple *tuple)
+{
+    if ( !packet_is_v4_syn(skb) )
+    {
+        log_warning("BIB entry not found for %pI4#%u.", &tuple->dst.addr.ipv4, tuple->dst.l4_id);
+        return NF_DROP;
+    }
+
+    if ( drop_external_connections() )
+    {
+        log_info("Applying policy: Dropping externally initiated TCP connections.");
+        return NF_DROP;
+    }
+
+    log_warning("Unknown TCP connections started from the IPv4 side is still unsupported. "
+            "Dropping packet...");
+    icmp_send(skb, ICMP_DEST_UNREACH, ICMP_HOST_UNREACH, 0);
+    return NF_DROP;
+}
+
 /** Filtering of incoming TCP packets.
  * 
  *  Each Session Table Entry (STE) has two purposes: 
@@ -1420,9 +1738,46 @@ bool session_expired(struct session_entry *session_entry_p)
 static int tcp(struct sk_buff* skb, struct tuple *tuple)
 {
     struct session_entry *session_entry_p;
+    struct bib_entry *bib_entry_p;
+    struct ipv6_tuple_address ipv6_ta;
+    spinlock_t *lock;
     bool result;
     
-    spin_lock_bh(&bib_session_lock);
+    /*
+     * Most packets belong to established connections and don't change the state; those only need
+     * to refresh the lifetime, which doesn't require the lock.
+     */
+    if ( !packet_is_v4_fin(skb) && !packet_is_v6_fin(skb)
+            && !packet_is_v4_rst(skb) && !packet_is_v6_rst(skb) )
+    {
+        rcu_read_lock();
+        session_entry_p = session_get( tuple );
+        if ( session_entry_p != NULL && session_entry_p->state == ESTABLISHED )
+        {
+            update_session_lifetime(session_entry_p, SESSION_TIMER_TCP_EST);
+            rcu_read_unlock();
+            return NF_ACCEPT;
+        }
+        rcu_read_unlock();
+    }
+
+    switch ( tuple->l3_proto )
+    {
+        case PF_INET6:
+            transport_address_ipv6(tuple->src.addr.ipv6, tuple->src.l4_id, &ipv6_ta);
+            lock = bib_get_lock(&ipv6_ta);
+            spin_lock_bh(lock);
+            break;
+        case PF_INET:
+            lock = lock_bib_by_ipv4(tuple, &bib_entry_p);
+            if ( lock == NULL )
+                return tcp_ipv4_no_bib(skb, tuple);
+            break;
+        default:
+            log_crit(ERR_L3PROTO, "Unsupported network protocol: %u.", tuple->l3_proto);
+            return NF_DROP;
+    }
+
     session_entry_p = session_get( tuple );
 
     /* If NO session was found: */
@@ -1466,7 +1821,7 @@ static int tcp(struct sk_buff* skb, struct tuple *tuple)
     /* Fall through. */
 
 end:
-    spin_unlock_bh(&bib_session_lock);
+    spin_unlock_bh(lock);
     return result ? NF_ACCEPT : NF_DROP;
 }
 
@@ -1521,6 +1876,12 @@ int filtering_and_updating(struct sk_buff* skb, struct tuple *tuple)
 			log_info("Packet was rejected by pool4, dropping...");
 			return NF_DROP;
 		}
+        /* Deterministic ports outside of every subscriber's range cannot have a BIB entry. */
+        if ( determ_contains4(&tuple->dst.addr.ipv4) && !determ_accepts(tuple) )
+        {
+			log_info("Packet is not headed to any deterministic subscriber, dropping...");
+			return NF_DROP;
+		}
     }
 
     /* Process packet, according to its protocol. */
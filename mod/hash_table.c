@@ -1,30 +1,90 @@
 /**
  * @file
  * A generic hash table implementation. Its design is largely based off Java's java.util.HashMap.
- * One difference is that the internal array does not resize. One important similarity is that it
- * is not synchronized.
+ *
+ * Unlike HashMap, writers synchronize themselves. The slots are split into HASH_TABLE_LOCKS
+ * stripes (slot i belongs to stripe i % HASH_TABLE_LOCKS), each with its own spinlock, so puts and
+ * removes which land in different stripes run in parallel. Each put or remove is atomic, but
+ * anything bigger (eg. "insert unless it's already there") still has to be serialized by the
+ * caller.
+ *
+ * Readers need not take any lock. The lists are RCU-protected, so GET and FIND can run within a
+ * RCU read-side critical section, concurrently with writers. If they do, they have to be done with
+ * the value before they leave the critical section, and whoever removes a value has to wait for a
+ * grace period before freeing it (eg. kfree_rcu()).
  *
  * Uses the kernel's hlist internally.
  * We're not using hlist directly because it implies a lot of code rewriting (eg. the entry
  * retrieval function; "get") and we need at least four different hash tables.
  *
+ * The internal array is not allocated until the first put, so tables which are never used cost
+ * nothing but the structure itself. From then on, it grows and shrinks with the number of stored
+ * entries, within limits which can be changed at runtime (see SET_SIZE_LIMITS). Unlike HashMap,
+ * the rehash is incremental: when the table decides to resize, a work item allocates the new array
+ * (in process context, so big arrays can be vmalloc'd) and then every subsequent put or remove
+ * moves a few slots of its stripe from the old one. Meanwhile, the work item moves the rest of them
+ * itself (see REHASH), so stripes nobody writes to do not keep the move going forever. Lookups
+ * search both arrays while the move is in progress. This way, the packet path never pays for the
+ * whole rehash, and never has to find more than HASH_TABLE_SIZE slots' worth of contiguous memory.
+ * Because array lengths are never smaller than the number of stripes, a value never changes stripe
+ * when it's moved.
+ * A lockless reader which happens to be walking a list while its nodes are being moved might miss
+ * a value, so the writer bumps its stripe's sequence counter while moving, and readers which didn't
+ * find their key retry if they notice it changed.
+ *
+ * Every table picks a random seed during init and hands it to its hash function, so hash functions
+ * are expected to be keyed (eg. jhash). Otherwise, anyone who can choose the keys (eg. by choosing
+ * ports) can make them all land in the same slot.
+ *
  * Because C does not support templates or generics, you have to set a number of macros and then
  * include this file. These are the macros:
  * @macro HTABLE_NAME name of the hash table structure to generate. Optional; Default: hash_table.
  * @macro KEY_TYPE data type of the table's keys.
  * @macro VALUE_TYPE data type of the table's values.
- * @macro HASH_TABLE_SIZE The size of the internal array, in slots. Optional;
- *		Default = Max = 64k - 1.
+ * @macro HASH_TABLE_SIZE The default minimum size of the internal array, in slots, and the largest
+ *		first array (the one allocated by the first put, in atomic context). Has to be a power of
+ *		two. Optional; Default = 1024.
+ * @macro HASH_TABLE_MAX_SIZE The default maximum size of the internal array, in slots. Has to be
+ *		a power of two. Optional; Default = 256k.
+ * @macro HASH_TABLE_LOCKS Number of stripes (and therefore locks) the slots are split into. Has to
+ *		be a power of two no bigger than HASH_TABLE_SIZE. Optional; Default = 64 (or
+ *		HASH_TABLE_SIZE, if smaller).
  * @macro GENERATE_PRINT just define it if you want the print function; otherwise it will not be
  *		generated.
  * @macro GENERATE_FOR_EACH just define it if you want the for_each function; otherwise it will not
  *		be generated.
+ * @macro GENERATE_FIND just define it if you want the find function; otherwise it will not be
+ *		generated.
+ * @macro NODE_MEMBER name of a "struct hlist_node" field from VALUE_TYPE the table can use to chain
+ *		the value. Optional; if defined, the table links the values directly instead of wrapping
+ *		them in dynamically allocated key-value structures, so put never allocates. Either KEY_MEMBER
+ *		or KEY_FUNCTION is required as well in this case.
+ * @macro KEY_MEMBER name of the KEY_TYPE field from VALUE_TYPE which is the value's key. Only used
+ *		if NODE_MEMBER is defined.
+ * @macro KEY_FUNCTION name of a "void (VALUE_TYPE *, KEY_TYPE *)" function which computes a value's
+ *		key, for values which do not store it. Only used if NODE_MEMBER is defined, and KEY_MEMBER
+ *		isn't. It can be called by lockless readers, so it has to be RCU-safe.
+ * @macro FREE_VALUE function the table uses to release values (when asked to). Optional; Default:
+ *		kfree.
  *
  * This module contains no header file; it needs to be #included directly.
  */
 
 #include "nat64/comm/types.h"
+#include "nat64/comm/constants.h"
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/workqueue.h>
+#include <linux/log2.h>
+#include <linux/numa.h>
+#include <linux/random.h>
+#include <linux/rculist.h>
+#include <linux/sched.h>
+#include <linux/seqlock.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/cache.h>
 
 /********************************************
  * Macros.
@@ -35,7 +95,37 @@
 #endif
 
 #ifndef HASH_TABLE_SIZE
-#define HASH_TABLE_SIZE (64 * 1024 - 1)
+#define HASH_TABLE_SIZE 1024
+#endif
+
+#ifndef HASH_TABLE_MAX_SIZE
+#define HASH_TABLE_MAX_SIZE (256 * 1024)
+#endif
+
+#ifndef HASH_TABLE_LOCKS
+#define HASH_TABLE_LOCKS ((HASH_TABLE_SIZE < 64) ? HASH_TABLE_SIZE : 64)
+#endif
+
+#ifndef FREE_VALUE
+#define FREE_VALUE kfree
+#endif
+
+/**
+ * Number of slots from the old array that are moved to the new one on every put or remove, while a
+ * resize is in progress. Only slots from the writer's stripe are moved.
+ */
+#define HASH_TABLE_REHASH_STEP 8
+
+#ifndef HLIST_FOR_EACH_RCU
+/**
+ * Iterates over the "head" list, tolerating concurrent RCU list mutations.
+ * Dereferences raw because both lockless readers and writers (who hold the table's lock instead of
+ * rcu_read_lock()) use it.
+ */
+#define HLIST_FOR_EACH_RCU(pos, head) \
+	for (pos = rcu_dereference_raw(hlist_first_rcu(head)); \
+			pos; \
+			pos = rcu_dereference_raw(hlist_next_rcu(pos)))
 #endif
 
 /** Creates a token name by concatenating prefix and suffix. */
@@ -43,8 +133,18 @@
 /** Seems useless, but if not present, the compiler won't expand the HTABLE_NAME macro... */
 #define CONCAT(prefix, suffix) CONCAT_AUX(prefix, suffix)
 
+/** The name of the slot array structure. */
+#define SLOT_ARRAY		CONCAT(HTABLE_NAME, _slots)
+/** The name of the stripe structure. */
+#define STRIPE			CONCAT(HTABLE_NAME, _stripe)
 /** The name of the key-value structure. */
 #define KEY_VALUE_PAIR	CONCAT(HTABLE_NAME, _key_value)
+/** The name of the function that returns the key a node belongs to. */
+#define NODE_KEY		CONCAT(HTABLE_NAME, _node_key)
+/** The name of the function that returns the value a node belongs to. */
+#define NODE_VALUE		CONCAT(HTABLE_NAME, _node_value)
+/** The name of the function that releases whatever a removed node belongs to. */
+#define RELEASE_NODE	CONCAT(HTABLE_NAME, _release_node)
 /** The name of the init function. */
 #define INIT			CONCAT(HTABLE_NAME, _init)
 /** The name of the put function. */
@@ -55,31 +155,152 @@
 #define REMOVE			CONCAT(HTABLE_NAME, _remove)
 /** The name of the empty function. */
 #define EMPTY			CONCAT(HTABLE_NAME, _empty)
+/** The name of the destroy function. */
+#define DESTROY			CONCAT(HTABLE_NAME, _destroy)
+/** The name of the function that changes the load factor thresholds. */
+#define SET_LOAD_LIMITS	CONCAT(HTABLE_NAME, _set_load_limits)
 /** The name of the auxiliary get function. */
 #define GET_AUX			CONCAT(HTABLE_NAME, _get_aux)
+/** The name of the auxiliary get function which already knows the key's hash code. */
+#define GET_BY_HASH		CONCAT(HTABLE_NAME, _get_by_hash)
+/** The name of the function that returns the stripe a hash code belongs to. */
+#define GET_STRIPE		CONCAT(HTABLE_NAME, _get_stripe)
+/** The name of the auxiliary function that searches a single slot. */
+#define GET_FROM_SLOT	CONCAT(HTABLE_NAME, _get_from_slot)
+/** The name of the function that allocates a slot array. */
+#define ALLOC_SLOTS		CONCAT(HTABLE_NAME, _alloc_slots)
+/** The name of the function that releases a slot array. */
+#define FREE_SLOTS		CONCAT(HTABLE_NAME, _free_slots)
+/** The name of the function that allocates the first slot array. */
+#define CREATE_ARRAY	CONCAT(HTABLE_NAME, _create_array)
+/** The name of the function that moves slots from the old array to the new one. */
+#define MIGRATE			CONCAT(HTABLE_NAME, _migrate)
+/** The name of the function that finishes moving the slots from the old array to the new one. */
+#define REHASH			CONCAT(HTABLE_NAME, _rehash)
+/** The name of the function that starts a resize. */
+#define RESIZE			CONCAT(HTABLE_NAME, _resize)
+/** The name of the function that returns the number of values in the table. */
+#define COUNT			CONCAT(HTABLE_NAME, _count)
+/** The name of the function that computes the size the table should have. */
+#define TARGET_SLOTS	CONCAT(HTABLE_NAME, _target_slots)
+/** The name of the function that decides whether the table should resize. */
+#define ADJUST_SIZE		CONCAT(HTABLE_NAME, _adjust_size)
+/** The name of the work function that resizes the table and releases its old arrays. */
+#define RESIZE_WORK		CONCAT(HTABLE_NAME, _resize_work)
+/** The name of the function that changes the size limits. */
+#define SET_SIZE_LIMITS	CONCAT(HTABLE_NAME, _set_size_limits)
+/** The name of the function that changes the NUMA node the arrays are allocated from. */
+#define SET_NODE		CONCAT(HTABLE_NAME, _set_node)
 /** The name of the print function. */
 #define PRINT			CONCAT(HTABLE_NAME, _print)
 /** The name of the for_each function. */
 #define FOR_EACH		CONCAT(HTABLE_NAME, _for_each)
+/** The name of the find function. */
+#define FIND			CONCAT(HTABLE_NAME, _find)
 
 /********************************************
  * Structures.
  ********************************************/
 
+/**
+ * An array of linked lists, along with its length.
+ * They are allocated together so lockless readers can never see one without the other.
+ */
+struct SLOT_ARRAY {
+	/** Number of elements in "heads". Always a power of two. */
+	__u32 length;
+	/** Each of these contains the values mapped to its index's hash code. */
+	struct hlist_head heads[0];
+};
+
+/**
+ * A group of slots which share a lock.
+ * Each stripe gets its own cache line, so writers from different CPUs do not fight over them.
+ */
+struct STRIPE {
+	/** Serializes the writers of the stripe's slots. */
+	spinlock_t lock;
+	/** Changes whenever values from the stripe are moved from one list to another (see GET_AUX). */
+	seqcount_t rehash_seq;
+	/**
+	 * The next slot from the old array this stripe has to move (see MIGRATE). Slots from the stripe
+	 * whose index is lower than this have already been moved.
+	 */
+	__u32 rehash_index;
+	/** Number of values stored in the stripe's slots. */
+	unsigned int count;
+} ____cacheline_aligned_in_smp;
+
 /** The hash table. */
 struct HTABLE_NAME {
+	/** The array values are inserted to. NULL until the first put. */
+	struct SLOT_ARRAY __rcu *table;
+
+	/**
+	 * If a resize is in progress, this is the array "table" is replacing. NULL otherwise.
+	 * Its slots are moved to "table" a few at a time (see MIGRATE).
+	 */
+	struct SLOT_ARRAY __rcu *old_table;
+	/** Number of stripes which still have slots in "old_table". */
+	atomic_t rehash_pending;
+	/**
+	 * A former "old_table" which might still be seen by lockless readers. RESIZE_WORK releases it
+	 * after a grace period.
+	 */
+	struct SLOT_ARRAY *retired_table;
+	/** Serializes the replacement of the arrays (see RESIZE and FOR_EACH). */
+	spinlock_t resize_lock;
+	/** Allocates the arrays the table grows or shrinks to, and releases the old ones. */
+	struct work_struct resize_work;
 	/**
-	 * The array of linked lists.
-	 * Each of these contains the values mapped to its index's hash code.
+	 * The slots' locks. Each one also counts its own values, so writers from different stripes
+	 * don't fight over a shared counter either (see COUNT).
 	 */
-	struct hlist_head table[HASH_TABLE_SIZE];
+	struct STRIPE stripes[HASH_TABLE_LOCKS];
+
+	/** The table grows when it holds more values than this percentage of its slots. */
+	__u16 max_load;
+	/** The table shrinks when it holds less values than this percentage of its slots. Zero = never. */
+	__u16 min_load;
+	/** The table never shrinks below this many slots (and grows to it as soon as it's used). */
+	__u32 min_slots;
+	/** The table never grows beyond this many slots. */
+	__u32 max_slots;
+	/** NUMA node the arrays are allocated from. NUMA_NO_NODE = wherever the allocation runs. */
+	int node;
 
 	/** Used to locate the slot (within the linked list) of a value. */
 	bool (*equals_function)(KEY_TYPE *, KEY_TYPE *);
 	/** Used locate the linked list (within the array) of a value. */
-	__u16 (*hash_function)(KEY_TYPE *);
+	__u32 (*hash_function)(KEY_TYPE *, __u32);
+	/** Random value "hash_function" is keyed with. Does not change while the table is alive. */
+	__u32 seed;
 };
 
+#ifdef NODE_MEMBER
+
+/** Returns the value "node" is embedded in. */
+static VALUE_TYPE *NODE_VALUE(struct hlist_node *node)
+{
+	return hlist_entry(node, VALUE_TYPE, NODE_MEMBER);
+}
+
+/**
+ * Returns the key of the value "node" is embedded in. "buffer" is where the key is computed, if the
+ * value does not store it.
+ */
+static KEY_TYPE *NODE_KEY(struct hlist_node *node, KEY_TYPE *buffer)
+{
+#ifdef KEY_MEMBER
+	return &NODE_VALUE(node)->KEY_MEMBER;
+#else
+	KEY_FUNCTION(NODE_VALUE(node), buffer);
+	return buffer;
+#endif
+}
+
+#else
+
 /** Every entry in the table; the key used to access the value and the value. */
 struct KEY_VALUE_PAIR {
 	/** Dictates where in the table the value is. */
@@ -88,40 +309,437 @@ struct KEY_VALUE_PAIR {
 	VALUE_TYPE *value;
 	/** Other key-values chained with this one (see: HTABLE_NAME.table). */
 	struct hlist_node nodes;
+	/** Used to release the key-value once no readers can be looking at it. */
+	struct rcu_head rcu;
 };
 
+/** Returns the value of the key-value "node" belongs to. */
+static VALUE_TYPE *NODE_VALUE(struct hlist_node *node)
+{
+	return hlist_entry(node, struct KEY_VALUE_PAIR, nodes)->value;
+}
+
+/** Returns the key of the key-value "node" belongs to. "buffer" is not used. */
+static KEY_TYPE *NODE_KEY(struct hlist_node *node, KEY_TYPE *buffer)
+{
+	return hlist_entry(node, struct KEY_VALUE_PAIR, nodes)->key;
+}
+
+#endif
+
 /********************************************
  * Private "methods".
  ********************************************/
 
 /**
- * Returns the key-value mapped to the "key" key within the table.
+ * Returns the first node from the "head" list whose key "matches" "key".
+ */
+static struct hlist_node *GET_FROM_SLOT(struct hlist_head *head, KEY_TYPE *key,
+		bool (*matches)(KEY_TYPE *, KEY_TYPE *))
+{
+	struct hlist_node *current_node;
+	KEY_TYPE buffer;
+
+	HLIST_FOR_EACH_RCU(current_node, head) {
+		if (matches(key, NODE_KEY(current_node, &buffer)))
+			return current_node;
+	}
+
+	return NULL;
+}
+
+/**
+ * Releases from memory whatever "node" belongs to, depending on the release_* arguments.
+ * Assumes "node" has already been unlinked from the table.
+ *
+ * The key and value are released right away, so only request that if nobody else can be looking at
+ * them.
+ */
+static void RELEASE_NODE(struct hlist_node *node, bool release_key, bool release_value)
+{
+#ifdef NODE_MEMBER
+	/* The key is part of the value, and the node is part of the value too. */
+	if (release_value)
+		FREE_VALUE(NODE_VALUE(node));
+#else
+	struct KEY_VALUE_PAIR *pair = hlist_entry(node, struct KEY_VALUE_PAIR, nodes);
+
+	if (release_key)
+		kfree(pair->key);
+	if (release_value)
+		FREE_VALUE(pair->value);
+	kfree_rcu(pair, rcu);
+#endif
+}
+
+/** Returns the stripe the slots "hash_code" can be in belong to. */
+static struct STRIPE *GET_STRIPE(struct HTABLE_NAME *table, __u32 hash_code)
+{
+	return &table->stripes[hash_code & (HASH_TABLE_LOCKS - 1)];
+}
+
+/**
+ * Returns the node mapped to the "key" key within the table, assuming "hash_code" is the key's
+ * hash code.
  *
  * To be used by hash table functions; outside code should use GET instead.
+ * Can be called either by a writer or within a RCU read-side critical section.
  *
- * @param table hash table instance you want the key-value from.
+ * @param table hash table instance you want the node from.
  * @param key descriptor to which the associated key-value is to be returned.
- * @return the key-value to which "table" maps "key", "null" if there's no mapping for the key.
+ * @param hash_code table->hash_function(key, table->seed).
+ * @param matches function used to compare "key" to the keys from the table. Can be a looser
+ *		comparison than table->equals_function as long as keys which match also share hash codes.
+ * @return the node to which "table" maps "key", "null" if there's no mapping for the key.
  */
-static struct KEY_VALUE_PAIR *GET_AUX(struct HTABLE_NAME *table, KEY_TYPE *key)
+static struct hlist_node *GET_BY_HASH(struct HTABLE_NAME *table, KEY_TYPE *key, __u32 hash_code,
+		bool (*matches)(KEY_TYPE *, KEY_TYPE *))
 {
-	struct hlist_node *current_node;
-	struct KEY_VALUE_PAIR *current_pair;
-	__u16 hash_code;
+	struct STRIPE *stripe = GET_STRIPE(table, hash_code);
+	struct SLOT_ARRAY *array;
+	struct hlist_node *result;
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&stripe->rehash_seq);
+
+		array = rcu_dereference_raw(table->table);
+		if (!array)
+			return NULL;
+		result = GET_FROM_SLOT(&array->heads[hash_code & (array->length - 1)], key, matches);
+		if (result)
+			return result;
+
+		/* The key might not have been moved yet. Moved slots are empty, so no need to check. */
+		array = rcu_dereference_raw(table->old_table);
+		if (array) {
+			result = GET_FROM_SLOT(&array->heads[hash_code & (array->length - 1)], key,
+					matches);
+			if (result)
+				return result;
+		}
+	} while (read_seqcount_retry(&stripe->rehash_seq, seq));
 
+	return NULL;
+}
+
+/**
+ * Returns the node mapped to the "key" key within the table.
+ * Same as GET_BY_HASH, except it computes the hash code itself, and NULL "matches" means
+ * table->equals_function.
+ */
+static struct hlist_node *GET_AUX(struct HTABLE_NAME *table, KEY_TYPE *key,
+		bool (*matches)(KEY_TYPE *, KEY_TYPE *))
+{
 	if (!table) {
 		log_err(ERR_NULL, "The table is NULL.");
-		return false;
+		return NULL;
 	}
 
-	hash_code = table->hash_function(key) % HASH_TABLE_SIZE;
-	hlist_for_each(current_node, &table->table[hash_code]) {
-		current_pair = list_entry(current_node, struct KEY_VALUE_PAIR, nodes);
-		if (table->equals_function(key, current_pair->key))
-			return current_pair;
+	return GET_BY_HASH(table, key, table->hash_function(key, table->seed),
+			matches ? matches : table->equals_function);
+}
+
+/**
+ * Allocates and initializes an array of "slots" empty lists, preferably from the "node" NUMA node.
+ * If "atomic" is false, big arrays which cannot be found contiguous are vmalloc'd instead.
+ */
+static struct SLOT_ARRAY *ALLOC_SLOTS(__u32 slots, bool atomic, int node)
+{
+	struct SLOT_ARRAY *result;
+	size_t size = sizeof(*result) + slots * sizeof(result->heads[0]);
+	__u32 i;
+
+	if (atomic) {
+		result = kmalloc_node(size, GFP_ATOMIC | __GFP_NOWARN, node);
+	} else {
+		/* Don't make the page allocator work hard for what vmalloc() can provide. */
+		result = (size <= (PAGE_SIZE << PAGE_ALLOC_COSTLY_ORDER))
+				? kmalloc_node(size, GFP_KERNEL | __GFP_NOWARN | __GFP_NORETRY, node)
+				: NULL;
+		if (!result)
+			result = vmalloc_node(size, node);
 	}
+	if (!result)
+		return NULL;
 
-	return NULL;
+	result->length = slots;
+	for (i = 0; i < slots; i++)
+		INIT_HLIST_HEAD(&result->heads[i]);
+
+	return result;
+}
+
+static void FREE_SLOTS(struct SLOT_ARRAY *array)
+{
+	if (is_vmalloc_addr(array))
+		vfree(array);
+	else
+		kfree(array);
+}
+
+/**
+ * Allocates the table's first array, unless somebody else already did.
+ * Runs in the context of the first put, so it's atomic, and the array cannot be very big. If the
+ * table wants more slots than HASH_TABLE_SIZE, it will grow later (see TARGET_SLOTS).
+ */
+static int CREATE_ARRAY(struct HTABLE_NAME *table)
+{
+	struct SLOT_ARRAY *array;
+	int error = 0;
+
+	spin_lock_bh(&table->resize_lock);
+	if (rcu_access_pointer(table->table))
+		goto end;
+
+	array = ALLOC_SLOTS(min_t(__u32, table->min_slots, HASH_TABLE_SIZE), true, table->node);
+	if (!array) {
+		log_err(ERR_ALLOC_FAILED, "Could not allocate the table's internal array.");
+		error = -ENOMEM;
+		goto end;
+	}
+	rcu_assign_pointer(table->table, array);
+	/* Fall through. */
+
+end:
+	spin_unlock_bh(&table->resize_lock);
+	return error;
+}
+
+/**
+ * If a resize is in progress, moves up to HASH_TABLE_REHASH_STEP of "stripe"'s slots from the old
+ * array to the new one. Releases the old array once every stripe is done with it.
+ * Assumes "stripe"'s lock is held, and that the caller is within a RCU read-side critical section.
+ */
+static void MIGRATE(struct HTABLE_NAME *table, struct STRIPE *stripe)
+{
+	struct SLOT_ARRAY *new_array, *old_array;
+	struct hlist_node *current_node;
+	struct hlist_head *old_head;
+	KEY_TYPE buffer;
+	__u32 moved, slot;
+
+	old_array = rcu_dereference(table->old_table);
+	if (!old_array || stripe->rehash_index >= old_array->length)
+		return;
+	new_array = rcu_dereference(table->table);
+
+	write_seqcount_begin(&stripe->rehash_seq);
+
+	for (moved = 0; moved < HASH_TABLE_REHASH_STEP; moved++) {
+		if (stripe->rehash_index >= old_array->length)
+			break;
+
+		/*
+		 * The nodes are moved without waiting for a grace period, so a reader walking this list
+		 * might jump to the new one halfway. That's why the sequence counter exists.
+		 */
+		old_head = &old_array->heads[stripe->rehash_index];
+		while (!hlist_empty(old_head)) {
+			current_node = old_head->first;
+			slot = table->hash_function(NODE_KEY(current_node, &buffer), table->seed);
+			slot &= new_array->length - 1;
+			hlist_del_rcu(current_node);
+			hlist_add_head_rcu(current_node, &new_array->heads[slot]);
+		}
+		stripe->rehash_index += HASH_TABLE_LOCKS;
+	}
+
+	write_seqcount_end(&stripe->rehash_seq);
+
+	/*
+	 * The other stripes are done, so nobody else can be touching the old array's slots.
+	 * It might be vmalloc'd, which cannot be released from here, so RESIZE_WORK does it.
+	 */
+	if (stripe->rehash_index >= old_array->length
+			&& atomic_dec_and_test(&table->rehash_pending)) {
+		rcu_assign_pointer(table->old_table, NULL);
+		WARN_ON(xchg(&table->retired_table, old_array) != NULL);
+		schedule_work(&table->resize_work);
+	}
+}
+
+/**
+ * Moves whatever the writers left in the old array to the new one, one stripe at a time, so the old
+ * array is released even if some stripes never see another put or remove.
+ * Can sleep. Assumes no stripe lock is held.
+ */
+static void REHASH(struct HTABLE_NAME *table)
+{
+	struct SLOT_ARRAY *old_array;
+	struct STRIPE *stripe;
+	int i;
+
+	for (i = 0; i < HASH_TABLE_LOCKS; i++) {
+		stripe = &table->stripes[i];
+
+		rcu_read_lock();
+		spin_lock_bh(&stripe->lock);
+		/* Only RESIZE_WORK can start a resize, so the old array cannot be replaced meanwhile. */
+		old_array = rcu_dereference(table->old_table);
+		while (old_array && stripe->rehash_index < old_array->length) {
+			MIGRATE(table, stripe);
+			old_array = rcu_dereference(table->old_table);
+		}
+		spin_unlock_bh(&stripe->lock);
+		rcu_read_unlock();
+
+		cond_resched();
+	}
+}
+
+/**
+ * Replaces the table's internal array with one of "new_slots" slots, unless somebody else
+ * resized the table since "old_slots" was read.
+ * The values are not moved here; MIGRATE takes care of that gradually.
+ *
+ * If the new array cannot be allocated, the table just keeps its current size.
+ * Can sleep. Assumes no stripe lock is held.
+ */
+static void RESIZE(struct HTABLE_NAME *table, __u32 old_slots, __u32 new_slots)
+{
+	struct SLOT_ARRAY *new_array, *old_array;
+	int i;
+
+	new_array = ALLOC_SLOTS(new_slots, false, table->node);
+	if (!new_array) {
+		log_debug("Could not allocate %u slots; the table will keep its %u slots.", new_slots,
+				old_slots);
+		return;
+	}
+
+	/* Nobody can be writing while the arrays are swapped. */
+	spin_lock_bh(&table->resize_lock);
+	for (i = 0; i < HASH_TABLE_LOCKS; i++)
+		spin_lock_nest_lock(&table->stripes[i].lock, &table->resize_lock);
+
+	old_array = rcu_dereference_protected(table->table, true);
+	if (rcu_access_pointer(table->old_table) || old_array->length != old_slots)
+		goto end;
+
+	for (i = 0; i < HASH_TABLE_LOCKS; i++) {
+		write_seqcount_begin(&table->stripes[i].rehash_seq);
+		table->stripes[i].rehash_index = i;
+	}
+	atomic_set(&table->rehash_pending, HASH_TABLE_LOCKS);
+	rcu_assign_pointer(table->old_table, old_array);
+	rcu_assign_pointer(table->table, new_array);
+	for (i = 0; i < HASH_TABLE_LOCKS; i++)
+		write_seqcount_end(&table->stripes[i].rehash_seq);
+	new_array = NULL;
+	/* Fall through. */
+
+end:
+	for (i = HASH_TABLE_LOCKS - 1; i >= 0; i--)
+		spin_unlock(&table->stripes[i].lock);
+	spin_unlock_bh(&table->resize_lock);
+
+	/* It might be vmalloc'd, so it has to be released out of the lock. */
+	if (new_array)
+		FREE_SLOTS(new_array);
+}
+
+/**
+ * Returns the number of values stored in "table". Visits every stripe, so keep it out of the packet
+ * path. The result might be outdated if there are concurrent writers.
+ */
+static unsigned int COUNT(struct HTABLE_NAME *table)
+{
+	unsigned int result = 0;
+	int i;
+
+	for (i = 0; i < HASH_TABLE_LOCKS; i++)
+		result += ACCESS_ONCE(table->stripes[i].count);
+
+	return result;
+}
+
+/**
+ * Returns the number of slots a table which currently has "slots" slots and "values" values should
+ * have, given its load factor and size limits.
+ */
+static __u32 TARGET_SLOTS(struct HTABLE_NAME *table, __u32 slots, __u64 values)
+{
+	__u64 count = values * 100;
+	__u32 min_slots = table->min_slots;
+	__u32 max_slots = table->max_slots;
+
+	if (slots < min_slots)
+		return min_slots;
+	if (slots > max_slots)
+		return max_slots;
+
+	if (count > (__u64) slots * table->max_load && slots < max_slots)
+		return slots << 1;
+	if (count < (__u64) slots * table->min_load && slots > min_slots)
+		return slots >> 1;
+
+	return slots;
+}
+
+/**
+ * Schedules a resize if the load factor of the table went beyond its limits, or its size is out of
+ * bounds.
+ * Only "stripe" (the one the caller just wrote to) is counted; the values are spread evenly over
+ * the stripes, so it stands for the rest. RESIZE_WORK counts all of them before deciding.
+ * Can be called from atomic context.
+ */
+static void ADJUST_SIZE(struct HTABLE_NAME *table, struct STRIPE *stripe)
+{
+	struct SLOT_ARRAY *array;
+	__u32 slots = 0;
+	__u64 estimate;
+
+	/* Wait until the current resize is done; MIGRATE will reschedule us then. */
+	if (rcu_access_pointer(table->old_table))
+		return;
+
+	rcu_read_lock();
+	array = rcu_dereference(table->table);
+	if (array)
+		slots = array->length;
+	rcu_read_unlock();
+
+	if (!slots || work_pending(&table->resize_work))
+		return;
+
+	estimate = (__u64) ACCESS_ONCE(stripe->count) * HASH_TABLE_LOCKS;
+	if (TARGET_SLOTS(table, slots, estimate) != slots)
+		schedule_work(&table->resize_work);
+}
+
+/**
+ * Releases the array the last resize left behind, starts another resize if the table needs one,
+ * and finishes the resize in progress. Runs in process context, so it can wait for grace periods
+ * and vmalloc().
+ */
+static void RESIZE_WORK(struct work_struct *work)
+{
+	struct HTABLE_NAME *table = container_of(work, struct HTABLE_NAME, resize_work);
+	struct SLOT_ARRAY *array;
+	__u32 slots, new_slots;
+
+	array = xchg(&table->retired_table, NULL);
+	if (array) {
+		synchronize_rcu();
+		FREE_SLOTS(array);
+	}
+
+	if (!rcu_access_pointer(table->old_table)) {
+		/* Only this function and DESTROY (which stops it first) replace or release the arrays. */
+		array = rcu_dereference_raw(table->table);
+		if (!array)
+			return;
+		slots = array->length;
+
+		new_slots = TARGET_SLOTS(table, slots, COUNT(table));
+		if (new_slots == slots)
+			return;
+		RESIZE(table, slots, new_slots);
+	}
+
+	/* The last MIGRATE retires the old array and schedules us again. */
+	REHASH(table);
 }
 
 /********************************************
@@ -133,13 +751,20 @@ static struct KEY_VALUE_PAIR *GET_AUX(struct HTABLE_NAME *table, KEY_TYPE *key)
  *
  * @param table the HTABLE_NAME instance you want to initialize.
  * @param equals_function function the table will use to locate slots.
- * @param hash_function function the table will use to locate linked lists.
+ * @param hash_function function the table will use to locate linked lists. Will receive the key
+ *		and a random seed, which has to affect the result.
  */
 static int INIT(struct HTABLE_NAME *table,
 		bool (*equals_function)(KEY_TYPE *, KEY_TYPE *),
-		__u16 (*hash_function)(KEY_TYPE *))
+		__u32 (*hash_function)(KEY_TYPE *, __u32))
 {
-	__u16 i;
+	int i;
+
+	BUILD_BUG_ON((HASH_TABLE_SIZE & (HASH_TABLE_SIZE - 1)) != 0);
+	BUILD_BUG_ON((HASH_TABLE_MAX_SIZE & (HASH_TABLE_MAX_SIZE - 1)) != 0);
+	BUILD_BUG_ON(HASH_TABLE_SIZE > HASH_TABLE_MAX_SIZE);
+	BUILD_BUG_ON((HASH_TABLE_LOCKS & (HASH_TABLE_LOCKS - 1)) != 0);
+	BUILD_BUG_ON(HASH_TABLE_LOCKS > HASH_TABLE_SIZE);
 
 	if (!table) {
 		log_err(ERR_NULL, "The table is NULL.");
@@ -154,39 +779,140 @@ static int INIT(struct HTABLE_NAME *table,
 		return -EINVAL;
 	}
 
-	for (i = 0; i < HASH_TABLE_SIZE; i++)
-		INIT_HLIST_HEAD(&table->table[i]);
+	/* The array will be allocated by the first put. */
+	RCU_INIT_POINTER(table->table, NULL);
+	RCU_INIT_POINTER(table->old_table, NULL);
+	atomic_set(&table->rehash_pending, 0);
+	table->retired_table = NULL;
+	spin_lock_init(&table->resize_lock);
+	INIT_WORK(&table->resize_work, RESIZE_WORK);
+	for (i = 0; i < HASH_TABLE_LOCKS; i++) {
+		spin_lock_init(&table->stripes[i].lock);
+		seqcount_init(&table->stripes[i].rehash_seq);
+		table->stripes[i].rehash_index = 0;
+		table->stripes[i].count = 0;
+	}
+	table->max_load = TABLES_DEF_MAX_LOAD;
+	table->min_load = TABLES_DEF_MIN_LOAD;
+	table->min_slots = HASH_TABLE_SIZE;
+	table->max_slots = HASH_TABLE_MAX_SIZE;
+	table->node = NUMA_NO_NODE;
 
 	table->equals_function = equals_function;
 	table->hash_function = hash_function;
+	get_random_bytes(&table->seed, sizeof(table->seed));
 
 	return 0;
 }
 
+/**
+ * Changes the load factor thresholds which make "table" resize.
+ * The new values will be taken into account from the next put or remove onwards. Needs no lock.
+ *
+ * @param table the HTABLE_NAME instance whose thresholds you want to change.
+ * @param max_load the table will grow when it holds more than this percentage of its slots.
+ * @param min_load the table will shrink when it holds less than this percentage of its slots.
+ *		Zero means the table should never shrink.
+ */
+static void SET_LOAD_LIMITS(struct HTABLE_NAME *table, __u16 max_load, __u16 min_load)
+{
+	table->max_load = max_load;
+	table->min_load = min_load;
+}
+
+/**
+ * Changes the number of slots "table" is allowed to have. If its current size is out of the new
+ * bounds, it will be resized in the background.
+ * Can be called from atomic context.
+ *
+ * @param table the HTABLE_NAME instance whose size limits you want to change.
+ * @param min_slots the table will never have less slots than this. It will also grow to this size
+ *		as soon as something is inserted to it, regardless of its load.
+ * @param max_slots the table will never have more slots than this, regardless of its load.
+ * @return -EINVAL if the limits are not powers of two, "min_slots" is smaller than the number of
+ *		stripes, or "max_slots" is smaller than "min_slots". Zero otherwise.
+ */
+static int SET_SIZE_LIMITS(struct HTABLE_NAME *table, __u32 min_slots, __u32 max_slots)
+{
+	if (!is_power_of_2(min_slots) || !is_power_of_2(max_slots)) {
+		log_err(ERR_TABLE_SLOTS, "The number of slots has to be a power of two.");
+		return -EINVAL;
+	}
+	if (min_slots < HASH_TABLE_LOCKS) {
+		log_err(ERR_TABLE_SLOTS, "Tables cannot have less than %u slots.", HASH_TABLE_LOCKS);
+		return -EINVAL;
+	}
+	if (min_slots > max_slots) {
+		log_err(ERR_TABLE_SLOTS, "The minimum number of slots (%u) is larger than the maximum "
+				"(%u).", min_slots, max_slots);
+		return -EINVAL;
+	}
+
+	table->min_slots = min_slots;
+	table->max_slots = max_slots;
+
+	if (rcu_access_pointer(table->table))
+		schedule_work(&table->resize_work);
+	return 0;
+}
+
+/**
+ * Makes "table" allocate its arrays from the "node" NUMA node (if it has memory left).
+ * Tables which are mostly used by the CPUs of a single node should live there; the others are
+ * better off with the default (NUMA_NO_NODE).
+ * Affects the arrays allocated from then on, so call it before the first put.
+ */
+static void SET_NODE(struct HTABLE_NAME *table, int node)
+{
+	table->node = node;
+}
+
 /**
  * Inserts "value" to the "table" table in the slot described by the "key" key.
+ * "value" becomes visible to lockless readers right away, so initialize it before calling this.
  *
  * Important: The table stores pointers to (as opposed to "copies of") both key and value.
  * So please consider that neither must be released from memory after the call to this function.
+ * If NODE_MEMBER is defined, "key" has to be value->KEY_MEMBER (or, if the table uses KEY_FUNCTION,
+ * equal to the key it computes for "value"; then "key" is only used during the call), and
+ * value->NODE_MEMBER will be linked to the table (so the value cannot be in two tables which share
+ * the same node member).
  *
  * Also important: This function differs from HashMap.put() in that it doesn't validate whether the
- * value is already in the table before inserting.
+ * value is already in the table before inserting. If concurrent callers might be inserting the same
+ * key, the caller has to serialize them.
  *
  * @param table the HTABLE_NAME instance you want to insert a value to.
  * @param key descriptor of the slot to place "value" in.
  * @param value element to store in the table.
- * @return success status. The value will not be inserted if a kmalloc fails.
+ * @return success status. The value will not be inserted if the table's first array cannot be
+ *		allocated, or (if NODE_MEMBER is not defined) if a kmalloc fails.
  */
 static int PUT(struct HTABLE_NAME *table, KEY_TYPE *key, VALUE_TYPE *value)
 {
+	struct SLOT_ARRAY *array;
+	struct STRIPE *stripe;
+	struct hlist_node *node;
+#ifndef NODE_MEMBER
 	struct KEY_VALUE_PAIR *key_value;
-	__u16 hash_code;
+#endif
+	__u32 hash_code;
+	int error;
 
 	if (!table) {
 		log_err(ERR_NULL, "The table is NULL.");
 		return -EINVAL;
 	}
 
+	if (!rcu_access_pointer(table->table)) {
+		error = CREATE_ARRAY(table);
+		if (error)
+			return error;
+	}
+
+#ifdef NODE_MEMBER
+	node = &value->NODE_MEMBER;
+#else
 	/*
 	 * We're not going to insert the value alone, but a key-value structure.
 	 * (Because we'll later need the key available during lookups.)
@@ -199,11 +925,23 @@ static int PUT(struct HTABLE_NAME *table, KEY_TYPE *key, VALUE_TYPE *value)
 	}
 	key_value->key = key;
 	key_value->value = value;
+	node = &key_value->nodes;
+#endif
+
+	/* Insert the node to the table. New values always go to the newest array. */
+	hash_code = table->hash_function(key, table->seed);
+	stripe = GET_STRIPE(table, hash_code);
 
-	/* Insert the key-value to the table. */
-	hash_code = table->hash_function(key) % HASH_TABLE_SIZE;
-	hlist_add_head(&key_value->nodes, &table->table[hash_code]);
+	rcu_read_lock();
+	spin_lock_bh(&stripe->lock);
+	array = rcu_dereference(table->table);
+	hlist_add_head_rcu(node, &array->heads[hash_code & (array->length - 1)]);
+	stripe->count++;
+	MIGRATE(table, stripe);
+	spin_unlock_bh(&stripe->lock);
+	rcu_read_unlock();
 
+	ADJUST_SIZE(table, stripe);
 	return 0;
 }
 
@@ -213,45 +951,71 @@ static int PUT(struct HTABLE_NAME *table, KEY_TYPE *key, VALUE_TYPE *value)
  * You will receive the actual stored value. Please don't release it from memory (use the REMOVE
  * function instead).
  *
+ * Can be called from within a RCU read-side critical section, in which case the value can only be
+ * used until the critical section ends. Otherwise, whatever keeps the value from being removed and
+ * released (eg. a lock the removers need) has to be held.
+ *
  * @param table the HTABLE_NAME instance you want the value from.
  * @param key descriptor to which the associated value is to be returned.
  * @return the value to which "table" maps "key", "null" if there's no mapping for the key.
  */
 static VALUE_TYPE *GET(struct HTABLE_NAME *table, KEY_TYPE *key)
 {
-	struct KEY_VALUE_PAIR *key_value = GET_AUX(table, key);
-	return (key_value != NULL) ? key_value->value : NULL;
+	struct hlist_node *node = GET_AUX(table, key, NULL);
+	return (node != NULL) ? NODE_VALUE(node) : NULL;
 }
 
 /**
  * Stops "key" from accesing its value in the "table" table.
  * Releases memory as well, depending on the release_* arguments.
  *
+ * Lockless readers might still be looking at the value after this returns. If you didn't request
+ * its release, wait for a grace period before you free it yourself.
+ *
  * @param table the HTABLE_NAME instance you want to stop mapping "key" from.
  * @param key descriptor whose associated value will be removed from "table".
  * @param release_key send "true" if the key stored in the table should be released from memory.
+ *		Ignored if NODE_MEMBER is defined (the key is part of the value).
  * @param release_value send "true" if the value stored in the table should be released from memory.
  */
 static bool REMOVE(struct HTABLE_NAME *table, KEY_TYPE *key, bool release_key, bool release_value)
 {
-	struct KEY_VALUE_PAIR *key_value = GET_AUX(table, key);
-	if (key_value == NULL)
+	struct STRIPE *stripe;
+	struct hlist_node *node;
+	__u32 hash_code;
+
+	if (!table) {
+		log_err(ERR_NULL, "The table is NULL.");
 		return false;
+	}
 
-	hlist_del(&key_value->nodes);
+	hash_code = table->hash_function(key, table->seed);
+	stripe = GET_STRIPE(table, hash_code);
 
-	if (release_key)
-		kfree(key_value->key);
-	if (release_value)
-		kfree(key_value->value);
-	kfree(key_value);
+	rcu_read_lock();
+	spin_lock_bh(&stripe->lock);
+	node = GET_BY_HASH(table, key, hash_code, table->equals_function);
+	if (node) {
+		hlist_del_rcu(node);
+		stripe->count--;
+		MIGRATE(table, stripe);
+	}
+	spin_unlock_bh(&stripe->lock);
+	rcu_read_unlock();
+
+	if (!node)
+		return false;
 
+	RELEASE_NODE(node, release_key, release_value);
+
+	ADJUST_SIZE(table, stripe);
 	return true;
 }
 
 /**
- * Clears all memory allocated by the table. You definitely want to call this before your table goes
- * into oblivion!!!
+ * Clears all the values from the table. The table can still be used afterwards.
+ * Assumes there are no lockless readers nor other writers (eg. the packet hooks are not
+ * registered). Can sleep.
  *
  * @param table the HTABLE_NAME instance you want to clear.
  * @param release_keys send "true" if the table's stored keys should be deallocated.
@@ -259,40 +1023,80 @@ static bool REMOVE(struct HTABLE_NAME *table, KEY_TYPE *key, bool release_key, b
  *
  * Note that even if you want to release the keys and the values, you still need to call this
  * function since you have no control over the key-value pairs.
+ * If NODE_MEMBER is defined, "release_keys" is ignored (the keys are part of the values).
  */
 static void EMPTY(struct HTABLE_NAME *table, bool release_keys, bool release_values)
 {
+	struct SLOT_ARRAY *arrays[2];
 	struct hlist_node *current_node;
-	struct KEY_VALUE_PAIR *current_pair;
-	__u16 row;
+	__u32 array, row;
+	int i;
 
 	if (!table) {
 		log_err(ERR_NULL, "The table is NULL.");
 		return;
 	}
 
-	for (row = 0; row < HASH_TABLE_SIZE; row++) {
-		while (!hlist_empty(&table->table[row])) {
-			current_node = table->table[row].first;
-			current_pair = container_of(current_node, struct KEY_VALUE_PAIR, nodes);
+	/* Don't let a resize replace the arrays under our feet. */
+	cancel_work_sync(&table->resize_work);
 
-			hlist_del(current_node);
+	arrays[0] = rcu_dereference_protected(table->table, true);
+	arrays[1] = rcu_dereference_protected(table->old_table, true);
 
-			if (release_keys)
-				kfree(current_pair->key);
-			if (release_values)
-				kfree(current_pair->value);
-			kfree(current_pair);
+	for (array = 0; array < ARRAY_SIZE(arrays); array++) {
+		if (!arrays[array])
+			continue;
 
-			/* log_debug("Deleted a node whose hash code was %u.", row); */
+		for (row = 0; row < arrays[array]->length; row++) {
+			while (!hlist_empty(&arrays[array]->heads[row])) {
+				current_node = arrays[array]->heads[row].first;
+				hlist_del(current_node);
+				RELEASE_NODE(current_node, release_keys, release_values);
+			}
 		}
 	}
+
+	if (arrays[1])
+		FREE_SLOTS(arrays[1]);
+	RCU_INIT_POINTER(table->old_table, NULL);
+	if (table->retired_table) {
+		FREE_SLOTS(table->retired_table);
+		table->retired_table = NULL;
+	}
+	atomic_set(&table->rehash_pending, 0);
+	for (i = 0; i < HASH_TABLE_LOCKS; i++) {
+		table->stripes[i].rehash_index = 0;
+		table->stripes[i].count = 0;
+	}
+}
+
+/**
+ * Clears all memory allocated by the table. You definitely want to call this before your table goes
+ * into oblivion!!!
+ * Assumes there are no lockless readers nor other writers (eg. the packet hooks are not
+ * registered). Can sleep.
+ *
+ * @param table the HTABLE_NAME instance you want to destroy.
+ * @param release_keys send "true" if the table's stored keys should be deallocated.
+ * @param release_values send "true" if the table's stored keys should be deallocated.
+ */
+static void DESTROY(struct HTABLE_NAME *table, bool release_keys, bool release_values)
+{
+	if (!table) {
+		log_err(ERR_NULL, "The table is NULL.");
+		return;
+	}
+
+	EMPTY(table, release_keys, release_values);
+	if (rcu_access_pointer(table->table))
+		FREE_SLOTS(rcu_dereference_protected(table->table, true));
+	RCU_INIT_POINTER(table->table, NULL);
 }
 
 #ifdef GENERATE_PRINT
 /**
  * Printks the content of the table in KERN_DEBUG level.
- * Use for debugging purposes.
+ * Use for debugging purposes. Assumes there are no concurrent writers.
  *
  * @param the HTABLE_NAME instance you want to print.
  * @param header a header label for the table. Will precede the table so you can locate it in dmesg
@@ -300,19 +1104,36 @@ static void EMPTY(struct HTABLE_NAME *table, bool release_keys, bool release_val
  */
 static void PRINT(struct HTABLE_NAME *table, char *header)
 {
+	struct SLOT_ARRAY *array, *old_array;
 	struct hlist_node *current_node;
-	struct KEY_VALUE_PAIR *current_pair;
-	__u16 row;
+	KEY_TYPE buffer;
+	__u32 row;
 
 	log_debug("** Printing table: %s **", header);
 
 	if (!table)
 		goto end;
-	for (row = 0; row < HASH_TABLE_SIZE; row++) {
-		hlist_for_each(current_node, &table->table[row]) {
-			current_pair = hlist_entry(current_node, struct KEY_VALUE_PAIR, nodes);
-			log_debug("  hash:%u - key:%p - value:%p", row, &current_pair->key,
-					&current_pair->value);
+
+	array = rcu_dereference_protected(table->table, true);
+	if (!array) {
+		log_debug("  (Not allocated yet.)");
+		goto end;
+	}
+	old_array = rcu_dereference_protected(table->old_table, true);
+	log_debug("  slots:%u - values:%u - resizing:%s", array->length, COUNT(table),
+			old_array ? "yes" : "no");
+
+	for (row = 0; row < array->length; row++) {
+		hlist_for_each(current_node, &array->heads[row]) {
+			log_debug("  hash:%u - key:%p - value:%p", row, NODE_KEY(current_node, &buffer),
+					NODE_VALUE(current_node));
+		}
+	}
+	/* Moved slots are empty. */
+	for (row = 0; old_array && row < old_array->length; row++) {
+		hlist_for_each(current_node, &old_array->heads[row]) {
+			log_debug("  old hash:%u - key:%p - value:%p", row, NODE_KEY(current_node, &buffer),
+					NODE_VALUE(current_node));
 		}
 	}
 
@@ -325,6 +1146,8 @@ end:
 #ifdef GENERATE_FOR_EACH
 /**
  * Executes the "func" function for every element in the table.
+ * Locks one stripe at a time, so writers from other stripes can keep working meanwhile. "func"
+ * runs while the lock of its value's stripe is held, so it cannot block or touch the table.
  *
  * @param table the HTABLE_NAME instance you want to walk-through.
  * @param func function you want executed for each table entry. Will receive each value and "arg".
@@ -333,24 +1156,80 @@ end:
  */
 static int FOR_EACH(struct HTABLE_NAME *table, int (*func)(VALUE_TYPE *, void *), void *arg)
 {
+	struct SLOT_ARRAY *array, *old_array;
+	struct STRIPE *stripe;
 	struct hlist_node *current_node;
-	struct KEY_VALUE_PAIR *current_pair;
-	__u16 row;
-	int error;
+	__u32 i, row;
+	int error = 0;
 
 	if (!table)
 		return -EINVAL;
 
-	for (row = 0; row < HASH_TABLE_SIZE; row++) {
-		hlist_for_each(current_node, &table->table[row]) {
-			current_pair = hlist_entry(current_node, struct KEY_VALUE_PAIR, nodes);
-			error = func(current_pair->value, arg);
-			if (error)
-				return error;
+	/* Keep the arrays from being replaced while we're walking them. */
+	spin_lock_bh(&table->resize_lock);
+	rcu_read_lock();
+	array = rcu_dereference(table->table);
+	if (!array)
+		goto end;
+
+	for (i = 0; i < HASH_TABLE_LOCKS; i++) {
+		stripe = &table->stripes[i];
+		spin_lock(&stripe->lock);
+
+		for (row = i; row < array->length; row += HASH_TABLE_LOCKS) {
+			hlist_for_each(current_node, &array->heads[row]) {
+				error = func(NODE_VALUE(current_node), arg);
+				if (error)
+					goto unlock_stripe;
+			}
 		}
+
+		/* Moved slots are empty. */
+		old_array = rcu_dereference(table->old_table);
+		for (row = i; old_array && row < old_array->length; row += HASH_TABLE_LOCKS) {
+			hlist_for_each(current_node, &old_array->heads[row]) {
+				error = func(NODE_VALUE(current_node), arg);
+				if (error)
+					goto unlock_stripe;
+			}
+		}
+
+		spin_unlock(&stripe->lock);
 	}
 
-	return 0;
+	goto end;
+
+unlock_stripe:
+	spin_unlock(&stripe->lock);
+	/* Fall through. */
+
+end:
+	rcu_read_unlock();
+	spin_unlock_bh(&table->resize_lock);
+	return error;
+}
+#endif
+
+#ifdef GENERATE_FIND
+/**
+ * Returns from "table" the first value whose key "matches" "key".
+ *
+ * Use this to look up values by partial key. Only the slot "key" hashes to is searched, so every
+ * key which "matches" "key" has to share its hash code.
+ *
+ * Same as GET, can be called within a RCU read-side critical section instead of holding the lock.
+ *
+ * @param table the HTABLE_NAME instance you want the value from.
+ * @param key descriptor of the value you want.
+ * @param matches function which returns "true" if its second argument (a key from the table) is
+ *		the one described by its first argument ("key").
+ * @return the first value whose key "matches" "key", "null" if there's no such value.
+ */
+static VALUE_TYPE *FIND(struct HTABLE_NAME *table, KEY_TYPE *key,
+		bool (*matches)(KEY_TYPE *, KEY_TYPE *))
+{
+	struct hlist_node *node = GET_AUX(table, key, matches);
+	return (node != NULL) ? NODE_VALUE(node) : NULL;
 }
 #endif
 
@@ -362,5 +1241,13 @@ static int FOR_EACH(struct HTABLE_NAME *table, int (*func)(VALUE_TYPE *, void *)
 #undef KEY_TYPE
 #undef VALUE_TYPE
 #undef HASH_TABLE_SIZE
+#undef HASH_TABLE_MAX_SIZE
+#undef HASH_TABLE_LOCKS
+#undef HASH_TABLE_REHASH_STEP
 #undef GENERATE_PRINT
 #undef GENERATE_FOR_EACH
+#undef GENERATE_FIND
+#undef NODE_MEMBER
+#undef KEY_MEMBER
+#undef KEY_FUNCTION
+#undef FREE_VALUE
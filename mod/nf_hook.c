@@ -1,8 +1,12 @@
 #include "nat64/comm/nat64.h"
+#include "nat64/comm/constants.h"
 #include "nat64/mod/pool4.h"
 #include "nat64/mod/pool6.h"
+#include "nat64/mod/rss.h"
+#include "nat64/mod/determ.h"
 #include "nat64/mod/bib.h"
 #include "nat64/mod/session.h"
+#include "nat64/mod/tables.h"
 #include "nat64/mod/config.h"
 #include "nat64/mod/filtering_and_updating.h"
 #include "nat64/mod/translate_packet.h"
@@ -21,11 +25,61 @@ MODULE_DESCRIPTION(MODULE_NAME " (RFC 6146)");
 static char *pool6[5];
 static int pool6_size;
 module_param_array(pool6, charp, &pool6_size, 0);
-MODULE_PARM_DESC(pool6, "The IPv6 pool's prefixes.");
+MODULE_PARM_DESC(pool6, "The IPv6 pool's prefixes. Each one can be followed by \"=\" and the "
+		"pool4 addresses its flows should be masked with (eg. 64:ff9b::/96=192.0.2.0/24).");
 static char *pool4[5];
 static int pool4_size;
 module_param_array(pool4, charp, &pool4_size, 0);
 MODULE_PARM_DESC(pool4, "The IPv4 pool's addresses.");
+static char *pool4_select;
+module_param(pool4_select, charp, 0);
+MODULE_PARM_DESC(pool4_select, "How new flows choose their IPv4 address: round-robin (default), "
+		"least-loaded or source-hash.");
+static unsigned int pba_block_size;
+module_param(pba_block_size, uint, 0);
+MODULE_PARM_DESC(pba_block_size, "Ports lent to each IPv6 node at a time (Port Block Allocation). "
+		"0 (default) lends them one by one.");
+static bool sharded_sessions;
+module_param(sharded_sessions, bool, 0);
+MODULE_PARM_DESC(sharded_sessions, "Partition the session tables by a hash of the IPv6 side of each "
+		"flow, into as many partitions as CPUs. Packets are not steered to their partition's CPU.");
+static bool port_reuse;
+module_param(port_reuse, bool, 0);
+MODULE_PARM_DESC(port_reuse, "Once the IPv4 pool runs out of ports, let IPv6 nodes share them as "
+		"long as they talk to different IPv4 endpoints. Incompatible with sharded_sessions.");
+static unsigned int reserve_rate = TABLES_DEF_RESERVE_RATE;
+module_param(reserve_rate, uint, 0);
+MODULE_PARM_DESC(reserve_rate, "New flows per second the entries kept free in advance should last "
+		"while the tables grow.");
+static char *rss_key;
+module_param(rss_key, charp, 0);
+MODULE_PARM_DESC(rss_key, "The IPv4 NIC's RSS hash key (as printed by ethtool -x).");
+static int rss_indir[RSS_INDIR_MAX_LEN];
+static int rss_indir_size;
+module_param_array(rss_indir, int, &rss_indir_size, 0);
+MODULE_PARM_DESC(rss_indir, "The CPU each entry of the IPv4 NIC's RSS indirection table lands on.");
+static char *det_prefix6;
+module_param(det_prefix6, charp, 0);
+MODULE_PARM_DESC(det_prefix6, "The IPv6 prefix of the deterministically mapped subscribers. "
+		"Deterministic mode is disabled if absent.");
+static unsigned int det_subscriber_len = 64;
+module_param(det_subscriber_len, uint, 0);
+MODULE_PARM_DESC(det_subscriber_len, "Length of each deterministic subscriber's IPv6 prefix.");
+static char *det_prefix4;
+module_param(det_prefix4, charp, 0);
+MODULE_PARM_DESC(det_prefix4, "The IPv4 prefix deterministic subscribers are mapped to.");
+static unsigned int det_ports = 2016;
+module_param(det_ports, uint, 0);
+MODULE_PARM_DESC(det_ports, "Number of ports each deterministic subscriber gets.");
+static unsigned int udp_slots[2] = { TABLES_DEF_UDP_MIN_SLOTS, TABLES_DEF_UDP_MAX_SLOTS };
+module_param_array(udp_slots, uint, NULL, 0);
+MODULE_PARM_DESC(udp_slots, "Minimum and maximum number of slots of the UDP tables.");
+static unsigned int tcp_slots[2] = { TABLES_DEF_TCP_MIN_SLOTS, TABLES_DEF_TCP_MAX_SLOTS };
+module_param_array(tcp_slots, uint, NULL, 0);
+MODULE_PARM_DESC(tcp_slots, "Minimum and maximum number of slots of the TCP tables.");
+static unsigned int icmp_slots[2] = { TABLES_DEF_ICMP_MIN_SLOTS, TABLES_DEF_ICMP_MAX_SLOTS };
+module_param_array(icmp_slots, uint, NULL, 0);
+MODULE_PARM_DESC(icmp_slots, "Minimum and maximum number of slots of the ICMP tables.");
 
 
 static char *banner = "\n"
@@ -64,9 +118,12 @@ static void deinit(void)
 {
 	translate_packet_destroy();
 	filtering_destroy();
+	tables_destroy();
 	session_destroy();
 	bib_destroy();
 	pool4_destroy();
+	determ_destroy();
+	rss_destroy();
 	pool6_destroy();
 	config_destroy();
 }
@@ -88,6 +145,9 @@ static struct nf_hook_ops nfho[] = {
 
 int __init nat64_init(void)
 {
+	struct table_slots udp = { udp_slots[0], udp_slots[1] };
+	struct table_slots tcp = { tcp_slots[0], tcp_slots[1] };
+	struct table_slots icmp = { icmp_slots[0], icmp_slots[1] };
 	int error;
 
 	log_debug("%s", banner);
@@ -97,15 +157,31 @@ int __init nat64_init(void)
 	if (error)
 		goto failure;
 	error = pool6_init(pool6, pool6_size);
+	if (error)
+		goto failure;
+	error = rss_init(rss_key, rss_indir, rss_indir_size);
+	if (error)
+		goto failure;
+	error = determ_init(det_prefix6, det_subscriber_len, det_prefix4, det_ports);
 	if (error)
 		goto failure;
 	error = pool4_init(pool4, pool4_size);
 	if (error)
 		goto failure;
-	error = bib_init();
+	error = pool4_set_select(pool4_select);
+	if (error)
+		goto failure;
+	error = pool4_set_block_size(pba_block_size);
 	if (error)
 		goto failure;
-	error = session_init(session_expired);
+	error = bib_init(reserve_rate);
+	if (error)
+		goto failure;
+	bib_set_port_reuse(port_reuse);
+	error = session_init(session_expired, sharded_sessions, reserve_rate);
+	if (error)
+		goto failure;
+	error = tables_init(&udp, &tcp, &icmp);
 	if (error)
 		goto failure;
 	error = filtering_init();
@@ -129,8 +205,9 @@ failure:
 
 void __exit nat64_exit(void)
 {
-	deinit();
+	/* Unregistering also waits for the packets (and therefore RCU readers) in flight. */
 	nf_unregister_hooks(nfho, ARRAY_SIZE(nfho));
+	deinit();
 	log_info(MODULE_NAME " module removed.");
 }
 
@@ -2,89 +2,941 @@
 #include "nat64/comm/constants.h"
 #include "nat64/comm/str_utils.h"
 #include "nat64/mod/poolnum.h"
+#include "nat64/mod/rss.h"
+#include "nat64/mod/determ.h"
 
 #include <linux/slab.h>
+#include <linux/smp.h>
+#include <linux/rcupdate.h>
+#include <linux/random.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
 
 
+/**
+ * The kinds of values a pool4 address lends. Each one is lent independently of the others.
+ * See RFC 6146 section 3.5.1.1 for the reason behind the parity and range split.
+ */
+enum pool4_class {
+	/** Even UDP ports from the range 0-1023. */
+	CLASS_UDP_LOW_EVEN,
+	/** Odd UDP ports from the range 0-1023. */
+	CLASS_UDP_LOW_ODD,
+	/** Even UDP ports from the range 1024-65535. */
+	CLASS_UDP_HIGH_EVEN,
+	/** Odd UDP ports from the range 1024-65535. */
+	CLASS_UDP_HIGH_ODD,
+	/** TCP ports from the range 0-1023. */
+	CLASS_TCP_LOW,
+	/** TCP ports from the range 1024-65535. */
+	CLASS_TCP_HIGH,
+	/** ICMP identifiers. */
+	CLASS_ICMP,
+	CLASS_COUNT,
+};
+
+/** The values each class holds. */
+static const struct {
+	__u16 min;
+	__u16 max;
+	__u16 step;
+} class_ranges[CLASS_COUNT] = {
+	[CLASS_UDP_LOW_EVEN] = { 0, 1022, 2 },
+	[CLASS_UDP_LOW_ODD] = { 1, 1023, 2 },
+	[CLASS_UDP_HIGH_EVEN] = { 1024, 65534, 2 },
+	[CLASS_UDP_HIGH_ODD] = { 1025, 65535, 2 },
+	[CLASS_TCP_LOW] = { 0, 1023, 1 },
+	[CLASS_TCP_HIGH] = { 1024, 65535, 1 },
+	[CLASS_ICMP] = { 0, 65535, 1 },
+};
+
+/** Index of the ring that holds every node, regardless of what they have left. */
+#define RING_ALL CLASS_COUNT
+#define RING_COUNT (CLASS_COUNT + 1)
+
 /**
  * An address within the pool, along with its ports.
  */
 struct pool4_node {
 	/** The address itself. */
 	struct in_addr addr;
+	/** The address's ports and identifiers, indexed by enum pool4_class. */
+	struct poolnum ids[CLASS_COUNT];
 
-	struct {
-		/** The address's even ports from the range 0-1023. */
-		struct poolnum low_even;
-		/** The address's odd ports from the range 0-1023. */
-		struct poolnum low_odd;
-		/** The address's even ports from the range 1024-65535. */
-		struct poolnum high_even;
-		/** The address's odd ports from the range 1024-65535. */
-		struct poolnum high_odd;
-	} udp_ports;
-	struct {
-		struct poolnum low;
-		struct poolnum high;
-	} tcp_ports;
-	struct poolnum icmp_ids;
+	/** Position of the node in each of the "rings" (meaningless if it's not there). */
+	unsigned int ring_index[RING_COUNT];
 
 	/** Next address within the pool (since they are linked listed; see pool). */
 	struct list_head next;
+	/** Links the node to its slot in "pool_table". */
+	struct hlist_node table_hook;
+	/**
+	 * Lockless readers of "pool_table" might still be looking at removed nodes (and their ports),
+	 * so they are released after a grace period.
+	 */
+	struct rcu_head rcu;
 };
 
+/**
+ * A set of nodes, stored in an array so any of them can be reached in constant time.
+ * The order is meaningless; removals move the last node to the vacated slot.
+ */
+struct pool4_ring {
+	struct pool4_node **nodes;
+	unsigned int count;
+	/** Length of "nodes". */
+	unsigned int capacity;
+	/** Index of the node round robin selection will offer next. */
+	unsigned int cursor;
+	/** Index of this ring in "rings" (and therefore in the nodes' "ring_index"). */
+	unsigned int id;
+};
+
+/*
+ * Indexes the nodes by address (this code generates the "pool4_table" structure and related
+ * functions used below).
+ */
+#define HTABLE_NAME pool4_table
+#define KEY_TYPE struct in_addr
+#define VALUE_TYPE struct pool4_node
+#define NODE_MEMBER table_hook
+#define KEY_MEMBER addr
+#define HASH_TABLE_SIZE 64
+#define HASH_TABLE_MAX_SIZE (64 * 1024)
+#include "hash_table.c"
+
+/** The pool's nodes, in the order they were registered. */
 static LIST_HEAD(pool);
+/**
+ * The same nodes, indexed by address. Packets ask whether their addresses belong to the pool all
+ * the time, so that question is answered from here, without locking.
+ */
+static struct pool4_table pool_table;
+/**
+ * rings[c] (c being a pool4_class) holds the nodes which still have values of class c to lend, so
+ * selection never has to wade through exhausted addresses. rings[RING_ALL] holds every node.
+ */
+static struct pool4_ring rings[RING_COUNT];
+/** Serializes the writers of "pool", "pool_table" and "rings", and protects the nodes' ports. */
 static DEFINE_SPINLOCK(pool_lock);
 
+/** How get_any() chooses addresses. */
+static enum pool4_select select_mode = POOL4_SELECT_ROUND_ROBIN;
+/** Randomizes the source hash and the least-loaded candidates. */
+static u32 select_seed;
+/** Feeds the least-loaded candidates. */
+static u32 select_counter;
+
+/** Number of transport addresses each CPU can keep at hand, per class. */
+#define MAGAZINE_SIZE 32
+/** Number of transport addresses moved between a magazine and the pool at a time. */
+#define MAGAZINE_BATCH (MAGAZINE_SIZE / 2)
+/** Wildcard for magazine_take()'s "l4_id". */
+#define ANY_ID -1
+
+/**
+ * Transport addresses of one class which a CPU borrowed from the pool in advance (or had returned
+ * to it), so it can lend and take them back without touching pool_lock.
+ * As far as the pool is concerned, these are borrowed.
+ */
+struct pool4_magazine {
+	struct ipv4_tuple_address entries[MAGAZINE_SIZE];
+	unsigned int count;
+};
+
+/** One CPU's share of the pool. */
+struct pool4_cpu {
+	/**
+	 * Protects the magazines. Other CPUs only take it when they need something specific which
+	 * might be sitting here, so it's almost never contended. Never taken after pool_lock.
+	 */
+	spinlock_t lock;
+	/** Indexed by enum pool4_class. */
+	struct pool4_magazine magazines[CLASS_COUNT];
+	/** Borrows and returns this CPU's magazines could handle on their own. */
+	u64 hits;
+	/** Borrows and returns which had to go to the pool. */
+	u64 misses;
+};
+
+static struct pool4_cpu __percpu *cpus;
+
+/** Identifies a block; see struct pool4_block. */
+struct pool4_block_key {
+	struct in_addr addr;
+	/** The block's first value. */
+	__u16 first;
+	/** The block's enum pool4_class. */
+	__u8 class;
+};
+
+/**
+ * A set of "block_size" values of one class (Port Block Allocation) which were lent to a single
+ * IPv6 node in advance. The node's flows are given values from here, so they rarely touch the pool.
+ * As far as the pool is concerned, these are borrowed until the node is done with all of them.
+ *
+ * The block's values are the ones from "key.first" on, in steps of its class's "step".
+ */
+struct pool4_block {
+	struct pool4_block_key key;
+	/** Bit i is set if the block's ith value is lent. */
+	u64 lent;
+	/** Number of bits set in "lent". */
+	unsigned int lent_count;
+	/** The node the block belongs to. */
+	struct pool4_subscriber *subscriber;
+
+	/** Links the block to its subscriber's list. */
+	struct list_head list_hook;
+	/** Links the block to its slot in "block_table". */
+	struct hlist_node table_hook;
+	/** Lockless readers of "block_table" might still be looking at released blocks. */
+	struct rcu_head rcu;
+};
+
+/** An IPv6 node which owns blocks. It exists as long as it does. */
+struct pool4_subscriber {
+	struct in6_addr addr;
+	/** The node's blocks (of any class), in the order they were lent. */
+	struct list_head blocks;
+
+	/** Links the subscriber to its slot in "subscriber_table". */
+	struct hlist_node table_hook;
+	struct rcu_head rcu;
+};
+
+/*
+ * Indexes the blocks by their first transport address, so returned values can be traced back to
+ * them.
+ */
+#define HTABLE_NAME block_table
+#define KEY_TYPE struct pool4_block_key
+#define VALUE_TYPE struct pool4_block
+#define NODE_MEMBER table_hook
+#define KEY_MEMBER key
+#define HASH_TABLE_SIZE 256
+#include "hash_table.c"
+
+/* Indexes the subscribers by IPv6 address. */
+#define HTABLE_NAME subscriber_table
+#define KEY_TYPE struct in6_addr
+#define VALUE_TYPE struct pool4_subscriber
+#define NODE_MEMBER table_hook
+#define KEY_MEMBER addr
+#define HASH_TABLE_SIZE 256
+#include "hash_table.c"
+
+/** Number of values in every block; zero if blocks are disabled. See pool4_set_block_size(). */
+static unsigned int block_size;
+static struct block_table block_table;
+static struct subscriber_table subscriber_table;
+
+#define PBA_LOCKS 64
+
+/** A PBA lock, alone in its cache line so CPUs holding neighbouring locks do not fight over it. */
+struct pba_lock {
+	spinlock_t lock;
+} ____cacheline_aligned_in_smp;
+
+/**
+ * Protect the subscribers and their blocks. Each subscriber is protected by the one its address
+ * hashes to (see get_pba_lock()). Never taken after pool_lock.
+ */
+static struct pba_lock pba_locks[PBA_LOCKS];
+/** Random value the lock index is keyed with, so nobody can choose to pile up on one lock. */
+static u32 pba_seed;
+
+/**
+ * Number of ports get_rss_aligned() tests before giving up. Roughly one in every "number of CPUs"
+ * ports is expected to qualify, so this only runs out if the pool is nearly exhausted or the
+ * indirection table barely mentions the current CPU.
+ */
+#define RSS_ATTEMPTS 1024
+
+/** Arguments of lands_on_cpu(). */
+struct rss_query {
+	/** The node the packets will come from. */
+	struct ipv4_tuple_address *remote;
+	/** The pool's transport address the packets will be headed to; the port is the candidate. */
+	struct ipv4_tuple_address local;
+	u_int8_t l4protocol;
+	/** The CPU the packets should be received by. */
+	int cpu;
+};
+
 
 /**
  * Assumes that pool has already been locked (pool_lock).
  */
 static struct pool4_node *get_pool4_node_from_addr(struct in_addr *addr)
 {
-	struct pool4_node *node;
-
 	if (list_empty(&pool)) {
 		log_err(ERR_POOL4_EMPTY, "The IPv4 pool is empty.");
 		return NULL;
 	}
 
-	list_for_each_entry(node, &pool, next)
-		if (ipv4_addr_equals(&node->addr, addr))
-			return node;
-
-	return NULL;
+	return pool4_table_get(&pool_table, addr);
 }
 
 /**
- * Assumes that pool has already been locked (pool_lock).
+ * Returns the class "id" belongs to, when used as a "l4protocol" port or identifier (-EINVAL if
+ * the protocol is not supported).
  */
-static struct poolnum *get_poolnum_from_pool4_node(struct pool4_node *node, u_int8_t l4protocol,
-		__u16 id)
+static int get_class(u_int8_t l4protocol, __u16 id)
 {
 	switch (l4protocol) {
 	case IPPROTO_UDP:
 		if (id < 1024)
-			return (id % 2 == 0) ? &node->udp_ports.low_even : &node->udp_ports.low_odd;
+			return (id % 2 == 0) ? CLASS_UDP_LOW_EVEN : CLASS_UDP_LOW_ODD;
 		else
-			return (id % 2 == 0) ? &node->udp_ports.high_even : &node->udp_ports.high_odd;
+			return (id % 2 == 0) ? CLASS_UDP_HIGH_EVEN : CLASS_UDP_HIGH_ODD;
 
 	case IPPROTO_TCP:
-		return (id < 1024) ? &node->tcp_ports.low : &node->tcp_ports.high;
+		return (id < 1024) ? CLASS_TCP_LOW : CLASS_TCP_HIGH;
 
 	case IPPROTO_ICMP:
 	case IPPROTO_ICMPV6:
-		return &node->icmp_ids;
+		return CLASS_ICMP;
 	}
 
 	log_crit(ERR_L4PROTO, "Unsupported transport protocol: %u.", l4protocol);
-	return NULL;
+	return -EINVAL;
+}
+
+/**
+ * Makes sure "ring" has room for "count" nodes.
+ * Assumes that pool has already been locked (pool_lock).
+ */
+static int ring_reserve(struct pool4_ring *ring, unsigned int count)
+{
+	struct pool4_node **nodes;
+	unsigned int capacity;
+
+	if (count <= ring->capacity)
+		return 0;
+
+	capacity = ring->capacity ? (2 * ring->capacity) : 8;
+	while (capacity < count)
+		capacity *= 2;
+
+	nodes = kmalloc(capacity * sizeof(*nodes), GFP_ATOMIC);
+	if (!nodes) {
+		log_err(ERR_ALLOC_FAILED, "Could not allocate the IPv4 pool's index.");
+		return -ENOMEM;
+	}
+	if (ring->nodes) {
+		memcpy(nodes, ring->nodes, ring->count * sizeof(*nodes));
+		kfree(ring->nodes);
+	}
+
+	ring->nodes = nodes;
+	ring->capacity = capacity;
+	return 0;
+}
+
+/**
+ * Adds "node" to "ring", which is assumed to have room for it (see ring_reserve()).
+ * Assumes that pool has already been locked (pool_lock).
+ */
+static void ring_add(struct pool4_ring *ring, struct pool4_node *node)
+{
+	node->ring_index[ring->id] = ring->count;
+	ring->nodes[ring->count] = node;
+	ring->count++;
+}
+
+/**
+ * Assumes that pool has already been locked (pool_lock).
+ */
+static void ring_remove(struct pool4_ring *ring, struct pool4_node *node)
+{
+	unsigned int index = node->ring_index[ring->id];
+	struct pool4_node *last;
+
+	ring->count--;
+	last = ring->nodes[ring->count];
+	ring->nodes[index] = last;
+	last->ring_index[ring->id] = index;
+}
+
+/**
+ * Registers the fact that "node" just lent a value of class "class".
+ * Assumes that pool has already been locked (pool_lock).
+ */
+static void lent(struct pool4_node *node, int class)
+{
+	if (node->ids[class].free_count == 0)
+		ring_remove(&rings[class], node);
+}
+
+/**
+ * Registers the fact that "node" just got back a value of class "class".
+ * Assumes that pool has already been locked (pool_lock).
+ */
+static void returned(struct pool4_node *node, int class)
+{
+	/* The ring can hold every node, so there's room. */
+	if (node->ids[class].free_count == 1)
+		ring_add(&rings[class], node);
+}
+
+/**
+ * Returns the node the round robin selection wants to lend the next "ring" value from.
+ * "ring" must not be empty.
+ * Assumes that pool has already been locked (pool_lock).
+ */
+static struct pool4_node *select_next(struct pool4_ring *ring)
+{
+	if (ring->cursor >= ring->count)
+		ring->cursor = 0;
+	return ring->nodes[ring->cursor++];
+}
+
+/**
+ * Returns the node that should lend the next value of class "class" (NULL if there are none
+ * left).
+ * "source" is the IPv6 node the value will be lent to; it can be NULL.
+ * Assumes that pool has already been locked (pool_lock).
+ */
+static struct pool4_node *select_node(int class, struct in6_addr *source)
+{
+	struct pool4_ring *ring = &rings[class];
+	struct pool4_ring *all = &rings[RING_ALL];
+	struct pool4_node *node, *other;
+
+	if (ring->count == 0)
+		return NULL;
+
+	switch (select_mode) {
+	case POOL4_SELECT_ROUND_ROBIN:
+		break;
+
+	case POOL4_SELECT_LEAST_LOADED:
+		/*
+		 * Keeping the nodes sorted by load would cost a lot more than comparing two random ones
+		 * ("the power of two choices"), which already keeps the loads remarkably close.
+		 */
+		node = ring->nodes[jhash_1word(select_counter++, select_seed) % ring->count];
+		other = ring->nodes[jhash_1word(select_counter++, select_seed) % ring->count];
+		return (node->ids[class].free_count >= other->ids[class].free_count) ? node : other;
+
+	case POOL4_SELECT_SOURCE_HASH:
+		if (!source)
+			break;
+		/* Hash against every node, so the IPv6 node keeps its address while it has ports. */
+		node = all->nodes[jhash2(source->s6_addr32, 4, select_seed) % all->count];
+		if (node->ids[class].free_count > 0)
+			return node;
+		/* That address is exhausted; any other will do. */
+		break;
+	}
+
+	return select_next(ring);
+}
+
+/**
+ * Returns whether the packets described by "arg" (a struct rss_query) would be received by the
+ * desired CPU, if "port" was their destination port.
+ */
+static bool lands_on_cpu(u16 port, void *arg)
+{
+	struct rss_query *query = arg;
+
+	query->local.l4_id = port;
+	return rss_get_cpu_ipv4(query->remote, &query->local, query->l4protocol) == query->cpu;
+}
+
+/**
+ * Borrows from "node" a port of class "class" such that the NIC will hand the packets from
+ * "remote" towards it to the current CPU.
+ * Assumes that pool has already been locked (pool_lock).
+ *
+ * @return zero on success, -ESRCH if no such port could be found.
+ */
+static int get_rss_aligned(struct pool4_node *node, int class, u_int8_t l4protocol,
+		struct ipv4_tuple_address *remote, __u16 *result)
+{
+	struct poolnum *ids = &node->ids[class];
+	struct rss_query query = {
+		.remote = remote,
+		.local.address = node->addr,
+		.local.l4_id = 0,
+		.l4protocol = l4protocol,
+		.cpu = smp_processor_id(),
+	};
+
+	switch (l4protocol) {
+	case IPPROTO_TCP:
+	case IPPROTO_UDP:
+		return poolnum_get_matching(ids, lands_on_cpu, &query, RSS_ATTEMPTS, result);
+	}
+
+	/* The NIC doesn't hash ICMP identifiers, so only the address can make a difference. */
+	if (!lands_on_cpu(0, &query))
+		return -ESRCH;
+	return poolnum_get_any(ids, result);
+}
+
+/**
+ * Removes from "magazine" a transport address whose address is "addr" (any, if NULL) and whose
+ * identifier is "l4_id" (any, if ANY_ID), and copies it to "result".
+ * The most recently cached addresses are preferred, because they're likelier to be in the cache.
+ * Assumes that the magazine's CPU has already been locked.
+ *
+ * @return whether there was such an address.
+ */
+static bool magazine_take(struct pool4_magazine *magazine, struct in_addr *addr, int l4_id,
+		struct ipv4_tuple_address *result)
+{
+	struct ipv4_tuple_address *entry;
+	unsigned int i;
+
+	for (i = magazine->count; i > 0; i--) {
+		entry = &magazine->entries[i - 1];
+		if (addr && !ipv4_addr_equals(&entry->address, addr))
+			continue;
+		if (l4_id != ANY_ID && entry->l4_id != l4_id)
+			continue;
+
+		*result = *entry;
+		magazine->count--;
+		*entry = magazine->entries[magazine->count];
+		return true;
+	}
+
+	return false;
+}
+
+/**
+ * Returns whether "magazine" is holding "addr".
+ * Assumes that the magazine's CPU has already been locked.
+ */
+static bool magazine_contains(struct pool4_magazine *magazine, struct ipv4_tuple_address *addr)
+{
+	unsigned int i;
+
+	for (i = 0; i < magazine->count; i++)
+		if (ipv4_tuple_addr_equals(&magazine->entries[i], addr))
+			return true;
+
+	return false;
+}
+
+/**
+ * Borrows up to MAGAZINE_BATCH values of class "class" from the pool, and caches them in
+ * "magazine". The addresses are chosen the same way pool4_get_any() would.
+ * Assumes that the magazine's CPU has already been locked.
+ */
+static void magazine_refill(struct pool4_magazine *magazine, int class)
+{
+	struct ipv4_tuple_address *entry;
+	struct pool4_node *node;
+	unsigned int i;
+
+	spin_lock_bh(&pool_lock);
+	for (i = 0; i < MAGAZINE_BATCH && magazine->count < MAGAZINE_SIZE; i++) {
+		node = select_node(class, NULL);
+		if (!node)
+			break;
+
+		entry = &magazine->entries[magazine->count];
+		if (poolnum_get_any(&node->ids[class], &entry->l4_id) != 0)
+			break;
+		lent(node, class);
+		entry->address = node->addr;
+		magazine->count++;
+	}
+	spin_unlock_bh(&pool_lock);
+}
+
+/**
+ * Gives MAGAZINE_BATCH of "magazine"'s values (of class "class") back to the pool.
+ * Assumes that the magazine's CPU has already been locked.
+ */
+static void magazine_drain(struct pool4_magazine *magazine, int class)
+{
+	struct ipv4_tuple_address *entry;
+	struct pool4_node *node;
+	unsigned int i;
+
+	spin_lock_bh(&pool_lock);
+	for (i = 0; i < MAGAZINE_BATCH && magazine->count > 0; i++) {
+		magazine->count--;
+		entry = &magazine->entries[magazine->count];
+		/* The address might have been removed since; then there's nothing to return to. */
+		node = pool4_table_get(&pool_table, &entry->address);
+		if (node && poolnum_return(&node->ids[class], entry->l4_id) == 0)
+			returned(node, class);
+	}
+	spin_unlock_bh(&pool_lock);
+}
+
+/**
+ * Takes from any CPU's magazine a transport address of class "class", as magazine_take() would.
+ * For when the pool doesn't have what's needed, but the magazines might.
+ * Must not be called while holding any of the pool's locks.
+ */
+static bool magazines_steal(int class, struct in_addr *addr, int l4_id,
+		struct ipv4_tuple_address *result)
+{
+	struct pool4_cpu *cpu;
+	int i;
+	bool found;
+
+	for_each_possible_cpu(i) {
+		cpu = per_cpu_ptr(cpus, i);
+		spin_lock_bh(&cpu->lock);
+		found = magazine_take(&cpu->magazines[class], addr, l4_id, result);
+		spin_unlock_bh(&cpu->lock);
+		if (found)
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * Drops "addr"'s transport addresses from every magazine.
+ * Must not be called while holding any of the pool's locks.
+ */
+static void purge_magazines(struct in_addr *addr)
+{
+	struct pool4_cpu *cpu;
+	struct pool4_magazine *magazine;
+	int i, class;
+	unsigned int j;
+
+	for_each_possible_cpu(i) {
+		cpu = per_cpu_ptr(cpus, i);
+		spin_lock_bh(&cpu->lock);
+		for (class = 0; class < CLASS_COUNT; class++) {
+			magazine = &cpu->magazines[class];
+			j = 0;
+			while (j < magazine->count) {
+				if (ipv4_addr_equals(&magazine->entries[j].address, addr)) {
+					magazine->count--;
+					magazine->entries[j] = magazine->entries[magazine->count];
+				} else {
+					j++;
+				}
+			}
+		}
+		spin_unlock_bh(&cpu->lock);
+	}
+}
+
+static bool block_key_equals(struct pool4_block_key *key1, struct pool4_block_key *key2)
+{
+	return ipv4_addr_equals(&key1->addr, &key2->addr)
+			&& key1->first == key2->first
+			&& key1->class == key2->class;
+}
+
+static __u32 block_key_hashcode(struct pool4_block_key *key, __u32 seed)
+{
+	return jhash_3words(key->addr.s_addr, key->first, key->class, seed);
+}
+
+static spinlock_t *get_pba_lock(struct in6_addr *addr)
+{
+	return &pba_locks[jhash2(addr->s6_addr32, 4, pba_seed) & (PBA_LOCKS - 1)].lock;
+}
+
+/**
+ * Writes in "key" the identifier of the block "addr" (a value of class "class") would belong to,
+ * and in "bit" the value's bit within the block's "lent" field.
+ */
+static void get_block_key(int class, struct ipv4_tuple_address *addr, struct pool4_block_key *key,
+		u64 *bit)
+{
+	__u16 step = class_ranges[class].step;
+	unsigned int index = (addr->l4_id - class_ranges[class].min) / step;
+	unsigned int offset = index & (block_size - 1);
+
+	key->addr = addr->address;
+	key->first = addr->l4_id - offset * step;
+	key->class = class;
+	*bit = 1ULL << offset;
+}
+
+/**
+ * Borrows a block of class "class" from "node", and writes its identifier in "result".
+ * Assumes that pool has already been locked (pool_lock).
+ */
+static int take_block(struct pool4_node *node, int class, struct pool4_block_key *result)
+{
+	int error;
+
+	error = poolnum_get_block(&node->ids[class], block_size, &result->first);
+	if (error)
+		return error;
+	lent(node, class);
+
+	result->addr = node->addr;
+	result->class = class;
+	return 0;
+}
+
+/**
+ * Borrows a block of class "class" from the pool, meant for "source", and writes its identifier in
+ * "result".
+ * The block comes from "addr" if it's not NULL and still has one. Otherwise, if "strict" is false,
+ * the address is chosen the same way pool4_get_any() would.
+ *
+ * @return zero on success, -ESRCH if there was no block available.
+ */
+static int reserve_block(int class, struct in6_addr *source, struct in_addr *addr, bool strict,
+		struct pool4_block_key *result)
+{
+	struct pool4_ring *ring;
+	struct pool4_node *node = NULL;
+	unsigned int i;
+	int error = -ESRCH;
+
+	spin_lock_bh(&pool_lock);
+
+	if (addr) {
+		node = pool4_table_get(&pool_table, addr);
+		if (node)
+			error = take_block(node, class, result);
+		if (error != -ESRCH || strict)
+			goto end;
+	}
+
+	node = select_node(class, source);
+	if (node)
+		error = take_block(node, class, result);
+
+	/*
+	 * The ring only says the addresses have some values left, not whole blocks. If the selected
+	 * address's are too fragmented, try the other ones (in the same order).
+	 */
+	ring = &rings[class];
+	for (i = 0; error == -ESRCH && i < ring->count; i++)
+		if (ring->nodes[i] != node)
+			error = take_block(ring->nodes[i], class, result);
+	/* Fall through. */
+
+end:
+	spin_unlock_bh(&pool_lock);
+	return error;
+}
+
+/**
+ * Gives the values of the "key" block back to the pool.
+ */
+static void unreserve_block(struct pool4_block_key *key)
+{
+	struct pool4_node *node;
+	struct poolnum *ids;
+	__u16 step = class_ranges[key->class].step;
+	unsigned int i;
+	bool was_available;
+
+	spin_lock_bh(&pool_lock);
+
+	/* The address might have been removed since; then there's nothing to return to. */
+	node = pool4_table_get(&pool_table, &key->addr);
+	if (node) {
+		ids = &node->ids[key->class];
+		was_available = (ids->free_count > 0);
+		for (i = 0; i < block_size; i++)
+			poolnum_return(ids, key->first + i * step);
+		if (!was_available && ids->free_count > 0)
+			ring_add(&rings[key->class], node);
+	}
+
+	spin_unlock_bh(&pool_lock);
+}
+
+/**
+ * Forgets "subscriber" if it doesn't have any blocks left.
+ * Assumes that the subscriber's PBA lock has already been locked.
+ */
+static void put_subscriber(struct pool4_subscriber *subscriber)
+{
+	if (!list_empty(&subscriber->blocks))
+		return;
+
+	subscriber_table_remove(&subscriber_table, &subscriber->addr, false, false);
+	kfree_rcu(subscriber, rcu);
+}
+
+/**
+ * Lends one of "source"'s block values of class "class", reserving a new block if its current
+ * ones are spent. If "addr" is not NULL, the value has to belong to that address.
+ *
+ * @return zero on success, -ESRCH if the pool doesn't have a block to spare, -ENOMEM if a kmalloc
+ *		failed.
+ */
+static int pba_get(int class, struct in6_addr *source, struct in_addr *addr,
+		struct ipv4_tuple_address *result)
+{
+	spinlock_t *lock = get_pba_lock(source);
+	struct pool4_subscriber *subscriber;
+	struct pool4_block *block;
+	struct pool4_block_key key;
+	struct in_addr *preferred;
+	unsigned int offset;
+	int error;
+
+	/* The tables are also written by the holders of other PBA locks. */
+	spin_lock_bh(lock);
+	rcu_read_lock();
+
+	subscriber = subscriber_table_get(&subscriber_table, source);
+	if (subscriber) {
+		list_for_each_entry(block, &subscriber->blocks, list_hook) {
+			if (block->key.class != class || block->lent_count == block_size)
+				continue;
+			if (addr && !ipv4_addr_equals(&block->key.addr, addr))
+				continue;
+			/* Blocks from removed addresses are only kept until their values come back. */
+			if (!pool4_table_get(&pool_table, &block->key.addr))
+				continue;
+			goto lend;
+		}
+	} else {
+		subscriber = kmalloc(sizeof(*subscriber), GFP_ATOMIC);
+		if (!subscriber) {
+			error = -ENOMEM;
+			goto end;
+		}
+		subscriber->addr = *source;
+		INIT_LIST_HEAD(&subscriber->blocks);
+		error = subscriber_table_put(&subscriber_table, &subscriber->addr, subscriber);
+		if (error) {
+			kfree(subscriber);
+			goto end;
+		}
+	}
+
+	block = kmalloc(sizeof(*block), GFP_ATOMIC);
+	if (!block) {
+		error = -ENOMEM;
+		goto abandon;
+	}
+
+	/* The node's flows should share an IPv4 address, if possible (RFC 6146 section 3.5.1). */
+	preferred = addr;
+	if (!preferred && !list_empty(&subscriber->blocks))
+		preferred = &list_first_entry(&subscriber->blocks, struct pool4_block, list_hook)->key.addr;
+
+	do {
+		error = reserve_block(class, source, preferred, addr != NULL, &key);
+		if (error) {
+			kfree(block);
+			goto abandon;
+		}
+		/*
+		 * If the address was removed and added back, its old blocks might still be around. Their
+		 * values are in use, so leave them borrowed; the old block will return them.
+		 */
+	} while (block_table_get(&block_table, &key));
+
+	block->key = key;
+	block->lent = 0;
+	block->lent_count = 0;
+	block->subscriber = subscriber;
+	error = block_table_put(&block_table, &block->key, block);
+	if (error) {
+		unreserve_block(&key);
+		kfree(block);
+		goto abandon;
+	}
+	list_add_tail(&block->list_hook, &subscriber->blocks);
+
+	log_info("PBA: %pI6c got %pI4 #%u-%u (step %u).", source, &key.addr, key.first,
+			key.first + (block_size - 1) * class_ranges[class].step, class_ranges[class].step);
+	/* Fall through. */
+
+lend:
+	offset = __ffs64(~block->lent);
+	block->lent |= 1ULL << offset;
+	block->lent_count++;
+	result->address = block->key.addr;
+	result->l4_id = block->key.first + offset * class_ranges[class].step;
+	error = 0;
+	goto end;
+
+abandon:
+	put_subscriber(subscriber);
+	/* Fall through. */
+
+end:
+	rcu_read_unlock();
+	spin_unlock_bh(lock);
+	return error;
+}
+
+/**
+ * Takes "addr" (a value of class "class") back from the block it was lent from, and gives the
+ * block back to the pool if that was its last lent value.
+ *
+ * @return zero on success, -ENOENT if "addr" was not lent from a block, -EINVAL if it belongs to a
+ *		block but it was not lent.
+ */
+static int pba_return(int class, struct ipv4_tuple_address *addr)
+{
+	struct pool4_subscriber *subscriber;
+	struct pool4_block *block;
+	struct pool4_block_key key;
+	struct in6_addr owner;
+	spinlock_t *lock;
+	u64 bit;
+
+	if (!block_size)
+		return -ENOENT;
+
+	get_block_key(class, addr, &key, &bit);
+
+	/* We need the owner to know which lock protects the block. */
+	rcu_read_lock();
+	block = block_table_get(&block_table, &key);
+	if (block)
+		owner = block->subscriber->addr;
+	rcu_read_unlock();
+	if (!block)
+		return -ENOENT;
+
+	lock = get_pba_lock(&owner);
+	spin_lock_bh(lock);
+	rcu_read_lock();
+
+	/*
+	 * If the block changed hands in the meantime, its values were all returned, this one
+	 * included.
+	 */
+	block = block_table_get(&block_table, &key);
+	if (!block || !ipv6_addr_equals(&block->subscriber->addr, &owner) || !(block->lent & bit)) {
+		rcu_read_unlock();
+		spin_unlock_bh(lock);
+		return -EINVAL;
+	}
+
+	block->lent &= ~bit;
+	block->lent_count--;
+	if (block->lent_count == 0) {
+		subscriber = block->subscriber;
+		block_table_remove(&block_table, &key, false, false);
+		list_del(&block->list_hook);
+		unreserve_block(&key);
+
+		log_info("PBA: %pI6c released %pI4 #%u-%u.", &owner, &key.addr, key.first,
+				key.first + (block_size - 1) * class_ranges[class].step);
+		kfree_rcu(block, rcu);
+		put_subscriber(subscriber);
+	}
+
+	rcu_read_unlock();
+	spin_unlock_bh(lock);
+	return 0;
 }
 
 int pool4_init(char *addr_strs[], int addr_count)
 {
 	char *defaults[] = POOL4_DEF;
-	int i;
+	int i, cpu;
 	int error;
 
 	if (!addr_strs || addr_count == 0) {
@@ -92,6 +944,35 @@ int pool4_init(char *addr_strs[], int addr_count)
 		addr_count = ARRAY_SIZE(defaults);
 	}
 
+	error = pool4_table_init(&pool_table, ipv4_addr_equals, ipv4_addr_hashcode);
+	if (error)
+		return error;
+	error = block_table_init(&block_table, block_key_equals, block_key_hashcode);
+	if (error)
+		goto block_failure;
+	error = subscriber_table_init(&subscriber_table, ipv6_addr_equals, ipv6_addr_hashcode);
+	if (error)
+		goto subscriber_failure;
+	cpus = alloc_percpu(struct pool4_cpu);
+	if (!cpus) {
+		log_err(ERR_ALLOC_FAILED, "Could not allocate the IPv4 pool's CPU caches.");
+		error = -ENOMEM;
+		goto cpu_failure;
+	}
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu_ptr(cpus, cpu)->lock);
+	for (i = 0; i < PBA_LOCKS; i++)
+		spin_lock_init(&pba_locks[i].lock);
+	get_random_bytes(&pba_seed, sizeof(pba_seed));
+	block_size = 0;
+	for (i = 0; i < RING_COUNT; i++) {
+		memset(&rings[i], 0, sizeof(rings[i]));
+		rings[i].id = i;
+	}
+	select_mode = POOL4_SELECT_ROUND_ROBIN;
+	get_random_bytes(&select_seed, sizeof(select_seed));
+	select_counter = 0;
+
 	for (i = 0; i < addr_count; i++) {
 		struct in_addr addr;
 
@@ -114,31 +995,82 @@ parse_failure:
 silent_failure:
 	pool4_destroy();
 	return error;
+
+cpu_failure:
+	subscriber_table_destroy(&subscriber_table, false, false);
+	/* Fall through. */
+
+subscriber_failure:
+	block_table_destroy(&block_table, false, false);
+	/* Fall through. */
+
+block_failure:
+	pool4_table_destroy(&pool_table, false, false);
+	return error;
+}
+
+int pool4_set_select(char *name)
+{
+	enum pool4_select mode;
+
+	if (!name || strcmp(name, "round-robin") == 0) {
+		mode = POOL4_SELECT_ROUND_ROBIN;
+	} else if (strcmp(name, "least-loaded") == 0) {
+		mode = POOL4_SELECT_LEAST_LOADED;
+	} else if (strcmp(name, "source-hash") == 0) {
+		mode = POOL4_SELECT_SOURCE_HASH;
+	} else {
+		log_err(ERR_POOL4_SELECT, "Unknown address selection mode: '%s'.", name);
+		return -EINVAL;
+	}
+
+	spin_lock_bh(&pool_lock);
+	select_mode = mode;
+	spin_unlock_bh(&pool_lock);
+	return 0;
+}
+
+int pool4_set_block_size(unsigned int size)
+{
+	if (size != 0 && (size < 2 || size > BITS_PER_LONG || !is_power_of_2(size))) {
+		log_err(ERR_POOL4_BLOCK_SIZE, "Port blocks cannot hold %u values.", size);
+		return -EINVAL;
+	}
+
+	block_size = size;
+	return 0;
+}
+
+static void release_pool4_node(struct rcu_head *rcu)
+{
+	struct pool4_node *node = container_of(rcu, struct pool4_node, rcu);
+	int class;
+
+	for (class = 0; class < CLASS_COUNT; class++)
+		poolnum_destroy(&node->ids[class]);
+	kfree(node);
 }
 
 /**
- * Assumes that pool has already been locked (pool_lock).
+ * Assumes that pool has already been locked (pool_lock), and that "node" is not in "pool_table"
+ * or "rings" anymore.
  */
 static void destroy_pool4_node(struct pool4_node *node, bool remove_from_list)
 {
 	if (remove_from_list)
 		list_del(&node->next);
 
-	poolnum_destroy(&node->udp_ports.low_even);
-	poolnum_destroy(&node->udp_ports.low_odd);
-	poolnum_destroy(&node->udp_ports.high_even);
-	poolnum_destroy(&node->udp_ports.high_odd);
-	poolnum_destroy(&node->tcp_ports.low);
-	poolnum_destroy(&node->tcp_ports.high);
-	poolnum_destroy(&node->icmp_ids);
-
-	kfree(node);
+	call_rcu(&node->rcu, release_pool4_node);
 }
 
 void pool4_destroy(void)
 {
 	struct list_head *head;
 	struct pool4_node *node;
+	int i;
+
+	/* Unlinks the nodes, but doesn't release them. */
+	pool4_table_destroy(&pool_table, false, false);
 
 	spin_lock_bh(&pool_lock);
 	while (!list_empty(&pool)) {
@@ -146,18 +1078,39 @@ void pool4_destroy(void)
 		node = container_of(head, struct pool4_node, next);
 		destroy_pool4_node(node, true);
 	}
+	for (i = 0; i < RING_COUNT; i++) {
+		kfree(rings[i].nodes);
+		rings[i].nodes = NULL;
+		rings[i].count = 0;
+		rings[i].capacity = 0;
+	}
 	spin_unlock_bh(&pool_lock);
+
+	/* Same for the blocks. Nobody's looking at them anymore, so they can go right away. */
+	block_table_destroy(&block_table, false, true);
+	subscriber_table_destroy(&subscriber_table, false, true);
+
+	/* Whatever the magazines were holding went away along with the nodes. */
+	free_percpu(cpus);
+	cpus = NULL;
+	/* The nodes are released by RCU callbacks, which live in this module. */
+	rcu_barrier();
 }
 
 int pool4_register(struct in_addr *addr)
 {
 	struct pool4_node *old_node, *new_node;
+	int i;
 	int error;
 
 	if (!addr) {
 		log_err(ERR_NULL, "NULL cannot be inserted to the pool.");
 		return -EINVAL;
 	}
+	if (determ_contains4(addr)) {
+		log_err(ERR_POOL4_DETERM, "%pI4 is reserved to the deterministic subscribers.", addr);
+		return -EINVAL;
+	}
 
 	new_node = kmalloc(sizeof(struct pool4_node), GFP_ATOMIC);
 	if (!new_node) {
@@ -167,39 +1120,42 @@ int pool4_register(struct in_addr *addr)
 	memset(new_node, 0, sizeof(*new_node));
 
 	new_node->addr = *addr;
-	error = poolnum_init(&new_node->udp_ports.low_even, 0, 1022, 2);
-	if (error)
-		goto failure;
-	error = poolnum_init(&new_node->udp_ports.low_odd, 1, 1023, 2);
-	if (error)
-		goto failure;
-	error = poolnum_init(&new_node->udp_ports.high_even, 1024, 65534, 2);
-	if (error)
-		goto failure;
-	error = poolnum_init(&new_node->udp_ports.high_odd, 1025, 65535, 2);
-	if (error)
-		goto failure;
-	error = poolnum_init(&new_node->tcp_ports.low, 0, 1023, 1);
-	if (error)
-		goto failure;
-	error = poolnum_init(&new_node->tcp_ports.high, 1024, 65535, 1);
-	if (error)
-		goto failure;
-	error = poolnum_init(&new_node->icmp_ids, 0, 65535, 1);
-	if (error)
-		goto failure;
+	for (i = 0; i < CLASS_COUNT; i++) {
+		error = poolnum_init(&new_node->ids[i], class_ranges[i].min, class_ranges[i].max,
+				class_ranges[i].step);
+		if (error)
+			goto failure;
+	}
 
 	spin_lock_bh(&pool_lock);
 
-	list_for_each_entry(old_node, &pool, next) {
-		if (ipv4_addr_equals(&old_node->addr, addr)) {
+	old_node = pool4_table_get(&pool_table, addr);
+	if (old_node) {
+		spin_unlock_bh(&pool_lock);
+		destroy_pool4_node(new_node, false);
+		log_err(ERR_POOL4_REINSERT, "The %pI4 address already belongs to the pool.", addr);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < RING_COUNT; i++) {
+		error = ring_reserve(&rings[i], rings[RING_ALL].count + 1);
+		if (error) {
 			spin_unlock_bh(&pool_lock);
 			destroy_pool4_node(new_node, false);
-			log_err(ERR_POOL4_REINSERT, "The %pI4 address already belongs to the pool.", addr);
-			return -EINVAL;
+			return error;
 		}
 	}
+
+	error = pool4_table_put(&pool_table, &new_node->addr, new_node);
+	if (error) {
+		spin_unlock_bh(&pool_lock);
+		destroy_pool4_node(new_node, false);
+		return error;
+	}
 	list_add(&new_node->next, pool.prev); /* "add to head->prev" = "add to the end of the list". */
+	/* Everything is available at first. */
+	for (i = 0; i < RING_COUNT; i++)
+		ring_add(&rings[i], new_node);
 
 	spin_unlock_bh(&pool_lock);
 	return 0;
@@ -212,6 +1168,7 @@ failure:
 int pool4_remove(struct in_addr *addr)
 {
 	struct pool4_node *node;
+	int class;
 
 	if (!addr) {
 		log_err(ERR_NULL, "NULL is not a valid address.");
@@ -227,60 +1184,176 @@ int pool4_remove(struct in_addr *addr)
 		return -ENOENT;
 	}
 
+	pool4_table_remove(&pool_table, &node->addr, false, false);
+	for (class = 0; class < CLASS_COUNT; class++)
+		if (node->ids[class].free_count > 0)
+			ring_remove(&rings[class], node);
+	ring_remove(&rings[RING_ALL], node);
 	destroy_pool4_node(node, true);
 
 	spin_unlock_bh(&pool_lock);
+
+	/*
+	 * CPUs might still lend the address's cached ports until this is done; that's no different
+	 * than them having borrowed the ports just before the removal.
+	 */
+	purge_magazines(addr);
 	return 0;
 }
 
-bool pool4_get_any(u_int8_t l4protocol, __u16 port, struct ipv4_tuple_address *result)
+/**
+ * Returns whether borrows which want to be RSS-aligned with "remote" can be served by the
+ * magazines. Magazines are filled without knowing the remote nodes, so they cannot.
+ */
+static bool rss_wanted(struct ipv4_tuple_address *remote)
+{
+	return remote && rss_is_enabled();
+}
+
+/**
+ * pool4_get_any(), minus the magazines.
+ */
+static bool get_any_from_pool(int class, u_int8_t l4protocol, struct in6_addr *source,
+		struct ipv4_tuple_address *remote, struct ipv4_tuple_address *result)
 {
+	struct pool4_ring *ring;
 	struct pool4_node *node;
+	unsigned int i;
+	int error;
 
 	spin_lock_bh(&pool_lock);
 
 	if (list_empty(&pool)) {
-		spin_unlock(&pool_lock);
+		spin_unlock_bh(&pool_lock);
 		log_err(ERR_POOL4_EMPTY, "The IPv4 pool is empty.");
 		return false;
 	}
 
-	/* Find an address with a compatible port */
-	list_for_each_entry(node, &pool, next) {
-		struct poolnum *ids;
-		int error;
+	node = select_node(class, source);
+	if (!node) {
+		spin_unlock_bh(&pool_lock);
+		return false;
+	}
 
-		ids = get_poolnum_from_pool4_node(node, l4protocol, port);
-		if (!ids) {
-			spin_unlock_bh(&pool_lock);
-			return false;
+	/* Prefer a transport address whose replies will be received by this CPU. */
+	if (rss_wanted(remote)) {
+		error = get_rss_aligned(node, class, l4protocol, remote, &result->l4_id);
+		if (!error)
+			goto success;
+
+		/* The selected address didn't have any; try the other ones (in the same order). */
+		ring = &rings[class];
+		for (i = 0; i < ring->count; i++) {
+			if (ring->nodes[i] == node)
+				continue;
+			error = get_rss_aligned(ring->nodes[i], class, l4protocol, remote, &result->l4_id);
+			if (!error) {
+				node = ring->nodes[i];
+				goto success;
+			}
 		}
+	}
 
-		error = poolnum_get_any(ids, &result->l4_id);
-		if (!error) {
-			result->address = node->addr;
-			spin_unlock_bh(&pool_lock);
-			return true;
-		}
+	/* The selected address has something left, since it is still in the ring. */
+	error = poolnum_get_any(&node->ids[class], &result->l4_id);
+	if (error) {
+		spin_unlock_bh(&pool_lock);
+		return false;
 	}
+	/* Fall through. */
 
-	/* All compatible ports are taken. Go to a corner and cry... */
+success:
+	lent(node, class);
+	result->address = node->addr;
 	spin_unlock_bh(&pool_lock);
-	return false;
+	return true;
+}
+
+bool pool4_get_any(u_int8_t l4protocol, __be16 port, struct in6_addr *source,
+		struct ipv4_tuple_address *remote, struct ipv4_tuple_address *result)
+{
+	struct pool4_cpu *cpu;
+	struct pool4_magazine *magazine;
+	int class;
+	bool found;
+
+	class = get_class(l4protocol, port);
+	if (class < 0)
+		return false;
+
+	/* If the pool has no whole blocks left, lend loose values instead. */
+	if (block_size && source && pba_get(class, source, NULL, result) == 0)
+		return true;
+
+	/*
+	 * The source hash wants a particular address, and RSS alignment depends on the remote node,
+	 * so only the other modes can use the magazines.
+	 */
+	if (rss_wanted(remote) || select_mode == POOL4_SELECT_SOURCE_HASH) {
+		if (get_any_from_pool(class, l4protocol, source, remote, result))
+			return true;
+		goto steal;
+	}
+
+	cpu = get_cpu_ptr(cpus);
+	spin_lock_bh(&cpu->lock);
+	magazine = &cpu->magazines[class];
+	if (magazine->count > 0) {
+		cpu->hits++;
+	} else {
+		cpu->misses++;
+		magazine_refill(magazine, class);
+	}
+	found = magazine_take(magazine, NULL, ANY_ID, result);
+	spin_unlock_bh(&cpu->lock);
+	put_cpu_ptr(cpus);
+
+	if (found)
+		return true;
+	/* Fall through. */
+
+steal:
+	/* The pool ran out; other CPUs might still be holding something. */
+	return magazines_steal(class, NULL, ANY_ID, result);
 }
 
 bool pool4_get_similar(u_int8_t l4protocol, struct ipv4_tuple_address *addr,
+		struct in6_addr *source, struct ipv4_tuple_address *remote,
 		struct ipv4_tuple_address *result)
 {
+	struct pool4_cpu *cpu;
 	struct pool4_node *node;
-	struct poolnum *ids;
+	int class;
 	int error;
+	bool found;
 
 	if (!addr) {
 		log_err(ERR_NULL, "NULL is not a valid address.");
 		return false;
 	}
 
+	class = get_class(l4protocol, addr->l4_id);
+	if (class < 0)
+		return false;
+
+	if (block_size && source && pba_get(class, source, &addr->address, result) == 0)
+		return true;
+
+	if (!rss_wanted(remote)) {
+		cpu = get_cpu_ptr(cpus);
+		spin_lock_bh(&cpu->lock);
+		found = magazine_take(&cpu->magazines[class], &addr->address, ANY_ID, result);
+		if (found)
+			cpu->hits++;
+		else
+			cpu->misses++;
+		spin_unlock_bh(&cpu->lock);
+		put_cpu_ptr(cpus);
+
+		if (found)
+			return true;
+	}
+
 	spin_lock_bh(&pool_lock);
 
 	node = get_pool4_node_from_addr(&addr->address);
@@ -289,12 +1362,16 @@ bool pool4_get_similar(u_int8_t l4protocol, struct ipv4_tuple_address *addr,
 		goto failure;
 	}
 
-	ids = get_poolnum_from_pool4_node(node, l4protocol, addr->l4_id);
-	if (!ids)
-		goto failure;
-	error = poolnum_get_any(ids, &result->l4_id);
+	error = -ESRCH;
+	if (rss_wanted(remote))
+		error = get_rss_aligned(node, class, l4protocol, remote, &result->l4_id);
 	if (error)
-		goto failure;
+		error = poolnum_get_any(&node->ids[class], &result->l4_id);
+	if (error) {
+		spin_unlock_bh(&pool_lock);
+		return magazines_steal(class, &addr->address, ANY_ID, result);
+	}
+	lent(node, class);
 
 	spin_unlock_bh(&pool_lock);
 	result->address = addr->address;
@@ -307,15 +1384,19 @@ failure:
 
 bool pool4_get(u_int8_t l4protocol, struct ipv4_tuple_address *addr)
 {
+	struct ipv4_tuple_address stolen;
 	struct pool4_node *node;
-	struct poolnum *ids;
-	bool success;
+	int class;
 
 	if (!addr) {
 		log_err(ERR_NULL, "NULL is not a valid address.");
 		return false;
 	}
 
+	class = get_class(l4protocol, addr->l4_id);
+	if (class < 0)
+		return false;
+
 	spin_lock_bh(&pool_lock);
 
 	node = get_pool4_node_from_addr(&addr->address);
@@ -324,12 +1405,12 @@ bool pool4_get(u_int8_t l4protocol, struct ipv4_tuple_address *addr)
 		goto failure;
 	}
 
-	ids = get_poolnum_from_pool4_node(node, l4protocol, addr->l4_id);
-	if (!ids)
-		goto failure;
-	success = poolnum_get(ids, addr->l4_id);
-	if (!success)
-		goto failure;
+	if (!poolnum_get(&node->ids[class], addr->l4_id)) {
+		/* It might be borrowed, or it might be waiting in some CPU's magazine. */
+		spin_unlock_bh(&pool_lock);
+		return magazines_steal(class, &addr->address, addr->l4_id, &stolen);
+	}
+	lent(node, class);
 
 	spin_unlock_bh(&pool_lock);
 	return true;
@@ -341,46 +1422,109 @@ failure:
 
 bool pool4_return(u_int8_t l4protocol, struct ipv4_tuple_address *addr)
 {
+	struct pool4_cpu *cpu;
+	struct pool4_magazine *magazine;
 	struct pool4_node *node;
-	struct poolnum *ids;
-	int error;
+	enum error_code error;
+	int class;
+	int pba_error;
 
 	if (!addr) {
 		log_err(ERR_NULL, "NULL is not a valid address.");
 		return false;
 	}
 
-	spin_lock_bh(&pool_lock);
+	/* Deterministic transport addresses are computed, not lent, so there's nothing to give back. */
+	if (determ_contains4(&addr->address))
+		return true;
 
-	node = get_pool4_node_from_addr(&addr->address);
-	if (!node) {
-		log_err(ERR_POOL4_NOT_FOUND, "%pI4 does not belong to the pool.", &addr->address);
-		goto failure;
+	class = get_class(l4protocol, addr->l4_id);
+	if (class < 0)
+		return false;
+
+	pba_error = pba_return(class, addr);
+	if (pba_error != -ENOENT) {
+		if (pba_error)
+			log_crit(ERR_UNKNOWN_ERROR, "Something's trying to return %pI4#%u, which was not "
+					"borrowed.", &addr->address, addr->l4_id);
+		return !pba_error;
 	}
 
-	ids = get_poolnum_from_pool4_node(node, l4protocol, addr->l4_id);
-	if (!ids)
-		goto failure;
+	cpu = get_cpu_ptr(cpus);
+	spin_lock_bh(&cpu->lock);
+	magazine = &cpu->magazines[class];
+
+	/*
+	 * Validate without pool_lock. The node cannot be released while we're in the RCU read-side
+	 * section, and purge_magazines() cannot sweep this CPU while we hold its lock, so if the
+	 * address is removed after this check, whatever we cache here is purged afterwards.
+	 * A port which was never lent is free in the pool; one which was already returned is usually
+	 * still in this magazine. (This doesn't catch every double return, but those are bugs anyway.)
+	 */
+	rcu_read_lock();
+	node = pool4_table_get(&pool_table, &addr->address);
+	if (!node)
+		error = ERR_POOL4_NOT_FOUND;
+	else if (poolnum_is_free(&node->ids[class], addr->l4_id) || magazine_contains(magazine, addr))
+		error = ERR_UNKNOWN_ERROR;
+	else
+		error = ERR_SUCCESS;
+	rcu_read_unlock();
+
+	if (error) {
+		spin_unlock_bh(&cpu->lock);
+		put_cpu_ptr(cpus);
+		if (error == ERR_POOL4_NOT_FOUND)
+			log_err(error, "%pI4 does not belong to the pool.", &addr->address);
+		else
+			log_crit(error, "Something's trying to return %pI4#%u, which was not borrowed.",
+					&addr->address, addr->l4_id);
+		return false;
+	}
 
-	error = poolnum_return(ids, addr->l4_id);
-	if (error)
-		goto failure;
+	if (magazine->count < MAGAZINE_SIZE) {
+		cpu->hits++;
+	} else {
+		cpu->misses++;
+		magazine_drain(magazine, class);
+	}
+	magazine->entries[magazine->count++] = *addr;
 
-	spin_unlock_bh(&pool_lock);
+	spin_unlock_bh(&cpu->lock);
+	put_cpu_ptr(cpus);
 	return true;
+}
 
-failure:
-	spin_unlock_bh(&pool_lock);
-	return false;
+void pool4_get_magazine_stats(struct magazine_stats *result)
+{
+	struct pool4_cpu *cpu;
+	int i, class;
+
+	memset(result, 0, sizeof(*result));
+	if (!cpus)
+		return;
+
+	for_each_possible_cpu(i) {
+		cpu = per_cpu_ptr(cpus, i);
+		spin_lock_bh(&cpu->lock);
+		result->hits += cpu->hits;
+		result->misses += cpu->misses;
+		for (class = 0; class < CLASS_COUNT; class++)
+			result->cached += cpu->magazines[class].count;
+		spin_unlock_bh(&cpu->lock);
+	}
 }
 
 bool pool4_contains(struct in_addr *addr)
 {
 	bool result;
 
-	spin_lock_bh(&pool_lock);
-	result = (get_pool4_node_from_addr(addr) != NULL);
-	spin_unlock_bh(&pool_lock);
+	if (determ_contains4(addr))
+		return true;
+
+	rcu_read_lock();
+	result = (pool4_table_get(&pool_table, addr) != NULL);
+	rcu_read_unlock();
 
 	return result;
 }
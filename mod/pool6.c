@@ -2,28 +2,101 @@
 #include "nat64/comm/constants.h"
 #include "nat64/comm/str_utils.h"
 
+#include <linux/kernel.h>
 #include <linux/inet.h>
+#include <linux/inetdevice.h>
+#include <linux/slab.h>
+#include <linux/rcupdate.h>
 #include <net/ipv6.h>
 
 
+/** Value of the trie links which point nowhere. */
+#define TRIE_NONE 0xFFFF
+
 /**
- * A prefix within the pool.
+ * A node of the trie.
+ * A node's descendants are the prefixes which start with the node's bits and are longer; they hang
+ * from the child which the bit that follows says. Nodes with one child only exist if they are
+ * prefixes from the pool, so no lookup ever visits more nodes than the pool has prefixes.
  */
-struct pool_node {
-	/** The address itself. */
-	struct ipv6_prefix prefix;
-	/** Next prefix within the pool (since they are linked listed; see pools.*). */
-	struct list_head next;
+struct trie_node {
+	/** The bits this node stands for. The rest are zero. */
+	struct in6_addr address;
+	/** Number of bits from "address" which are meaningful. */
+	__u8 len;
+	/**
+	 * Position of the node's prefix in the snapshot's "entries". TRIE_NONE if the node is not one
+	 * of the pool's prefixes; such nodes only exist to fork the paths towards their children.
+	 */
+	__u16 entry;
+	/** Positions of the node's children in the snapshot's "nodes" (TRIE_NONE if missing). */
+	__u16 children[2];
 };
 
 /**
- * The global container of the entire pool.
- * It can be a linked list because we're assuming we won't be holding too many prefixes.
- * The list contains nodes of type pool_node.
+ * A snapshot of the pool.
+ * Snapshots are never modified once they are published; configuration changes replace them.
  */
-static LIST_HEAD(pool);
+struct pool6 {
+	/** The prefixes, oldest first. */
+	struct pool6_entry *entries;
+	/** Length of "entries". */
+	unsigned int count;
+	/** The trie's nodes. A trie never needs more than twice as many nodes as it has prefixes. */
+	struct trie_node *nodes;
+	/** Number of slots from "nodes" in use. */
+	unsigned int node_count;
+	/** Position of the trie's root in "nodes". */
+	__u16 root;
+	struct rcu_head rcu;
+};
+
+/** The current snapshot. NULL means the pool is empty. */
+static struct pool6 __rcu *pool;
+/** Serializes the writers. Readers don't need it. */
 static DEFINE_SPINLOCK(pool_lock);
 
+/** Maximum number of different prefixes the pool can see while the module is loaded. */
+#define PREFIX_INDEXES 256
+
+/**
+ * Every prefix that has been registered since the module was loaded, in registration order.
+ * Sessions refer to prefixes by their index in this array, so prefixes never move and are not
+ * dropped from it when they are removed from the pool (registering them again reuses their index).
+ * Slots are written once, before their index is handed out, so they can be read without the lock.
+ * Protected by "pool_lock" otherwise.
+ */
+static struct ipv6_prefix indexed_prefixes[PREFIX_INDEXES];
+/** Number of slots from "indexed_prefixes" in use. */
+static unsigned int indexed_count;
+
+/**
+ * Returns the index "prefix" has (or has just been given) in "indexed_prefixes".
+ * Assumes "pool_lock" is held.
+ */
+static int get_index(struct ipv6_prefix *prefix, __u8 *result)
+{
+	unsigned int i;
+
+	for (i = 0; i < indexed_count; i++) {
+		if (ipv6_prefix_equals(&indexed_prefixes[i], prefix)) {
+			*result = i;
+			return 0;
+		}
+	}
+
+	if (indexed_count >= PREFIX_INDEXES) {
+		log_err(ERR_POOL6_FULL, "The IPv6 pool cannot take more than %u different prefixes.",
+				PREFIX_INDEXES);
+		return -ENOSPC;
+	}
+
+	indexed_prefixes[indexed_count] = *prefix;
+	*result = indexed_count;
+	indexed_count++;
+	return 0;
+}
+
 static bool is_prefix_len_valid(__u8 prefix_len)
 {
 	__u8 valid_lengths[] = POOL6_PREFIX_LENGTHS;
@@ -36,6 +109,166 @@ static bool is_prefix_len_valid(__u8 prefix_len)
 	return false;
 }
 
+/**
+ * Returns bit number "bit" of "addr" (zero being the most significant one).
+ */
+static unsigned int get_bit(const struct in6_addr *addr, unsigned int bit)
+{
+	return (addr->s6_addr[bit >> 3] >> (7 - (bit & 7))) & 1;
+}
+
+/**
+ * Returns a snapshot with room for "count" prefixes, and an empty trie.
+ */
+static struct pool6 *snapshot_alloc(unsigned int count)
+{
+	struct pool6 *result;
+
+	result = kmalloc(sizeof(*result) + count * sizeof(*result->entries)
+			+ 2 * count * sizeof(*result->nodes), GFP_ATOMIC);
+	if (!result) {
+		log_err(ERR_ALLOC_FAILED, "Allocation of IPv6 pool snapshot failed.");
+		return NULL;
+	}
+
+	result->entries = (struct pool6_entry *) (result + 1);
+	result->count = count;
+	result->nodes = (struct trie_node *) (result->entries + count);
+	result->node_count = 0;
+	result->root = TRIE_NONE;
+
+	return result;
+}
+
+/**
+ * Appends a node to "snapshot"'s trie, and returns its position.
+ */
+static __u16 trie_node_add(struct pool6 *snapshot, struct in6_addr *addr, __u8 len, __u16 entry)
+{
+	struct trie_node *node = &snapshot->nodes[snapshot->node_count];
+
+	ipv6_addr_prefix(&node->address, addr, len);
+	node->len = len;
+	node->entry = entry;
+	node->children[0] = TRIE_NONE;
+	node->children[1] = TRIE_NONE;
+
+	return snapshot->node_count++;
+}
+
+/**
+ * Inserts snapshot->entries[entry] in "snapshot"'s trie.
+ * The prefix's host bits have to be zero, and it cannot already be in the trie.
+ */
+static void trie_add(struct pool6 *snapshot, __u16 entry)
+{
+	struct ipv6_prefix *prefix = &snapshot->entries[entry].prefix;
+	__u16 *link = &snapshot->root;
+	struct trie_node *node;
+	unsigned int common;
+	__u16 fork;
+
+	while (*link != TRIE_NONE) {
+		node = &snapshot->nodes[*link];
+		common = ipv6_addr_diff(&node->address, &prefix->address);
+		common = min3(common, (unsigned int) node->len, (unsigned int) prefix->len);
+
+		if (common == node->len) {
+			if (node->len == prefix->len) {
+				/* It's a fork, and the prefix happens to be its bits. */
+				node->entry = entry;
+				return;
+			}
+			/* The prefix is one of the node's descendants. */
+			link = &node->children[get_bit(&prefix->address, node->len)];
+			continue;
+		}
+
+		/* The node and the prefix part ways after "common" bits. Join them there. */
+		if (common == prefix->len) {
+			fork = trie_node_add(snapshot, &prefix->address, prefix->len, entry);
+		} else {
+			fork = trie_node_add(snapshot, &prefix->address, common, TRIE_NONE);
+			snapshot->nodes[fork].children[get_bit(&prefix->address, common)] =
+					trie_node_add(snapshot, &prefix->address, prefix->len, entry);
+		}
+		snapshot->nodes[fork].children[get_bit(&node->address, common)] = *link;
+		*link = fork;
+		return;
+	}
+
+	*link = trie_node_add(snapshot, &prefix->address, prefix->len, entry);
+}
+
+/**
+ * Returns the longest prefix from "snapshot" "addr" belongs to (NULL if there's none).
+ */
+static struct pool6_entry *trie_find(struct pool6 *snapshot, struct in6_addr *addr)
+{
+	struct pool6_entry *result = NULL;
+	struct trie_node *node;
+	__u16 i;
+
+	for (i = snapshot->root; i != TRIE_NONE; i = node->children[get_bit(addr, node->len)]) {
+		node = &snapshot->nodes[i];
+		if (!ipv6_prefix_equal(&node->address, addr, node->len))
+			break;
+		if (node->entry != TRIE_NONE)
+			result = &snapshot->entries[node->entry];
+	}
+
+	return result;
+}
+
+/**
+ * Builds "snapshot"'s trie and makes the snapshot the pool (NULL empties it).
+ * Assumes "pool_lock" is held.
+ */
+static void publish(struct pool6 *snapshot)
+{
+	struct pool6 *old = rcu_dereference_protected(pool, lockdep_is_held(&pool_lock));
+	unsigned int i;
+
+	if (snapshot)
+		for (i = 0; i < snapshot->count; i++)
+			trie_add(snapshot, i);
+
+	rcu_assign_pointer(pool, snapshot);
+	if (old)
+		kfree_rcu(old, rcu);
+}
+
+/**
+ * Parses "str" as a prefix, optionally followed by "=" and its pool4 subset.
+ */
+static int parse_entry(char *str, struct ipv6_prefix *prefix, struct ipv4_prefix *pool4)
+{
+	const char *slash_pos;
+	char *end;
+	unsigned long len;
+
+	if (in6_pton(str, -1, (u8 *) &prefix->address, '/', &slash_pos) != 1 || *slash_pos != '/')
+		return -EINVAL;
+	/* kstrtou8() would choke on the subset. */
+	len = simple_strtoul(slash_pos + 1, &end, 10);
+	if (end == slash_pos + 1 || len > 128)
+		return -EINVAL;
+	prefix->len = len;
+
+	pool4->address.s_addr = 0;
+	pool4->len = 0;
+	if (*end == '\0')
+		return 0;
+	if (*end != '=')
+		return -EINVAL;
+
+	if (in4_pton(end + 1, -1, (u8 *) &pool4->address, '/', &slash_pos) != 1
+			|| *slash_pos != '/' || kstrtou8(slash_pos + 1, 0, &pool4->len) != 0)
+		return -EINVAL;
+
+	return 0;
+}
+
 int pool6_init(char *pref_strs[], int pref_count)
 {
 	char *defaults[] = POOL6_DEF;
@@ -48,14 +281,12 @@ int pool6_init(char *pref_strs[], int pref_count)
 
 	for (i = 0; i < pref_count; i++) {
 		struct ipv6_prefix pref;
-		const char *slash_pos;
+		struct ipv4_prefix pool4;
 
-		if (in6_pton(pref_strs[i], -1, (u8 *) &pref.address.in6_u.u6_addr8, '/', &slash_pos) != 1)
-			goto parse_failure;
-		if (kstrtou8(slash_pos + 1, 0, &pref.len) != 0)
+		if (parse_entry(pref_strs[i], &pref, &pool4) != 0)
 			goto parse_failure;
 		log_debug("Inserting prefix to the IPv6 pool: %pI6c/%u.", &pref.address, pref.len);
-		if (pool6_register(&pref) != 0)
+		if (pool6_register(&pref, &pool4) != 0)
 			goto silent_failure;
 	}
 
@@ -73,17 +304,18 @@ silent_failure:
 void pool6_destroy(void)
 {
 	spin_lock_bh(&pool_lock);
-	while (!list_empty(&pool)) {
-		struct pool_node *node = container_of(pool.next, struct pool_node, next);
-		list_del(&node->next);
-		kfree(node);
-	}
+	publish(NULL);
+	/* There are no sessions left to refer to the indexes. */
+	indexed_count = 0;
 	spin_unlock_bh(&pool_lock);
 }
 
-int pool6_register(struct ipv6_prefix *prefix)
+int pool6_register(struct ipv6_prefix *prefix, struct ipv4_prefix *pool4)
 {
-	struct pool_node *node;
+	struct pool6 *old, *new;
+	struct pool6_entry entry;
+	unsigned int count, i;
+	int error;
 
 	if (!prefix) {
 		log_err(ERR_NULL, "NULL is not a valid prefix.");
@@ -95,112 +327,217 @@ int pool6_register(struct ipv6_prefix *prefix)
 				prefix->len);
 		return -EINVAL;
 	}
+	if (pool4 && pool4->len != 0 && (pool4->len < POOL6_SUBSET_MIN_LEN || pool4->len > 32)) {
+		log_err(ERR_POOL6_SUBSET, "%pI4/%u is not a valid pool4 subset (it has to be a /%u or "
+				"longer).", &pool4->address, pool4->len, POOL6_SUBSET_MIN_LEN);
+		return -EINVAL;
+	}
 
-	node = kmalloc(sizeof(struct pool_node), GFP_ATOMIC);
-	if (!node) {
-		log_err(ERR_ALLOC_FAILED, "Allocation of IPv6 pool node failed.");
+	/* Ignore the host bits, if the user wrote any. */
+	ipv6_addr_prefix(&entry.prefix.address, &prefix->address, prefix->len);
+	entry.prefix.len = prefix->len;
+	entry.pool4.len = pool4 ? pool4->len : 0;
+	entry.pool4.address.s_addr = entry.pool4.len
+			? (pool4->address.s_addr & inet_make_mask(entry.pool4.len))
+			: 0;
+
+	spin_lock_bh(&pool_lock);
+
+	old = rcu_dereference_protected(pool, lockdep_is_held(&pool_lock));
+	count = old ? old->count : 0;
+	for (i = 0; i < count; i++) {
+		if (ipv6_prefix_equals(&old->entries[i].prefix, &entry.prefix)) {
+			spin_unlock_bh(&pool_lock);
+			log_err(ERR_POOL6_REINSERT, "%pI6c/%u is already part of the pool.",
+					&entry.prefix.address, entry.prefix.len);
+			return -EEXIST;
+		}
+	}
+
+	new = snapshot_alloc(count + 1);
+	if (!new) {
+		spin_unlock_bh(&pool_lock);
 		return -ENOMEM;
 	}
 
-	node->prefix = *prefix;
+	error = get_index(&entry.prefix, &entry.index);
+	if (error) {
+		spin_unlock_bh(&pool_lock);
+		kfree(new);
+		return error;
+	}
 
-	spin_lock_bh(&pool_lock);
-	list_add(&node->next, pool.prev);
-	spin_unlock_bh(&pool_lock);
+	if (old)
+		memcpy(new->entries, old->entries, count * sizeof(*old->entries));
+	new->entries[count] = entry;
+	publish(new);
 
+	spin_unlock_bh(&pool_lock);
 	return 0;
 }
 
 int pool6_remove(struct ipv6_prefix *prefix)
 {
-	struct pool_node *node;
+	struct ipv6_prefix key;
+	struct pool6 *old, *new = NULL;
+	unsigned int i;
 
 	if (!prefix) {
 		log_err(ERR_NULL, "NULL is not a valid prefix.");
 		return -EINVAL;
 	}
 
+	ipv6_addr_prefix(&key.address, &prefix->address, prefix->len);
+	key.len = prefix->len;
+
 	spin_lock_bh(&pool_lock);
 
-	if (list_empty(&pool)) {
+	old = rcu_dereference_protected(pool, lockdep_is_held(&pool_lock));
+	if (!old) {
 		spin_unlock_bh(&pool_lock);
 		log_err(ERR_POOL6_EMPTY, "The IPv6 pool is empty.");
 		return -EINVAL;
 	}
 
-	list_for_each_entry(node, &pool, next) {
-		if (ipv6_prefix_equals(&node->prefix, prefix)) {
-			list_del(&node->next);
-			kfree(node);
+	for (i = 0; i < old->count; i++)
+		if (ipv6_prefix_equals(&old->entries[i].prefix, &key))
+			break;
+	if (i == old->count) {
+		spin_unlock_bh(&pool_lock);
+		log_err(ERR_POOL6_NOT_FOUND, "The prefix is not part of the pool.");
+		return -ENOENT;
+	}
+
+	if (old->count > 1) {
+		new = snapshot_alloc(old->count - 1);
+		if (!new) {
 			spin_unlock_bh(&pool_lock);
-			return 0;
+			return -ENOMEM;
 		}
+		memcpy(new->entries, old->entries, i * sizeof(*old->entries));
+		memcpy(new->entries + i, old->entries + i + 1,
+				(old->count - i - 1) * sizeof(*old->entries));
 	}
-	spin_unlock_bh(&pool_lock);
+	publish(new);
 
-	log_err(ERR_POOL6_NOT_FOUND, "The prefix is not part of the pool.");
-	return -ENOENT;
+	spin_unlock_bh(&pool_lock);
+	return 0;
 }
 
 bool pool6_contains(struct in6_addr *address)
 {
-	struct pool_node *node;
+	struct pool6 *snapshot;
+	bool result;
 
 	if (!address) {
 		log_err(ERR_NULL, "NULL is not a valid address.");
 		return false;
 	}
 
-	spin_lock_bh(&pool_lock);
+	rcu_read_lock();
 
-	if (list_empty(&pool)) {
-		spin_unlock_bh(&pool_lock);
+	snapshot = rcu_dereference(pool);
+	if (!snapshot) {
+		rcu_read_unlock();
 		log_err(ERR_POOL6_EMPTY, "The IPv6 pool is empty.");
 		return false;
 	}
 
-	list_for_each_entry(node, &pool, next) {
-		if (ipv6_prefix_equal(&node->prefix.address, address, node->prefix.len)) {
-			spin_unlock_bh(&pool_lock);
-			return true;
-		}
-	}
-	spin_unlock_bh(&pool_lock);
-	return false;
+	result = (trie_find(snapshot, address) != NULL);
+
+	rcu_read_unlock();
+	return result;
+}
+
+bool pool6_get(struct in6_addr *address, struct pool6_entry *result)
+{
+	struct pool6 *snapshot;
+	struct pool6_entry *entry = NULL;
+
+	rcu_read_lock();
+	snapshot = rcu_dereference(pool);
+	if (snapshot)
+		entry = trie_find(snapshot, address);
+	if (entry)
+		*result = *entry;
+	rcu_read_unlock();
+
+	return entry != NULL;
+}
+
+bool pool6_get_index(struct in6_addr *address, struct ipv6_prefix *prefix, __u8 *index)
+{
+	struct pool6_entry entry;
+
+	if (!pool6_get(address, &entry))
+		return false;
+
+	*prefix = entry.prefix;
+	*index = entry.index;
+	return true;
+}
+
+struct ipv6_prefix *pool6_get_by_index(__u8 index)
+{
+	return &indexed_prefixes[index];
 }
 
 bool pool6_peek(struct ipv6_prefix *out)
 {
-	struct pool_node *node;
+	struct pool6 *snapshot;
 
-	spin_lock_bh(&pool_lock);
+	rcu_read_lock();
 
-	if (list_empty(&pool)) {
-		spin_unlock_bh(&pool_lock);
+	snapshot = rcu_dereference(pool);
+	if (!snapshot) {
+		rcu_read_unlock();
 		log_err(ERR_POOL6_EMPTY, "The IPv6 pool is empty.");
 		return false;
 	}
 
-	node = container_of(pool.next, struct pool_node, next);
-	*out = node->prefix;
+	*out = snapshot->entries[0].prefix;
 
-	spin_unlock_bh(&pool_lock);
+	rcu_read_unlock();
 	return true;
 }
 
-int pool6_for_each(int (*func)(struct ipv6_prefix *, void *), void * arg)
+bool pool6_peek_by_pool4(struct in_addr *addr, struct ipv6_prefix *out)
 {
-	struct pool_node *node;
-
-	spin_lock_bh(&pool_lock);
-	list_for_each_entry(node, &pool, next) {
-		int error = func(&node->prefix, arg);
-		if (error) {
-			spin_unlock_bh(&pool_lock);
-			return error;
-		}
+	struct pool6 *snapshot;
+	struct pool6_entry *entry, *best = NULL;
+	unsigned int i;
+
+	rcu_read_lock();
+
+	snapshot = rcu_dereference(pool);
+	for (i = 0; snapshot && i < snapshot->count; i++) {
+		entry = &snapshot->entries[i];
+		if (!ipv4_prefix_contains(&entry->pool4, addr))
+			continue;
+		if (!best || entry->pool4.len > best->pool4.len)
+			best = entry;
 	}
-	spin_unlock_bh(&pool_lock);
+	if (best)
+		*out = best->prefix;
 
-	return 0;
+	rcu_read_unlock();
+
+	if (!best)
+		log_err(ERR_POOL6_EMPTY, "The IPv6 pool has no prefixes for %pI4.", addr);
+	return best != NULL;
+}
+
+int pool6_for_each(int (*func)(struct pool6_entry *, void *), void * arg)
+{
+	struct pool6 *snapshot;
+	unsigned int i;
+	int error = 0;
+
+	rcu_read_lock();
+	snapshot = rcu_dereference(pool);
+	for (i = 0; snapshot && i < snapshot->count && !error; i++)
+		error = func(&snapshot->entries[i], arg);
+	rcu_read_unlock();
+
+	return error;
 }
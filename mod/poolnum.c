@@ -1,108 +1,337 @@
 #include "nat64/mod/poolnum.h"
 
 #include <linux/slab.h>
+#include <linux/bitops.h>
+#include <linux/bitmap.h>
+#include <linux/jhash.h>
 
 #include "nat64/comm/types.h"
 #include "nat64/mod/random.h"
 
 
-static int random_by_range(u16 min, u16 max)
-{
-	u32 random_num = get_random_u32();
-	return min + random_num % (max - min + 1);
-}
+/** Rounds of the Feistel network. Four are enough for it to look like a random permutation. */
+#define FEISTEL_ROUNDS 4
 
 int poolnum_init(struct poolnum *pool, u16 min, u16 max, u16 step)
 {
-	u32 i, j;
-
 	if (min > max) {
 		u16 temp = min;
 		min = max;
 		max = temp;
 	}
+	if (step == 0)
+		return -EINVAL;
+
+	pool->min = min;
+	pool->step = step;
+	pool->count = (max - min) / step + 1;
+	pool->free_count = pool->count;
+	pool->words = BITS_TO_LONGS(pool->count);
+	pool->bitmap = NULL;
+	pool->summary = NULL;
+
+	/* The smallest even number of bits that can represent every index. */
+	pool->half_bits = 1;
+	while ((1U << (2 * pool->half_bits)) < pool->count)
+		pool->half_bits++;
+	pool->key = 0;
+	pool->cursor = 0;
+
+	return 0;
+}
+
+/**
+ * Allocates "pool"'s bitmaps, if that hasn't been done yet.
+ */
+static int materialize(struct poolnum *pool)
+{
+	u32 summary_words;
 
-	/* TODO (fine) this looks like it could be optimized using some formula. */
-	pool->count = 0;
-	for (i = min; i <= max; i += step)
-		pool->count++;
+	if (pool->bitmap)
+		return 0;
 
-	pool->array = kmalloc(pool->count * sizeof(u16), GFP_ATOMIC);
-	if (!pool->array)
+	/* Both bitmaps share the allocation; the summary goes right after the values. */
+	summary_words = BITS_TO_LONGS(pool->words);
+	pool->bitmap = kmalloc((pool->words + summary_words) * sizeof(unsigned long), GFP_ATOMIC);
+	if (!pool->bitmap)
 		return -ENOMEM;
-	/* Initialize and shuffle the numbers (http://en.wikipedia.org/wiki/Fisher-Yates_shuffle). */
-	pool->array[0] = min;
-	for (i = 1; i < pool->count; i++) {
-		j = random_by_range(0, i);
-		pool->array[i] = pool->array[j];
-		pool->array[j] = min + step * i;
-	}
+	pool->summary = pool->bitmap + pool->words;
 
-	pool->next = 0;
-	pool->returned = 0;
-	pool->next_is_ahead = false;
+	/* bitmap_fill() leaves the bits beyond the last value clear, so they are never handed out. */
+	bitmap_fill(pool->bitmap, pool->count);
+	bitmap_fill(pool->summary, pool->words);
 
+	pool->key = get_random_u32();
 	return 0;
 }
 
 void poolnum_destroy(struct poolnum *pool)
 {
 	if (pool)
-		kfree(pool->array);
+		kfree(pool->bitmap);
+}
+
+/**
+ * Writes the index of "value" within "pool" in "index". Returns false if "value" is not part of
+ * the pool.
+ */
+static bool value_to_index(struct poolnum *pool, u16 value, u32 *index)
+{
+	u32 offset;
+
+	if (value < pool->min)
+		return false;
+	offset = value - pool->min;
+	if (offset % pool->step != 0)
+		return false;
+	offset /= pool->step;
+	if (offset >= pool->count)
+		return false;
+
+	*index = offset;
+	return true;
 }
 
-static u32 get_next_index(u32 index, u32 max)
+static u16 index_to_value(struct poolnum *pool, u32 index)
 {
-	index++;
-	if (index >= max)
-		index = 0;
+	return pool->min + index * pool->step;
+}
+
+/**
+ * Returns the index of the first available value at or after "start", wrapping around.
+ * The pool must not be exhausted.
+ */
+static u32 find_free(struct poolnum *pool, u32 start)
+{
+	u32 word = BIT_WORD(start);
+	unsigned long bits;
+
+	/* Most of the time, there's something left in the start's own word. */
+	bits = pool->bitmap[word] & (~0UL << (start % BITS_PER_LONG));
+	if (bits)
+		return word * BITS_PER_LONG + __ffs(bits);
+
+	word = find_next_bit(pool->summary, pool->words, word + 1);
+	if (word >= pool->words)
+		word = find_first_bit(pool->summary, pool->words);
+
+	return word * BITS_PER_LONG + __ffs(pool->bitmap[word]);
+}
+
+/**
+ * Encrypts "plaintext" (a number of 2 * "pool->half_bits" bits) using "pool"'s key.
+ * Different plaintexts always yield different ciphertexts.
+ */
+static u32 permute(struct poolnum *pool, u32 plaintext)
+{
+	u32 mask = (1U << pool->half_bits) - 1;
+	u32 left = plaintext >> pool->half_bits;
+	u32 right = plaintext & mask;
+	u32 temp;
+	unsigned int round;
+
+	for (round = 0; round < FEISTEL_ROUNDS; round++) {
+		temp = right;
+		right = left ^ (jhash_2words(right, round, pool->key) & mask);
+		left = temp;
+	}
+
+	return (left << pool->half_bits) | right;
+}
+
+/**
+ * Returns the index where the next random borrow should start looking.
+ * Over 4^"half_bits" consecutive calls, every index is returned exactly once.
+ */
+static u32 next_start(struct poolnum *pool)
+{
+	u32 domain_mask = (1U << (2 * pool->half_bits)) - 1;
+	u32 index;
+
+	/*
+	 * The permutation's domain can be up to four times larger than the pool, so skip the indexes
+	 * that don't exist (cycle-walking). Every index does exist for most of the domain, so this
+	 * usually ends on the first iteration.
+	 */
+	do {
+		index = permute(pool, pool->cursor);
+		pool->cursor = (pool->cursor + 1) & domain_mask;
+	} while (index >= pool->count);
+
 	return index;
 }
 
+static void take(struct poolnum *pool, u32 index)
+{
+	u32 word = BIT_WORD(index);
+
+	__clear_bit(index, pool->bitmap);
+	if (!pool->bitmap[word])
+		__clear_bit(word, pool->summary);
+	pool->free_count--;
+}
+
 int poolnum_get_any(struct poolnum *pool, u16 *result)
 {
-	if (pool->next_is_ahead && pool->next == pool->returned)
+	u32 index;
+	int error;
+
+	if (pool->free_count == 0)
 		return -ESRCH; /* We ran out of values. */
+	error = materialize(pool);
+	if (error)
+		return error;
 
-	*result = pool->array[pool->next];
-	pool->next = get_next_index(pool->next, pool->count);
-	pool->next_is_ahead = true;
+	index = find_free(pool, next_start(pool));
+	take(pool, index);
+	*result = index_to_value(pool, index);
 	return 0;
 }
 
+int poolnum_get_matching(struct poolnum *pool, bool (*matches)(u16, void *), void *arg,
+		u32 max_attempts, u16 *result)
+{
+	u32 index;
+	u16 value;
+	int error;
+
+	if (pool->free_count == 0)
+		return -ESRCH;
+	error = materialize(pool);
+	if (error)
+		return error;
+
+	/* Available values are visited in order, so there's no point in testing more than there are. */
+	if (max_attempts > pool->free_count)
+		max_attempts = pool->free_count;
+
+	index = next_start(pool);
+	while (max_attempts--) {
+		index = find_free(pool, index);
+		value = index_to_value(pool, index);
+		if (matches(value, arg)) {
+			take(pool, index);
+			*result = value;
+			return 0;
+		}
+
+		index++;
+		if (index >= pool->count)
+			index = 0;
+	}
+
+	return -ESRCH;
+}
+
 bool poolnum_get(struct poolnum *pool, u16 value)
 {
-	u32 current_index;
+	u32 index;
 
-	if (pool->next_is_ahead && pool->next == pool->returned)
+	if (!value_to_index(pool, value, &index))
+		return false;
+	if (materialize(pool) != 0)
+		return false;
+	if (!test_bit(index, pool->bitmap))
 		return false;
 
-	current_index = pool->next;
-	do {
-		if (pool->array[current_index] == value) {
-			pool->array[current_index] = pool->array[pool->next];
-			pool->next = get_next_index(pool->next, pool->count);
-			pool->next_is_ahead = true;
-			return true;
+	take(pool, index);
+	return true;
+}
+
+/**
+ * Returns the bits of "word" which start an aligned run of "size" set bits.
+ * "size" has to be a power of two no larger than BITS_PER_LONG.
+ */
+static unsigned long block_starts(unsigned long word, unsigned int size)
+{
+	unsigned long pattern;
+	unsigned int shift;
+
+	/* After this, bit i is set if bits i through i + size - 1 were. */
+	for (shift = 1; shift < size; shift <<= 1)
+		word &= word >> shift;
+
+	/* One bit at every multiple of "size". */
+	pattern = (size < BITS_PER_LONG) ? (~0UL / ((1UL << size) - 1)) : 1UL;
+	return word & pattern;
+}
+
+int poolnum_get_block(struct poolnum *pool, unsigned int size, u16 *result)
+{
+	u32 start, word, index;
+	unsigned long starts;
+	bool wrapped;
+	int error;
+
+	if (size == 0 || size > BITS_PER_LONG || (size & (size - 1)) != 0)
+		return -EINVAL;
+	if (pool->free_count < size)
+		return -ESRCH;
+	error = materialize(pool);
+	if (error)
+		return error;
+
+	/*
+	 * Blocks are aligned, so none of them straddles two words. Visit the words which have
+	 * something left, starting at a random one.
+	 */
+	start = BIT_WORD(next_start(pool));
+	word = start;
+	wrapped = false;
+	while (true) {
+		word = find_next_bit(pool->summary, pool->words, word);
+		if (word >= pool->words) {
+			if (wrapped)
+				break;
+			wrapped = true;
+			word = find_first_bit(pool->summary, pool->words);
 		}
-		current_index = get_next_index(current_index, pool->count);
-	} while (current_index != pool->returned);
+		if (wrapped && word >= start)
+			break;
+
+		starts = block_starts(pool->bitmap[word], size);
+		if (starts) {
+			index = word * BITS_PER_LONG + __ffs(starts);
+			bitmap_clear(pool->bitmap, index, size);
+			if (!pool->bitmap[word])
+				__clear_bit(word, pool->summary);
+			pool->free_count -= size;
+			*result = index_to_value(pool, index);
+			return 0;
+		}
+
+		word++;
+	}
+
+	return -ESRCH;
+}
+
+bool poolnum_is_free(struct poolnum *pool, u16 value)
+{
+	u32 index;
 
-	return false;
+	if (!value_to_index(pool, value, &index))
+		return false;
+	return pool->bitmap ? test_bit(index, pool->bitmap) : true;
 }
 
 int poolnum_return(struct poolnum *pool, u16 value)
 {
-	if (!pool->next_is_ahead && pool->returned == pool->next) {
-		log_crit(ERR_UNKNOWN_ERROR, "Something's trying to return values that were originally "
-				"not part of the pool.");
+	u32 index;
+
+	if (!value_to_index(pool, value, &index)) {
+		log_crit(ERR_UNKNOWN_ERROR, "Something's trying to return %u, which was originally "
+				"not part of the pool.", value);
+		return -EINVAL;
+	}
+	if (!pool->bitmap || test_bit(index, pool->bitmap)) {
+		log_crit(ERR_UNKNOWN_ERROR, "Something's trying to return %u, which was not borrowed.",
+				value);
 		return -EINVAL;
 	}
 
-	pool->array[pool->returned] = value;
-	pool->returned = get_next_index(pool->returned, pool->count);
-	if (pool->next == pool->returned)
-		pool->next_is_ahead = false;
-
+	__set_bit(index, pool->bitmap);
+	__set_bit(BIT_WORD(index), pool->summary);
+	pool->free_count++;
 	return 0;
 }
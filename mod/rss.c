@@ -0,0 +1,157 @@
+#include "nat64/mod/rss.h"
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/cpumask.h>
+#include <linux/in.h>
+
+
+/** Length of the hash input of an IPv4 packet: both addresses, then both ports. */
+#define INPUT_LEN 12
+
+/**
+ * windows[i] is the 32-bit portion of the key which starts at bit "i". The Toeplitz hash is the
+ * XOR of the windows of the input bits which are set, so precomputing them is all the hash needs
+ * from the key.
+ */
+static __u32 windows[INPUT_LEN * 8];
+/** The CPU each entry of the NIC's indirection table is served by. */
+static int indirection_table[RSS_INDIR_MAX_LEN];
+/** Length of "indirection_table". Zero means RSS awareness is disabled. */
+static unsigned int indirection_len;
+
+
+/**
+ * Parses "str" (colon-separated pairs of hexadecimal digits) into "key".
+ */
+static int parse_key(char *str, u8 *key, unsigned int *key_len)
+{
+	int high, low;
+
+	*key_len = 0;
+	while (*str) {
+		if (*key_len >= RSS_KEY_MAX_LEN) {
+			log_err(ERR_RSS_CONFIG, "The RSS key is longer than %u bytes.", RSS_KEY_MAX_LEN);
+			return -EINVAL;
+		}
+
+		high = hex_to_bin(str[0]);
+		low = (high >= 0) ? hex_to_bin(str[1]) : -1;
+		if (high < 0 || low < 0) {
+			log_err(ERR_RSS_CONFIG, "The RSS key is malformed near '%s'.", str);
+			return -EINVAL;
+		}
+
+		key[(*key_len)++] = (high << 4) | low;
+		str += 2;
+		if (*str == ':')
+			str++;
+	}
+
+	return 0;
+}
+
+static __u32 hash_bytes(u8 *input, unsigned int len)
+{
+	__u32 result = 0;
+	unsigned int i, bit;
+
+	for (i = 0; i < len; i++)
+		for (bit = 0; bit < 8; bit++)
+			if (input[i] & (0x80 >> bit))
+				result ^= windows[8 * i + bit];
+
+	return result;
+}
+
+int rss_init(char *key_str, int *indirection, int indirection_count)
+{
+	u8 key[RSS_KEY_MAX_LEN];
+	unsigned int key_len, byte, shift, i;
+	u64 window;
+	int error;
+
+	indirection_len = 0;
+
+	if ((!key_str || !*key_str) && indirection_count == 0)
+		return 0; /* RSS awareness was not requested. */
+	if (!key_str || !*key_str || indirection_count == 0) {
+		log_err(ERR_RSS_CONFIG, "RSS awareness needs both the key and the indirection table.");
+		return -EINVAL;
+	}
+	if (indirection_count > RSS_INDIR_MAX_LEN) {
+		log_err(ERR_RSS_CONFIG, "The indirection table has more than %u entries.",
+				RSS_INDIR_MAX_LEN);
+		return -EINVAL;
+	}
+
+	error = parse_key(key_str, key, &key_len);
+	if (error)
+		return error;
+	/* Hashing the last input bit requires the 32 key bits that start there. */
+	if (key_len < INPUT_LEN + 4) {
+		log_err(ERR_RSS_CONFIG, "The RSS key needs at least %u bytes.", INPUT_LEN + 4);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < indirection_count; i++) {
+		if (indirection[i] < 0 || indirection[i] >= nr_cpu_ids) {
+			log_err(ERR_RSS_CONFIG, "Indirection table entry %u points to nonexistent CPU %d.",
+					i, indirection[i]);
+			return -EINVAL;
+		}
+		indirection_table[i] = indirection[i];
+	}
+
+	for (i = 0; i < ARRAY_SIZE(windows); i++) {
+		byte = i / 8;
+		shift = i % 8;
+		window = ((u64) key[byte] << 32) | ((u64) key[byte + 1] << 24)
+				| ((u64) key[byte + 2] << 16) | ((u64) key[byte + 3] << 8)
+				| (u64) key[byte + 4];
+		windows[i] = (__u32) (window >> (8 - shift));
+	}
+
+	indirection_len = indirection_count;
+	return 0;
+}
+
+void rss_destroy(void)
+{
+	indirection_len = 0;
+}
+
+bool rss_is_enabled(void)
+{
+	return indirection_len != 0;
+}
+
+__u32 rss_hash_ipv4(struct ipv4_tuple_address *src, struct ipv4_tuple_address *dst,
+		u_int8_t l4protocol)
+{
+	u8 input[INPUT_LEN];
+	__be16 port;
+
+	memcpy(&input[0], &src->address, 4);
+	memcpy(&input[4], &dst->address, 4);
+
+	switch (l4protocol) {
+	case IPPROTO_TCP:
+	case IPPROTO_UDP:
+		port = cpu_to_be16(src->l4_id);
+		memcpy(&input[8], &port, 2);
+		port = cpu_to_be16(dst->l4_id);
+		memcpy(&input[10], &port, 2);
+		return hash_bytes(input, INPUT_LEN);
+	}
+
+	return hash_bytes(input, 8);
+}
+
+int rss_get_cpu_ipv4(struct ipv4_tuple_address *src, struct ipv4_tuple_address *dst,
+		u_int8_t l4protocol)
+{
+	if (!indirection_len)
+		return -1;
+	return indirection_table[rss_hash_ipv4(src, dst, l4protocol) % indirection_len];
+}
@@ -1,10 +1,19 @@
 #include "nat64/mod/session.h"
 #include "nat64/comm/constants.h"
 #include "nat64/mod/pool4.h"
+#include "nat64/mod/pool6.h"
+#include "nat64/mod/rfc6052.h"
+#include "nat64/mod/entry_cache.h"
 
 #include <linux/module.h>
 #include <linux/printk.h>
 #include <linux/timer.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+#include <linux/cpumask.h>
+#include <linux/topology.h>
+#include <linux/log2.h>
 
 
 /********************************************
@@ -18,7 +27,10 @@
 #define HTABLE_NAME ipv4_table
 #define KEY_TYPE struct ipv4_pair
 #define VALUE_TYPE struct session_entry
+#define NODE_MEMBER ipv4_hook
+#define KEY_FUNCTION session_get_ipv4
 #define GENERATE_FOR_EACH
+#define GENERATE_FIND
 #include "hash_table.c"
 
 /*
@@ -28,6 +40,9 @@
 #define HTABLE_NAME ipv6_table
 #define KEY_TYPE struct ipv6_pair
 #define VALUE_TYPE struct session_entry
+#define NODE_MEMBER ipv6_hook
+#define KEY_FUNCTION session_get_ipv6
+#define FREE_VALUE session_kfree
 #include "hash_table.c"
 
 /**
@@ -41,23 +56,98 @@ struct session_table {
 	struct ipv6_table ipv6;
 };
 
-/** The session table for UDP connections. */
-static struct session_table session_table_udp;
-/** The session table for TCP connections. */
-static struct session_table session_table_tcp;
-/** The session table for ICMP connections. */
-static struct session_table session_table_icmp;
+/**
+ * A portion of the session database.
+ *
+ * The sessions are spread over the shards by the hash of their BIB's IPv6 transport address (the
+ * same one that picks their BIB lock; see bib_get_lock_index()), so both directions of a flow land
+ * on the same shard, and each shard owns a fixed subset of the BIB locks. Shards share nothing, so
+ * packets from different shards don't contend on the same tables.
+ * Nothing steers a packet to its shard's CPU, though; any CPU can end up working on any shard.
+ */
+struct session_shard {
+	/** The session table for UDP connections. */
+	struct session_table udp;
+	/** The session table for TCP connections. */
+	struct session_table tcp;
+	/** The session table for ICMP connections. */
+	struct session_table icmp;
+	/** Periodically deletes this shard's expired sessions. */
+	struct delayed_work expire_work;
+	/** Index of this shard in "shards". Also, the first BIB lock this shard owns. */
+	unsigned int index;
+	/** CPU this shard's cleaner runs on (and whose NUMA node holds its tables). */
+	int cpu;
+};
+
+/** The session database. Either one shard, or as many as CPUs (rounded up to a power of two). */
+static struct session_shard **shards;
+/** Length of "shards". Always a power of two no bigger than BIB_LOCKS. */
+static unsigned int shard_count;
+
+/**
+ * A list of sessions, chained through their "prev_in_queue" and "next_in_queue" handles.
+ */
+struct session_queue {
+	/** Handle of the session that expires first (ENTRY_NULL if the queue is empty). */
+	__u32 first;
+	/** Handle of the session that expires last (ENTRY_NULL if the queue is empty). */
+	__u32 last;
+};
+
+/**
+ * Index of the expire_queue list that holds the sessions the cleaner decided to look at again later
+ * (see clean_expired_sessions_queue()). They all get the same delay, so this list is sorted too.
+ * They keep it as their "timer_type" until somebody gives them a new lifetime, so everyone else can
+ * tell which list they are in.
+ */
+#define RETRY_QUEUE SESSION_TIMER_COUNT
+
+/**
+ * The sessions protected by one BIB lock, sorted by expiration date.
+ *
+ * There is one queue per timer type (plus RETRY_QUEUE). Every session from a queue was given the
+ * same lifetime the last time it was refreshed, and refreshing moves a session to the tail, so each
+ * queue is sorted by "dying_time" and the cleaner can stop at the first session which is still
+ * alive.
+ */
+struct expire_queue {
+	/**
+	 * Protects "sessions", and the lifetimes of the sessions in them. Refreshers don't hold the
+	 * BIB lock, so this one is needed; when both are taken, the BIB lock goes first.
+	 */
+	spinlock_t lock;
+	/** The queues themselves; indexed by enum session_timer_type (plus RETRY_QUEUE). */
+	struct session_queue sessions[SESSION_TIMER_COUNT + 1];
+};
 
 /**
- * Chains all known session entries.
- * Currently only used while looking en deleting expired ones.
+ * Index "i" queues the sessions protected by the BIB lock of the same index (see
+ * bib_get_lock_index()), so the cleaner can delete them while holding only that lock.
  */
-static LIST_HEAD(all_sessions);
+static struct expire_queue expire_queues[BIB_LOCKS];
 
-struct timer_list expire_timer;
+/** Whether the shards' cleaners should keep rescheduling themselves. */
 static bool expire_timer_active = false;
 static DEFINE_SPINLOCK(expire_timer_lock);
 
+/**
+ * Runs the shards' cleaners. They live in process context (rather than in timer callbacks) so they
+ * can let go of the CPU when a lot of sessions expire at once.
+ */
+static struct workqueue_struct *cleaner_wq;
+/**
+ * Maximum number of expired sessions a cleaner handles before letting go of its BIB lock (so the
+ * packets that need it can go through) and of the CPU.
+ */
+static unsigned int cleaner_batch = TABLES_DEF_CLEANER_BATCH;
+/** What the cleaners have been up to. Added over all the shards. */
+static struct cleaner_stats cleaner_stats;
+static DEFINE_SPINLOCK(cleaner_stats_lock);
+
+/** The session entries are allocated from here. */
+static struct entry_cache entry_cache;
+
 /**
  * This callback will be called by the session-cleaning thread for every session whose lifetime
  * just expired. It's expected to either update the session (particularly its lifetime) or approve
@@ -73,18 +163,19 @@ static bool (*session_expired_cb)(struct session_entry *session);
  * Private (helper) functions.
  ********************************************/
 
-static int get_session_table(u_int8_t l4protocol, struct session_table **result)
+static int get_session_table(struct session_shard *shard, u_int8_t l4protocol,
+		struct session_table **result)
 {
 	switch (l4protocol) {
 	case IPPROTO_UDP:
-		*result = &session_table_udp;
+		*result = &shard->udp;
 		return 0;
 	case IPPROTO_TCP:
-		*result = &session_table_tcp;
+		*result = &shard->tcp;
 		return 0;
 	case IPPROTO_ICMP:
 	case IPPROTO_ICMPV6:
-		*result = &session_table_icmp;
+		*result = &shard->icmp;
 		return 0;
 	}
 
@@ -92,6 +183,112 @@ static int get_session_table(u_int8_t l4protocol, struct session_table **result)
 	return -EINVAL;
 }
 
+/**
+ * Returns the shard which holds the sessions of the BIB entry whose IPv6 transport address is
+ * "bib_ipv6".
+ */
+static struct session_shard *get_shard_by_ipv6(struct ipv6_tuple_address *bib_ipv6)
+{
+	if (shard_count == 1)
+		return shards[0];
+	return shards[bib_get_lock_index(bib_ipv6) & (shard_count - 1)];
+}
+
+/**
+ * Returns the shard which holds the sessions of the BIB entry whose IPv4 transport address is
+ * "bib_ipv4", or NULL if there is no such BIB entry (in which case there are no such sessions
+ * either).
+ * Has to be called within an RCU read-side critical section (or holding the BIB's lock).
+ */
+static struct session_shard *get_shard_by_ipv4(struct ipv4_tuple_address *bib_ipv4,
+		u_int8_t l4protocol)
+{
+	struct bib_entry *bib;
+
+	if (shard_count == 1)
+		return shards[0];
+
+	/* IPv4 packets don't carry (X', x), but the BIB knows it. */
+	bib = bib_get_by_ipv4(bib_ipv4, l4protocol);
+	return bib ? get_shard_by_ipv6(&bib->ipv6) : NULL;
+}
+
+static void session_rcu_free(struct rcu_head *rcu)
+{
+	entry_cache_free(&entry_cache, container_of(rcu, struct session_entry, rcu)->handle);
+}
+
+/**
+ * Returns the session whose handle is "handle", or NULL if "handle" is ENTRY_NULL.
+ */
+static struct session_entry *get_session(__u32 handle)
+{
+	return (handle != ENTRY_NULL) ? entry_cache_get(&entry_cache, handle) : NULL;
+}
+
+static void queue_init(struct session_queue *queue)
+{
+	queue->first = ENTRY_NULL;
+	queue->last = ENTRY_NULL;
+}
+
+static bool queue_empty(struct session_queue *queue)
+{
+	return queue->first == ENTRY_NULL;
+}
+
+/**
+ * Marks "session" as not being in any queue.
+ */
+static void session_unqueued(struct session_entry *session)
+{
+	session->prev_in_queue = session->handle;
+	session->next_in_queue = session->handle;
+}
+
+static bool session_is_queued(struct session_entry *session)
+{
+	return session->next_in_queue != session->handle;
+}
+
+/**
+ * Assumes the lock of the expire_queue "queue" belongs to is held, and "session" is in "queue".
+ */
+static void queue_del(struct session_queue *queue, struct session_entry *session)
+{
+	if (session->prev_in_queue != ENTRY_NULL)
+		get_session(session->prev_in_queue)->next_in_queue = session->next_in_queue;
+	else
+		queue->first = session->next_in_queue;
+
+	if (session->next_in_queue != ENTRY_NULL)
+		get_session(session->next_in_queue)->prev_in_queue = session->prev_in_queue;
+	else
+		queue->last = session->prev_in_queue;
+
+	session_unqueued(session);
+}
+
+/**
+ * Assumes the lock of the expire_queue "queue" belongs to is held, and "session" is not queued.
+ */
+static void queue_add_tail(struct session_queue *queue, struct session_entry *session)
+{
+	session->prev_in_queue = queue->last;
+	session->next_in_queue = ENTRY_NULL;
+
+	if (queue->last != ENTRY_NULL)
+		get_session(queue->last)->next_in_queue = session->handle;
+	else
+		queue->first = session->handle;
+	queue->last = session->handle;
+}
+
+static struct expire_queue *get_expire_queue(struct session_entry *session)
+{
+	return &expire_queues[bib_get_lock_index(&session->bib->ipv6)];
+}
+
 static void tuple_to_ipv6_pair(struct tuple *tuple, struct ipv6_pair *pair)
 {
 	pair->remote.address = tuple->src.addr.ipv6;
@@ -109,77 +306,252 @@ static void tuple_to_ipv4_pair(struct tuple *tuple, struct ipv4_pair *pair)
 }
 
 /**
- * Removes from the tables the entries whose lifetime has expired. The entries are also freed from
- * memory.
+ * Returns "true" if "pair_1" and "pair_2" share the local transport address and the remote address,
+ * regardless of the remote port.
+ * Used to search the IPv4 index while ignoring the remote port (this works because the IPv4 hash
+ * function ignores ports).
+ */
+static bool ipv4_pair_equals_remote_address(struct ipv4_pair *pair_1, struct ipv4_pair *pair_2)
+{
+	return ipv4_tuple_addr_equals(&pair_1->local, &pair_2->local)
+			&& ipv4_addr_equals(&pair_1->remote.address, &pair_2->remote.address);
+}
+
+/**
+ * Removes from the tables the sessions from "queue"'s "type" queue whose lifetime has expired. The
+ * entries are also freed from memory.
+ * Only visits the expired sessions, and the first one that isn't.
+ * Assumes the BIB lock which protects "queue" is held.
  * TODO (fine) this is too much business logic to belong to this module; move it to a model.
+ *
+ * @param budget maximum number of expired sessions to visit; decreased by the ones that were.
+ * @param s number of sessions removed will be added here.
+ * @param b number of BIB entries removed will be added here.
+ * @return true if the queue has no expired sessions left, false if "budget" ran out first.
  */
-static void clean_expired_sessions(void)
+static bool clean_expired_sessions_queue(struct expire_queue *queue, unsigned int type,
+		unsigned int current_time, unsigned int *budget, unsigned int *s, unsigned int *b)
 {
-	struct list_head *current_node, *next_node;
+	struct session_queue *list = &queue->sessions[type];
 	struct session_entry *session;
-	unsigned int s = 0;
 	struct bib_entry *bib;
-	unsigned int b = 0;
-	unsigned int current_time = jiffies_to_msecs(jiffies);
 	u_int8_t l4_proto;
+	bool done = true;
 
-	log_debug("Deleting expired sessions...");
-	spin_lock_bh(&bib_session_lock);
-
-	list_for_each_safe(current_node, next_node, &all_sessions) {
-		session = list_entry(current_node, struct session_entry, all_sessions);
+	while (true) {
+		if (*budget == 0) {
+			done = false;
+			break;
+		}
 
-		if (session->dying_time > current_time || session_expired_cb(session))
+		spin_lock_bh(&queue->lock);
+		session = get_session(list->first);
+		if (!session) {
+			spin_unlock_bh(&queue->lock);
+			break;
+		}
+		if (session->dying_time > current_time) {
+			spin_unlock_bh(&queue->lock);
+			break;
+		}
+		/* Unqueue it, so refreshers leave the queues alone while we decide its fate. */
+		queue_del(list, session);
+		spin_unlock_bh(&queue->lock);
+		(*budget)--;
+
+		if (session_expired_cb(session)) {
+			spin_lock_bh(&queue->lock);
+			if (session->dying_time > current_time) {
+				queue_add_tail(&queue->sessions[session->timer_type], session);
+			} else {
+				/*
+				 * The callback kept it but didn't say for how long; try again in a while.
+				 * Its own queue's lifetime might be longer than that.
+				 */
+				session->dying_time = current_time + SESSION_TIMER_INTERVAL;
+				session->timer_type = RETRY_QUEUE;
+				queue_add_tail(&queue->sessions[RETRY_QUEUE], session);
+			}
+			spin_unlock_bh(&queue->lock);
 			continue;
+		}
+
 		if (!session_remove(session))
 			continue; /* Error msg already printed. */
 
 		bib = session->bib;
 		l4_proto = session->l4_proto;
 
-		list_del(&session->entries_from_bib);
-		kfree(session);
-		s++;
+		session_unlink_from_bib(session);
+		session_kfree_rcu(session);
+		(*s)++;
 
 		if (!bib) {
 			log_crit(ERR_NULL, "The session entry I just removed had no BIB entry."); /* ?? */
 			continue;
 		}
 
-		if (!list_empty(&bib->sessions) || bib->is_static)
+		if (bib->sessions != ENTRY_NULL || bib->is_static)
 			continue;
 		if (!bib_remove(bib, l4_proto))
 			continue; /* Error msg already printed. */
 
-		pool4_return(l4_proto, &bib->ipv4);
-		kfree(bib);
-		b++;
+		if (bib_release_port(bib, l4_proto))
+			pool4_return(l4_proto, &bib->ipv4);
+		bib_kfree_rcu(bib);
+		(*b)++;
+	}
+
+	return done;
+}
+
+/**
+ * Lowers "*next_dying_time" to the lifetime of the first session from "queue"'s queues, if it's
+ * earlier. "*found" tells whether "*next_dying_time" already holds a value, and is updated
+ * accordingly.
+ */
+static void update_next_dying_time(struct expire_queue *queue, unsigned int *next_dying_time,
+		bool *found)
+{
+	struct session_entry *session;
+	unsigned int type;
+
+	spin_lock_bh(&queue->lock);
+	for (type = 0; type <= RETRY_QUEUE; type++) {
+		session = get_session(queue->sessions[type].first);
+		if (!session)
+			continue;
+		if (!(*found) || session->dying_time < *next_dying_time)
+			*next_dying_time = session->dying_time;
+		*found = true;
 	}
+	spin_unlock_bh(&queue->lock);
+}
 
-	spin_unlock_bh(&bib_session_lock);
+static void update_cleaner_stats(s64 ns, unsigned int sessions, unsigned int yields)
+{
+	spin_lock_bh(&cleaner_stats_lock);
+	cleaner_stats.runs++;
+	cleaner_stats.yields += yields;
+	cleaner_stats.sessions += sessions;
+	cleaner_stats.last_ns = ns;
+	cleaner_stats.total_ns += ns;
+	if (ns > cleaner_stats.max_ns)
+		cleaner_stats.max_ns = ns;
+	spin_unlock_bh(&cleaner_stats_lock);
+}
+
+/**
+ * Removes from "shard"'s tables the entries whose lifetime has expired. The entries are also freed
+ * from memory.
+ * Only one BIB lock is held at a time, so packets from other BIB entries can keep flowing. Also,
+ * the lock is released (and the CPU offered to someone else) every "cleaner_batch" expired
+ * sessions, so a mass expiration doesn't starve the packets which need the same lock.
+ *
+ * @param next_dying_time the earliest lifetime among the surviving sessions will be stored here.
+ * @return whether "shard" still has sessions (ie. whether "next_dying_time" was set).
+ */
+static bool clean_expired_sessions(struct session_shard *shard, unsigned int *next_dying_time)
+{
+	unsigned int current_time = jiffies_to_msecs(jiffies);
+	unsigned int batch = cleaner_batch;
+	unsigned int budget;
+	unsigned int s = 0, b = 0, yields = 0;
+	ktime_t start = ktime_get();
+	spinlock_t *lock;
+	unsigned int i, type;
+	bool found = false;
+
+	log_debug("Deleting expired sessions from shard %u...", shard->index);
+
+	/* The shard owns every BIB lock whose index maps to it (see get_shard_by_ipv6()). */
+	for (i = shard->index; i < BIB_LOCKS; i += shard_count) {
+		lock = bib_get_lock_by_index(i);
+		budget = batch;
+		type = 0;
+
+		spin_lock_bh(lock);
+		while (type <= RETRY_QUEUE) {
+			if (clean_expired_sessions_queue(&expire_queues[i], type, current_time, &budget,
+					&s, &b)) {
+				type++;
+				continue;
+			}
+
+			/* Out of budget; take a break and pick up where we left. */
+			spin_unlock_bh(lock);
+			cond_resched();
+			yields++;
+			budget = batch;
+			spin_lock_bh(lock);
+		}
+		update_next_dying_time(&expire_queues[i], next_dying_time, &found);
+		spin_unlock_bh(lock);
+
+		cond_resched();
+	}
+
+	update_cleaner_stats(ktime_to_ns(ktime_sub(ktime_get(), start)), s, yields);
 	log_debug("Deleted %u session entries and %u BIB entries.", s, b);
+	return found;
 }
 
-static void cleaner_timer(unsigned long param)
+/**
+ * Makes sure "shard"'s cleaner runs no later than "dying_time" (a jiffies_to_msecs(jiffies)
+ * timestamp). When there's one shard per CPU, the cleaner runs on the shard's CPU.
+ */
+static void schedule_cleaner(struct session_shard *shard, unsigned int dying_time)
 {
-	clean_expired_sessions();
+	struct timer_list *timer = &shard->expire_work.timer;
+	unsigned int current_time = jiffies_to_msecs(jiffies);
+	unsigned long delay = 1;
+
+	if (dying_time > current_time)
+		delay = msecs_to_jiffies(dying_time - current_time);
+
+	/* Most of the time, some other session is bound to expire first; don't bother the lock. */
+	if (timer_pending(timer) && !time_before(jiffies + delay, timer->expires))
+		return;
 
 	spin_lock_bh(&expire_timer_lock);
-	if (expire_timer_active) {
-		expire_timer.expires = jiffies + msecs_to_jiffies(SESSION_TIMER_INTERVAL);
-		add_timer(&expire_timer);
+	if (!expire_timer_active)
+		goto end;
+	if (timer_pending(timer)) {
+		if (!time_before(jiffies + delay, timer->expires))
+			goto end;
+	} else if (delayed_work_pending(&shard->expire_work)) {
+		goto end; /* It's already queued to run right away. */
 	}
+
+	if (shard_count > 1)
+		mod_delayed_work_on(shard->cpu, cleaner_wq, &shard->expire_work, delay);
+	else
+		mod_delayed_work(cleaner_wq, &shard->expire_work, delay);
+	/* Fall through. */
+
+end:
 	spin_unlock_bh(&expire_timer_lock);
 }
 
-/*******************************
- * Public functions.
- *******************************/
+static void cleaner_work(struct work_struct *work)
+{
+	struct session_shard *shard;
+	unsigned int next_dying_time;
+
+	shard = container_of(to_delayed_work(work), struct session_shard, expire_work);
 
-int session_init(bool (*session_expired_callback)(struct session_entry *))
+	/* If the shard is empty, the next session_add() will reschedule the cleaner. */
+	if (clean_expired_sessions(shard, &next_dying_time))
+		schedule_cleaner(shard, next_dying_time);
+}
+
+/**
+ * Readies "shard"'s tables. If there are several shards, they will live in the NUMA node of the
+ * shard's CPU.
+ */
+static int init_shard(struct session_shard *shard, int node)
 {
-	struct session_table *tables[] = { &session_table_udp, &session_table_tcp,
-			&session_table_icmp };
+	struct session_table *tables[] = { &shard->udp, &shard->tcp, &shard->icmp };
 	int i, error;
 
 	for (i = 0; i < ARRAY_SIZE(tables); i++) {
@@ -189,25 +561,167 @@ int session_init(bool (*session_expired_callback)(struct session_entry *))
 		error = ipv6_table_init(&tables[i]->ipv6, ipv6_pair_equals, ipv6_pair_hashcode);
 		if (error)
 			return error;
+		ipv4_table_set_node(&tables[i]->ipv4, node);
+		ipv6_table_set_node(&tables[i]->ipv6, node);
 	}
 
-	INIT_LIST_HEAD(&all_sessions);
+	return 0;
+}
+
+static void destroy_shard(struct session_shard *shard)
+{
+	struct session_table *tables[] = { &shard->udp, &shard->tcp, &shard->icmp };
+	int i;
 
-	init_timer(&expire_timer);
-	expire_timer.function = cleaner_timer;
-	expire_timer.expires = jiffies + msecs_to_jiffies(SESSION_TIMER_INTERVAL);
-	expire_timer.data = 0;
-	add_timer(&expire_timer);
-	expire_timer_active = true;
+	/*
+	 * The keys needn't be released because they're part of the values.
+	 * Neither do the values, one by one; they all go away along with the arena (see
+	 * session_destroy()).
+	 */
+	for (i = 0; i < ARRAY_SIZE(tables); i++) {
+		ipv4_table_destroy(&tables[i]->ipv4, false, false);
+		ipv6_table_destroy(&tables[i]->ipv6, false, false);
+	}
 
+	kfree(shard);
+}
+
+/**
+ * Releases the shards, along with their sessions.
+ * Assumes the cleaners are not running.
+ */
+static void destroy_shards(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < shard_count; i++)
+		if (shards[i])
+			destroy_shard(shards[i]);
+
+	kfree(shards);
+	shards = NULL;
+	shard_count = 0;
+}
+
+static void set_shard_load_limits(struct session_shard *shard, __u16 max_load, __u16 min_load)
+{
+	struct session_table *tables[] = { &shard->udp, &shard->tcp, &shard->icmp };
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(tables); i++) {
+		ipv4_table_set_load_limits(&tables[i]->ipv4, max_load, min_load);
+		ipv6_table_set_load_limits(&tables[i]->ipv6, max_load, min_load);
+	}
+}
+
+/*******************************
+ * Public functions.
+ *******************************/
+
+int session_init(bool (*session_expired_callback)(struct session_entry *), bool sharded,
+		unsigned int reserve)
+{
+	struct session_shard *shard;
+	unsigned int i, type;
+	int cpu, node, error;
+
+	/* Shared BIB entries are not indexed by IPv4, so the IPv4 lookups could not find their shard. */
+	if (sharded && bib_port_reuse_enabled()) {
+		log_err(ERR_PORT_REUSE_SHARDED, "Port reuse cannot be combined with sharded sessions.");
+		return -EINVAL;
+	}
+
+	shard_count = 1;
+	if (sharded)
+		shard_count = min_t(unsigned int, roundup_pow_of_two(num_possible_cpus()), BIB_LOCKS);
+
+	error = entry_cache_init(&entry_cache, "nat64_session_entries",
+			sizeof(struct session_entry), false, reserve);
+	if (error) {
+		shard_count = 0;
+		return error;
+	}
+
+	cleaner_wq = alloc_workqueue("nat64_cleaner", 0, 0);
+	if (!cleaner_wq) {
+		log_err(ERR_ALLOC_FAILED, "Could not allocate the session cleaners' workqueue.");
+		shard_count = 0;
+		error = -ENOMEM;
+		goto cache_failure;
+	}
+
+	shards = kcalloc(shard_count, sizeof(*shards), GFP_KERNEL);
+	if (!shards) {
+		log_err(ERR_ALLOC_FAILED, "Could not allocate the session shard list.");
+		shard_count = 0;
+		error = -ENOMEM;
+		goto wq_failure;
+	}
+
+	for (i = 0; i < BIB_LOCKS; i++) {
+		spin_lock_init(&expire_queues[i].lock);
+		for (type = 0; type <= RETRY_QUEUE; type++)
+			queue_init(&expire_queues[i].sessions[type]);
+	}
 	session_expired_cb = session_expired_callback;
+	cleaner_batch = TABLES_DEF_CLEANER_BATCH;
+	memset(&cleaner_stats, 0, sizeof(cleaner_stats));
+
+	/* Hand out the online CPUs round robin; there might be more shards than CPUs. */
+	cpu = cpumask_first(cpu_online_mask);
+	for (i = 0; i < shard_count; i++) {
+		node = (shard_count > 1) ? cpu_to_node(cpu) : NUMA_NO_NODE;
+		shard = kzalloc_node(sizeof(*shard), GFP_KERNEL, node);
+		if (!shard) {
+			log_err(ERR_ALLOC_FAILED, "Could not allocate session shard %u.", i);
+			error = -ENOMEM;
+			goto failure;
+		}
+		shards[i] = shard;
+
+		shard->index = i;
+		shard->cpu = cpu;
+		INIT_DELAYED_WORK(&shard->expire_work, cleaner_work);
+
+		error = init_shard(shard, node);
+		if (error)
+			goto failure;
+
+		cpu = cpumask_next(cpu, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpu_online_mask);
+	}
+
+	/* The cleaners are scheduled as sessions are added. */
+	spin_lock_bh(&expire_timer_lock);
+	expire_timer_active = true;
+	spin_unlock_bh(&expire_timer_lock);
 
 	return 0;
+
+failure:
+	destroy_shards();
+	/* Fall through. */
+
+wq_failure:
+	destroy_workqueue(cleaner_wq);
+	cleaner_wq = NULL;
+	/* Fall through. */
+
+cache_failure:
+	entry_cache_destroy(&entry_cache);
+	return error;
 }
 
 int session_add(struct session_entry *entry)
 {
+	struct session_shard *shard;
 	struct session_table *table;
+	struct expire_queue *queue;
+	struct ipv4_pair pair4;
+	struct ipv6_pair pair6;
+	spinlock_t *port_lock = NULL;
+	bool taken;
 	enum error_code error;
 
 	if (!entry) {
@@ -215,39 +729,117 @@ int session_add(struct session_entry *entry)
 		return -EINVAL;
 	}
 
-	error = get_session_table(entry->l4_proto, &table);
+	shard = get_shard_by_ipv6(&entry->bib->ipv6);
+	error = get_session_table(shard, entry->l4_proto, &table);
 	if (error)
 		return error;
 
+	session_get_ipv4(entry, &pair4);
+	session_get_ipv6(entry, &pair6);
+
+	/*
+	 * Other BIB entries might be bound to the same (T, t), and their locks are not ours. Their
+	 * sessions cannot be headed to the same (Z, z), or the IPv4 side would not know which one a
+	 * packet belongs to.
+	 */
+	if (entry->bib->is_shared) {
+		port_lock = bib_get_port_lock(&entry->bib->ipv4);
+		spin_lock_bh(port_lock);
+		rcu_read_lock();
+		taken = ipv4_table_get(&table->ipv4, &pair4) != NULL;
+		rcu_read_unlock();
+		if (taken) {
+			log_debug("Another BIB entry is already talking to %pI4#%u from %pI4#%u.",
+					&pair4.remote.address, pair4.remote.l4_id,
+					&pair4.local.address, pair4.local.l4_id);
+			error = -EEXIST;
+			goto failure;
+		}
+	}
+
 	/* Insert into the hash tables. */
-	error = ipv4_table_put(&table->ipv4, &entry->ipv4, entry);
+	error = ipv4_table_put(&table->ipv4, &pair4, entry);
 	if (error)
-		return error;
+		goto failure;
 
-	error = ipv6_table_put(&table->ipv6, &entry->ipv6, entry);
+	error = ipv6_table_put(&table->ipv6, &pair6, entry);
 	if (error) {
-		ipv4_table_remove(&table->ipv4, &entry->ipv4, false, false);
-		return error;
+		ipv4_table_remove(&table->ipv4, &pair4, false, false);
+		goto failure;
 	}
 
-	/* Insert into the linked list. */
-	list_add(&entry->all_sessions, &all_sessions);
+	if (port_lock)
+		spin_unlock_bh(port_lock);
 
+	/* Insert into the expiration queue. */
+	queue = get_expire_queue(entry);
+	spin_lock_bh(&queue->lock);
+	queue_add_tail(&queue->sessions[entry->timer_type], entry);
+	spin_unlock_bh(&queue->lock);
+
+	schedule_cleaner(shard, entry->dying_time);
 	return 0;
+
+failure:
+	if (port_lock)
+		spin_unlock_bh(port_lock);
+	return error;
 }
 
 struct session_entry *session_get_by_ipv4(struct ipv4_pair *pair, u_int8_t l4protocol)
 {
+	struct session_shard *shard;
 	struct session_table *table;
-	if (get_session_table(l4protocol, &table) != 0)
+
+	shard = get_shard_by_ipv4(&pair->local, l4protocol);
+	if (!shard)
+		return NULL;
+	if (get_session_table(shard, l4protocol, &table) != 0)
 		return NULL;
 	return ipv4_table_get(&table->ipv4, pair);
 }
 
+spinlock_t *session_lock_by_ipv4(struct ipv4_pair *pair, u_int8_t l4protocol,
+		struct session_entry **result)
+{
+	struct session_entry *session;
+	struct ipv6_tuple_address bib_ipv6;
+	spinlock_t *lock;
+	bool locked;
+
+	do {
+		rcu_read_lock();
+		session = session_get_by_ipv4(pair, l4protocol);
+		if (session)
+			bib_ipv6 = session->bib->ipv6;
+		rcu_read_unlock();
+
+		if (!session)
+			return NULL;
+
+		lock = bib_get_lock(&bib_ipv6);
+		spin_lock_bh(lock);
+
+		/* Same as bib_lock_by_ipv4(); the session might have died before we got the lock. */
+		rcu_read_lock();
+		session = session_get_by_ipv4(pair, l4protocol);
+		locked = session && ipv6_tuple_addr_equals(&session->bib->ipv6, &bib_ipv6);
+		rcu_read_unlock();
+
+		if (locked) {
+			*result = session;
+			return lock;
+		}
+		spin_unlock_bh(lock);
+	} while (session);
+
+	return NULL;
+}
+
 struct session_entry *session_get_by_ipv6(struct ipv6_pair *pair, u_int8_t l4protocol)
 {
 	struct session_table *table;
-	if (get_session_table(l4protocol, &table) != 0)
+	if (get_session_table(get_shard_by_ipv6(&pair->remote), l4protocol, &table) != 0)
 		return NULL;
 	return ipv6_table_get(&table->ipv6, pair);
 }
@@ -277,35 +869,31 @@ struct session_entry *session_get(struct tuple *tuple)
 
 bool session_allow(struct tuple *tuple)
 {
+	struct session_shard *shard;
 	struct session_table *table;
-	__u16 hash_code;
-	struct hlist_node *current_node;
-	struct ipv4_pair tuple_pair, *session_pair;
+	struct ipv4_pair tuple_pair;
 
 	if (!tuple) {
 		log_err(ERR_NULL, "Cannot extract addresses from NULL.");
 		return false;
 	}
 
-	if (get_session_table(tuple->l4_proto, &table) != 0)
-		return false;
-
 	tuple_to_ipv4_pair(tuple, &tuple_pair);
-	hash_code = table->ipv4.hash_function(&tuple_pair) % ARRAY_SIZE(table->ipv4.table);
-	hlist_for_each(current_node, &table->ipv4.table[hash_code]) {
-		session_pair = list_entry(current_node, struct ipv4_table_key_value, nodes)->key;
-		if (ipv4_tuple_addr_equals(&session_pair->local, &tuple_pair.local)
-				&& ipv4_addr_equals(&session_pair->remote.address, &tuple_pair.remote.address)) {
-			return true;
-		}
-	}
+	shard = get_shard_by_ipv4(&tuple_pair.local, tuple->l4_proto);
+	if (!shard)
+		return false;
+	if (get_session_table(shard, tuple->l4_proto, &table) != 0)
+		return false;
 
-	return false;
+	return ipv4_table_find(&table->ipv4, &tuple_pair, ipv4_pair_equals_remote_address) != NULL;
 }
 
 bool session_remove(struct session_entry *entry)
 {
 	struct session_table *table;
+	struct expire_queue *queue;
+	struct ipv4_pair pair4;
+	struct ipv6_pair pair6;
 	bool removed_from_ipv4, removed_from_ipv6;
 
 	if (!entry) {
@@ -313,15 +901,21 @@ bool session_remove(struct session_entry *entry)
 		return false;
 	}
 
-	if (get_session_table(entry->l4_proto, &table) != 0)
+	if (get_session_table(get_shard_by_ipv6(&entry->bib->ipv6), entry->l4_proto, &table) != 0)
 		return false;
 
 	/* Free from both tables. */
-	removed_from_ipv4 = ipv4_table_remove(&table->ipv4, &entry->ipv4, false, false);
-	removed_from_ipv6 = ipv6_table_remove(&table->ipv6, &entry->ipv6, false, false);
+	session_get_ipv4(entry, &pair4);
+	session_get_ipv6(entry, &pair6);
+	removed_from_ipv4 = ipv4_table_remove(&table->ipv4, &pair4, false, false);
+	removed_from_ipv6 = ipv6_table_remove(&table->ipv6, &pair6, false, false);
 
 	if (removed_from_ipv4 && removed_from_ipv6) {
-		list_del(&entry->all_sessions);
+		queue = get_expire_queue(entry);
+		spin_lock_bh(&queue->lock);
+		if (session_is_queued(entry))
+			queue_del(&queue->sessions[entry->timer_type], entry);
+		spin_unlock_bh(&queue->lock);
 		return true;
 	}
 	if (!removed_from_ipv4 && !removed_from_ipv6) {
@@ -336,58 +930,238 @@ bool session_remove(struct session_entry *entry)
 
 void session_destroy(void)
 {
-	struct session_table *tables[] = { &session_table_udp, &session_table_tcp,
-			&session_table_icmp };
-	int i;
+	unsigned int i;
+
+	/* Stop the cleaners first, so they don't run into the tables as they are torn down. */
+	spin_lock_bh(&expire_timer_lock);
+	expire_timer_active = false;
+	spin_unlock_bh(&expire_timer_lock);
+	for (i = 0; i < shard_count; i++)
+		if (shards[i])
+			cancel_delayed_work_sync(&shards[i]->expire_work);
+	destroy_workqueue(cleaner_wq);
+	cleaner_wq = NULL;
 
 	log_debug("Emptying the session tables...");
-	/*
-	 * The keys needn't be released because they're part of the values.
-	 * The values need to be released only in one of the tables because both tables point to the
-	 * same values.
-	 */
-	for (i = 0; i < ARRAY_SIZE(tables); i++) {
-		ipv4_table_empty(&session_table_udp.ipv4, false, false);
-		ipv6_table_empty(&session_table_udp.ipv6, false, true);
+	destroy_shards();
+
+	/* Wait for the RCU callbacks which still want to touch the arena. */
+	rcu_barrier();
+	entry_cache_destroy(&entry_cache);
+}
+
+void session_set_lifetime(struct session_entry *session, unsigned int ttl,
+		enum session_timer_type type)
+{
+	struct expire_queue *queue = get_expire_queue(session);
+	bool moved_to_another_queue = false;
+
+	spin_lock_bh(&queue->lock);
+	session->dying_time = jiffies_to_msecs(jiffies) + ttl;
+	if (session_is_queued(session)) {
+		queue_del(&queue->sessions[session->timer_type], session);
+		queue_add_tail(&queue->sessions[type], session);
+		moved_to_another_queue = (session->timer_type != type);
 	}
+	session->timer_type = type;
+	spin_unlock_bh(&queue->lock);
 
-	spin_lock_bh(&expire_timer_lock);
-	if (expire_timer_active) {
-		expire_timer_active = false;
-		spin_unlock_bh(&expire_timer_lock);
-		del_timer_sync(&expire_timer);
-	} else {
-		spin_unlock_bh(&expire_timer_lock);
+	/* The new queue might have a shorter timeout than the ones the cleaner is waiting for. */
+	if (moved_to_another_queue)
+		schedule_cleaner(get_shard_by_ipv6(&session->bib->ipv6), session->dying_time);
+}
+
+void session_set_cleaner_batch(unsigned int batch)
+{
+	cleaner_batch = batch;
+}
+
+void session_get_cleaner_stats(struct cleaner_stats *result)
+{
+	spin_lock_bh(&cleaner_stats_lock);
+	*result = cleaner_stats;
+	spin_unlock_bh(&cleaner_stats_lock);
+}
+
+void session_set_load_limits(__u16 max_load, __u16 min_load)
+{
+	unsigned int i;
+
+	for (i = 0; i < shard_count; i++)
+		set_shard_load_limits(shards[i], max_load, min_load);
+}
+
+int session_set_size_limits(u_int8_t l4protocol, __u32 min_slots, __u32 max_slots)
+{
+	struct session_table *table;
+	unsigned int i;
+	int error;
+
+	/* Each shard holds its share of the sessions, so it gets its share of the slots. */
+	min_slots = max_t(__u32, min_slots / shard_count, TABLES_MIN_SLOTS);
+	max_slots = max_t(__u32, max_slots / shard_count, TABLES_MIN_SLOTS);
+
+	for (i = 0; i < shard_count; i++) {
+		error = get_session_table(shards[i], l4protocol, &table);
+		if (error)
+			return error;
+		error = ipv4_table_set_size_limits(&table->ipv4, min_slots, max_slots);
+		if (error)
+			return error;
+		error = ipv6_table_set_size_limits(&table->ipv6, min_slots, max_slots);
+		if (error)
+			return error;
 	}
+
+	return 0;
 }
 
-struct session_entry *session_create(struct ipv4_pair *ipv4, struct ipv6_pair *ipv6,
-		u_int8_t l4protocol)
+struct session_entry *session_create(struct bib_entry *bib, struct ipv4_tuple_address *remote4,
+		struct in6_addr *local6, u_int8_t l4protocol)
 {
-	struct session_entry *result = kmalloc(sizeof(struct session_entry), GFP_ATOMIC);
+	struct session_entry *result;
+	struct ipv6_prefix prefix;
+	struct in6_addr expected6;
+	__u8 prefix_index;
+	__u32 handle;
+
+	if (!bib) {
+		log_err(ERR_SESSION_BIBLESS, "Sessions need a BIB entry.");
+		return NULL;
+	}
+
+	/*
+	 * Y' is not stored; it is rebuilt from Z and the prefix when needed. So it has to be the one
+	 * RFC 6052 would have built.
+	 */
+	if (!pool6_get_index(local6, &prefix, &prefix_index))
+		return NULL;
+	if (!addr_4to6(&remote4->address, &prefix, &expected6))
+		return NULL;
+	if (!ipv6_addr_equals(local6, &expected6)) {
+		log_debug("%pI6c is not %pI4 under prefix %pI6c/%u.", local6, &remote4->address,
+				&prefix.address, prefix.len);
+		return NULL;
+	}
+
+	result = entry_cache_alloc(&entry_cache, &handle);
 	if (!result)
 		return NULL;
 
-	result->ipv4 = *ipv4;
-	result->ipv6 = *ipv6;
+	result->handle = handle;
+	result->bib = bib;
+	result->remote4 = *remote4;
+	result->prefix_index = prefix_index;
 	result->dying_time = 0;
-	INIT_LIST_HEAD(&result->entries_from_bib);
-	INIT_LIST_HEAD(&result->all_sessions);
+	result->prev_in_bib = ENTRY_NULL;
+	result->next_in_bib = ENTRY_NULL;
+	session_unqueued(result);
 	result->l4_proto = l4protocol;
+	switch (l4protocol) {
+	case IPPROTO_TCP:
+		result->timer_type = SESSION_TIMER_TCP_TRANS;
+		break;
+	case IPPROTO_ICMP:
+	case IPPROTO_ICMPV6:
+		result->timer_type = SESSION_TIMER_ICMP;
+		break;
+	default:
+		result->timer_type = SESSION_TIMER_UDP;
+	}
 
 	return result;
 }
 
+void session_get_ipv4(struct session_entry *session, struct ipv4_pair *result)
+{
+	result->local = session->bib->ipv4;
+	result->remote = session->remote4;
+}
+
+void session_get_ipv6(struct session_entry *session, struct ipv6_pair *result)
+{
+	struct ipv6_prefix *prefix;
+
+	result->remote = session->bib->ipv6;
+
+	prefix = pool6_get_by_index(session->prefix_index);
+	if (!addr_4to6(&session->remote4.address, prefix, &result->local.address)) {
+		/* session_create() validated this already; pool6 never forgets a prefix's index. */
+		WARN(true, "Session's prefix index %u is not valid.", session->prefix_index);
+		memset(&result->local.address, 0, sizeof(result->local.address));
+	}
+
+	switch (session->l4_proto) {
+	case IPPROTO_ICMP:
+	case IPPROTO_ICMPV6:
+		result->local.l4_id = session->bib->ipv6.l4_id;
+		break;
+	default:
+		result->local.l4_id = session->remote4.l4_id;
+	}
+}
+
+void session_link_to_bib(struct session_entry *session)
+{
+	struct bib_entry *bib = session->bib;
+
+	session->prev_in_bib = ENTRY_NULL;
+	session->next_in_bib = bib->sessions;
+	if (bib->sessions != ENTRY_NULL)
+		get_session(bib->sessions)->prev_in_bib = session->handle;
+	bib->sessions = session->handle;
+}
+
+void session_unlink_from_bib(struct session_entry *session)
+{
+	if (session->prev_in_bib != ENTRY_NULL)
+		get_session(session->prev_in_bib)->next_in_bib = session->next_in_bib;
+	else
+		session->bib->sessions = session->next_in_bib;
+
+	if (session->next_in_bib != ENTRY_NULL)
+		get_session(session->next_in_bib)->prev_in_bib = session->prev_in_bib;
+
+	session->prev_in_bib = ENTRY_NULL;
+	session->next_in_bib = ENTRY_NULL;
+}
+
+struct session_entry *session_first_of_bib(struct bib_entry *bib)
+{
+	return get_session(bib->sessions);
+}
+
+void session_kfree(struct session_entry *entry)
+{
+	entry_cache_free(&entry_cache, entry->handle);
+}
+
+void session_kfree_rcu(struct session_entry *entry)
+{
+	call_rcu(&entry->rcu, session_rcu_free);
+}
+
+void session_get_cache_stats(struct cache_stats *result)
+{
+	entry_cache_get_stats(&entry_cache, result);
+}
+
 int session_for_each(__u8 l4protocol, int (*func)(struct session_entry *, void *), void *arg)
 {
 	struct session_table *table;
+	unsigned int i;
 	int error;
 
-	error = get_session_table(l4protocol, &table);
-	if (error)
-		return error;
+	for (i = 0; i < shard_count; i++) {
+		error = get_session_table(shards[i], l4protocol, &table);
+		if (error)
+			return error;
+		error = ipv4_table_for_each(&table->ipv4, func, arg);
+		if (error)
+			return error;
+	}
 
-	return ipv4_table_for_each(&table->ipv4, func, arg);
+	return 0;
 }
 
 bool session_entry_equals(struct session_entry *session_1, struct session_entry *session_2)
@@ -399,13 +1173,13 @@ bool session_entry_equals(struct session_entry *session_1, struct session_entry
 
 	if (session_1->l4_proto != session_2->l4_proto)
 		return false;
-	if (!ipv6_tuple_addr_equals(&session_1->ipv6.remote, &session_2->ipv6.remote))
+	if (!ipv6_tuple_addr_equals(&session_1->bib->ipv6, &session_2->bib->ipv6))
 		return false;
-	if (!ipv6_tuple_addr_equals(&session_1->ipv6.local, &session_2->ipv6.local))
+	if (!ipv4_tuple_addr_equals(&session_1->bib->ipv4, &session_2->bib->ipv4))
 		return false;
-	if (!ipv4_tuple_addr_equals(&session_1->ipv4.local, &session_2->ipv4.local))
+	if (!ipv4_tuple_addr_equals(&session_1->remote4, &session_2->remote4))
 		return false;
-	if (!ipv4_tuple_addr_equals(&session_1->ipv4.remote, &session_2->ipv4.remote))
+	if (session_1->prefix_index != session_2->prefix_index)
 		return false;
 
 	return true;
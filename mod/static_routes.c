@@ -18,6 +18,7 @@ int add_static_route(struct request_bib *req)
 {
 	struct bib_entry *bib_by_ipv6, *bib_by_ipv4;
 	struct bib_entry *bib = NULL;
+	spinlock_t *lock;
 	int error;
 
 	if (!pool4_contains(&req->add.ipv4.address)) {
@@ -26,9 +27,14 @@ int add_static_route(struct request_bib *req)
 		return -EINVAL;
 	}
 
-	spin_lock_bh(&bib_session_lock);
+	lock = bib_get_lock(&req->add.ipv6);
+	spin_lock_bh(lock);
 
-	/* Check if the BIB entry exists. */
+	/*
+	 * Check if the BIB entry exists.
+	 * The one indexed by IPv4 might be protected by some other lock, hence the RCU.
+	 */
+	rcu_read_lock();
 	bib_by_ipv6 = bib_get_by_ipv6(&req->add.ipv6, req->l4_proto);
 	bib_by_ipv4 = bib_get_by_ipv4(&req->add.ipv4, req->l4_proto);
 
@@ -37,17 +43,18 @@ int add_static_route(struct request_bib *req)
 		log_err(ERR_BIB_REINSERT, "%pI6c#%u is already mapped to %pI4#%u.",
 				&bib->ipv6.address, bib->ipv6.l4_id,
 				&bib->ipv4.address, bib->ipv4.l4_id);
+		rcu_read_unlock();
 		bib = NULL;
 		error = -EEXIST;
 		goto failure;
 	}
+	rcu_read_unlock();
 
 	/* Borrow the address and port from the IPv4 pool. */
 	if (!pool4_get(req->l4_proto, &req->add.ipv4)) {
 		/*
 		 * This might happen if Filtering just reserved the address#port, but hasn't yet inserted
-		 * the BIB entry to the table. This is because bib_session_lock doesn't cover the IPv4
-		 * pool.
+		 * the BIB entry to the table. This is because the BIB locks don't cover the IPv4 pool.
 		 * Otherwise something's not returning borrowed address#ports to the pool, which is an
 		 * error.
 		 */
@@ -63,21 +70,26 @@ int add_static_route(struct request_bib *req)
 	if (!bib) {
 		log_err(ERR_ALLOC_FAILED, "Could NOT allocate a BIB entry.");
 		error = -ENOMEM;
-		goto failure;
+		goto return_port;
 	}
 
 	error = bib_add(bib, req->l4_proto);
 	if (error) {
 		log_err(ERR_UNKNOWN_ERROR, "Could NOT add the BIB entry to the table.");
-		goto failure;
+		/* bib_add() might have published the entry for a while. */
+		bib_kfree_rcu(bib);
+		goto return_port;
 	}
 
-	spin_unlock_bh(&bib_session_lock);
+	spin_unlock_bh(lock);
 	return 0;
 
+return_port:
+	pool4_return(req->l4_proto, &req->add.ipv4);
+	/* Fall through. */
+
 failure:
-	kfree(bib);
-	spin_unlock_bh(&bib_session_lock);
+	spin_unlock_bh(lock);
 	return error;
 }
 
@@ -85,21 +97,26 @@ int delete_static_route(struct request_bib *req)
 {
 	struct bib_entry *bib;
 	struct session_entry *session;
+	struct ipv6_pair pair6;
+	spinlock_t *lock;
 	int error = 0;
 
-	spin_lock_bh(&bib_session_lock);
-
 	switch (req->remove.l3_proto) {
 	case PF_INET6:
+		lock = bib_get_lock(&req->remove.ipv6);
+		spin_lock_bh(lock);
 		bib = bib_get_by_ipv6(&req->remove.ipv6, req->l4_proto);
 		break;
 	case PF_INET:
-		bib = bib_get_by_ipv4(&req->remove.ipv4, req->l4_proto);
+		lock = bib_lock_by_ipv4(&req->remove.ipv4, req->l4_proto, &bib);
+		if (!lock) {
+			log_err(ERR_BIB_NOT_FOUND, "Could not find the BIB entry requested by the user.");
+			return -ENOENT;
+		}
 		break;
 	default:
 		log_err(ERR_L3PROTO, "Unsupported network protocol: %u.", req->remove.l3_proto);
-		error = -EINVAL;
-		goto end;
+		return -EINVAL;
 	}
 
 	if (!bib) {
@@ -113,20 +130,20 @@ int delete_static_route(struct request_bib *req)
 	 * Nah.
 	 */
 
-	while (!list_empty(&bib->sessions)) {
-		session = container_of(bib->sessions.next, struct session_entry, entries_from_bib);
+	while ((session = session_first_of_bib(bib)) != NULL) {
 		if (!session_remove(session)) {
+			session_get_ipv6(session, &pair6);
 			log_err(ERR_UNKNOWN_ERROR,
 					"Session [%pI6c#%u, %pI6c#%u, %pI4#%u, %pI4#%u] refused to die.",
-					&session->ipv6.remote.address, session->ipv6.remote.l4_id,
-					&session->ipv6.local.address, session->ipv6.local.l4_id,
-					&session->ipv4.local.address, session->ipv4.local.l4_id,
-					&session->ipv4.remote.address, session->ipv4.remote.l4_id);
+					&pair6.remote.address, pair6.remote.l4_id,
+					&pair6.local.address, pair6.local.l4_id,
+					&bib->ipv4.address, bib->ipv4.l4_id,
+					&session->remote4.address, session->remote4.l4_id);
 			error = -EINVAL;
 			goto end;
 		}
-		list_del(&session->entries_from_bib);
-		kfree(session);
+		session_unlink_from_bib(session);
+		session_kfree_rcu(session);
 	}
 
 	if (!bib_remove(bib, req->l4_proto)) {
@@ -135,11 +152,12 @@ int delete_static_route(struct request_bib *req)
 		goto end;
 	}
 
-	pool4_return(req->l4_proto, &bib->ipv4);
-	kfree(bib);
+	if (bib_release_port(bib, req->l4_proto))
+		pool4_return(req->l4_proto, &bib->ipv4);
+	bib_kfree_rcu(bib);
 	/* Fall through. */
 
 end:
-	spin_unlock_bh(&bib_session_lock);
+	spin_unlock_bh(lock);
 	return error;
 }
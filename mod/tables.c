@@ -0,0 +1,169 @@
+#include "nat64/mod/tables.h"
+#include "nat64/comm/constants.h"
+#include "nat64/comm/types.h"
+#include "nat64/mod/bib.h"
+#include "nat64/mod/session.h"
+#include "nat64/mod/pool4.h"
+
+#include <linux/spinlock.h>
+#include <linux/log2.h>
+#include <linux/in.h>
+
+
+/** Current configuration of the BIB and session tables. */
+static struct tables_config config;
+static DEFINE_SPINLOCK(config_lock);
+
+
+/**
+ * Returns -EINVAL if "slots" are not acceptable size limits for the "name" tables.
+ */
+static int validate_slots(char *name, struct table_slots *slots)
+{
+	if (!is_power_of_2(slots->min) || !is_power_of_2(slots->max)) {
+		log_err(ERR_TABLE_SLOTS, "The %s table sizes (%u, %u) have to be powers of two.", name,
+				slots->min, slots->max);
+		return -EINVAL;
+	}
+	if (slots->min < TABLES_MIN_SLOTS || slots->max > TABLES_MAX_SLOTS) {
+		log_err(ERR_TABLE_SLOTS, "The %s table sizes (%u, %u) are out of bounds (%u-%u).", name,
+				slots->min, slots->max, TABLES_MIN_SLOTS, TABLES_MAX_SLOTS);
+		return -EINVAL;
+	}
+	if (slots->min > slots->max) {
+		log_err(ERR_TABLE_SLOTS, "The minimum size of the %s tables (%u) is larger than their "
+				"maximum size (%u).", name, slots->min, slots->max);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int apply_slots(u_int8_t l4protocol, struct table_slots *slots)
+{
+	int error;
+
+	error = bib_set_size_limits(l4protocol, slots->min, slots->max);
+	if (error)
+		return error;
+	return session_set_size_limits(l4protocol, slots->min, slots->max);
+}
+
+/**
+ * Hands "new_config" to the BIB and session tables.
+ * Assumes "new_config" has already been validated, so it only fails on bugs.
+ */
+static int apply_config(struct tables_config *new_config)
+{
+	int error;
+
+	bib_set_load_limits(new_config->max_load, new_config->min_load);
+	session_set_load_limits(new_config->max_load, new_config->min_load);
+	session_set_cleaner_batch(new_config->cleaner_batch);
+
+	error = apply_slots(IPPROTO_UDP, &new_config->udp_slots);
+	if (error)
+		return error;
+	error = apply_slots(IPPROTO_TCP, &new_config->tcp_slots);
+	if (error)
+		return error;
+	return apply_slots(IPPROTO_ICMP, &new_config->icmp_slots);
+}
+
+int tables_init(struct table_slots *udp_slots, struct table_slots *tcp_slots,
+		struct table_slots *icmp_slots)
+{
+	int error;
+
+	error = validate_slots("UDP", udp_slots);
+	if (error)
+		return error;
+	error = validate_slots("TCP", tcp_slots);
+	if (error)
+		return error;
+	error = validate_slots("ICMP", icmp_slots);
+	if (error)
+		return error;
+
+	spin_lock_bh(&config_lock);
+	config.max_load = TABLES_DEF_MAX_LOAD;
+	config.min_load = TABLES_DEF_MIN_LOAD;
+	config.cleaner_batch = TABLES_DEF_CLEANER_BATCH;
+	config.udp_slots = *udp_slots;
+	config.tcp_slots = *tcp_slots;
+	config.icmp_slots = *icmp_slots;
+	error = apply_config(&config);
+	spin_unlock_bh(&config_lock);
+
+	return error;
+}
+
+void tables_destroy(void)
+{
+	/* No code. */
+}
+
+int clone_tables_config(struct tables_config *clone)
+{
+	spin_lock_bh(&config_lock);
+	*clone = config;
+	spin_unlock_bh(&config_lock);
+
+	session_get_cleaner_stats(&clone->cleaner_stats);
+	bib_get_cache_stats(&clone->bib_cache);
+	session_get_cache_stats(&clone->session_cache);
+	pool4_get_magazine_stats(&clone->pool4_magazines);
+	return 0;
+}
+
+int set_tables_config(__u32 operation, struct tables_config *new_config)
+{
+	struct tables_config tmp;
+	int error;
+
+	spin_lock_bh(&config_lock);
+
+	tmp = config;
+	if (operation & MAX_LOAD_MASK)
+		tmp.max_load = new_config->max_load;
+	if (operation & MIN_LOAD_MASK)
+		tmp.min_load = new_config->min_load;
+	if (operation & CLEANER_BATCH_MASK)
+		tmp.cleaner_batch = new_config->cleaner_batch;
+	if (operation & UDP_SLOTS_MASK)
+		tmp.udp_slots = new_config->udp_slots;
+	if (operation & TCP_SLOTS_MASK)
+		tmp.tcp_slots = new_config->tcp_slots;
+	if (operation & ICMP_SLOTS_MASK)
+		tmp.icmp_slots = new_config->icmp_slots;
+
+	if (tmp.max_load == 0) {
+		spin_unlock_bh(&config_lock);
+		log_err(ERR_LOAD_LIMITS, "The maximum load factor cannot be zero.");
+		return -EINVAL;
+	}
+	/* Otherwise a table which just grew could immediately want to shrink, and vice versa. */
+	if (2 * tmp.min_load >= tmp.max_load) {
+		spin_unlock_bh(&config_lock);
+		log_err(ERR_LOAD_LIMITS, "The minimum load factor (%u) has to be less than half of the "
+				"maximum load factor (%u).", tmp.min_load, tmp.max_load);
+		return -EINVAL;
+	}
+	if (tmp.cleaner_batch == 0) {
+		spin_unlock_bh(&config_lock);
+		log_err(ERR_CLEANER_BATCH, "The session cleaner's batch size cannot be zero.");
+		return -EINVAL;
+	}
+	if (validate_slots("UDP", &tmp.udp_slots)
+			|| validate_slots("TCP", &tmp.tcp_slots)
+			|| validate_slots("ICMP", &tmp.icmp_slots)) {
+		spin_unlock_bh(&config_lock);
+		return -EINVAL;
+	}
+
+	config = tmp;
+	error = apply_config(&config);
+
+	spin_unlock_bh(&config_lock);
+	return error;
+}
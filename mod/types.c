@@ -2,6 +2,7 @@
 
 #include <linux/icmp.h>
 #include <linux/icmpv6.h>
+#include <linux/jhash.h>
 #include <net/ipv6.h>
 
 
@@ -43,9 +44,28 @@ bool ipv4_tuple_addr_equals(struct ipv4_tuple_address *expected, struct ipv4_tup
 	return true;
 }
 
-__u16 ipv4_tuple_addr_hashcode(struct ipv4_tuple_address *address)
+__u32 ipv4_addr_hashcode(struct in_addr *address, __u32 seed)
 {
-	return (address != NULL) ? address->l4_id : 0;
+	if (address == NULL)
+		return 0;
+
+	return jhash_1word(address->s_addr, seed);
+}
+
+__u32 ipv6_addr_hashcode(struct in6_addr *address, __u32 seed)
+{
+	if (address == NULL)
+		return 0;
+
+	return jhash2(address->s6_addr32, 4, seed);
+}
+
+__u32 ipv4_tuple_addr_hashcode(struct ipv4_tuple_address *address, __u32 seed)
+{
+	if (address == NULL)
+		return 0;
+
+	return jhash_2words(address->address.s_addr, address->l4_id, seed);
 }
 
 bool ipv6_tuple_addr_equals(struct ipv6_tuple_address *expected, struct ipv6_tuple_address *actual)
@@ -62,24 +82,17 @@ bool ipv6_tuple_addr_equals(struct ipv6_tuple_address *expected, struct ipv6_tup
 	return true;
 }
 
-__u16 ipv6_tuple_addr_hashcode(struct ipv6_tuple_address *address)
+__u32 ipv6_tuple_addr_hashcode(struct ipv6_tuple_address *address, __u32 seed)
 {
-	/*
-	 * address->l4_id would perhaps be the logical hash code, since it's usually random,
-	 * but during bib_get_by_ipv6_only() we need to ignore it during lookup
-	 * so this needs to be a little more creative.
-	 */
-
-	__u16 i;
-	__u16 result = 1;
+	__u32 words[5];
 
 	if (address == NULL)
 		return 0;
 
-	for (i = 0; i < 8; i++)
-		result = 31 * result + ntohs(address->address.s6_addr16[i]);
+	memcpy(&words[0], &address->address, sizeof(address->address));
+	words[4] = address->l4_id;
 
-	return result;
+	return jhash2(words, ARRAY_SIZE(words), seed);
 }
 
 bool ipv4_pair_equals(struct ipv4_pair *pair_1, struct ipv4_pair *pair_2)
@@ -110,37 +123,31 @@ bool ipv6_pair_equals(struct ipv6_pair *pair_1, struct ipv6_pair *pair_2)
 	return true;
 }
 
-__u16 ipv4_pair_hashcode(struct ipv4_pair *pair)
+__u32 ipv4_pair_hashcode(struct ipv4_pair *pair, __u32 seed)
 {
 	/*
-	 * pair->remote.l4_id would perhaps be the logical hash code, since it's usually random,
-	 * but during session_allow() we need to ignore it during lookup
-	 * so this needs to be a little more creative.
+	 * pair->remote.l4_id would perhaps be part of the hash code, but during session_allow() we need
+	 * to ignore it during lookup, so everything else is hashed.
 	 */
-
-	union ipv4_addr_union {
-		__be32 by32;
-		__be16 by16[2];
-	} local, remote;
-	__u16 result = 1;
-
 	if (pair == NULL)
 		return 0;
 
-	local.by32 = pair->local.address.s_addr;
-	remote.by32 = pair->remote.address.s_addr;
-
-	result = 31 * result + ntohs(local.by16[0]);
-	result = 31 * result + ntohs(remote.by16[0]);
-	result = 31 * result + ntohs(local.by16[1]);
-	result = 31 * result + ntohs(remote.by16[1]);
-
-	return result;
+	return jhash_3words(pair->local.address.s_addr, pair->remote.address.s_addr,
+			pair->local.l4_id, seed);
 }
 
-__u16 ipv6_pair_hashcode(struct ipv6_pair *pair)
+__u32 ipv6_pair_hashcode(struct ipv6_pair *pair, __u32 seed)
 {
-	return (pair != NULL) ? pair->local.l4_id : 0;
+	__u32 words[9];
+
+	if (pair == NULL)
+		return 0;
+
+	memcpy(&words[0], &pair->local.address, sizeof(pair->local.address));
+	memcpy(&words[4], &pair->remote.address, sizeof(pair->remote.address));
+	words[8] = ((__u32) pair->local.l4_id << 16) | pair->remote.l4_id;
+
+	return jhash2(words, ARRAY_SIZE(words), seed);
 }
 
 bool ipv6_prefix_equals(struct ipv6_prefix *expected, struct ipv6_prefix *actual)
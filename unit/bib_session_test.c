@@ -19,11 +19,11 @@ MODULE_DESCRIPTION("BIB-Session module test.");
 #define PRINT_BIB(bib) \
 	&bib->ipv4.address, bib->ipv4.l4_id, \
 	&bib->ipv6.address, bib->ipv6.l4_id
-#define PRINT_SESSION(session) \
-	&session->ipv4.remote.address, session->ipv4.remote.l4_id, \
-	&session->ipv4.local.address, session->ipv4.local.l4_id, \
-	&session->ipv6.local.address, session->ipv6.local.l4_id, \
-	&session->ipv6.remote.address, session->ipv6.remote.l4_id
+#define PRINT_SESSION(pair4, pair6) \
+	&(pair4)->remote.address, (pair4)->remote.l4_id, \
+	&(pair4)->local.address, (pair4)->local.l4_id, \
+	&(pair6)->local.address, (pair6)->local.l4_id, \
+	&(pair6)->remote.address, (pair6)->remote.l4_id
 
 const char* IPV4_ADDRS[] = { "0.0.0.0", "255.1.2.3", "65.0.123.2", "0.1.0.3",
 		"55.55.55.55", "10.11.12.13", "13.12.11.10", "255.255.255.255",
@@ -58,28 +58,28 @@ struct bib_entry *create_bib_entry(int ipv4_index, int ipv6_index)
 	return bib_create(&addr4[ipv4_index], &addr6[ipv6_index], false);
 }
 
-struct session_entry *create_session_entry(int remote_id_4, int local_id_4,
-		int local_id_6, int remote_id_6,
-		struct bib_entry* bib, u_int8_t l4protocol, unsigned int dying_time)
+/**
+ * The session's IPv6 remote and IPv4 local transport addresses are "bib"'s, like in real life.
+ * The IPv6 local address is the IPv4 remote one, under the pool6 prefix.
+ */
+struct session_entry *create_session_entry(int remote_id_4, struct bib_entry* bib,
+		u_int8_t l4protocol, unsigned int dying_time)
 {
-	struct ipv4_pair pair_4 = {
-			.remote = addr4[remote_id_4],
-			.local = addr4[local_id_4],
-	};
-	struct ipv6_pair pair_6 = {
-			.local = addr6[local_id_6],
-			.remote = addr6[remote_id_6],
-	};
+	struct session_entry* entry;
+	struct ipv6_prefix prefix;
+	struct in6_addr local6;
+
+	if (!pool6_peek(&prefix))
+		return NULL;
+	if (!addr_4to6(&addr4[remote_id_4].address, &prefix, &local6))
+		return NULL;
 
-	struct session_entry* entry = session_create(&pair_4, &pair_6, l4protocol);
+	entry = session_create(bib, &addr4[remote_id_4], &local6, l4protocol);
 	if (!entry)
 		return NULL;
 
 	entry->dying_time = dying_time;
-	if (bib) {
-		entry->bib = bib;
-		list_add(&entry->entries_from_bib, &bib->sessions);
-	}
+	session_link_to_bib(entry);
 
 	return entry;
 }
@@ -104,13 +104,13 @@ static struct bib_entry *create_and_insert_bib(int ipv4_index, int ipv6_index, i
 	return result;
 }
 
-static struct session_entry *create_and_insert_session(int remote4_id, int local4_id, int local6_id,
-		int remote6_id, struct bib_entry* bib, u_int8_t l4protocol, unsigned int dying_time)
+static struct session_entry *create_and_insert_session(int remote4_id, struct bib_entry* bib,
+		u_int8_t l4protocol, unsigned int dying_time)
 {
 	struct session_entry *result;
 	int error;
 
-	result = create_session_entry(remote4_id, local4_id, local6_id, remote6_id, bib, l4protocol, dying_time);
+	result = create_session_entry(remote4_id, bib, l4protocol, dying_time);
 	if (!result) {
 		log_warning("Could not allocate a session entry.");
 		return NULL;
@@ -149,25 +149,38 @@ bool assert_bib_entry_equals(struct bib_entry* expected, struct bib_entry* actua
 	return true;
 }
 
-bool assert_session_entry_equals(struct session_entry* expected, struct session_entry* actual,
-		char* test_name)
+/**
+ * Sessions do not store all of their addresses, and their BIBs might be dead by the time they're
+ * compared, so the expected sessions are represented by their addresses.
+ * "expected4" and "expected6" being NULL means "actual" is expected to be NULL.
+ */
+bool assert_session_entry_equals(struct ipv4_pair *expected4, struct ipv6_pair *expected6,
+		struct session_entry* actual, char* test_name)
 {
-	if (expected == actual)
+	struct ipv4_pair actual4;
+	struct ipv6_pair actual6;
+
+	if (!expected4 && !actual)
 		return true;
 
-	if (expected == NULL) {
+	if (actual) {
+		session_get_ipv4(actual, &actual4);
+		session_get_ipv6(actual, &actual6);
+	}
+
+	if (expected4 == NULL) {
 		log_warning("Test '%s' failed: Expected null, obtained " SESSION_PRINT_KEY ".",
-				test_name, PRINT_SESSION(actual));
+				test_name, PRINT_SESSION(&actual4, &actual6));
 		return false;
 	}
 	if (actual == NULL) {
 		log_warning("Test '%s' failed: Expected " SESSION_PRINT_KEY ", got null.",
-				test_name, PRINT_SESSION(expected));
+				test_name, PRINT_SESSION(expected4, expected6));
 		return false;
 	}
-	if (!session_entry_equals(expected, actual)) {
+	if (!ipv4_pair_equals(expected4, &actual4) || !ipv6_pair_equals(expected6, &actual6)) {
 		log_warning("Test '%s' failed: Expected " SESSION_PRINT_KEY ", got " SESSION_PRINT_KEY ".",
-				test_name, PRINT_SESSION(expected), PRINT_SESSION(actual));
+				test_name, PRINT_SESSION(expected4, expected6), PRINT_SESSION(&actual4, &actual6));
 		return false;
 	}
 
@@ -207,9 +220,10 @@ bool assert_bib(char* test_name, struct bib_entry* bib,
 }
 
 /**
- * Same as assert_bib(), except asserting session entries on the session table.
+ * Same as assert_bib(), except asserting the session whose addresses are "pair_4" and "pair_6" on
+ * the session table.
  */
-bool assert_session(char* test_name, struct session_entry* session,
+bool assert_session(char* test_name, struct ipv4_pair *pair_4, struct ipv6_pair *pair_6,
 		bool udp_table_has_it, bool tcp_table_has_it, bool icmp_table_has_it)
 {
 	u_int8_t l4protocols[] = { IPPROTO_UDP, IPPROTO_TCP, IPPROTO_ICMP };
@@ -217,17 +231,16 @@ bool assert_session(char* test_name, struct session_entry* session,
 	int i;
 
 	for (i = 0; i < 3; i++) {
-		struct ipv4_pair pair_4 = { session->ipv4.remote, session->ipv4.local };
-		struct ipv6_pair pair_6 = { session->ipv6.local, session->ipv6.remote };
-		struct session_entry *expected_session = table_has_it[i] ? session : NULL;
+		struct ipv4_pair *expected4 = table_has_it[i] ? pair_4 : NULL;
+		struct ipv6_pair *expected6 = table_has_it[i] ? pair_6 : NULL;
 		struct session_entry *retrieved_session;
 
-		retrieved_session = session_get_by_ipv4(&pair_4, l4protocols[i]);
-		if (!assert_session_entry_equals(expected_session, retrieved_session, test_name))
+		retrieved_session = session_get_by_ipv4(pair_4, l4protocols[i]);
+		if (!assert_session_entry_equals(expected4, expected6, retrieved_session, test_name))
 			return false;
 
-		retrieved_session = session_get_by_ipv6(&pair_6, l4protocols[i]);
-		if (!assert_session_entry_equals(expected_session, retrieved_session, test_name))
+		retrieved_session = session_get_by_ipv6(pair_6, l4protocols[i]);
+		if (!assert_session_entry_equals(expected4, expected6, retrieved_session, test_name))
 			return false;
 	}
 
@@ -266,41 +279,142 @@ bool simple_bib(void)
 	if (!success)
 		return false;
 
-	kfree(bib);
+	bib_kfree(bib);
 	return success;
 }
 
 bool simple_session(void)
 {
+	struct bib_entry *bib;
 	struct session_entry *session;
+	struct ipv4_pair pair4;
+	struct ipv6_pair pair6;
 	bool success = true;
 
-	session = create_session_entry(1, 0, 1, 0, NULL, IPPROTO_TCP, 12345);
+	bib = create_bib_entry(0, 0);
+	if (!assert_not_null(bib, "Allocation of test BIB entry"))
+		return false;
+	session = create_session_entry(1, bib, IPPROTO_TCP, 12345);
 	if (!assert_not_null(session, "Allocation of test session entry"))
 		return false;
+	session_get_ipv4(session, &pair4);
+	session_get_ipv6(session, &pair6);
 
 	success &= assert_equals_int(0, session_add(session), "Session insertion call");
-	success &= assert_session("Session insertion state", session, false, true, false);
+	success &= assert_session("Session insertion state", &pair4, &pair6, false, true, false);
 	if (!success)
 		return false; /* See simple_bib(). */
 
 	success &= assert_true(session_remove(session), "Session removal call");
-	success &= assert_session("Session removal state", session, false, false, false);
+	success &= assert_session("Session removal state", &pair4, &pair6, false, false, false);
 	if (!success)
 		return false;
 
-	kfree(session);
+	session_unlink_from_bib(session);
+	session_kfree(session);
+	bib_kfree(bib);
 	return true;
 }
 
+bool test_derived_addresses(void)
+{
+	struct bib_entry *bib;
+	struct session_entry *session;
+	struct ipv6_prefix prefix;
+	struct ipv4_pair pair4;
+	struct ipv6_pair pair6;
+	struct in6_addr local6;
+	bool success = true;
+
+	if (!pool6_peek(&prefix))
+		return false;
+	bib = create_and_insert_bib(0, 0, IPPROTO_ICMP);
+	if (!bib)
+		return false;
+
+	/* (X', x) and (T, t) come from the BIB, (Y', y) from (Z, z). */
+	session = create_and_insert_session(1, bib, IPPROTO_UDP, 12345);
+	if (!session)
+		return false;
+	session_get_ipv4(session, &pair4);
+	session_get_ipv6(session, &pair6);
+	success &= assert_true(addr_4to6(&addr4[1].address, &prefix, &local6), "4to6");
+	success &= assert_true(ipv4_tuple_addr_equals(&addr4[0], &pair4.local), "T, t");
+	success &= assert_true(ipv4_tuple_addr_equals(&addr4[1], &pair4.remote), "Z, z");
+	success &= assert_true(ipv6_tuple_addr_equals(&addr6[0], &pair6.remote), "X', x");
+	success &= assert_equals_ipv6(&local6, &pair6.local.address, "Y'");
+	success &= assert_equals_u16(addr4[1].l4_id, pair6.local.l4_id, "y");
+
+	/* ICMP sessions use the same identifier on both sides of the IPv6 network. */
+	session = create_and_insert_session(1, bib, IPPROTO_ICMP, 12345);
+	if (!session)
+		return false;
+	session_get_ipv6(session, &pair6);
+	success &= assert_equals_u16(addr6[0].l4_id, pair6.local.l4_id, "ICMP y");
+
+	/* Y' has to be the one RFC 6052 would have generated, or it could not be derived later. */
+	local6.s6_addr[15]++;
+	success &= assert_null(session_create(bib, &addr4[1], &local6, IPPROTO_UDP), "Bogus Y'");
+	success &= assert_null(session_create(NULL, &addr4[1], &local6, IPPROTO_UDP), "No BIB");
+
+	return success;
+}
+
+bool test_bib_links(void)
+{
+	struct bib_entry *bib;
+	struct session_entry *s1, *s2, *s3;
+	bool success = true;
+
+	bib = create_and_insert_bib(0, 0, IPPROTO_UDP);
+	if (!bib)
+		return false;
+	success &= assert_null(session_first_of_bib(bib), "No sessions yet");
+
+	s1 = create_and_insert_session(5, bib, IPPROTO_UDP, 12345);
+	s2 = create_and_insert_session(6, bib, IPPROTO_UDP, 12345);
+	s3 = create_and_insert_session(7, bib, IPPROTO_UDP, 12345);
+	if (!s1 || !s2 || !s3)
+		return false;
+
+	/* The handles lead back to the objects. */
+	success &= assert_equals_ptr(s1, get_session(s1->handle), "Handle");
+
+	/* Sessions are added to the front. */
+	success &= assert_equals_ptr(s3, session_first_of_bib(bib), "First");
+	success &= assert_equals_ptr(s2, get_session(s3->next_in_bib), "Second");
+	success &= assert_equals_ptr(s1, get_session(s2->next_in_bib), "Third");
+	success &= assert_null(get_session(s1->next_in_bib), "End");
+
+	/* Unlinking the middle one stitches its neighbours together. */
+	success &= assert_true(session_remove(s2), "Remove 2");
+	session_unlink_from_bib(s2);
+	session_kfree(s2);
+	success &= assert_equals_ptr(s1, get_session(s3->next_in_bib), "Stitched forwards");
+	success &= assert_equals_ptr(s3, get_session(s1->prev_in_bib), "Stitched backwards");
+
+	/* Unlinking the first one moves the BIB's head. */
+	success &= assert_true(session_remove(s3), "Remove 3");
+	session_unlink_from_bib(s3);
+	session_kfree(s3);
+	success &= assert_equals_ptr(s1, session_first_of_bib(bib), "New first");
+	success &= assert_null(get_session(s1->prev_in_bib), "New first has no predecessor");
+
+	/* s1 and the BIB are left in the tables; end() tears them down along with the arenas. */
+	return success;
+}
+
 #define BIB_COUNT 4
 #define SESSIONS_PER_BIB 3
 
 #define ASSERT_SINGLE_BIB(test_name, bib_id, bib_is_alive, s1_is_alive, s2_is_alive, s3_is_alive) \
 		assert_bib(test_name, &bibs[bib_id], bib_is_alive, false, false) \
-				& assert_session(test_name, &sessions[bib_id][0], s1_is_alive, false, false) \
-				& assert_session(test_name, &sessions[bib_id][1], s2_is_alive, false, false) \
-				& assert_session(test_name, &sessions[bib_id][2], s3_is_alive, false, false)
+				& assert_session(test_name, &sessions4[bib_id][0], &sessions6[bib_id][0], \
+						s1_is_alive, false, false) \
+				& assert_session(test_name, &sessions4[bib_id][1], &sessions6[bib_id][1], \
+						s2_is_alive, false, false) \
+				& assert_session(test_name, &sessions4[bib_id][2], &sessions6[bib_id][2], \
+						s3_is_alive, false, false)
 
 /*
  * The following fields are global because they don't fit in test_clean_old_sessions()'s frame
@@ -313,8 +427,42 @@ struct bib_entry *db_bibs[BIB_COUNT];
 struct session_entry *db_sessions[BIB_COUNT][SESSIONS_PER_BIB];
 /** Copies of db_bibs. We need this because clean_expired_sessions() kfrees the DB entries. */
 struct bib_entry bibs[BIB_COUNT];
-/** Copies of db_sessions. We need this because clean_expired_sessions() kfrees the DB entries. */
-struct session_entry sessions[BIB_COUNT][SESSIONS_PER_BIB];
+/**
+ * Addresses of db_sessions. We need this because clean_expired_sessions() kfrees the DB entries
+ * (and their BIBs, which hold half of the addresses).
+ */
+struct ipv4_pair sessions4[BIB_COUNT][SESSIONS_PER_BIB];
+struct ipv6_pair sessions6[BIB_COUNT][SESSIONS_PER_BIB];
+
+/** Runs every shard's cleaner once. */
+static void clean_all_shards(void)
+{
+	unsigned int i, next_dying_time;
+
+	for (i = 0; i < shard_count; i++)
+		clean_expired_sessions(shards[i], &next_dying_time);
+}
+
+/**
+ * Makes "session" expire at "dying_time", which is assumed to be in the past. Lifetimes only grow
+ * in real life, so this also moves the session to the front of its queue, where it would have
+ * ended up had it not been refreshed.
+ */
+static void expire_session(struct session_entry *session, unsigned int dying_time)
+{
+	struct session_queue *queue = &get_expire_queue(session)->sessions[session->timer_type];
+
+	session->dying_time = dying_time;
+	queue_del(queue, session);
+
+	session->prev_in_queue = ENTRY_NULL;
+	session->next_in_queue = queue->first;
+	if (queue->first != ENTRY_NULL)
+		get_session(queue->first)->prev_in_queue = session->handle;
+	else
+		queue->last = session->handle;
+	queue->first = session->handle;
+}
 
 bool test_clean_old_sessions(void)
 {
@@ -331,11 +479,12 @@ bool test_clean_old_sessions(void)
 			return false;
 
 		for (s = 0; s < SESSIONS_PER_BIB; s++) {
-			db_sessions[b][s] = create_and_insert_session(b, s + 5, b, s + 5, db_bibs[b], IPPROTO_UDP, after);
+			db_sessions[b][s] = create_and_insert_session(s + 5, db_bibs[b], IPPROTO_UDP, after);
 			if (!db_sessions[b][s])
 				return false;
 
-			memcpy(&sessions[b][s], db_sessions[b][s], sizeof(struct session_entry));
+			session_get_ipv4(db_sessions[b][s], &sessions4[b][s]);
+			session_get_ipv6(db_sessions[b][s], &sessions6[b][s]);
 		}
 
 		memcpy(&bibs[b], db_bibs[b], sizeof(struct bib_entry));
@@ -344,7 +493,7 @@ bool test_clean_old_sessions(void)
 	db_bibs[3]->is_static = true;
 
 	/* 1. Nothing has expired: Test nothing gets deleted. */
-	clean_expired_sessions();
+	clean_all_shards();
 
 	success &= ASSERT_SINGLE_BIB("Clean deletes nothing", 0, true, true, true, true);
 	success &= ASSERT_SINGLE_BIB("Clean deletes nothing", 1, true, true, true, true);
@@ -355,11 +504,11 @@ bool test_clean_old_sessions(void)
 		return false;
 
 	/* 2. All of a single BIB's sessions expire: Test both BIBs and Sessions die. */
-	db_sessions[1][0]->dying_time = before;
-	db_sessions[1][1]->dying_time = before;
-	db_sessions[1][2]->dying_time = before;
+	expire_session(db_sessions[1][0], before);
+	expire_session(db_sessions[1][1], before);
+	expire_session(db_sessions[1][2], before);
 
-	clean_expired_sessions();
+	clean_all_shards();
 
 	success &= ASSERT_SINGLE_BIB("Whole BIB dies 0", 0, true, true, true, true);
 	success &= ASSERT_SINGLE_BIB("Whole BIB dies 1", 1, false, false, false, false);
@@ -370,10 +519,10 @@ bool test_clean_old_sessions(void)
 		return false;
 
 	/* 3. Some sessions of a BIB expire: Test only those sessions get deleted. */
-	db_sessions[2][0]->dying_time = before;
-	db_sessions[2][1]->dying_time = before;
+	expire_session(db_sessions[2][0], before);
+	expire_session(db_sessions[2][1], before);
 
-	clean_expired_sessions();
+	clean_all_shards();
 
 	success &= ASSERT_SINGLE_BIB("Some sessions die", 0, true, true, true, true);
 	success &= ASSERT_SINGLE_BIB("Some sessions die", 1, false, false, false, false);
@@ -384,9 +533,9 @@ bool test_clean_old_sessions(void)
 		return false;
 
 	/* 4. The rest of them expire: Test the BIB keeps keeps behaving as expected. */
-	db_sessions[2][2]->dying_time = before;
+	expire_session(db_sessions[2][2], before);
 
-	clean_expired_sessions();
+	clean_all_shards();
 
 	success &= ASSERT_SINGLE_BIB("Last session dies", 0, true, true, true, true);
 	success &= ASSERT_SINGLE_BIB("Last session dies", 1, false, false, false, false);
@@ -397,11 +546,11 @@ bool test_clean_old_sessions(void)
 		return false;
 
 	/* 5. The sessions of a static BIB expire. Test only the sessions ones die. */
-	db_sessions[3][0]->dying_time = before;
-	db_sessions[3][1]->dying_time = before;
-	db_sessions[3][2]->dying_time = before;
+	expire_session(db_sessions[3][0], before);
+	expire_session(db_sessions[3][1], before);
+	expire_session(db_sessions[3][2], before);
 
-	clean_expired_sessions();
+	clean_all_shards();
 
 	success &= ASSERT_SINGLE_BIB("Static session doesn't die", 0, true, true, true, true);
 	success &= ASSERT_SINGLE_BIB("Static session doesn't die", 1, false, false, false, false);
@@ -416,6 +565,279 @@ bool test_clean_old_sessions(void)
 #undef SESSIONS_PER_BIB
 #undef ASSERT_SINGLE_BIB
 
+/** Asserts "list" holds exactly "s1", "s2" and "s3" (NULL meaning "nothing"), in that order. */
+static bool assert_queue(char *test_name, struct session_queue *list, struct session_entry *s1,
+		struct session_entry *s2, struct session_entry *s3)
+{
+	struct session_entry *expected[] = { s1, s2, s3 };
+	struct session_entry *session, *prev = NULL;
+	int i = 0;
+	bool success = true;
+
+	session = get_session(list->first);
+	while (session) {
+		if (i >= ARRAY_SIZE(expected) || !expected[i])
+			return assert_true(false, test_name);
+		success &= assert_equals_ptr(expected[i], session, test_name);
+		success &= assert_equals_ptr(prev, get_session(session->prev_in_queue), test_name);
+		prev = session;
+		session = get_session(session->next_in_queue);
+		i++;
+	}
+	success &= assert_equals_ptr(prev, get_session(list->last), test_name);
+
+	if (i < ARRAY_SIZE(expected))
+		success &= assert_null(expected[i], test_name);
+	return success;
+}
+
+bool test_expiration_queues(void)
+{
+	struct bib_entry *bib;
+	struct session_entry *s1, *s2, *s3;
+	struct expire_queue *queue;
+	struct session_shard *shard;
+	const unsigned int after = jiffies_to_msecs(jiffies) + 1000;
+	bool success = true;
+
+	bib = create_and_insert_bib(0, 0, IPPROTO_UDP);
+	if (!bib)
+		return false;
+	s1 = create_and_insert_session(5, bib, IPPROTO_UDP, after);
+	s2 = create_and_insert_session(6, bib, IPPROTO_UDP, after);
+	s3 = create_and_insert_session(7, bib, IPPROTO_UDP, after);
+	if (!s1 || !s2 || !s3)
+		return false;
+
+	/* The sessions share a BIB, so they share a queue. */
+	queue = get_expire_queue(s1);
+	shard = get_shard_by_ipv6(&s1->bib->ipv6);
+	success &= assert_queue("Insertion order", &queue->sessions[SESSION_TIMER_UDP], s1, s2, s3);
+	success &= assert_true(delayed_work_pending(&shard->expire_work), "Insertion arms the cleaner");
+
+	/* Refreshes move sessions to the tail. */
+	session_set_lifetime(s1, 2000, SESSION_TIMER_UDP);
+	success &= assert_queue("Refresh", &queue->sessions[SESSION_TIMER_UDP], s2, s3, s1);
+
+	/* And to other queues, if the timeout changes. */
+	session_set_lifetime(s2, 2000, SESSION_TIMER_TCP_SYN);
+	success &= assert_queue("Type change-old", &queue->sessions[SESSION_TIMER_UDP], s3, s1, NULL);
+	success &= assert_queue("Type change-new", &queue->sessions[SESSION_TIMER_TCP_SYN], s2, NULL,
+			NULL);
+
+	/* The cleaner only removes from the fronts, and leaves the timer waiting for the next one. */
+	expire_session(s1, after - 2000);
+	clean_all_shards();
+	success &= assert_queue("Clean-UDP", &queue->sessions[SESSION_TIMER_UDP], s3, NULL, NULL);
+	success &= assert_queue("Clean-SYN", &queue->sessions[SESSION_TIMER_TCP_SYN], s2, NULL, NULL);
+
+	/* Removal unqueues. */
+	success &= assert_true(session_remove(s2), "Remove");
+	success &= assert_queue("Remove", &queue->sessions[SESSION_TIMER_TCP_SYN], NULL, NULL, NULL);
+	session_unlink_from_bib(s2);
+	session_kfree(s2);
+
+	return success;
+}
+
+bool test_cleaner_batches(void)
+{
+	struct bib_entry *bib;
+	struct session_entry *s1, *s2, *s3;
+	struct cleaner_stats stats;
+	struct ipv6_tuple_address ipv6;
+	const unsigned int before = jiffies_to_msecs(jiffies) - 1000;
+	bool success = true;
+
+	bib = create_and_insert_bib(0, 0, IPPROTO_UDP);
+	if (!bib)
+		return false;
+	s1 = create_and_insert_session(5, bib, IPPROTO_UDP, before);
+	s2 = create_and_insert_session(6, bib, IPPROTO_UDP, before);
+	s3 = create_and_insert_session(7, bib, IPPROTO_UDP, before);
+	if (!s1 || !s2 || !s3)
+		return false;
+	ipv6 = bib->ipv6;
+
+	/* The sessions share a lock, so the cleaner has to let go of it between them. */
+	session_set_cleaner_batch(1);
+	clean_all_shards();
+
+	session_get_cleaner_stats(&stats);
+	success &= assert_equals_u32(shard_count, stats.runs, "Runs");
+	success &= assert_equals_u32(3, stats.sessions, "Sessions");
+	success &= assert_true(stats.yields >= 2, "Yields");
+	success &= assert_true(stats.max_ns >= stats.last_ns, "Longest run");
+	success &= assert_true(stats.total_ns >= stats.max_ns, "Added runs");
+
+	rcu_read_lock();
+	success &= assert_null(bib_get_by_ipv6(&ipv6, IPPROTO_UDP), "BIB entry is gone");
+	rcu_read_unlock();
+
+	return success;
+}
+
+bool test_cache_stats(void)
+{
+	struct bib_entry *bib;
+	struct session_entry *session;
+	struct cache_stats before, after;
+	bool success = true;
+
+	bib_get_cache_stats(&before);
+	bib = create_and_insert_bib(0, 0, IPPROTO_UDP);
+	if (!bib)
+		return false;
+	bib_get_cache_stats(&after);
+	success &= assert_equals_u32(before.in_use + 1, after.in_use, "BIB in use");
+	success &= assert_equals_u32(before.allocs + 1, after.allocs, "BIB allocs");
+	success &= assert_true(after.object_size >= sizeof(struct bib_entry), "BIB object size");
+	success &= assert_equals_u32(TABLES_DEF_RESERVE_RATE, after.reserve_size, "BIB reserve size");
+	success &= assert_true(after.capacity > after.reserve_size, "BIB capacity covers the reserve");
+
+	session_get_cache_stats(&before);
+	session = create_session_entry(1, bib, IPPROTO_UDP, 12345);
+	if (!assert_not_null(session, "Allocation of test session entry"))
+		return false;
+	session_get_cache_stats(&after);
+	success &= assert_equals_u32(before.in_use + 1, after.in_use, "Session in use");
+	success &= assert_true(after.object_size >= sizeof(struct session_entry),
+			"Session object size");
+
+	session_unlink_from_bib(session);
+	session_kfree(session);
+	session_get_cache_stats(&after);
+	success &= assert_equals_u32(before.in_use, after.in_use, "Session returned");
+	success &= assert_equals_u32(before.allocs + 1, after.allocs, "Session allocs");
+
+	return success;
+}
+
+/**
+ * Checks the nodes keep track of their entries across the tables, and of the address they're paired
+ * with.
+ */
+bool test_hosts(void)
+{
+	struct ipv6_tuple_address other_port = addr6[8];
+	struct bib_entry *bib1, *bib2, *bib3;
+	struct in_addr result;
+	bool success = true;
+
+	success &= assert_false(bib_get_host_ipv4(&addr6[8].address, &result), "No host yet");
+
+	bib1 = create_and_insert_bib(8, 8, IPPROTO_TCP);
+	if (!bib1)
+		return false;
+	other_port.l4_id++;
+	bib2 = bib_create(&addr4[9], &other_port, false);
+	if (!assert_not_null(bib2, "Allocation of the second entry"))
+		return false;
+	if (!assert_equals_int(0, bib_add(bib2, IPPROTO_UDP), "Insertion of the second entry"))
+		return false;
+	bib3 = create_and_insert_bib(10, 10, IPPROTO_UDP);
+	if (!bib3)
+		return false;
+
+	success &= assert_true(bib_get_host_ipv4(&addr6[8].address, &result), "Host lookup");
+	success &= assert_equals_ipv4(&addr4[8].address, &result, "Paired with the first entry");
+	success &= assert_equals_u32(1, bib_count_by_ipv6(&addr6[8].address, IPPROTO_TCP), "TCP count");
+	success &= assert_equals_u32(1, bib_count_by_ipv6(&addr6[8].address, IPPROTO_UDP), "UDP count");
+	success &= assert_equals_u32(0, bib_count_by_ipv6(&addr6[8].address, IPPROTO_ICMP),
+			"ICMP count");
+	success &= assert_true(bib_get_host_ipv4(&addr6[10].address, &result), "Other host lookup");
+	success &= assert_equals_ipv4(&addr4[10].address, &result, "Other host's address");
+
+	/* The host outlives its first entry, and keeps its address. */
+	success &= assert_true(bib_remove(bib1, IPPROTO_TCP), "First removal");
+	bib_kfree(bib1);
+	success &= assert_true(bib_get_host_ipv4(&addr6[8].address, &result), "Host survives");
+	success &= assert_equals_ipv4(&addr4[8].address, &result, "Address survives");
+	success &= assert_equals_u32(0, bib_count_by_ipv6(&addr6[8].address, IPPROTO_TCP),
+			"TCP count after removal");
+
+	success &= assert_true(bib_remove(bib2, IPPROTO_UDP), "Second removal");
+	bib_kfree(bib2);
+	success &= assert_false(bib_get_host_ipv4(&addr6[8].address, &result), "Host is gone");
+	success &= assert_equals_u32(0, bib_count_by_ipv6(&addr6[8].address, IPPROTO_UDP),
+			"UDP count after removal");
+	success &= assert_true(bib_get_host_ipv4(&addr6[10].address, &result), "Other host stays");
+
+	return success;
+}
+
+/**
+ * Binds two entries to the same transport address, and checks their sessions cannot collide.
+ */
+bool test_port_reuse(void)
+{
+	struct bib_entry *bib1, *bib2;
+	struct session_entry *session1, *session2, *session3, *locked;
+	struct ipv4_pair pair4;
+	spinlock_t *lock;
+	bool success = true;
+
+	bib_set_port_reuse(true);
+
+	if (!assert_equals_int(0, bib_add_shared_port(IPPROTO_UDP, &addr4[8]), "Port registration"))
+		return false;
+	bib1 = create_bib_entry(8, 8);
+	if (!assert_not_null(bib1, "Allocation of the first entry"))
+		return false;
+	bib1->is_shared = true;
+	if (!assert_equals_int(0, bib_add(bib1, IPPROTO_UDP), "Insertion of the first entry"))
+		return false;
+
+	if (!assert_true(bib_get_shared_port(IPPROTO_UDP, &addr4[8]), "Port sharing"))
+		return false;
+	bib2 = create_bib_entry(8, 9);
+	if (!assert_not_null(bib2, "Allocation of the second entry"))
+		return false;
+	bib2->is_shared = true;
+	if (!assert_equals_int(0, bib_add(bib2, IPPROTO_UDP), "Insertion of the second entry"))
+		return false;
+
+	success &= assert_null(bib_get_by_ipv4(&addr4[8], IPPROTO_UDP), "Not indexed by IPv4");
+	success &= assert_false(bib_get_shared_port(IPPROTO_UDP, &addr4[9]), "Unshared port");
+
+	/* Both entries can talk to node 1, but not from the same port. */
+	session1 = create_session_entry(1, bib1, IPPROTO_UDP, 12345);
+	session2 = create_session_entry(1, bib2, IPPROTO_UDP, 12345);
+	session3 = create_session_entry(2, bib2, IPPROTO_UDP, 12345);
+	if (!session1 || !session2 || !session3)
+		return false;
+	success &= assert_equals_int(0, session_add(session1), "First session");
+	success &= assert_equals_int(-EEXIST, session_add(session2), "Colliding session");
+	success &= assert_equals_int(0, session_add(session3), "Third session");
+	session_unlink_from_bib(session2);
+	session_kfree(session2);
+
+	/* IPv4 packets reach the right entry through the session. */
+	session_get_ipv4(session3, &pair4);
+	lock = session_lock_by_ipv4(&pair4, IPPROTO_UDP, &locked);
+	if (!assert_not_null(lock, "Lock by session"))
+		return false;
+	success &= assert_equals_ptr(session3, locked, "Locked session");
+	success &= assert_equals_ptr(bib2, locked->bib, "Locked BIB");
+	spin_unlock_bh(lock);
+
+	success &= assert_true(session_remove(session1), "First session removal");
+	session_unlink_from_bib(session1);
+	session_kfree(session1);
+	success &= assert_true(session_remove(session3), "Third session removal");
+	session_unlink_from_bib(session3);
+	session_kfree(session3);
+
+	success &= assert_true(bib_remove(bib1, IPPROTO_UDP), "First removal");
+	success &= assert_false(bib_release_port(bib1, IPPROTO_UDP), "Port still in use");
+	bib_kfree(bib1);
+	success &= assert_true(bib_remove(bib2, IPPROTO_UDP), "Second removal");
+	success &= assert_true(bib_release_port(bib2, IPPROTO_UDP), "Port released");
+	bib_kfree(bib2);
+
+	return success;
+}
+
 static bool test_address_filtering_aux(int src_addr_id, int src_port_id, int dst_addr_id,
 		int dst_port_id)
 {
@@ -441,7 +863,7 @@ bool test_address_filtering(void)
 	bib = create_and_insert_bib(0, 0, IPPROTO_UDP);
 	if (!bib)
 		return false;
-	session = create_and_insert_session(0, 0, 0, 0, bib, IPPROTO_UDP, 12345);
+	session = create_and_insert_session(0, bib, IPPROTO_UDP, 12345);
 	if (!session)
 		return false;
 
@@ -496,7 +918,7 @@ bool test_for_each(void)
 
 	success &= assert_equals_int(0, bib_for_each(IPPROTO_UDP, for_each_func, &summary), "");
 	success &= assert_true(bib_entry_equals(bib1, summary.bib1) || bib_entry_equals(bib1, summary.bib2), "");
-	success &= assert_true(bib_entry_equals(bib2, summary.bib2) || bib_entry_equals(bib2, summary.bib2), "");
+	success &= assert_true(bib_entry_equals(bib2, summary.bib1) || bib_entry_equals(bib2, summary.bib2), "");
 
 	return success;
 }
@@ -510,7 +932,7 @@ static bool session_always_dies(struct session_entry *session)
 	return false;
 }
 
-bool init(void)
+static bool init_tables(bool sharded)
 {
 	int error;
 	int i;
@@ -529,23 +951,42 @@ bool init(void)
 		addr6[i].l4_id = IPV6_PORTS[i];
 	}
 
-	error = bib_init();
+	error = pool6_init(NULL, 0);
 	if (error)
 		return false;
 
-	error = session_init(session_always_dies);
+	error = bib_init(TABLES_DEF_RESERVE_RATE);
+	if (error) {
+		pool6_destroy();
+		return false;
+	}
+
+	error = session_init(session_always_dies, sharded, TABLES_DEF_RESERVE_RATE);
 	if (error) {
 		bib_destroy();
+		pool6_destroy();
 		return false;
 	}
 
 	return true;
 }
 
+bool init(void)
+{
+	return init_tables(false);
+}
+
+bool init_sharded(void)
+{
+	return init_tables(true);
+}
+
 void end(void)
 {
 	session_destroy();
 	bib_destroy();
+	pool6_destroy();
+	bib_set_port_reuse(false);
 }
 
 int init_module(void)
@@ -554,9 +995,20 @@ int init_module(void)
 
 	INIT_CALL_END(init(), simple_bib(), end(), "Single BIB");
 	INIT_CALL_END(init(), simple_session(), end(), "Single Session");
+	INIT_CALL_END(init(), test_derived_addresses(), end(), "Derived session addresses");
+	INIT_CALL_END(init(), test_bib_links(), end(), "BIB-session links.");
 	INIT_CALL_END(init(), test_clean_old_sessions(), end(), "Session cleansing.");
 	INIT_CALL_END(init(), test_address_filtering(), end(), "Address-dependent filtering.");
 	INIT_CALL_END(init(), test_for_each(), end(), "for-each function.");
+	INIT_CALL_END(init(), test_expiration_queues(), end(), "Expiration queues.");
+	INIT_CALL_END(init(), test_cleaner_batches(), end(), "Session cleaner batches.");
+	INIT_CALL_END(init(), test_cache_stats(), end(), "Entry cache counters.");
+	INIT_CALL_END(init(), test_hosts(), end(), "Per-node index.");
+	INIT_CALL_END(init(), test_port_reuse(), end(), "Port reuse.");
+
+	INIT_CALL_END(init_sharded(), test_clean_old_sessions(), end(), "Session cleansing, sharded.");
+	INIT_CALL_END(init_sharded(), test_address_filtering(), end(), "Address filtering, sharded.");
+	INIT_CALL_END(init_sharded(), test_for_each(), end(), "for-each function, sharded.");
 
 	END_TESTS;
 }
@@ -4,6 +4,7 @@
 
 #include "nat64/unit/unit_test.h"
 #include "nat64/comm/str_utils.h"
+#include "nat64/comm/constants.h"
 #include "compute_outgoing_tuple.c"
 
 
@@ -22,22 +23,26 @@ struct in6_addr remote_ipv6, local_ipv6;
 struct in_addr local_ipv4, remote_ipv4;
 
 
+static bool session_expired_dummy(struct session_entry *session)
+{
+	/* The sessions won't live long enough. */
+	return true;
+}
+
 static bool add_bib(struct in_addr *ip4_addr, __u16 ip4_port, struct in6_addr *ip6_addr,
 		__u16 ip6_port, u_int8_t l4protocol)
 {
+	struct ipv4_tuple_address ipv4 = { .address = *ip4_addr, .l4_id = ip4_port };
+	struct ipv6_tuple_address ipv6 = { .address = *ip6_addr, .l4_id = ip6_port };
+	struct bib_entry *bib;
+
 	/* Generate the BIB. */
-	struct bib_entry *bib = kmalloc(sizeof(struct bib_entry), GFP_ATOMIC);
+	bib = bib_create(&ipv4, &ipv6, false);
 	if (!bib) {
 		log_warning("Unable to allocate a dummy BIB.");
-		goto failure;
+		return false;
 	}
 
-	bib->ipv4.address = *ip4_addr;
-	bib->ipv4.l4_id = ip4_port;
-	bib->ipv6.address = *ip6_addr;
-	bib->ipv6.l4_id = ip6_port;
-	INIT_LIST_HEAD(&bib->sessions);
-
 	/*
 	log_debug("BIB [%pI4#%u, %pI6c#%u]",
 			&bib->ipv4.address, bib->ipv4.l4_id,
@@ -53,7 +58,7 @@ static bool add_bib(struct in_addr *ip4_addr, __u16 ip4_port, struct in6_addr *i
 	return true;
 
 failure:
-	kfree(bib);
+	bib_kfree(bib);
 	return false;
 }
 
@@ -97,7 +102,9 @@ static bool init(void)
 	prefix.len = 96;
 
 	/* Init the BIB module */
-	if (bib_init() != 0)
+	if (bib_init(TABLES_DEF_RESERVE_RATE) != 0)
+		return false;
+	if (session_init(session_expired_dummy, false, TABLES_DEF_RESERVE_RATE) != 0)
 		return false;
 
 	for (i = 0; i < ARRAY_SIZE(protocols); i++)
@@ -112,6 +119,7 @@ static bool init(void)
  */
 static void cleanup(void)
 {
+	session_destroy();
 	bib_destroy();
 	pool6_destroy();
 }
@@ -162,6 +170,46 @@ static bool test_4to6(bool (*function)(struct tuple *, struct tuple *),
 	return success;
 }
 
+static bool test_prefixes(void)
+{
+	struct ipv6_prefix prefix;
+	struct ipv4_prefix subset;
+	struct in6_addr expected;
+	struct tuple incoming, outgoing;
+	bool success = true;
+
+	if (str_to_addr6("2001:db8:64::", &prefix.address) != 0
+			|| str_to_addr4("203.0.113.0", &subset.address) != 0
+			|| str_to_addr6("2001:db8:64::c0a8:2", &expected) != 0)
+		return false;
+	prefix.len = 96;
+	subset.len = 24;
+	if (!assert_equals_int(0, pool6_register(&prefix, &subset), "Register"))
+		return false;
+
+	/* IPv6 packets say which prefix they want. */
+	incoming.src.addr.ipv6 = remote_ipv6;
+	incoming.dst.addr.ipv6 = expected;
+	incoming.src.l4_id = 1500;
+	incoming.dst.l4_id = 123;
+	incoming.l3_proto = PF_INET6;
+	incoming.l4_proto = IPPROTO_UDP;
+	success &= assert_true(tuple5(&incoming, &outgoing), "6to4 call");
+	success &= assert_equals_ipv4(&remote_ipv4, &outgoing.dst.addr.ipv4, "6to4 destination");
+
+	/* IPv4 packets get the prefix whose subset is the most specific. */
+	incoming.src.addr.ipv4 = remote_ipv4;
+	incoming.dst.addr.ipv4 = local_ipv4;
+	incoming.src.l4_id = 123;
+	incoming.dst.l4_id = 80;
+	incoming.l3_proto = PF_INET;
+	success &= assert_true(tuple5(&incoming, &outgoing), "4to6 call");
+	success &= assert_equals_ipv6(&expected, &outgoing.src.addr.ipv6, "4to6 source");
+
+	success &= assert_equals_int(0, pool6_remove(&prefix), "Remove");
+	return success;
+}
+
 int init_module(void)
 {
 	START_TESTS("Outgoing");
@@ -178,6 +226,7 @@ int init_module(void)
 
 	CALL_TEST(test_6to4(tuple3, NEXTHDR_ICMP, IPPROTO_ICMP), "Tuple-3, 6 to 4, ICMP");
 	CALL_TEST(test_4to6(tuple3, IPPROTO_ICMP, NEXTHDR_ICMP), "Tuple-3, 4 to 6, ICMP");
+	CALL_TEST(test_prefixes(), "Several prefixes");
 
 	cleanup();
 
@@ -0,0 +1,129 @@
+#include <linux/module.h>
+#include <linux/printk.h>
+
+#include "nat64/unit/unit_test.h"
+#include "nat64/comm/str_utils.h"
+#include "nat64/mod/determ.h"
+
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Alberto Leiva");
+MODULE_DESCRIPTION("Deterministic NAT module test");
+
+
+/**
+ * Asserts the subscriber "addr6" belongs to maps to "addr4" and the range that starts at "first",
+ * and back.
+ */
+static bool assert_mapping(char *addr6, char *addr4, __u16 first, char *prefix, __u8 prefix_len,
+		char *test_name)
+{
+	struct in6_addr subscriber;
+	struct determ_range range;
+	struct ipv4_tuple_address transport;
+	struct ipv6_prefix expected, actual;
+	bool success = true;
+
+	if (str_to_addr6(addr6, &subscriber) != 0 || str_to_addr4(addr4, &transport.address) != 0
+			|| str_to_addr6(prefix, &expected.address) != 0)
+		return false;
+
+	if (!assert_equals_int(0, determ_get_range(&subscriber, &range), test_name))
+		return false;
+	success &= assert_equals_ipv4(&transport.address, &range.addr, test_name);
+	success &= assert_equals_u16(first, range.first, test_name);
+	success &= assert_equals_u16(2016, range.count, test_name);
+
+	/* Any port from the range leads back to the subscriber. */
+	transport.l4_id = first + 7;
+	if (!assert_equals_int(0, determ_get_prefix(&transport, &actual), test_name))
+		return false;
+	success &= assert_equals_ipv6(&expected.address, &actual.address, test_name);
+	success &= assert_equals_u8(prefix_len, actual.len, test_name);
+
+	return success;
+}
+
+static bool test_mapping(void)
+{
+	struct in6_addr addr6;
+	struct ipv4_tuple_address addr4;
+	struct ipv6_prefix prefix;
+	struct determ_range range;
+	bool success = true;
+
+	/* 4 addresses * 32 ranges; only the first 128 of the 2^16 subscribers are mapped. */
+	if (!assert_equals_int(0, determ_init("2001:db8::/40", 56, "192.0.2.0/30", 2016), "Init"))
+		return false;
+	success &= assert_true(determ_is_enabled(), "Enabled");
+
+	/* Consecutive subscribers are spread over the addresses first. */
+	success &= assert_mapping("2001:db8::1", "192.0.2.0", 1024, "2001:db8::", 56, "Subscriber 0");
+	success &= assert_mapping("2001:db8:0:100::5", "192.0.2.1", 1024, "2001:db8:0:100::", 56,
+			"Subscriber 1");
+	success &= assert_mapping("2001:db8:0:5ff::", "192.0.2.1", 3040, "2001:db8:0:500::", 56,
+			"Subscriber 5");
+
+	if (str_to_addr6("2001:db8:0:c800::", &addr6) != 0)
+		return false;
+	success &= assert_equals_int(-ESRCH, determ_get_range(&addr6, &range), "Not mapped");
+	if (str_to_addr6("2001:db9::", &addr6) != 0)
+		return false;
+	success &= assert_equals_int(-ESRCH, determ_get_range(&addr6, &range), "Not a subscriber");
+
+	if (str_to_addr4("192.0.2.1", &addr4.address) != 0)
+		return false;
+	addr4.l4_id = 1000;
+	success &= assert_equals_int(-ESRCH, determ_get_prefix(&addr4, &prefix), "Low port");
+	addr4.l4_id = 65535;
+	success &= assert_equals_int(0, determ_get_prefix(&addr4, &prefix), "Last range");
+	success &= assert_true(determ_contains4(&addr4.address), "Contains");
+	if (str_to_addr4("192.0.2.4", &addr4.address) != 0)
+		return false;
+	success &= assert_false(determ_contains4(&addr4.address), "Doesn't contain");
+	success &= assert_equals_int(-ESRCH, determ_get_prefix(&addr4, &prefix), "Foreign address");
+
+	/* The subscriber bits can straddle 32-bit words. */
+	if (!assert_equals_int(0, determ_init("2001:db0::/28", 44, "198.51.100.0/24", 2016), "Init 2"))
+		return false;
+	success &= assert_mapping("2001:db1:2300::1", "198.51.100.48", 37312, "2001:db1:2300::", 44,
+			"Subscriber 0x1230");
+
+	determ_destroy();
+	return success;
+}
+
+static bool test_init(void)
+{
+	bool success = true;
+
+	success &= assert_equals_int(0, determ_init(NULL, 64, NULL, 2016), "Disabled");
+	success &= assert_false(determ_is_enabled(), "Disabled is disabled");
+
+	success &= assert_equals_int(-EINVAL, determ_init("2001:db8::/40", 80, "192.0.2.0/24", 2016),
+			"Too many subscriber bits");
+	success &= assert_equals_int(-EINVAL, determ_init("2001:db8::/40", 56, "192.0.2.0/24", 0),
+			"No ports");
+	success &= assert_equals_int(-EINVAL, determ_init("2001:db8::/40", 56, NULL, 2016),
+			"No IPv4 prefix");
+	success &= assert_equals_int(-EINVAL, determ_init("2001:db8::/40", 56, "192.0.2.0", 2016),
+			"No IPv4 prefix length");
+	success &= assert_false(determ_is_enabled(), "Failures leave it disabled");
+
+	return success;
+}
+
+int init_module(void)
+{
+	START_TESTS("Deterministic NAT");
+
+	CALL_TEST(test_mapping(), "Mapping");
+	CALL_TEST(test_init(), "Configuration validation");
+
+	END_TESTS;
+}
+
+void cleanup_module(void)
+{
+	/* No code. */
+}
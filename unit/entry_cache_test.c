@@ -0,0 +1,117 @@
+#include <linux/module.h>
+#include <linux/printk.h>
+#include <linux/slab.h>
+#include <linux/bottom_half.h>
+
+#include "nat64/unit/unit_test.h"
+#include "nat64/mod/entry_cache.h"
+
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Alberto Leiva");
+MODULE_DESCRIPTION("Entry cache module test");
+
+
+/** Big enough for a chunk to hold only a handful of them, so the tests cross chunk boundaries. */
+#define OBJECT_SIZE 4000
+#define OBJECT_COUNT 100
+
+static struct entry_cache cache;
+static void *objects[OBJECT_COUNT];
+static __u32 handles[OBJECT_COUNT];
+
+static bool init(void)
+{
+	return entry_cache_init(&cache, "test_entries", OBJECT_SIZE, false, 8) == 0;
+}
+
+static void end(void)
+{
+	entry_cache_destroy(&cache);
+}
+
+static bool alloc_all(void)
+{
+	int i;
+
+	for (i = 0; i < OBJECT_COUNT; i++) {
+		objects[i] = entry_cache_alloc(&cache, &handles[i]);
+		if (!assert_not_null(objects[i], "Allocation"))
+			return false;
+		memset(objects[i], i, OBJECT_SIZE);
+	}
+
+	return true;
+}
+
+static bool test_handles(void)
+{
+	struct cache_stats stats;
+	int i, j;
+	bool success = true;
+
+	if (!alloc_all())
+		return false;
+
+	for (i = 0; i < OBJECT_COUNT; i++) {
+		success &= assert_true(handles[i] != ENTRY_NULL, "Handle is not NULL");
+		success &= assert_equals_ptr(objects[i], entry_cache_get(&cache, handles[i]),
+				"Handle leads to the object");
+		/* Writing one object didn't step on any other. */
+		for (j = 0; j < OBJECT_SIZE; j += 997)
+			success &= assert_equals_int(i & 0xFF, ((unsigned char *) objects[i])[j], "Contents");
+		if (!success)
+			return false;
+	}
+
+	entry_cache_get_stats(&cache, &stats);
+	success &= assert_equals_u32(OBJECT_COUNT, stats.in_use, "In use");
+	success &= assert_equals_u32(OBJECT_COUNT, stats.allocs, "Allocs");
+	success &= assert_equals_u32(0, stats.failures, "Failures");
+	success &= assert_true(stats.capacity >= OBJECT_COUNT, "Capacity");
+	success &= assert_true(stats.object_size >= OBJECT_SIZE, "Object size");
+
+	for (i = 0; i < OBJECT_COUNT; i++)
+		entry_cache_free(&cache, handles[i]);
+
+	entry_cache_get_stats(&cache, &stats);
+	success &= assert_equals_u32(0, stats.in_use, "Nothing in use");
+
+	return success;
+}
+
+static bool test_reuse(void)
+{
+	void *object;
+	__u32 handle;
+	bool success = true;
+
+	if (!alloc_all())
+		return false;
+
+	/* The CPU's free list is LIFO, so the object that was just released is the next one out. */
+	local_bh_disable();
+	entry_cache_free(&cache, handles[0]);
+	object = entry_cache_alloc(&cache, &handle);
+	local_bh_enable();
+	success &= assert_equals_ptr(objects[0], object, "Object is reused");
+	success &= assert_true(handles[0] == handle, "Handle is reused");
+
+	/* Bulk teardown: the objects are not returned; end() releases them along with the arena. */
+	return success;
+}
+
+int init_module(void)
+{
+	START_TESTS("Entry cache");
+
+	INIT_CALL_END(init(), test_handles(), end(), "Handles");
+	INIT_CALL_END(init(), test_reuse(), end(), "Reuse and bulk release");
+
+	END_TESTS;
+}
+
+void cleanup_module(void)
+{
+	/* No code. */
+}
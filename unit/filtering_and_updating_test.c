@@ -252,12 +252,16 @@ bool inject_bib_entry( u_int8_t l4protocol )
 #define IPV4_INIT_SESSION_ENTRY_SRC_PORT  1082
 #define IPV4_INIT_SESSION_ENTRY_DST_ADDR  "192.168.2.44"
 #define IPV4_INIT_SESSION_ENTRY_DST_PORT  1082
+/** Owner of the sessions the tests below build in the stack. */
+static struct bib_entry test_bib;
+
 bool init_session_entry( u_int8_t l4protocol, struct session_entry *se )
 {
     struct in_addr src4;
     struct in_addr dst4;
     struct in6_addr src6;
     struct in6_addr dst6;
+    struct ipv6_prefix prefix;
     
     if (!str_to_addr6_verbose(IPV6_INIT_SESSION_ENTRY_SRC_ADDR, &src6))
     	return false;
@@ -268,19 +272,26 @@ bool init_session_entry( u_int8_t l4protocol, struct session_entry *se )
     if (!str_to_addr4_verbose(IPV4_INIT_SESSION_ENTRY_DST_ADDR, &dst4))
 		return false;
 
-    se->ipv6.remote.address = src6; /* X' */
-    se->ipv6.remote.l4_id = IPV6_INIT_SESSION_ENTRY_SRC_PORT; /* x */
-    se->ipv6.local.address = dst6; /* Y' */
-    se->ipv6.local.l4_id = IPV6_INIT_SESSION_ENTRY_DST_PORT; /* y */
-    se->ipv4.local.address = src4; /* (T, t) */
-    se->ipv4.local.l4_id = IPV4_INIT_SESSION_ENTRY_SRC_PORT; /* (T, t) */
-    se->ipv4.remote.address = dst4; /* (Z, z) or (Z(Y’),y) */
-    se->ipv4.remote.l4_id = IPV4_INIT_SESSION_ENTRY_DST_PORT; /* (Z, z) or (Z(Y’),y) */
+    test_bib.ipv6.address = src6; /* X' */
+    test_bib.ipv6.l4_id = IPV6_INIT_SESSION_ENTRY_SRC_PORT; /* x */
+    test_bib.ipv4.address = src4; /* (T, t) */
+    test_bib.ipv4.l4_id = IPV4_INIT_SESSION_ENTRY_SRC_PORT; /* (T, t) */
+    test_bib.sessions = ENTRY_NULL;
+
+    /* (Y', y) is derived from (Z, z); Y' has to be Z under a pool6 prefix. */
+    if (!pool6_get_index(&dst6, &prefix, &se->prefix_index))
+        return false;
+    se->remote4.address = dst4; /* (Z, z) or (Z(Y’),y) */
+    se->remote4.l4_id = IPV4_INIT_SESSION_ENTRY_DST_PORT; /* (Z, z) or (Z(Y’),y) */
 
     se->dying_time = 0;
-    se->bib = NULL;
-    INIT_LIST_HEAD(&se->entries_from_bib);
-    INIT_LIST_HEAD(&se->all_sessions);
+    se->bib = &test_bib;
+    /* Stack sessions are not in the arena; they never get queued either. */
+    se->handle = ENTRY_NULL;
+    se->prev_in_bib = ENTRY_NULL;
+    se->next_in_bib = ENTRY_NULL;
+    se->prev_in_queue = ENTRY_NULL;
+    se->next_in_queue = ENTRY_NULL;
     se->l4_proto = l4protocol;
     se->state = CLOSED;
 
@@ -385,6 +396,7 @@ bool test_allocate_ipv4_transport_address( void )
     struct tuple tuple;
     struct ipv4_tuple_address tuple_addr;
     struct in_addr expected_addr;
+    bool shared;
     bool success = true;
 
     success &= str_to_addr4_verbose(IPV4_ALLOCATED_ADDR, &expected_addr);
@@ -395,33 +407,35 @@ bool test_allocate_ipv4_transport_address( void )
     	return false;
 
     init_tuple_for_test_ipv6(&tuple, IPPROTO_ICMP);
-	success &= assert_true(allocate_ipv4_transport_address(&tuple, IPPROTO_ICMP, &tuple_addr),
+	success &= assert_true(allocate_ipv4_transport_address(&tuple, IPPROTO_ICMP, &tuple_addr, &shared),
 		"Function result for ICMP");
 	success &= assert_equals_ipv4(&expected_addr , &tuple_addr.address, "IPv4 address for ICMP");
 
 	init_tuple_for_test_ipv6(&tuple, IPPROTO_TCP);
-	success &= assert_true(allocate_ipv4_transport_address(&tuple, IPPROTO_TCP, &tuple_addr),
+	success &= assert_true(allocate_ipv4_transport_address(&tuple, IPPROTO_TCP, &tuple_addr, &shared),
 		"Function result for TCP");
 	success &= assert_equals_ipv4(&expected_addr , &tuple_addr.address, "IPv4 address for TCP");
 	success &= assert_true(tuple_addr.l4_id > 1023, "Port range for TCP");
 
 	init_tuple_for_test_ipv6(&tuple, IPPROTO_UDP);
-	success &= assert_true(allocate_ipv4_transport_address(&tuple, IPPROTO_UDP, &tuple_addr),
+	success &= assert_true(allocate_ipv4_transport_address(&tuple, IPPROTO_UDP, &tuple_addr, &shared),
 		"Function result for UDP");
 	success &= assert_equals_ipv4(&expected_addr , &tuple_addr.address, "IPv4 address for UDP");
 	success &= assert_true(tuple_addr.l4_id % 2 == 0, "Port parity for UDP");
 	success &= assert_true( tuple_addr.l4_id > 1023, "Port range for UDP");
+	success &= assert_false(shared, "Ports are not shared by default");
 
     return success;
 }
 
 
 #define IPV4_ALLOCATED_PORT_DIGGER  1024
-bool test_allocate_ipv4_transport_address_digger( void )
+bool test_allocate_ipv4_transport_address_other_bibs( void )
 {
     struct in_addr expected_addr;
     struct tuple tuple;
     struct ipv4_tuple_address new_ipv4_transport_address;
+    bool shared;
     bool success = true;
 
     success &= inject_bib_entry( IPPROTO_ICMP );
@@ -431,7 +445,7 @@ bool test_allocate_ipv4_transport_address_digger( void )
     if (!success)
     	return false;
     
-    success &= assert_true( allocate_ipv4_transport_address_digger(&tuple, IPPROTO_UDP, &new_ipv4_transport_address),
+    success &= assert_true( allocate_ipv4_transport_address(&tuple, IPPROTO_UDP, &new_ipv4_transport_address, &shared),
         "Check that we can allocate a brand new IPv4 transport address for UDP.");
     success &= assert_true( ipv4_addr_equals(&new_ipv4_transport_address.address, &expected_addr) ,
         "Check that the allocated IPv4 address is correct for UDP.");
@@ -1028,16 +1042,22 @@ static bool init_skb_and_session(struct sk_buff **skb, struct session_entry *ses
     if (!init_tuple_for_test_ipv6(&tuple6, IPPROTO_TCP))
         goto failure;
 
-    session->ipv6.remote.address = tuple6.src.addr.ipv6;
-    session->ipv6.remote.l4_id = tuple6.src.l4_id;
-    session->ipv6.local.address = tuple6.dst.addr.ipv6;
-    session->ipv6.local.l4_id = tuple6.dst.l4_id;
-    session->ipv4.remote.address = tuple4.src.addr.ipv4;
-    session->ipv4.remote.l4_id = tuple4.src.l4_id;
-    session->ipv4.local.address = tuple4.dst.addr.ipv4;
-    session->ipv4.local.l4_id = tuple4.dst.l4_id;
+    test_bib.ipv6.address = tuple6.src.addr.ipv6;
+    test_bib.ipv6.l4_id = tuple6.src.l4_id;
+    test_bib.ipv4.address = tuple4.dst.addr.ipv4;
+    test_bib.ipv4.l4_id = tuple4.dst.l4_id;
+    test_bib.sessions = ENTRY_NULL;
+
+    /* The state machine never needs Y', so the prefix index is not validated. */
+    session->bib = &test_bib;
+    session->remote4.address = tuple4.src.addr.ipv4;
+    session->remote4.l4_id = tuple4.src.l4_id;
+    session->prefix_index = 0;
     session->dying_time = 10;
     session->state = state;
+    session->handle = ENTRY_NULL;
+    session->prev_in_queue = ENTRY_NULL;
+    session->next_in_queue = ENTRY_NULL;
 
     return true;
 
@@ -1342,10 +1362,10 @@ bool init_full(void)
 	error = pool4_init(NULL, 0);
 	if (error)
 		goto fail;
-	error = bib_init();
+	error = bib_init(TABLES_DEF_RESERVE_RATE);
 	if (error)
 		goto fail;
-	error = session_init(session_expired_callback);
+	error = session_init(session_expired_callback, false, TABLES_DEF_RESERVE_RATE);
 	if (error)
 		goto fail;
 	error = filtering_init();
@@ -1391,7 +1411,7 @@ int __init filtering_test_init(void)
     CALL_TEST(test_extract_ipv4_from_ipv6(), "test_extract_ipv4_from_ipv6");
     CALL_TEST(test_embed_ipv4_in_ipv6(), "test_embed_ipv4_in_ipv6");
     INIT_CALL_END(init_full(), test_allocate_ipv4_transport_address(), end_full(), "test_allocate_ipv4_transport_address");
-    INIT_CALL_END(init_full(), test_allocate_ipv4_transport_address_digger(), end_full(), "test_allocate_ipv4_transport_address_digger");
+    INIT_CALL_END(init_full(), test_allocate_ipv4_transport_address_other_bibs(), end_full(), "test_allocate_ipv4_transport_address_other_bibs");
     INIT_CALL_END(init_full(), test_ipv6_udp(), end_full(), "test_ipv6_udp");
     INIT_CALL_END(init_full(), test_ipv4_udp(), end_full(), "test_ipv4_udp");
     INIT_CALL_END(init_full(), test_ipv6_icmp6(), end_full(), "test_ipv6_icmp6");
@@ -1408,7 +1428,7 @@ int __init filtering_test_init(void)
     CALL_TEST(test_packet_is_v6_fin(), "test_packet_is_v6_fin");
     CALL_TEST(test_packet_is_v4_rst(), "test_packet_is_v4_rst");
     CALL_TEST(test_packet_is_v6_rst(), "test_packet_is_v6_rst");
-    CALL_TEST(test_send_probe_packet(), "test_send_probe_packet");
+    INIT_CALL_END(init_pool6_only(), test_send_probe_packet(), end_pool6_only(), "test_send_probe_packet");
     INIT_CALL_END(init_full(), test_tcp_closed_state_handle_6(), end_full(), "test_tcp_closed_state_handle_6");
     /* INIT_CALL_END(init_full(), test_tcp_closed_state_handle_4(), end_full(), "test_tcp_closed_state_handle_4"); Not implemented yet! */
     CALL_TEST(test_tcp_v4_init_state_handle(), "test_tcp_v4_init_state_handle");
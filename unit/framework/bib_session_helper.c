@@ -59,15 +59,20 @@ bool session_assert(int l4_proto, struct session_entry **expected_sessions)
 
 	while (expected_sessions[expected_count] != NULL) {
 		struct session_entry *expected = expected_sessions[expected_count];
-		struct session_entry *actual = session_get_by_ipv6(&expected->ipv6, l4_proto);
+		struct session_entry *actual;
+		struct ipv6_pair pair6;
+		struct ipv4_pair pair4;
 
+		session_get_ipv6(expected, &pair6);
+		actual = session_get_by_ipv6(&pair6, l4_proto);
 		if (!actual) {
+			session_get_ipv4(expected, &pair4);
 			log_warning("Could not find session entry %d [%pI6c#%u, %pI6c#%u, %pI4#%u, %pI4#%u] "
 					"in the database.", expected_count,
-					&expected->ipv6.remote.address, expected->ipv6.remote.l4_id,
-					&expected->ipv6.local.address, expected->ipv6.local.l4_id,
-					&expected->ipv4.local.address, expected->ipv4.local.l4_id,
-					&expected->ipv4.remote.address, expected->ipv4.remote.l4_id);
+					&pair6.remote.address, pair6.remote.l4_id,
+					&pair6.local.address, pair6.local.l4_id,
+					&pair4.local.address, pair4.local.l4_id,
+					&pair4.remote.address, pair4.remote.l4_id);
 			return false;
 		}
 
@@ -100,12 +105,17 @@ int print_bibs(int l4_proto)
 
 static int print_sessions_aux(struct session_entry *session, void *arg)
 {
+	struct ipv6_pair pair6;
+	struct ipv4_pair pair4;
+
+	session_get_ipv6(session, &pair6);
+	session_get_ipv4(session, &pair4);
 	log_debug("  [%s][%pI6c#%u, %pI6c#%u, %pI4#%u, %pI4#%u]",
 			session->bib->is_static ? "Static" : "Dynamic",
-			&session->ipv6.remote.address, session->ipv6.remote.l4_id,
-			&session->ipv6.local.address, session->ipv6.local.l4_id,
-			&session->ipv4.local.address, session->ipv4.local.l4_id,
-			&session->ipv4.remote.address, session->ipv4.remote.l4_id);
+			&pair6.remote.address, pair6.remote.l4_id,
+			&pair6.local.address, pair6.local.l4_id,
+			&pair4.local.address, pair4.local.l4_id,
+			&pair4.remote.address, pair4.remote.l4_id);
 	return 0;
 }
 
@@ -36,7 +36,8 @@ int pool4_remove(struct in_addr *address)
 	return 0;
 }
 
-bool pool4_get_any(u_int8_t l4protocol, __be16 port, struct ipv4_tuple_address *result)
+bool pool4_get_any(u_int8_t l4protocol, __be16 port, struct in6_addr *source,
+		struct ipv4_tuple_address *remote, struct ipv4_tuple_address *result)
 {
 	u32 *port_counter;
 
@@ -69,6 +70,7 @@ bool pool4_get_any(u_int8_t l4protocol, __be16 port, struct ipv4_tuple_address *
 }
 
 bool pool4_get_similar(u_int8_t l4protocol, struct ipv4_tuple_address *address,
+		struct in6_addr *source, struct ipv4_tuple_address *remote,
 		struct ipv4_tuple_address *result)
 {
 	if (!address) {
@@ -81,7 +83,7 @@ bool pool4_get_similar(u_int8_t l4protocol, struct ipv4_tuple_address *address,
 		return false;
 	}
 
-	return pool4_get_any(l4protocol, address->l4_id, result);
+	return pool4_get_any(l4protocol, address->l4_id, NULL, remote, result);
 
 }
 
@@ -114,3 +116,8 @@ int pool4_for_each(int (*func)(struct in_addr *, void *), void * arg)
 	log_debug("Somebody asked me to iterate through the pool.");
 	return -EINVAL;
 }
+
+void pool4_get_magazine_stats(struct magazine_stats *result)
+{
+	memset(result, 0, sizeof(*result));
+}
@@ -75,26 +75,24 @@
 #define STATIC_SESSION_IPV6_REMOTE_PORT STATIC_BIB_IPV6_PORT
 
 
-struct session_entry *create_dynamic_session(int l4_proto)
+/*
+ * The sessions' IPv6 remote and IPv4 local transport addresses are their BIB's, so "bib" has to
+ * hold DYNAMIC_SESSION_IPV6_REMOTE_* and DYNAMIC_SESSION_IPV4_LOCAL_* (and the equivalent for the
+ * static session).
+ */
+struct session_entry *create_dynamic_session(int l4_proto, struct bib_entry *bib)
 {
 	struct session_entry *session;
-	struct ipv4_pair pair4;
-	struct ipv6_pair pair6;
+	struct ipv4_tuple_address remote4;
+	struct in6_addr local6;
 
-	if (str_to_addr6(DYNAMIC_SESSION_IPV6_REMOTE_ADDR, &pair6.remote.address) != 0)
-		return NULL;
-	if (str_to_addr6(DYNAMIC_SESSION_IPV6_LOCAL_ADDR, &pair6.local.address) != 0)
+	if (str_to_addr6(DYNAMIC_SESSION_IPV6_LOCAL_ADDR, &local6) != 0)
 		return NULL;
-	if (str_to_addr4(DYNAMIC_SESSION_IPV4_LOCAL_ADDR, &pair4.local.address) != 0)
+	if (str_to_addr4(DYNAMIC_SESSION_IPV4_REMOTE_ADDR, &remote4.address) != 0)
 		return NULL;
-	if (str_to_addr4(DYNAMIC_SESSION_IPV4_REMOTE_ADDR, &pair4.remote.address) != 0)
-		return NULL;
-	pair6.remote.l4_id = DYNAMIC_SESSION_IPV6_REMOTE_PORT;
-	pair6.local.l4_id = DYNAMIC_SESSION_IPV6_LOCAL_PORT;
-	pair4.local.l4_id = DYNAMIC_SESSION_IPV4_LOCAL_PORT;
-	pair4.remote.l4_id = DYNAMIC_SESSION_IPV4_REMOTE_PORT;
+	remote4.l4_id = DYNAMIC_SESSION_IPV4_REMOTE_PORT;
 
-	session = session_create(&pair4, &pair6, l4_proto);
+	session = session_create(bib, &remote4, &local6, l4_proto);
 	if (!session) {
 		log_warning("Could not allocate the dynamic session entry.");
 		return NULL;
@@ -103,26 +101,19 @@ struct session_entry *create_dynamic_session(int l4_proto)
 	return session;
 }
 
-struct session_entry *create_static_session(int l4_proto)
+struct session_entry *create_static_session(int l4_proto, struct bib_entry *bib)
 {
 	struct session_entry *session;
-	struct ipv4_pair pair4;
-	struct ipv6_pair pair6;
+	struct ipv4_tuple_address remote4;
+	struct in6_addr local6;
 
-	if (str_to_addr4(STATIC_SESSION_IPV4_REMOTE_ADDR, &pair4.remote.address) != 0)
-		return NULL;
-	if (str_to_addr4(STATIC_SESSION_IPV4_LOCAL_ADDR, &pair4.local.address) != 0)
-		return NULL;
-	if (str_to_addr6(STATIC_SESSION_IPV6_LOCAL_ADDR, &pair6.local.address) != 0)
+	if (str_to_addr4(STATIC_SESSION_IPV4_REMOTE_ADDR, &remote4.address) != 0)
 		return NULL;
-	if (str_to_addr6(STATIC_SESSION_IPV6_REMOTE_ADDR, &pair6.remote.address) != 0)
+	if (str_to_addr6(STATIC_SESSION_IPV6_LOCAL_ADDR, &local6) != 0)
 		return NULL;
-	pair4.remote.l4_id = STATIC_SESSION_IPV4_REMOTE_PORT;
-	pair4.local.l4_id = STATIC_SESSION_IPV4_LOCAL_PORT;
-	pair6.local.l4_id = STATIC_SESSION_IPV6_LOCAL_PORT;
-	pair6.remote.l4_id = STATIC_SESSION_IPV6_REMOTE_PORT;
+	remote4.l4_id = STATIC_SESSION_IPV4_REMOTE_PORT;
 
-	session = session_create(&pair4, &pair6, l4_proto);
+	session = session_create(bib, &remote4, &local6, l4_proto);
 	if (!session) {
 		log_warning("Could not allocate the static session entry.");
 		return NULL;
@@ -235,10 +226,10 @@ static bool test_hairpin(int l4_proto, int (*create_skb_cb)(struct ipv6_pair *,
 	dynamic_bib = create_dynamic_bib(l4_proto);
 	if (!dynamic_bib)
 		return false;
-	static_session = create_static_session(l4_proto);
+	static_session = create_static_session(l4_proto, static_bib);
 	if (!static_session)
 		return false;
-	dynamic_session = create_dynamic_session(l4_proto);
+	dynamic_session = create_dynamic_session(l4_proto, dynamic_bib);
 	if (!dynamic_session)
 		return false;
 
@@ -317,10 +308,10 @@ static int init(void)
 	error = pool4_init(pool4, ARRAY_SIZE(pool4));
 	if (error)
 		goto failure;
-	error = bib_init();
+	error = bib_init(TABLES_DEF_RESERVE_RATE);
 	if (error)
 		goto failure;
-	error = session_init(session_expired_callback);
+	error = session_init(session_expired_callback, false, TABLES_DEF_RESERVE_RATE);
 	if (error)
 		goto failure;
 	error = filtering_init();
@@ -0,0 +1,286 @@
+#include <linux/module.h>
+#include <linux/printk.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+
+#include "nat64/unit/unit_test.h"
+#include "nat64/comm/types.h"
+
+/**
+ * @file
+ * Collision-attack benchmark for the BIB and session hash functions.
+ *
+ * Fills tables with keys an attacker (or merely a population of port-preserving clients) could
+ * choose, and reports the longest chain and the time it takes to look every key up, both with the
+ * old unkeyed 16-bit hash functions and with the current ones.
+ *
+ * Also reports how long lookups take from every NUMA node, depending on which node the table and
+ * its entries live in.
+ */
+
+
+/** Number of keys inserted in every run. */
+#define BENCH_KEY_COUNT 4096
+
+/* Generate the table; values embed their own keys and nodes. */
+struct bench_entry {
+	struct ipv6_pair ipv6;
+	struct ipv4_tuple_address ipv4;
+	struct hlist_node ipv6_hook;
+	struct hlist_node ipv4_hook;
+};
+
+#define HTABLE_NAME bench6_table
+#define KEY_TYPE struct ipv6_pair
+#define VALUE_TYPE struct bench_entry
+#define NODE_MEMBER ipv6_hook
+#define KEY_MEMBER ipv6
+#include "hash_table.c"
+
+#define HTABLE_NAME bench4_table
+#define KEY_TYPE struct ipv4_tuple_address
+#define VALUE_TYPE struct bench_entry
+#define NODE_MEMBER ipv4_hook
+#define KEY_MEMBER ipv4
+#include "hash_table.c"
+
+/* The tables are too big for the stack. */
+static struct bench6_table table6;
+static struct bench4_table table4;
+
+/** What the session module used to hash its IPv6 index with. */
+static __u32 legacy_ipv6_pair_hashcode(struct ipv6_pair *pair, __u32 seed)
+{
+	return (__u16) pair->local.l4_id;
+}
+
+/** What the BIB module used to hash its IPv4 index with. */
+static __u32 legacy_ipv4_tuple_addr_hashcode(struct ipv4_tuple_address *addr, __u32 seed)
+{
+	return (__u16) addr->l4_id;
+}
+
+/** Length of the longest chain from "slots". */
+static unsigned int max_chain(struct hlist_head *slots, __u32 slot_count)
+{
+	struct hlist_node *node;
+	unsigned int current_length, result = 0;
+	__u32 i;
+
+	for (i = 0; i < slot_count; i++) {
+		current_length = 0;
+		hlist_for_each(node, &slots[i])
+			current_length++;
+		if (current_length > result)
+			result = current_length;
+	}
+
+	return result;
+}
+
+/**
+ * IPv6 clients which all use the same source port (eg. because they are behind port-preserving
+ * CPEs, or because they're hostile) open sessions towards the same IPv4 node.
+ */
+static void init_same_port_entries(struct bench_entry *entries)
+{
+	struct bench_entry *entry;
+	int i;
+
+	memset(entries, 0, BENCH_KEY_COUNT * sizeof(*entries));
+	for (i = 0; i < BENCH_KEY_COUNT; i++) {
+		entry = &entries[i];
+
+		entry->ipv6.local.address.s6_addr32[0] = cpu_to_be32(0x20010db8);
+		entry->ipv6.local.address.s6_addr32[3] = cpu_to_be32(i + 1);
+		entry->ipv6.local.l4_id = 5060;
+		entry->ipv6.remote.address.s6_addr32[0] = cpu_to_be32(0x0064ff9b);
+		entry->ipv6.remote.address.s6_addr32[3] = cpu_to_be32(0xc0000201);
+		entry->ipv6.remote.l4_id = 80;
+
+		/* Port-preserving pool4 allocation; same port, different pool addresses. */
+		entry->ipv4.address.s_addr = cpu_to_be32(0xc0a80200 + (i & 0xff));
+		entry->ipv4.l4_id = 5060 + (i >> 8);
+	}
+}
+
+static bool bench_ipv6_pairs(struct bench_entry *entries, char *name,
+		__u32 (*hash_function)(struct ipv6_pair *, __u32), unsigned int *worst_chain)
+{
+	struct bench6_table *table = &table6;
+	ktime_t start;
+	s64 lookup_ns;
+	int i;
+	bool success = true;
+
+	if (bench6_table_init(table, ipv6_pair_equals, hash_function) != 0)
+		return false;
+
+	/* Let the table grow as it goes, as it would while serving traffic. */
+	for (i = 0; i < BENCH_KEY_COUNT; i++) {
+		bench6_table_put(table, &entries[i].ipv6, &entries[i]);
+		flush_work(&table->resize_work);
+	}
+
+	start = ktime_get();
+	for (i = 0; i < BENCH_KEY_COUNT; i++)
+		success &= (bench6_table_get(table, &entries[i].ipv6) == &entries[i]);
+	lookup_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	*worst_chain = max_chain(table->table->heads, table->table->length);
+	log_info("  session IPv6 index, %s hash: %u slots, worst chain: %u, %lld ns per lookup.",
+			name, table->table->length, *worst_chain, lookup_ns / BENCH_KEY_COUNT);
+
+	bench6_table_destroy(table, false, false);
+	return assert_true(success, "Every session can be found");
+}
+
+static bool bench_ipv4_tuples(struct bench_entry *entries, char *name,
+		__u32 (*hash_function)(struct ipv4_tuple_address *, __u32), unsigned int *worst_chain)
+{
+	struct bench4_table *table = &table4;
+	ktime_t start;
+	s64 lookup_ns;
+	int i;
+	bool success = true;
+
+	if (bench4_table_init(table, ipv4_tuple_addr_equals, hash_function) != 0)
+		return false;
+
+	/* Let the table grow as it goes, as it would while serving traffic. */
+	for (i = 0; i < BENCH_KEY_COUNT; i++) {
+		bench4_table_put(table, &entries[i].ipv4, &entries[i]);
+		flush_work(&table->resize_work);
+	}
+
+	start = ktime_get();
+	for (i = 0; i < BENCH_KEY_COUNT; i++)
+		success &= (bench4_table_get(table, &entries[i].ipv4) == &entries[i]);
+	lookup_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	*worst_chain = max_chain(table->table->heads, table->table->length);
+	log_info("  BIB IPv4 index, %s hash: %u slots, worst chain: %u, %lld ns per lookup.",
+			name, table->table->length, *worst_chain, lookup_ns / BENCH_KEY_COUNT);
+
+	bench4_table_destroy(table, false, false);
+	return assert_true(success, "Every BIB can be found");
+}
+
+static bool bench_collisions(void)
+{
+	struct bench_entry *entries;
+	unsigned int legacy_chain, keyed_chain;
+	bool success = true;
+
+	entries = kmalloc(BENCH_KEY_COUNT * sizeof(*entries), GFP_KERNEL);
+	if (!entries) {
+		log_warning("Could not allocate the benchmark entries.");
+		return false;
+	}
+	init_same_port_entries(entries);
+
+	success &= bench_ipv6_pairs(entries, "legacy", legacy_ipv6_pair_hashcode, &legacy_chain);
+	success &= bench_ipv6_pairs(entries, "keyed", ipv6_pair_hashcode, &keyed_chain);
+	success &= assert_true(keyed_chain < legacy_chain, "Keyed session hash spreads better");
+
+	success &= bench_ipv4_tuples(entries, "legacy", legacy_ipv4_tuple_addr_hashcode,
+			&legacy_chain);
+	success &= bench_ipv4_tuples(entries, "keyed", ipv4_tuple_addr_hashcode, &keyed_chain);
+	success &= assert_true(keyed_chain < legacy_chain, "Keyed BIB hash spreads better");
+
+	kfree(entries);
+	return success;
+}
+
+/**
+ * Looks up every entry from "arg" in "table6". Meant to run on a specific CPU (see work_on_cpu()).
+ * Returns the average nanoseconds per lookup, or -ESRCH if an entry could not be found.
+ */
+static long time_lookups(void *arg)
+{
+	struct bench_entry *entries = arg;
+	ktime_t start;
+	int i;
+
+	start = ktime_get();
+	for (i = 0; i < BENCH_KEY_COUNT; i++)
+		if (bench6_table_get(&table6, &entries[i].ipv6) != &entries[i])
+			return -ESRCH;
+
+	return ktime_to_ns(ktime_sub(ktime_get(), start)) / BENCH_KEY_COUNT;
+}
+
+/**
+ * Places a session table (and its entries) on every node in turn, and times lookups from a CPU of
+ * every node. A table on the node which loaded the module is what every table used to be; a table
+ * on the node of the CPU which uses it is what a sharded session table is now.
+ */
+static bool bench_numa(void)
+{
+	struct bench_entry *entries;
+	int table_node, cpu_node, cpu, i;
+	long ns;
+	bool success = true;
+
+	if (num_node_state(N_CPU) < 2) {
+		log_info("  Only one NUMA node has CPUs; there's nothing to compare.");
+		return true;
+	}
+
+	for_each_node_state(table_node, N_CPU) {
+		entries = kmalloc_node(BENCH_KEY_COUNT * sizeof(*entries), GFP_KERNEL, table_node);
+		if (!entries) {
+			log_warning("Could not allocate the benchmark entries.");
+			return false;
+		}
+		init_same_port_entries(entries);
+
+		if (bench6_table_init(&table6, ipv6_pair_equals, ipv6_pair_hashcode) != 0) {
+			kfree(entries);
+			return false;
+		}
+		bench6_table_set_node(&table6, table_node);
+		for (i = 0; i < BENCH_KEY_COUNT; i++) {
+			bench6_table_put(&table6, &entries[i].ipv6, &entries[i]);
+			flush_work(&table6.resize_work);
+		}
+
+		for_each_node_state(cpu_node, N_CPU) {
+			cpu = cpumask_any_and(cpumask_of_node(cpu_node), cpu_online_mask);
+			if (cpu >= nr_cpu_ids)
+				continue;
+
+			ns = work_on_cpu(cpu, time_lookups, entries);
+			success &= (ns >= 0);
+			log_info("  Table on node %d, lookups from node %d (CPU %d): %ld ns per lookup.",
+					table_node, cpu_node, cpu, ns);
+		}
+
+		bench6_table_destroy(&table6, false, false);
+		kfree(entries);
+	}
+
+	return assert_true(success, "Every session can be found from every node");
+}
+
+int init_module(void)
+{
+	START_TESTS("Hash table benchmark");
+
+	CALL_TEST(bench_collisions(), "Same-port collision attack");
+	CALL_TEST(bench_numa(), "Lookups across NUMA nodes");
+
+	END_TESTS;
+}
+
+void cleanup_module(void)
+{
+	/* No code. */
+}
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Alberto Leiva Popper <aleiva@nic.mx>");
+MODULE_DESCRIPTION("Hash table collision benchmark.");
@@ -17,11 +17,26 @@ struct table_value {
 #define HTABLE_NAME test_table
 #define KEY_TYPE struct table_key
 #define VALUE_TYPE struct table_value
-#define HASH_TABLE_SIZE (10)
+#define HASH_TABLE_SIZE (8)
 #define GENERATE_PRINT
 #define GENERATE_FOR_EACH
 #include "hash_table.c"
 
+/* Generate a second table, which chains the values directly. */
+struct intrusive_value {
+	struct table_key key;
+	int value;
+	struct hlist_node hook;
+};
+
+#define HTABLE_NAME intrusive_table
+#define KEY_TYPE struct table_key
+#define VALUE_TYPE struct intrusive_value
+#define HASH_TABLE_SIZE (8)
+#define NODE_MEMBER hook
+#define KEY_MEMBER key
+#include "hash_table.c"
+
 /* These are also kind of part of the table. */
 static bool equals_function(struct table_key *key1, struct table_key *key2)
 {
@@ -33,7 +48,8 @@ static bool equals_function(struct table_key *key1, struct table_key *key2)
 	return (key1->key == key2->key);
 }
 
-static __u16 hash_code_function(struct table_key *key1)
+/* Ignores the seed on purpose; the tests need to know which keys collide. */
+static __u32 hash_code_function(struct table_key *key1, __u32 seed)
 {
 	return (key1 != NULL) ? key1->key : 0;
 }
@@ -148,11 +164,11 @@ static bool test(void)
 	if (!assert_table_content(&table, keys, values, "Needless extra test"))
 		goto failure;
 
-	test_table_empty(&table, false, false);
+	test_table_destroy(&table, false, false);
 	return true;
 
 failure:
-	test_table_empty(&table, false, false);
+	test_table_destroy(&table, false, false);
 	return false;
 }
 
@@ -194,7 +210,7 @@ static bool test_for_each_function(void)
 	for (i = 0; i < ARRAY_SIZE(values); i++) {
 		if (test_table_put(&table, &keys[i], &values[i]) != 0) {
 			log_warning("Put operation failed on value %d.", i);
-			test_table_empty(&table, false, false);
+			test_table_destroy(&table, false, false);
 			return false;
 		}
 	}
@@ -207,16 +223,297 @@ static bool test_for_each_function(void)
 				|| summary.values[2] == values[i].value, "");
 	}
 
-	test_table_empty(&table, false, false);
+	test_table_destroy(&table, false, false);
 	return true;
 }
 
+#define RESIZE_TEST_COUNT 200
+
+/**
+ * Asserts the table grows as values are inserted, shrinks as they are removed, and never loses
+ * track of them in the meantime.
+ */
+static bool test_resize(void)
+{
+	struct test_table table;
+	struct table_key *keys;
+	struct table_value *values;
+	__u32 max_slots;
+	int i;
+	bool success = true;
+
+	keys = kmalloc(RESIZE_TEST_COUNT * sizeof(*keys), GFP_KERNEL);
+	values = kmalloc(RESIZE_TEST_COUNT * sizeof(*values), GFP_KERNEL);
+	if (!keys || !values) {
+		log_warning("Could not allocate the test keys and values.");
+		kfree(keys);
+		kfree(values);
+		return false;
+	}
+
+	if (test_table_init(&table, &equals_function, &hash_code_function) < 0) {
+		log_warning("The init function failed.");
+		kfree(keys);
+		kfree(values);
+		return false;
+	}
+	test_table_set_load_limits(&table, 100, 25);
+
+	for (i = 0; i < RESIZE_TEST_COUNT; i++) {
+		keys[i].key = i;
+		values[i].value = i * 10;
+		if (test_table_put(&table, &keys[i], &values[i]) != 0) {
+			log_warning("Put operation failed on value %d.", i);
+			success = false;
+			goto end;
+		}
+		/* Every value inserted so far has to be reachable, even mid-rehash. */
+		success &= assert_not_null(test_table_get(&table, &keys[i / 2]), "Get while growing");
+		/* Let the resizes happen in between, like they would in a real table. */
+		flush_work(&table.resize_work);
+	}
+
+	success &= assert_equals_int(RESIZE_TEST_COUNT, test_table_count(&table),
+			"Count after puts");
+	success &= assert_true(table.table->length > 8, "The table grew");
+	for (i = 0; i < RESIZE_TEST_COUNT; i++) {
+		struct table_value *value = test_table_get(&table, &keys[i]);
+		success &= assert_not_null(value, "Get after growth");
+		if (value)
+			success &= assert_equals_int(i * 10, value->value, "Value after growth");
+	}
+	test_table_print(&table, "After growth");
+	max_slots = table.table->length;
+
+	for (i = 0; i < RESIZE_TEST_COUNT; i += 2) {
+		success &= assert_true(test_table_remove(&table, &keys[i], false, false), "Remove");
+		flush_work(&table.resize_work);
+	}
+	for (i = 0; i < RESIZE_TEST_COUNT; i++) {
+		struct table_value *value = test_table_get(&table, &keys[i]);
+		if (i % 2 == 0)
+			success &= assert_null(value, "Get removed value");
+		else
+			success &= assert_not_null(value, "Get surviving value");
+	}
+
+	for (i = 1; i < RESIZE_TEST_COUNT; i += 2) {
+		success &= assert_true(test_table_remove(&table, &keys[i], false, false), "Remove");
+		flush_work(&table.resize_work);
+	}
+	success &= assert_equals_int(0, test_table_count(&table), "Count after removes");
+	success &= assert_true(table.table->length < max_slots, "The table shrank");
+	test_table_print(&table, "After shrink");
+
+	/* Fall through. */
+end:
+	test_table_destroy(&table, false, false);
+	kfree(keys);
+	kfree(values);
+	return success;
+}
+
+/**
+ * Asserts a resize finishes even if nobody writes to the table after it starts.
+ */
+static bool test_idle_rehash(void)
+{
+	struct test_table table;
+	struct table_key *keys;
+	struct table_value *values;
+	int i;
+	bool success = true;
+
+	keys = kmalloc(RESIZE_TEST_COUNT * sizeof(*keys), GFP_KERNEL);
+	values = kmalloc(RESIZE_TEST_COUNT * sizeof(*values), GFP_KERNEL);
+	if (!keys || !values) {
+		log_warning("Could not allocate the test keys and values.");
+		kfree(keys);
+		kfree(values);
+		return false;
+	}
+
+	if (test_table_init(&table, &equals_function, &hash_code_function) < 0) {
+		log_warning("The init function failed.");
+		kfree(keys);
+		kfree(values);
+		return false;
+	}
+	test_table_set_load_limits(&table, 100, 25);
+
+	/* No flushes in between, so the resizes start while the writes are already over. */
+	for (i = 0; i < RESIZE_TEST_COUNT; i++) {
+		keys[i].key = i;
+		values[i].value = i * 10;
+		if (test_table_put(&table, &keys[i], &values[i]) != 0) {
+			log_warning("Put operation failed on value %d.", i);
+			success = false;
+			goto end;
+		}
+	}
+
+	/* The work item keeps rescheduling itself until there's nothing left to do. */
+	while (flush_work(&table.resize_work))
+		;
+
+	success &= assert_null(table.old_table, "The old array was released");
+	success &= assert_equals_u32(256, table.table->length, "Grew all the way");
+	for (i = 0; i < RESIZE_TEST_COUNT; i++)
+		success &= assert_not_null(test_table_get(&table, &keys[i]), "Get after the rehash");
+
+	/* Fall through. */
+end:
+	test_table_destroy(&table, false, false);
+	kfree(keys);
+	kfree(values);
+	return success;
+}
+
+/**
+ * Asserts the table doesn't allocate its array until it's needed, and honors its size limits.
+ */
+static bool test_size_limits(void)
+{
+	struct test_table table;
+	struct table_key *keys;
+	struct table_value *values;
+	int i;
+	bool success = true;
+
+	keys = kmalloc(RESIZE_TEST_COUNT * sizeof(*keys), GFP_KERNEL);
+	values = kmalloc(RESIZE_TEST_COUNT * sizeof(*values), GFP_KERNEL);
+	if (!keys || !values) {
+		log_warning("Could not allocate the test keys and values.");
+		kfree(keys);
+		kfree(values);
+		return false;
+	}
+
+	if (test_table_init(&table, &equals_function, &hash_code_function) < 0) {
+		log_warning("The init function failed.");
+		kfree(keys);
+		kfree(values);
+		return false;
+	}
+
+	/* Unused tables cost nothing, but still behave like empty ones. */
+	success &= assert_null(table.table, "No array before the first put");
+	keys[0].key = 0;
+	success &= assert_null(test_table_get(&table, &keys[0]), "Get from an unused table");
+	success &= assert_false(test_table_remove(&table, &keys[0], false, false),
+			"Remove from an unused table");
+	success &= assert_equals_int(0, test_table_for_each(&table, for_each_func, NULL),
+			"For each on an unused table");
+
+	success &= assert_equals_int(-EINVAL, test_table_set_size_limits(&table, 4, 64),
+			"Less slots than stripes");
+	success &= assert_equals_int(-EINVAL, test_table_set_size_limits(&table, 24, 64),
+			"Not a power of two");
+	success &= assert_equals_int(-EINVAL, test_table_set_size_limits(&table, 64, 32),
+			"Minimum above maximum");
+	success &= assert_equals_int(0, test_table_set_size_limits(&table, 32, 64), "Valid limits");
+	success &= assert_null(table.table, "Setting the limits doesn't allocate");
+
+	for (i = 0; i < RESIZE_TEST_COUNT; i++) {
+		keys[i].key = i;
+		values[i].value = i * 10;
+		if (test_table_put(&table, &keys[i], &values[i]) != 0) {
+			log_warning("Put operation failed on value %d.", i);
+			success = false;
+			goto end;
+		}
+
+		flush_work(&table.resize_work);
+		/* The first array is small, but the table grows to its minimum right away. */
+		if (i == 0)
+			success &= assert_equals_u32(32, table.table->length, "Grew to the minimum");
+	}
+
+	/* 200 values would normally need 256 slots. */
+	success &= assert_equals_u32(64, table.table->length, "Stopped at the maximum");
+	for (i = 0; i < RESIZE_TEST_COUNT; i++)
+		success &= assert_not_null(test_table_get(&table, &keys[i]), "Get at the maximum");
+
+	/* Lowering the maximum shrinks the table, even though it's overloaded. */
+	success &= assert_equals_int(0, test_table_set_size_limits(&table, 16, 16), "Lower limits");
+	while (flush_work(&table.resize_work))
+		;
+	success &= assert_equals_u32(16, table.table->length, "Shrank to the new maximum");
+	for (i = 0; i < RESIZE_TEST_COUNT; i++)
+		success &= assert_not_null(test_table_get(&table, &keys[i]), "Get after the shrink");
+
+	/* Fall through. */
+end:
+	test_table_destroy(&table, false, false);
+	kfree(keys);
+	kfree(values);
+	return success;
+}
+
+/**
+ * Asserts a table whose values embed their own nodes can store, find, remove and release them.
+ */
+static bool test_intrusive(void)
+{
+	struct intrusive_table table;
+	struct intrusive_value *values[3];
+	struct table_key missing_key = { 4 };
+	/* The first and third keys share a hash slot. */
+	int keys[] = { 2, 3, 10 };
+	int i;
+	bool success = true;
+
+	if (intrusive_table_init(&table, &equals_function, &hash_code_function) < 0) {
+		log_warning("The init function failed.");
+		return false;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(values); i++) {
+		values[i] = kmalloc(sizeof(*values[i]), GFP_KERNEL);
+		if (!values[i]) {
+			log_warning("Could not allocate test value %d.", i);
+			success = false;
+			goto end;
+		}
+		values[i]->key.key = keys[i];
+		values[i]->value = keys[i] * 100;
+		if (intrusive_table_put(&table, &values[i]->key, values[i]) != 0) {
+			log_warning("Put operation failed on value %d.", i);
+			kfree(values[i]);
+			success = false;
+			goto end;
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(values); i++)
+		success &= assert_equals_ptr(values[i], intrusive_table_get(&table, &values[i]->key),
+				"Get");
+	success &= assert_null(intrusive_table_get(&table, &missing_key), "Get missing");
+
+	/* The value has to be released by the table. */
+	missing_key.key = keys[0];
+	success &= assert_true(intrusive_table_remove(&table, &missing_key, false, true), "Remove");
+	success &= assert_null(intrusive_table_get(&table, &missing_key), "Get removed");
+	success &= assert_equals_ptr(values[2], intrusive_table_get(&table, &values[2]->key),
+			"Collision survives removal");
+	success &= assert_equals_int(2, intrusive_table_count(&table), "Count after remove");
+
+	/* Fall through. */
+end:
+	intrusive_table_destroy(&table, false, true);
+	return success;
+}
+
 int init_module(void)
 {
 	START_TESTS("Hash table");
 
 	CALL_TEST(test(), "Everything, except for_each");
 	CALL_TEST(test_for_each_function(), "for_each function");
+	CALL_TEST(test_resize(), "Growth and shrinkage");
+	CALL_TEST(test_idle_rehash(), "Rehash without writers");
+	CALL_TEST(test_size_limits(), "Lazy allocation and size limits");
+	CALL_TEST(test_intrusive(), "Embedded nodes");
 
 	END_TESTS;
 }
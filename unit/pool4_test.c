@@ -28,21 +28,57 @@ struct in_addr expected_ips[ARRAY_SIZE(expected_ips_as_str)];
  */
 static bool ports[ARRAY_SIZE(expected_ips)][ID_COUNT];
 
+/**
+ * Returns the index of "addr" in "expected_ips" (-1 if it's not there).
+ */
+static int addr_index(struct in_addr *addr)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(expected_ips); i++)
+		if (ipv4_addr_equals(&expected_ips[i], addr))
+			return i;
+
+	return -1;
+}
+
+/**
+ * Borrows something compatible with "port" using get_any(), and records it in "ports".
+ */
+static bool borrow_any(u_int8_t l4protocol, u32 port, char *test_name)
+{
+	struct ipv4_tuple_address result;
+	int addr_ctr;
+	bool success = true;
+
+	success &= assert_true(pool4_get_any(l4protocol, port, NULL, NULL, &result), test_name);
+	if (!success)
+		return false;
+	addr_ctr = addr_index(&result.address);
+	success &= assert_true(addr_ctr >= 0, test_name);
+	if (!success)
+		return false;
+	success &= assert_false(ports[addr_ctr][result.l4_id], test_name);
+	ports[addr_ctr][result.l4_id] = true;
+
+	return success;
+}
+
 static bool test_get_any_aux(u_int8_t l4protocol, u32 port_min, u32 port_max, u32 step, char *test_name)
 {
 	u32 addr_ctr, port_ctr;
 	struct ipv4_tuple_address result;
 	bool success = true;
 
-	for (addr_ctr = 0; addr_ctr < ARRAY_SIZE(expected_ips); addr_ctr++) {
-		for (port_ctr = port_min; port_ctr <= port_max; port_ctr += step) {
-			success &= assert_true(pool4_get_any(l4protocol, port_ctr, &result), test_name);
-			success &= assert_equals_ipv4(&expected_ips[addr_ctr], &result.address, test_name);
-			success &= assert_false(ports[addr_ctr][result.l4_id], test_name);
-			ports[addr_ctr][result.l4_id] = true;
-		}
-	}
-	success &= assert_false(pool4_get_any(l4protocol, 0, &result), test_name);
+	for (addr_ctr = 0; addr_ctr < ARRAY_SIZE(expected_ips); addr_ctr++)
+		for (port_ctr = port_min; port_ctr <= port_max; port_ctr += step)
+			success &= borrow_any(l4protocol, port_ctr, test_name);
+	success &= assert_false(pool4_get_any(l4protocol, 0, NULL, NULL, &result), test_name);
+
+	/* Every address lent every compatible port. */
+	for (addr_ctr = 0; addr_ctr < ARRAY_SIZE(expected_ips); addr_ctr++)
+		for (port_ctr = port_min; port_ctr <= port_max; port_ctr += step)
+			success &= assert_true(ports[addr_ctr][port_ctr], test_name);
 
 	return success;
 }
@@ -91,14 +127,14 @@ static bool test_get_similar_aux(u_int8_t l4protocol, u32 port_min, u32 port_max
 
 		for (port_ctr = port_min; port_ctr <= port_max; port_ctr += step) {
 			query.l4_id = port_ctr;
-			success &= assert_true(pool4_get_similar(l4protocol, &query, &result), test_name);
+			success &= assert_true(pool4_get_similar(l4protocol, &query, NULL, NULL, &result), test_name);
 			success &= assert_equals_ipv4(&expected_ips[addr_ctr], &result.address, test_name);
 			success &= assert_false(ports[addr_ctr][result.l4_id], test_name);
 			ports[addr_ctr][result.l4_id] = true;
 		}
 
 		query.l4_id = port_min;
-		success &= assert_false(pool4_get_similar(l4protocol, &query, &result), test_name);
+		success &= assert_false(pool4_get_similar(l4protocol, &query, NULL, NULL, &result), test_name);
 	}
 
 	return success;
@@ -150,15 +186,11 @@ static bool test_return_function(void)
 	}
 
 	/* Borrow the entire pool. */
-	for (addr_ctr = 0; addr_ctr < ARRAY_SIZE(expected_ips); addr_ctr++) {
-		for (port_ctr = 0; port_ctr < 1024; port_ctr += 2) {
-			success &= assert_true(pool4_get_any(IPPROTO_UDP, port_ctr, &result), "Borrow-result");
-			success &= assert_equals_ipv4(&expected_ips[addr_ctr], &result.address, "Borrow-addr");
-			success &= assert_false(ports[addr_ctr][result.l4_id], "Borrow-port");
-			ports[addr_ctr][result.l4_id] = true;
-		}
-	}
-	success &= assert_false(pool4_get_any(IPPROTO_UDP, 0, &result), "Pool should be exhausted.");
+	for (addr_ctr = 0; addr_ctr < ARRAY_SIZE(expected_ips); addr_ctr++)
+		for (port_ctr = 0; port_ctr < 1024; port_ctr += 2)
+			success &= borrow_any(IPPROTO_UDP, port_ctr, "Borrow");
+	success &= assert_false(pool4_get_any(IPPROTO_UDP, 0, NULL, NULL, &result),
+			"Pool should be exhausted.");
 
 	if (!success)
 		return success;
@@ -173,11 +205,11 @@ static bool test_return_function(void)
 		return success;
 
 	/* Re-borrow it, assert it's the same one. */
-	success &= assert_true(pool4_get_any(IPPROTO_UDP, 0, &result), "");
+	success &= assert_true(pool4_get_any(IPPROTO_UDP, 0, NULL, NULL, &result), "");
 	success &= assert_equals_ipv4(&expected_ips[0], &result.address, "");
 	success &= assert_false(ports[0][result.l4_id], "");
 	ports[0][result.l4_id] = true;
-	success &= assert_false(pool4_get_any(IPPROTO_UDP, 0, &result), "");
+	success &= assert_false(pool4_get_any(IPPROTO_UDP, 0, NULL, NULL, &result), "");
 
 	if (!success)
 		return success;
@@ -196,11 +228,11 @@ static bool test_return_function(void)
 
 	query.address = expected_ips[1];
 	query.l4_id = 0;
-	success &= assert_true(pool4_get_similar(IPPROTO_UDP, &query, &result), "");
+	success &= assert_true(pool4_get_similar(IPPROTO_UDP, &query, NULL, NULL, &result), "");
 	success &= assert_equals_ipv4(&expected_ips[1], &result.address, "");
 	success &= assert_false(ports[1][result.l4_id], "");
 	ports[1][result.l4_id] = true;
-	success &= assert_false(pool4_get_similar(IPPROTO_UDP, &query, &result), "");
+	success &= assert_false(pool4_get_similar(IPPROTO_UDP, &query, NULL, NULL, &result), "");
 
 	if (!success)
 		return success;
@@ -223,25 +255,19 @@ static bool test_return_function(void)
 	if (!success)
 		return success;
 
-	/* Reborrow it. */
-	success &= assert_true(pool4_get_any(IPPROTO_UDP, 24, &result), "Reborrow Addr1-res-port24");
-	success &= assert_equals_ipv4(&expected_ips[0], &result.address, "");
-	success &= assert_false(ports[0][result.l4_id], "");
-	ports[0][result.l4_id] = true;
+	/* Reborrow it. Addr1 has two ports left and Addr2 has one; get_any() can pick either. */
+	success &= borrow_any(IPPROTO_UDP, 24, "Reborrow port24");
 
 	query.address = expected_ips[0];
 	query.l4_id = 100;
-	success &= assert_true(pool4_get_similar(IPPROTO_UDP, &query, &result), "Reborrow Addr1-res-port100");
+	success &= assert_true(pool4_get_similar(IPPROTO_UDP, &query, NULL, NULL, &result), "Reborrow Addr1-res-port100");
 	success &= assert_equals_ipv4(&expected_ips[0], &result.address, "");
 	success &= assert_false(ports[0][result.l4_id], "");
 	ports[0][result.l4_id] = true;
 
-	success &= assert_true(pool4_get_any(IPPROTO_UDP, 56, &result), "ReReborrow Addr2-res-port56");
-	success &= assert_equals_ipv4(&expected_ips[1], &result.address, "");
-	success &= assert_false(ports[1][result.l4_id], "");
-	ports[1][result.l4_id] = true;
+	success &= borrow_any(IPPROTO_UDP, 56, "ReReborrow port56");
 
-	success &= assert_false(pool4_get_any(IPPROTO_UDP, 12, &result), "");
+	success &= assert_false(pool4_get_any(IPPROTO_UDP, 12, NULL, NULL, &result), "");
 
 	if (!success)
 		return success;
@@ -260,6 +286,320 @@ static bool test_return_function(void)
 	return success;
 }
 
+/**
+ * Asserts that, when RSS awareness is enabled, the pool lends transport addresses whose replies
+ * will be received by the current CPU, without forgetting about range (and, for UDP, parity).
+ */
+static bool test_rss_aux(u_int8_t l4protocol, __u16 port, struct ipv4_tuple_address *remote,
+		char *test_name)
+{
+	struct ipv4_tuple_address query, result;
+	int i, cpu = get_cpu();
+	bool success = true;
+
+	for (i = 0; i < 64; i++) {
+		success &= assert_true(pool4_get_any(l4protocol, port, NULL, remote, &result), test_name);
+		success &= assert_equals_int(cpu, rss_get_cpu_ipv4(remote, &result, l4protocol), test_name);
+		if (l4protocol == IPPROTO_UDP)
+			success &= assert_equals_u16(port & 1, result.l4_id & 1, test_name);
+		success &= assert_equals_int(port < 1024, result.l4_id < 1024, test_name);
+
+		query.address = result.address;
+		query.l4_id = port;
+		success &= assert_true(pool4_get_similar(l4protocol, &query, NULL, remote, &result), test_name);
+		success &= assert_equals_ipv4(&query.address, &result.address, test_name);
+		success &= assert_equals_int(cpu, rss_get_cpu_ipv4(remote, &result, l4protocol), test_name);
+	}
+
+	put_cpu();
+	return success;
+}
+
+static bool test_rss(void)
+{
+	char *key = "6d:5a:56:da:25:5b:0e:c2:41:67:25:3d:43:a3:8f:b0:d0:ca:2b:cb:"
+			"ae:7b:30:b4:77:cb:2d:a3:80:30:f2:0c:6a:42:b7:3b:be:ac:01:fa";
+	int indirection[128];
+	struct ipv4_tuple_address remote;
+	int i, cpu = get_cpu();
+	bool success = true;
+
+	put_cpu();
+
+	/* Half of the traffic goes to this CPU, the rest to some other one (if there is one). */
+	for (i = 0; i < ARRAY_SIZE(indirection); i++)
+		indirection[i] = (i & 1) ? cpu : ((cpu + 1) % nr_cpu_ids);
+	if (!assert_equals_int(0, rss_init(key, indirection, ARRAY_SIZE(indirection)), "RSS init"))
+		return false;
+
+	if (str_to_addr4("203.0.113.5", &remote.address) != 0) {
+		rss_destroy();
+		return false;
+	}
+	remote.l4_id = 80;
+
+	success &= test_rss_aux(IPPROTO_UDP, 1024, &remote, "UDP-High even ports");
+	success &= test_rss_aux(IPPROTO_UDP, 7, &remote, "UDP-Low odd ports");
+	success &= test_rss_aux(IPPROTO_TCP, 2000, &remote, "TCP");
+
+	rss_destroy();
+	return success;
+}
+
+/**
+ * Asserts the pool can tell which addresses belong to it, as they come and go.
+ */
+static bool test_contains(void)
+{
+	struct in_addr addr;
+	int i;
+	bool success = true;
+
+	for (i = 0; i < ARRAY_SIZE(expected_ips); i++)
+		success &= assert_true(pool4_contains(&expected_ips[i]), "Initial addresses");
+	addr.s_addr = cpu_to_be32(0xc0a80203); /* 192.168.2.3 */
+	success &= assert_false(pool4_contains(&addr), "Neighbor of the initial addresses");
+
+	/* Enough addresses to spread over several slots. */
+	for (i = 0; i < 64; i++) {
+		addr.s_addr = cpu_to_be32(0x0a000000 | i);
+		success &= assert_equals_int(0, pool4_register(&addr), "Register");
+	}
+	for (i = 0; i < 64; i++) {
+		addr.s_addr = cpu_to_be32(0x0a000000 | i);
+		success &= assert_true(pool4_contains(&addr), "Registered address");
+	}
+	addr.s_addr = cpu_to_be32(0x0a000000 | 64);
+	success &= assert_false(pool4_contains(&addr), "Address after the registered ones");
+
+	success &= assert_equals_int(0, pool4_remove(&expected_ips[0]), "Remove");
+	success &= assert_false(pool4_contains(&expected_ips[0]), "Removed address");
+	success &= assert_true(pool4_contains(&expected_ips[1]), "Surviving address");
+
+	/* The deterministic addresses are not the pool's to lend. */
+	if (!assert_equals_int(0, determ_init("2001:db8::/40", 56, "198.51.100.0/30", 2016), "Determ"))
+		return false;
+	addr.s_addr = cpu_to_be32(0xc6336401); /* 198.51.100.1 */
+	success &= assert_equals_int(-EINVAL, pool4_register(&addr), "Deterministic address");
+	determ_destroy();
+
+	return success;
+}
+
+/**
+ * Asserts the addresses share the load, however they are chosen.
+ */
+static bool test_select(void)
+{
+	struct ipv4_tuple_address result;
+	struct in6_addr source;
+	unsigned int counts[ARRAY_SIZE(expected_ips)];
+	int i, addr_ctr, first;
+	bool success = true;
+
+	/* Round robin alternates. */
+	success &= assert_equals_int(0, pool4_set_select("round-robin"), "RR mode");
+	memset(counts, 0, sizeof(counts));
+	for (i = 0; i < 100; i++) {
+		success &= assert_true(pool4_get_any(IPPROTO_TCP, 2000, NULL, NULL, &result), "RR get");
+		addr_ctr = addr_index(&result.address);
+		if (!assert_true(addr_ctr >= 0, "RR address"))
+			return false;
+		counts[addr_ctr]++;
+	}
+	success &= assert_equals_u32(50, counts[0], "RR first address");
+	success &= assert_equals_u32(50, counts[1], "RR second address");
+
+	/* Least loaded compensates for the first address being busier. */
+	success &= assert_equals_int(0, pool4_set_select("least-loaded"), "LL mode");
+	for (i = 0; i < 100; i++) {
+		result.address = expected_ips[0];
+		result.l4_id = 3000 + i;
+		success &= assert_true(pool4_get(IPPROTO_TCP, &result), "LL occupy first address");
+	}
+	memset(counts, 0, sizeof(counts));
+	for (i = 0; i < 100; i++) {
+		success &= assert_true(pool4_get_any(IPPROTO_TCP, 2000, NULL, NULL, &result), "LL get");
+		addr_ctr = addr_index(&result.address);
+		if (!assert_true(addr_ctr >= 0, "LL address"))
+			return false;
+		counts[addr_ctr]++;
+	}
+	success &= assert_true(counts[1] > counts[0], "LL prefers the idle address");
+
+	/* Source hash always sends the same IPv6 node to the same address. */
+	success &= assert_equals_int(0, pool4_set_select("source-hash"), "Hash mode");
+	if (str_to_addr6("2001:db8::1", &source) != 0)
+		return false;
+	success &= assert_true(pool4_get_any(IPPROTO_UDP, 1500, &source, NULL, &result), "Hash get");
+	first = addr_index(&result.address);
+	for (i = 0; i < 20; i++) {
+		success &= assert_true(pool4_get_any(IPPROTO_UDP, 1500, &source, NULL, &result),
+				"Hash get again");
+		success &= assert_equals_int(first, addr_index(&result.address), "Hash is sticky");
+	}
+
+	success &= assert_equals_int(-EINVAL, pool4_set_select("fastest"), "Bogus mode");
+	success &= assert_equals_int(0, pool4_set_select(NULL), "Default mode");
+
+	return success;
+}
+
+/**
+ * Returns any transport address of class "class" cached by any CPU, in "result".
+ */
+static bool find_cached(int class, struct ipv4_tuple_address *result)
+{
+	struct pool4_cpu *cpu;
+	int i;
+	bool found = false;
+
+	for_each_possible_cpu(i) {
+		cpu = per_cpu_ptr(cpus, i);
+		spin_lock_bh(&cpu->lock);
+		if (cpu->magazines[class].count > 0) {
+			*result = cpu->magazines[class].entries[0];
+			found = true;
+		}
+		spin_unlock_bh(&cpu->lock);
+		if (found)
+			break;
+	}
+
+	return found;
+}
+
+/**
+ * Asserts the CPUs' caches serve borrows and returns, and never lose track of anything.
+ */
+static bool test_magazines(void)
+{
+	struct ipv4_tuple_address result, cached;
+	struct magazine_stats before, after;
+	bool success = true;
+
+	pool4_get_magazine_stats(&before);
+	success &= assert_equals_u32(0, before.hits + before.misses, "Nothing happened yet");
+
+	/* The first borrow fills the cache, so the rest of the batch stays there. */
+	success &= assert_true(pool4_get_any(IPPROTO_TCP, 2000, NULL, NULL, &result), "Borrow");
+	pool4_get_magazine_stats(&after);
+	success &= assert_equals_u32(1, after.misses, "First borrow is a miss");
+	success &= assert_equals_u32(MAGAZINE_BATCH - 1, after.cached, "Rest of the batch is cached");
+
+	/* Returns land in the cache. */
+	success &= assert_true(pool4_return(IPPROTO_TCP, &result), "Return");
+	success &= assert_false(pool4_return(IPPROTO_TCP, &result), "Double return");
+	pool4_get_magazine_stats(&after);
+	success &= assert_equals_u32(1, after.hits, "Return is a hit");
+	success &= assert_equals_u32(MAGAZINE_BATCH, after.cached, "Returned port is cached");
+
+	/* Specific ports can be taken even if some CPU is holding them. */
+	if (!assert_true(find_cached(CLASS_TCP_HIGH, &cached), "Something is cached"))
+		return false;
+	success &= assert_true(pool4_get(IPPROTO_TCP, &cached), "Take cached port");
+	success &= assert_false(pool4_get(IPPROTO_TCP, &cached), "Take it again");
+	pool4_get_magazine_stats(&after);
+	success &= assert_equals_u32(MAGAZINE_BATCH - 1, after.cached, "Taken port left the cache");
+	success &= assert_true(pool4_return(IPPROTO_TCP, &cached), "Return the taken port");
+
+	/* Removed addresses vanish from the caches. */
+	success &= assert_equals_int(0, pool4_remove(&expected_ips[0]), "Remove");
+	while (find_cached(CLASS_TCP_HIGH, &cached)) {
+		success &= assert_false(ipv4_addr_equals(&expected_ips[0], &cached.address),
+				"Removed address is not cached");
+		if (!success || !pool4_get(IPPROTO_TCP, &cached))
+			break;
+	}
+
+	return success;
+}
+
+/**
+ * Returns the number of values of class "class" "addr" has left.
+ */
+static u32 free_count(struct in_addr *addr, int class)
+{
+	struct pool4_node *node;
+	u32 result;
+
+	spin_lock_bh(&pool_lock);
+	node = pool4_table_get(&pool_table, addr);
+	result = node ? node->ids[class].free_count : 0;
+	spin_unlock_bh(&pool_lock);
+
+	return result;
+}
+
+/**
+ * Asserts IPv6 nodes are given ports from their own blocks, which are given back as a whole.
+ */
+static bool test_blocks(void)
+{
+	struct ipv4_tuple_address first_block[8], result, similar;
+	struct in6_addr source1, source2;
+	u32 initial;
+	__u16 min, max;
+	int i, j;
+	bool success = true;
+
+	success &= assert_equals_int(-EINVAL, pool4_set_block_size(3), "Not a power of two");
+	success &= assert_equals_int(-EINVAL, pool4_set_block_size(128), "Too big");
+	success &= assert_equals_int(0, pool4_set_block_size(8), "Block size");
+	if (str_to_addr6("2001:db8::1", &source1) != 0 || str_to_addr6("2001:db8::2", &source2) != 0)
+		return false;
+
+	/* The first borrow reserves a block; the next ones are served from it. */
+	for (i = 0; i < 8; i++) {
+		if (!assert_true(pool4_get_any(IPPROTO_UDP, 1500, &source1, NULL, &first_block[i]),
+				"Borrow from the block"))
+			return false;
+	}
+	initial = free_count(&first_block[0].address, CLASS_UDP_HIGH_EVEN);
+
+	min = max = first_block[0].l4_id;
+	for (i = 0; i < 8; i++) {
+		success &= assert_true(ipv4_addr_equals(&first_block[0].address, &first_block[i].address),
+				"Same address");
+		success &= assert_true(first_block[i].l4_id >= 1024, "Compatible range");
+		success &= assert_equals_int(0, first_block[i].l4_id % 2, "Compatible parity");
+		for (j = 0; j < i; j++)
+			success &= assert_true(first_block[i].l4_id != first_block[j].l4_id, "Unique");
+		min = min_t(__u16, min, first_block[i].l4_id);
+		max = max_t(__u16, max, first_block[i].l4_id);
+	}
+	success &= assert_equals_int(14, max - min, "Strided block");
+
+	/* A spent block makes way for a new one, from the same address. */
+	success &= assert_true(pool4_get_any(IPPROTO_UDP, 1500, &source1, NULL, &result), "New block");
+	success &= assert_true(ipv4_addr_equals(&first_block[0].address, &result.address),
+			"New block, same address");
+	success &= assert_equals_u32(initial - 8, free_count(&result.address, CLASS_UDP_HIGH_EVEN),
+			"The pool only lent the new block");
+	success &= assert_true(pool4_get_similar(IPPROTO_UDP, &result, &source1, NULL, &similar),
+			"Similar comes from the new block");
+	success &= assert_equals_u32(initial - 8, free_count(&similar.address, CLASS_UDP_HIGH_EVEN),
+			"The pool was not bothered");
+
+	/* Other nodes get their own blocks. */
+	success &= assert_true(pool4_get_any(IPPROTO_UDP, 1500, &source2, NULL, &result), "Other node");
+	if (ipv4_addr_equals(&first_block[0].address, &result.address))
+		success &= assert_true(result.l4_id < min || max < result.l4_id, "Other node's block");
+
+	/* The block goes back once all of its ports do. */
+	initial = free_count(&first_block[0].address, CLASS_UDP_HIGH_EVEN);
+	for (i = 0; i < 7; i++)
+		success &= assert_true(pool4_return(IPPROTO_UDP, &first_block[i]), "Return");
+	success &= assert_false(pool4_return(IPPROTO_UDP, &first_block[0]), "Double return");
+	success &= assert_equals_u32(initial, free_count(&first_block[0].address, CLASS_UDP_HIGH_EVEN),
+			"Block is still lent");
+	success &= assert_true(pool4_return(IPPROTO_UDP, &first_block[7]), "Return the last one");
+	success &= assert_equals_u32(initial + 8,
+			free_count(&first_block[0].address, CLASS_UDP_HIGH_EVEN), "Block was given back");
+
+	return success;
+}
+
 static bool init(void)
 {
 	int addr_ctr, port_ctr;
@@ -299,6 +639,11 @@ int init_module(void)
 	INIT_CALL_END(init(), test_get_similar_function_tcp(), destroy(), "Get similar-TCP");
 	INIT_CALL_END(init(), test_get_similar_function_icmp(), destroy(), "Get similar-ICMP");
 	INIT_CALL_END(init(), test_return_function(), destroy(), "Return function");
+	INIT_CALL_END(init(), test_rss(), destroy(), "RSS-aware borrowing");
+	INIT_CALL_END(init(), test_contains(), destroy(), "Membership");
+	INIT_CALL_END(init(), test_select(), destroy(), "Address selection");
+	INIT_CALL_END(init(), test_magazines(), destroy(), "CPU caches");
+	INIT_CALL_END(init(), test_blocks(), destroy(), "Port blocks");
 
 	END_TESTS;
 }
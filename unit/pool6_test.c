@@ -0,0 +1,205 @@
+#include <linux/module.h>
+#include <linux/printk.h>
+
+#include "nat64/unit/unit_test.h"
+#include "nat64/comm/str_utils.h"
+#include "pool6.c"
+
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Alberto Leiva");
+MODULE_DESCRIPTION("IPv6 pool module test");
+
+
+static bool register_prefix(char *prefix_str, __u8 len, char *subset_str, __u8 subset_len)
+{
+	struct ipv6_prefix prefix;
+	struct ipv4_prefix subset = { .len = 0 };
+
+	if (str_to_addr6(prefix_str, &prefix.address) != 0)
+		return false;
+	prefix.len = len;
+	if (subset_str) {
+		if (str_to_addr4(subset_str, &subset.address) != 0)
+			return false;
+		subset.len = subset_len;
+	}
+
+	return assert_equals_int(0, pool6_register(&prefix, &subset), prefix_str);
+}
+
+static bool remove_prefix(char *prefix_str, __u8 len)
+{
+	struct ipv6_prefix prefix;
+
+	if (str_to_addr6(prefix_str, &prefix.address) != 0)
+		return false;
+	prefix.len = len;
+
+	return assert_equals_int(0, pool6_remove(&prefix), prefix_str);
+}
+
+/**
+ * Asserts "addr_str" belongs to the "prefix_str"/"len" prefix of the pool.
+ */
+static bool assert_match(char *addr_str, char *prefix_str, __u8 len, char *test_name)
+{
+	struct in6_addr addr, expected;
+	struct pool6_entry entry;
+	bool success = true;
+
+	if (str_to_addr6(addr_str, &addr) != 0 || str_to_addr6(prefix_str, &expected) != 0)
+		return false;
+
+	success &= assert_true(pool6_contains(&addr), test_name);
+	if (!assert_true(pool6_get(&addr, &entry), test_name))
+		return false;
+	success &= assert_equals_ipv6(&expected, &entry.prefix.address, test_name);
+	success &= assert_equals_u8(len, entry.prefix.len, test_name);
+
+	return success;
+}
+
+static bool assert_no_match(char *addr_str, char *test_name)
+{
+	struct in6_addr addr;
+	struct pool6_entry entry;
+	bool success = true;
+
+	if (str_to_addr6(addr_str, &addr) != 0)
+		return false;
+
+	success &= assert_false(pool6_contains(&addr), test_name);
+	success &= assert_false(pool6_get(&addr, &entry), test_name);
+
+	return success;
+}
+
+static bool test_longest_match(void)
+{
+	bool success = true;
+
+	if (!assert_equals_int(0, pool6_init(NULL, 0), "Init"))
+		return false;
+
+	/* The siblings are forked first; the /32 has to be slipped above the fork later. */
+	success &= register_prefix("2001:db8:1::", 48, "192.0.2.0", 24);
+	success &= register_prefix("2001:db8:2::", 48, NULL, 0);
+	success &= register_prefix("2001:db8::", 32, NULL, 0);
+	success &= register_prefix("2001:db8:1:2::", 64, NULL, 0);
+	if (!success)
+		goto end;
+
+	success &= assert_match("2001:db8:1:2::1", "2001:db8:1:2::", 64, "Most specific");
+	success &= assert_match("2001:db8:1:3::1", "2001:db8:1::", 48, "First sibling");
+	success &= assert_match("2001:db8:2:3::1", "2001:db8:2::", 48, "Second sibling");
+	success &= assert_match("2001:db8:3::1", "2001:db8::", 32, "Parent");
+	success &= assert_match("64:ff9b::c000:201", "64:ff9b::", 96, "Default");
+	success &= assert_no_match("2001:db9::1", "Outside");
+	success &= assert_no_match("::1", "Way outside");
+
+	/* Removing the middle of a path must not disconnect the rest. */
+	success &= remove_prefix("2001:db8:1::", 48);
+	success &= assert_match("2001:db8:1:3::1", "2001:db8::", 32, "Removed sibling");
+	success &= assert_match("2001:db8:1:2::1", "2001:db8:1:2::", 64, "Orphan");
+	success &= remove_prefix("2001:db8::", 32);
+	success &= assert_no_match("2001:db8:3::1", "Removed parent");
+	success &= assert_match("2001:db8:2:3::1", "2001:db8:2::", 48, "Remaining sibling");
+
+end:
+	pool6_destroy();
+	return success;
+}
+
+static bool test_config(void)
+{
+	struct ipv6_prefix prefix, peeked;
+	struct ipv4_prefix subset;
+	struct in6_addr addr;
+	struct in_addr addr4;
+	__u8 index1, index2;
+	bool success = true;
+
+	if (!assert_equals_int(0, pool6_init(NULL, 0), "Init"))
+		return false;
+
+	if (str_to_addr6("2001:db8::", &prefix.address) != 0
+			|| str_to_addr4("192.0.2.0", &subset.address) != 0)
+		goto end;
+
+	prefix.len = 33;
+	success &= assert_equals_int(-EINVAL, pool6_register(&prefix, NULL), "Bad length");
+	prefix.len = 32;
+	subset.len = 16;
+	success &= assert_equals_int(-EINVAL, pool6_register(&prefix, &subset), "Big subset");
+	subset.len = 24;
+	success &= assert_equals_int(0, pool6_register(&prefix, &subset), "Register");
+	success &= assert_equals_int(-EEXIST, pool6_register(&prefix, NULL), "Reinsert");
+
+	/* Indexes survive removals. */
+	if (str_to_addr6("2001:db8::1", &addr) != 0)
+		goto end;
+	success &= assert_true(pool6_get_index(&addr, &peeked, &index1), "Index");
+	success &= assert_equals_int(0, pool6_remove(&prefix), "Remove");
+	success &= assert_equals_int(-ENOENT, pool6_remove(&prefix), "Remove again");
+	success &= assert_equals_int(0, pool6_register(&prefix, &subset), "Register again");
+	success &= assert_true(pool6_get_index(&addr, &peeked, &index2), "Index again");
+	success &= assert_equals_u8(index1, index2, "Same index");
+	success &= assert_true(ipv6_prefix_equals(&prefix, pool6_get_by_index(index1)), "By index");
+
+	/* IPv4 nodes get the prefix with the most specific subset. */
+	if (str_to_addr4("192.0.2.5", &addr4) != 0)
+		goto end;
+	success &= assert_true(pool6_peek_by_pool4(&addr4, &peeked), "Peek in subset");
+	success &= assert_true(ipv6_prefix_equals(&prefix, &peeked), "Subset's prefix");
+	if (str_to_addr4("198.51.100.1", &addr4) != 0)
+		goto end;
+	success &= assert_true(pool6_peek_by_pool4(&addr4, &peeked), "Peek outside");
+	success &= assert_equals_u8(96, peeked.len, "Default prefix");
+
+	/* The oldest prefix is still the default one. */
+	success &= assert_true(pool6_peek(&peeked), "Peek");
+	success &= assert_equals_u8(96, peeked.len, "Oldest");
+
+end:
+	pool6_destroy();
+	return success;
+}
+
+static bool test_init(void)
+{
+	char *good[] = { "2001:db8::/32=192.0.2.0/24", "64:ff9b::/96" };
+	char *bad[] = { "2001:db8::/32=192.0.2.0" };
+	struct ipv6_prefix prefix;
+	struct in_addr addr4;
+	bool success = true;
+
+	success &= assert_equals_int(0, pool6_init(good, ARRAY_SIZE(good)), "Init");
+	if (str_to_addr4("192.0.2.1", &addr4) != 0)
+		return false;
+	success &= assert_true(pool6_peek_by_pool4(&addr4, &prefix), "Subset parsed");
+	success &= assert_equals_u8(32, prefix.len, "Subset's prefix");
+	success &= assert_match("64:ff9b::1", "64:ff9b::", 96, "Second prefix");
+	pool6_destroy();
+
+	success &= assert_equals_int(-EINVAL, pool6_init(bad, ARRAY_SIZE(bad)), "Subset length");
+	success &= assert_false(pool6_peek(&prefix), "Failures leave the pool empty");
+
+	return success;
+}
+
+int init_module(void)
+{
+	START_TESTS("IPv6 pool");
+
+	CALL_TEST(test_longest_match(), "Longest prefix match");
+	CALL_TEST(test_config(), "Configuration");
+	CALL_TEST(test_init(), "Module parameters");
+
+	END_TESTS;
+}
+
+void cleanup_module(void)
+{
+	/* No code. */
+}
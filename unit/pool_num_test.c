@@ -4,17 +4,6 @@
 #include "nat64/unit/unit_test.h"
 #include "poolnum.c"
 
-static bool find(u16 *arr, u16 arr_len, u16 value)
-{
-	u16 i;
-
-	for (i = 0; i < arr_len; i++)
-		if (arr[i] == value)
-			return true;
-
-	return false;
-}
-
 static bool test_poolnum_init_function(void)
 {
 	bool success = true;
@@ -24,21 +13,21 @@ static bool test_poolnum_init_function(void)
 	if (!success)
 		return success;
 
-	success &= assert_equals_u16(4, pool.count, "Pool's array count");
-	success &= assert_equals_u16(0, pool.next, "Next gettable value's index");
-	success &= assert_equals_u16(0, pool.returned, "Index of value just returned");
-
-	success &= assert_false(find(pool.array, 4, 5), "5 should not belong to the pool");
-	success &= assert_false(find(pool.array, 4, 6), "6 should not belong to the pool");
-	success &= assert_true(find(pool.array, 4, 7), "7 should belong to the pool");
-	success &= assert_false(find(pool.array, 4, 8), "8 should not belong to the pool");
-	success &= assert_true(find(pool.array, 4, 9), "9 should belong to the pool");
-	success &= assert_false(find(pool.array, 4, 10), "10 should not belong to the pool");
-	success &= assert_true(find(pool.array, 4, 11), "11 should belong to the pool");
-	success &= assert_false(find(pool.array, 4, 12), "12 should not belong to the pool");
-	success &= assert_true(find(pool.array, 4, 13), "13 should belong to the pool");
-	success &= assert_false(find(pool.array, 4, 14), "14 should not belong to the pool");
-	success &= assert_false(find(pool.array, 4, 15), "15 should not belong to the pool");
+	success &= assert_equals_u32(4, pool.count, "Pool's value count");
+	success &= assert_equals_u32(4, pool.free_count, "Available values");
+	success &= assert_null(pool.bitmap, "Nothing is allocated until the first borrow");
+
+	success &= assert_false(poolnum_is_free(&pool, 5), "5 should not belong to the pool");
+	success &= assert_false(poolnum_is_free(&pool, 6), "6 should not belong to the pool");
+	success &= assert_true(poolnum_is_free(&pool, 7), "7 should belong to the pool");
+	success &= assert_false(poolnum_is_free(&pool, 8), "8 should not belong to the pool");
+	success &= assert_true(poolnum_is_free(&pool, 9), "9 should belong to the pool");
+	success &= assert_false(poolnum_is_free(&pool, 10), "10 should not belong to the pool");
+	success &= assert_true(poolnum_is_free(&pool, 11), "11 should belong to the pool");
+	success &= assert_false(poolnum_is_free(&pool, 12), "12 should not belong to the pool");
+	success &= assert_true(poolnum_is_free(&pool, 13), "13 should belong to the pool");
+	success &= assert_false(poolnum_is_free(&pool, 14), "14 should not belong to the pool");
+	success &= assert_false(poolnum_is_free(&pool, 15), "15 should not belong to the pool");
 
 	poolnum_destroy(&pool);
 	return success;
@@ -55,22 +44,20 @@ static bool test_poolnum_get_any_function(void)
 		return success;
 
 	success &= assert_equals_int(0, poolnum_get_any(&pool, &first_get), "");
-	success &= assert_equals_u16(pool.count, 3, "Count remains unchanged 1");
-	success &= assert_equals_u16(pool.next, 1, "Next should point to the second value");
-	success &= assert_equals_u16(pool.returned, 0, "Returned remains unchanged 1");
+	success &= assert_true(1 <= first_get && first_get <= 3, "The number belongs to the pool 1");
+	success &= assert_false(poolnum_is_free(&pool, first_get), "The number is taken 1");
+	success &= assert_equals_u32(2, pool.free_count, "Available values 1");
 
 	success &= assert_equals_int(0, poolnum_get_any(&pool, &second_get), "");
+	success &= assert_true(1 <= second_get && second_get <= 3, "The number belongs to the pool 2");
 	success &= assert_true(first_get != second_get, "The number is not already taken 1");
-	success &= assert_equals_u16(pool.count, 3, "Count remains unchanged 2");
-	success &= assert_equals_u16(pool.next, 2, "Next should point to the third value");
-	success &= assert_equals_u16(pool.returned, 0, "Returned remains unchanged 2");
+	success &= assert_equals_u32(1, pool.free_count, "Available values 2");
 
 	success &= assert_equals_int(0, poolnum_get_any(&pool, &third_get), "");
+	success &= assert_true(1 <= third_get && third_get <= 3, "The number belongs to the pool 3");
 	success &= assert_true(first_get != third_get && second_get != third_get,
 			"The number is not already taken 2");
-	success &= assert_equals_u16(pool.count, 3, "Count remains unchanged 3");
-	success &= assert_equals_u16(pool.next, 0, "Next should point to the first value");
-	success &= assert_equals_u16(pool.returned, 0, "Returned remains unchanged 3");
+	success &= assert_equals_u32(0, pool.free_count, "Available values 3");
 
 	success &= assert_equals_int(-ESRCH, poolnum_get_any(&pool, &fourth_get),
 			"Pool is exhausted; get should fail 1");
@@ -81,89 +68,43 @@ static bool test_poolnum_get_any_function(void)
 	return success;
 }
 
-/*
-static bool assert_pool(struct poolnum *pool,
-		u16 expected_arr_1, u16 expected_arr_2, u16 expected_arr_3,
-		u32 expected_next, u32 expected_returned)
-{
-	bool success = true;
-
-	success &= assert_equals_u16(expected_arr_1, pool->array[0], "");
-	success &= assert_equals_u16(expected_arr_2, pool->array[1], "");
-	success &= assert_equals_u16(expected_arr_3, pool->array[2], "");
-	success &= assert_equals_u32(3, pool->count, "");
-	success &= assert_equals_u32(expected_next, pool->next, "");
-	success &= assert_equals_u32(expected_returned, pool->returned, "");
-
-	return success;
-}
-*/
-
 static bool test_poolnum_return_function(void)
 {
 	bool success = true;
 	struct poolnum pool;
-	u16 next_get = 0;
+	u16 next_get = 0, first_get;
 
-	/* TODO (test) change numbers to comments? */
-	success &= assert_equals_int(0, poolnum_init(&pool, 1, 3, 1), "1");
+	success &= assert_equals_int(0, poolnum_init(&pool, 1, 3, 1), "Init");
 	if (!success)
 		return success;
-	pool.array[0] = 1;
-	pool.array[1] = 2;
-	pool.array[2] = 3;
-
-	success &= assert_equals_int(-EINVAL, poolnum_return(&pool, 4), "2");
-	/* success &= assert_pool(&pool, 1, 2, 3, 0, 0); */
-
-	success &= assert_equals_int(0, poolnum_get_any(&pool, &next_get), "3");
-	success &= assert_equals_u16(1, next_get, "");
-	/* success &= assert_pool(&pool, 1, 2, 3, 1, 0); */
 
-	success &= assert_equals_int(0, poolnum_return(&pool, 10), "4");
-	/* success &= assert_pool(&pool, 10, 2, 3, 1, 1); */
+	/* Nothing has been borrowed yet. */
+	success &= assert_equals_int(-EINVAL, poolnum_return(&pool, 1), "Return unborrowed");
+	success &= assert_equals_int(-EINVAL, poolnum_return(&pool, 4), "Return foreign");
 
-	success &= assert_equals_int(-EINVAL, poolnum_return(&pool, 4), "5");
-	/* success &= assert_pool(&pool, 10, 2, 3, 1, 1); */
+	success &= assert_equals_int(0, poolnum_get_any(&pool, &first_get), "Get 1");
+	success &= assert_equals_int(-EINVAL, poolnum_return(&pool, 10), "Return out of range");
+	success &= assert_equals_int(0, poolnum_return(&pool, first_get), "Return 1");
+	success &= assert_equals_int(-EINVAL, poolnum_return(&pool, first_get), "Return twice");
+	success &= assert_equals_u32(3, pool.free_count, "Everything is back");
 
-	success &= assert_equals_int(0, poolnum_get_any(&pool, &next_get), "6");
-	success &= assert_equals_u16(2, next_get, "7");
-	success &= assert_equals_int(0, poolnum_get_any(&pool, &next_get), "8");
-	success &= assert_equals_u16(3, next_get, "9");
-	success &= assert_equals_int(0, poolnum_get_any(&pool, &next_get), "10");
-	success &= assert_equals_u16(10, next_get, "11");
-	success &= assert_equals_int(-ESRCH, poolnum_get_any(&pool, &next_get), "12");
-	/* success &= assert_pool(&pool, 10, 2, 3, 1, 0); */
+	success &= assert_equals_int(0, poolnum_get_any(&pool, &next_get), "Get 2");
+	success &= assert_equals_int(0, poolnum_get_any(&pool, &next_get), "Get 3");
+	success &= assert_equals_int(0, poolnum_get_any(&pool, &next_get), "Get 4");
+	success &= assert_equals_int(-ESRCH, poolnum_get_any(&pool, &next_get), "Exhausted");
 
-	success &= assert_equals_int(0, poolnum_return(&pool, 2), "13");
-	success &= assert_equals_int(0, poolnum_return(&pool, 3), "14");
-	success &= assert_equals_int(0, poolnum_return(&pool, 1), "15");
-	success &= assert_equals_int(-EINVAL, poolnum_return(&pool, 4), "16");
+	success &= assert_equals_int(0, poolnum_return(&pool, 2), "Return 2");
+	success &= assert_equals_int(0, poolnum_return(&pool, 3), "Return 3");
+	success &= assert_equals_int(0, poolnum_return(&pool, 1), "Return 4");
+	success &= assert_equals_int(-EINVAL, poolnum_return(&pool, 4), "Return foreign again");
 
-	success &= assert_equals_int(0, poolnum_get_any(&pool, &next_get), "17");
-	success &= assert_equals_u16(2, next_get, "18");
+	success &= assert_equals_int(0, poolnum_get_any(&pool, &next_get), "Get 5");
+	success &= assert_true(1 <= next_get && next_get <= 3, "Get 5 belongs to the pool");
 
 	poolnum_destroy(&pool);
 	return success;
 }
 
-static bool assert_pool(struct poolnum *pool, u16 val1, u16 val2, u16 val3, u16 val4, u32 next,
-		u32 returned, bool next_is_ahead)
-{
-	bool success = true;
-
-	success &= assert_equals_u16(val1, pool->array[0], "1st value");
-	success &= assert_equals_u16(val2, pool->array[1], "2nd value");
-	success &= assert_equals_u16(val3, pool->array[2], "3rd value");
-	success &= assert_equals_u16(val4, pool->array[3], "4th value");
-	success &= assert_equals_u32(4, pool->count, "count");
-	success &= assert_equals_u32(next, pool->next, "next");
-	success &= assert_equals_u32(returned, pool->returned, "returned");
-	success &= assert_equals_u32(next_is_ahead, pool->next_is_ahead, "next_is_ahead");
-
-	return success;
-}
-
 static bool test_poolnum_get_function(void) {
 	bool success = true;
 	struct poolnum pool;
@@ -172,65 +113,42 @@ static bool test_poolnum_get_function(void) {
 	success &= assert_equals_int(0, poolnum_init(&pool, 0, 3, 1), "");
 	if (!success)
 		return success;
-	pool.array[0] = 0;
-	pool.array[1] = 1;
-	pool.array[2] = 2;
-	pool.array[3] = 3;
 
 	/* Request values that do not belong to the pool. */
 	success &= assert_false(poolnum_get(&pool, -1), "");
-	success &= assert_pool(&pool, 0, 1, 2, 3,	0, 0, false);
 	success &= assert_false(poolnum_get(&pool, -4), "");
-	success &= assert_pool(&pool, 0, 1, 2, 3,	0, 0, false);
-
-	if (!success)
-		return success;
+	success &= assert_equals_u32(4, pool.free_count, "Nothing was taken");
 
 	/* Test featuring get_anys. */
 	success &= assert_true(poolnum_get(&pool, 2), "");
-	success &= assert_pool(&pool, 0, 1, 0, 3,	1, 0, true);
+	success &= assert_false(poolnum_is_free(&pool, 2), "");
 	success &= assert_true(poolnum_get(&pool, 1), "");
-	success &= assert_pool(&pool, 0, 1, 0, 3,	2, 0, true);
+	success &= assert_false(poolnum_is_free(&pool, 1), "");
 	success &= assert_equals_int(0, poolnum_get_any(&pool, &get_any_result), "");
-	success &= assert_equals_u16(0, get_any_result, "");
-	success &= assert_false(poolnum_get(&pool, 0), "");
+	success &= assert_true(get_any_result == 0 || get_any_result == 3, "");
+	success &= assert_false(poolnum_get(&pool, get_any_result), "");
 	success &= assert_false(poolnum_get(&pool, 1), "");
 	success &= assert_false(poolnum_get(&pool, 2), "");
-	success &= assert_true(poolnum_get(&pool, 3), "");
-	success &= assert_pool(&pool, 0, 1, 0, 3,	0, 0, true);
-	success &= assert_false(poolnum_get(&pool, 3), "");
+	success &= assert_true(poolnum_get(&pool, 3 - get_any_result), "");
+	success &= assert_false(poolnum_get(&pool, 3 - get_any_result), "");
 	success &= assert_equals_int(-ESRCH, poolnum_get_any(&pool, &get_any_result), "");
 
 	if (!success)
 		return success;
 
-	/* Reset. */
-	pool.array[0] = 0;
-	pool.array[1] = 1;
-	pool.array[2] = 2;
-	pool.array[3] = 3;
-	pool.next = 0;
-	pool.returned = 0;
-	pool.next_is_ahead = false;
-
 	/* Test featuring returns. */
-	success &= assert_true(poolnum_get(&pool, 0), "1");
-	success &= assert_pool(&pool, 0, 1, 2, 3,	1, 0, true);
-	success &= assert_true(poolnum_get(&pool, 3), "2");
-	success &= assert_pool(&pool, 0, 1, 2, 1,	2, 0, true);
-	success &= assert_equals_int(0, poolnum_return(&pool, 3), "3");
-	success &= assert_pool(&pool, 3, 1, 2, 1,	2, 1, true);
-	success &= assert_equals_int(0, poolnum_return(&pool, 0), "4");
-	success &= assert_pool(&pool, 3, 0, 2, 1,	2, 2, false);
-
-	success &= assert_true(poolnum_get(&pool, 3), "5");
-	success &= assert_pool(&pool, 2, 0, 2, 1,	3, 2, true);
-	success &= assert_true(poolnum_get(&pool, 1), "6");
-	success &= assert_pool(&pool, 2, 0, 2, 1,	0, 2, true);
-	success &= assert_true(poolnum_get(&pool, 0), "7");
-	success &= assert_pool(&pool, 2, 2, 2, 1,	1, 2, true);
-	success &= assert_true(poolnum_get(&pool, 2), "8");
-	success &= assert_pool(&pool, 2, 2, 2, 1,	2, 2, true);
+	success &= assert_equals_int(0, poolnum_return(&pool, 3), "1");
+	success &= assert_equals_int(0, poolnum_return(&pool, 0), "2");
+	success &= assert_true(poolnum_is_free(&pool, 0), "3");
+	success &= assert_false(poolnum_is_free(&pool, 1), "4");
+	success &= assert_false(poolnum_is_free(&pool, 2), "5");
+	success &= assert_true(poolnum_is_free(&pool, 3), "6");
+
+	success &= assert_true(poolnum_get(&pool, 3), "7");
+	success &= assert_false(poolnum_get(&pool, 1), "8");
+	success &= assert_true(poolnum_get(&pool, 0), "9");
+	success &= assert_equals_int(0, poolnum_return(&pool, 2), "10");
+	success &= assert_true(poolnum_get(&pool, 2), "11");
 
 	success &= assert_false(poolnum_get(&pool, 0), "");
 	success &= assert_false(poolnum_get(&pool, 1), "");
@@ -242,6 +160,164 @@ static bool test_poolnum_get_function(void) {
 	return success;
 }
 
+static bool test_lazy_init(void)
+{
+	bool success = true;
+	struct poolnum pool;
+	u16 value;
+
+	success &= assert_equals_int(0, poolnum_init(&pool, 1024, 65535, 1), "Init");
+	if (!success)
+		return success;
+
+	/* Queries and bogus returns don't need the bitmaps. */
+	success &= assert_true(poolnum_is_free(&pool, 2000), "Untouched value is free");
+	success &= assert_equals_int(-EINVAL, poolnum_return(&pool, 2000), "Return to untouched pool");
+	success &= assert_null(pool.bitmap, "Still nothing allocated");
+
+	success &= assert_equals_int(0, poolnum_get_any(&pool, &value), "First borrow");
+	success &= assert_not_null(pool.bitmap, "The first borrow allocated");
+	success &= assert_false(poolnum_is_free(&pool, value), "Borrowed value");
+	success &= assert_equals_int(0, poolnum_return(&pool, value), "Return");
+
+	poolnum_destroy(&pool);
+	return success;
+}
+
+static bool test_permutation(void)
+{
+	bool success = true;
+	struct poolnum pool;
+	unsigned long *seen;
+	u32 domain, i, ciphertext;
+
+	success &= assert_equals_int(0, poolnum_init(&pool, 0, 1022, 2), "Init");
+	if (!success)
+		return success;
+	pool.key = 1234;
+
+	domain = 1U << (2 * pool.half_bits);
+	success &= assert_true(domain >= pool.count, "Domain covers the pool");
+	success &= assert_true(domain / 4 < pool.count, "Domain is not too large");
+
+	seen = kzalloc(BITS_TO_LONGS(domain) * sizeof(unsigned long), GFP_KERNEL);
+	if (!assert_not_null(seen, "Test bitmap allocation")) {
+		poolnum_destroy(&pool);
+		return false;
+	}
+
+	/* Every index comes out exactly once per cycle. */
+	for (i = 0; i < domain; i++) {
+		ciphertext = permute(&pool, i);
+		success &= assert_true(ciphertext < domain, "Ciphertext is within the domain");
+		success &= assert_false(test_bit(ciphertext, seen), "Ciphertext is unique");
+		if (!success)
+			break;
+		__set_bit(ciphertext, seen);
+	}
+
+	/* The starting points never fall outside of the pool. */
+	for (i = 0; i < domain && success; i++)
+		success &= assert_true(next_start(&pool) < pool.count, "Start is within the pool");
+
+	kfree(seen);
+	poolnum_destroy(&pool);
+	return success;
+}
+
+static bool test_poolnum_step(void)
+{
+	bool success = true;
+	struct poolnum pool;
+	u16 value = 0;
+	u32 i;
+
+	/* Same as the low even UDP ports. */
+	success &= assert_equals_int(0, poolnum_init(&pool, 0, 1022, 2), "Init");
+	if (!success)
+		return success;
+	success &= assert_equals_u32(512, pool.count, "Count");
+
+	success &= assert_false(poolnum_get(&pool, 1023), "Odd value");
+	success &= assert_false(poolnum_get(&pool, 1024), "Value beyond max");
+	success &= assert_equals_int(-EINVAL, poolnum_return(&pool, 511), "Return odd value");
+	success &= assert_true(poolnum_get(&pool, 1022), "Max");
+	success &= assert_true(poolnum_get(&pool, 0), "Min");
+
+	for (i = 0; i < 510; i++) {
+		success &= assert_equals_int(0, poolnum_get_any(&pool, &value), "Get any");
+		success &= assert_true(value % 2 == 0 && value <= 1022, "Parity and range");
+	}
+	success &= assert_equals_int(-ESRCH, poolnum_get_any(&pool, &value), "Exhausted");
+
+	poolnum_destroy(&pool);
+	return success;
+}
+
+static bool is_multiple(u16 value, void *arg)
+{
+	return (value % *((u16 *) arg)) == 0;
+}
+
+static bool count_attempts(u16 value, void *arg)
+{
+	(*((u32 *) arg))++;
+	return false;
+}
+
+static bool test_poolnum_get_matching_function(void)
+{
+	struct poolnum pool;
+	u16 divisor = 3, value = 0;
+	u32 attempts;
+	bool results[11] = { false };
+	int i;
+	bool success = true;
+
+	success &= assert_equals_int(0, poolnum_init(&pool, 1, 10, 1), "Pool init");
+	if (!success)
+		return false;
+
+	/* 3, 6 and 9. */
+	for (i = 0; i < 3; i++) {
+		success &= assert_equals_int(0, poolnum_get_matching(&pool, is_multiple, &divisor, 10,
+				&value), "Match result");
+		success &= assert_true(value % 3 == 0, "Match is a multiple");
+		success &= assert_false(results[value], "Match is unique");
+		results[value] = true;
+	}
+	success &= assert_equals_int(-ESRCH, poolnum_get_matching(&pool, is_multiple, &divisor, 10,
+			&value), "No more matches");
+
+	/* The rest of the values are still there. */
+	for (i = 0; i < 7; i++) {
+		success &= assert_equals_int(0, poolnum_get_any(&pool, &value), "Leftover result");
+		success &= assert_false(results[value], "Leftover is unique");
+		results[value] = true;
+	}
+	success &= assert_equals_int(-ESRCH, poolnum_get_any(&pool, &value), "Pool should be empty");
+
+	/* The attempt limit is honored. */
+	success &= assert_equals_int(0, poolnum_return(&pool, 1), "Return 1");
+	success &= assert_equals_int(0, poolnum_return(&pool, 2), "Return 2");
+	success &= assert_equals_int(0, poolnum_return(&pool, 4), "Return 4");
+	attempts = 0;
+	success &= assert_equals_int(-ESRCH, poolnum_get_matching(&pool, count_attempts, &attempts,
+			2, &value), "Limit too low");
+	success &= assert_equals_u32(2, attempts, "Attempts were limited");
+	attempts = 0;
+	success &= assert_equals_int(-ESRCH, poolnum_get_matching(&pool, count_attempts, &attempts,
+			10, &value), "Limit higher than the pool");
+	success &= assert_equals_u32(3, attempts, "Every available value was tested once");
+	divisor = 4;
+	success &= assert_equals_int(0, poolnum_get_matching(&pool, is_multiple, &divisor, 3,
+			&value), "Limit high enough");
+	success &= assert_equals_int(4, value, "Limited match");
+
+	poolnum_destroy(&pool);
+	return success;
+}
+
 static bool test_boundaries(void)
 {
 	const u32 PORT_COUNT = 65536;
@@ -269,10 +345,6 @@ static bool test_boundaries(void)
 		return false;
 	}
 
-	/* Fakely advance both pointers, in order to test the wrapping as well. */
-	pool.next = 10;
-	pool.returned = 10;
-
 	/* Test. */
 	for (i = 0; i < PORT_COUNT; i++) {
 		success &= assert_equals_int(0, poolnum_get_any(&pool, &port), "Function result");
@@ -304,6 +376,10 @@ int init_module(void)
 	CALL_TEST(test_poolnum_get_any_function(), "num_pool_get_any function.");
 	CALL_TEST(test_poolnum_return_function(), "num_pool_return function.");
 	CALL_TEST(test_poolnum_get_function(), "num_pool_get function.");
+	CALL_TEST(test_poolnum_get_matching_function(), "num_pool_get_matching function.");
+	CALL_TEST(test_poolnum_step(), "Stepped pool.");
+	CALL_TEST(test_lazy_init(), "Lazy initialization.");
+	CALL_TEST(test_permutation(), "Start permutation.");
 	CALL_TEST(test_boundaries(), "boundaries test.");
 
 	END_TESTS;
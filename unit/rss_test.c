@@ -0,0 +1,134 @@
+#include <linux/module.h>
+#include <linux/printk.h>
+
+#include "nat64/unit/unit_test.h"
+#include "nat64/mod/rss.h"
+
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Alberto Leiva");
+MODULE_DESCRIPTION("RSS module test");
+
+
+/** The key from Microsoft's RSS verification suite (and the default key of many NICs). */
+static char *key = "6d:5a:56:da:25:5b:0e:c2:41:67:25:3d:43:a3:8f:b0:d0:ca:2b:cb:"
+		"ae:7b:30:b4:77:cb:2d:a3:80:30:f2:0c:6a:42:b7:3b:be:ac:01:fa";
+
+/** A packet from Microsoft's RSS verification suite, and the hashes it is expected to yield. */
+struct rss_vector {
+	__u32 src_addr;
+	__u16 src_port;
+	__u32 dst_addr;
+	__u16 dst_port;
+	/** Hash of the addresses only. */
+	__u32 hash_ip;
+	/** Hash of the addresses and the ports. */
+	__u32 hash_ip_ports;
+};
+
+static struct rss_vector vectors[] = {
+	{ 0x420995bb, 2794, 0xa18e6450, 1766, 0x323e8fc2, 0x51ccc178 },
+	{ 0xc75c6f02, 14230, 0x41458c53, 4739, 0xd718262a, 0xc626b0ea },
+	{ 0x1813c65f, 12898, 0x0c16cfb8, 38024, 0xd2d0a5de, 0x5c2b394a },
+	{ 0x261bcd1e, 48228, 0xd18ea306, 2217, 0x82989176, 0xafc7327f },
+	{ 0x9927a3bf, 44251, 0xcabc7f02, 1303, 0x5d1809c5, 0x10e828a2 },
+};
+
+static void init_addrs(struct rss_vector *vector, struct ipv4_tuple_address *src,
+		struct ipv4_tuple_address *dst)
+{
+	src->address.s_addr = cpu_to_be32(vector->src_addr);
+	src->l4_id = vector->src_port;
+	dst->address.s_addr = cpu_to_be32(vector->dst_addr);
+	dst->l4_id = vector->dst_port;
+}
+
+static bool test_hash(void)
+{
+	struct ipv4_tuple_address src, dst;
+	int indirection[] = { 0 };
+	int i;
+	bool success = true;
+
+	if (!assert_equals_int(0, rss_init(key, indirection, ARRAY_SIZE(indirection)), "init"))
+		return false;
+
+	for (i = 0; i < ARRAY_SIZE(vectors); i++) {
+		init_addrs(&vectors[i], &src, &dst);
+		success &= assert_equals_u32(vectors[i].hash_ip_ports,
+				rss_hash_ipv4(&src, &dst, IPPROTO_TCP), "TCP hash");
+		success &= assert_equals_u32(vectors[i].hash_ip_ports,
+				rss_hash_ipv4(&src, &dst, IPPROTO_UDP), "UDP hash");
+		success &= assert_equals_u32(vectors[i].hash_ip,
+				rss_hash_ipv4(&src, &dst, IPPROTO_ICMP), "ICMP hash");
+	}
+
+	rss_destroy();
+	return success;
+}
+
+static bool test_indirection(void)
+{
+	struct ipv4_tuple_address src, dst;
+	int indirection[] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+	__u32 hash;
+	int i;
+	bool success = true;
+
+	/* Mark a different entry every time, so only the right one points to CPU 1. */
+	for (i = 0; i < ARRAY_SIZE(vectors); i++) {
+		init_addrs(&vectors[i], &src, &dst);
+		hash = vectors[i].hash_ip_ports;
+
+		indirection[hash % ARRAY_SIZE(indirection)] = 1;
+		success &= assert_equals_int(0, rss_init(key, indirection, ARRAY_SIZE(indirection)),
+				"init");
+		success &= assert_equals_int(1, rss_get_cpu_ipv4(&src, &dst, IPPROTO_TCP), "CPU");
+		indirection[hash % ARRAY_SIZE(indirection)] = 0;
+
+		rss_destroy();
+	}
+
+	success &= assert_equals_int(-1, rss_get_cpu_ipv4(&src, &dst, IPPROTO_TCP), "Disabled");
+	return success;
+}
+
+static bool test_init(void)
+{
+	int indirection[] = { 0 };
+	int bad_indirection[] = { 0, nr_cpu_ids };
+	bool success = true;
+
+	success &= assert_equals_int(0, rss_init(NULL, indirection, 0), "Nothing");
+	success &= assert_false(rss_is_enabled(), "Nothing - disabled");
+
+	success &= assert_equals_int(-EINVAL, rss_init(key, indirection, 0), "Key only");
+	success &= assert_equals_int(-EINVAL, rss_init(NULL, indirection, 1), "Table only");
+	success &= assert_equals_int(-EINVAL, rss_init("6d:5a:56:da", indirection, 1), "Short key");
+	success &= assert_equals_int(-EINVAL, rss_init("6d:5a:5x", indirection, 1), "Bad key");
+	success &= assert_equals_int(-EINVAL, rss_init(key, bad_indirection, 2), "Bad CPU");
+	success &= assert_false(rss_is_enabled(), "Errors - disabled");
+
+	success &= assert_equals_int(0, rss_init(key, indirection, 1), "Valid");
+	success &= assert_true(rss_is_enabled(), "Valid - enabled");
+
+	rss_destroy();
+	success &= assert_false(rss_is_enabled(), "Destroyed - disabled");
+	return success;
+}
+
+int init_module(void)
+{
+	START_TESTS("RSS");
+
+	CALL_TEST(test_hash(), "Toeplitz hash");
+	CALL_TEST(test_indirection(), "Indirection table");
+	CALL_TEST(test_init(), "Configuration validation");
+
+	END_TESTS;
+}
+
+void cleanup_module(void)
+{
+	/* No code. */
+}
@@ -0,0 +1,267 @@
+#include <linux/module.h>
+#include <linux/printk.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/cpumask.h>
+#include <linux/math64.h>
+
+#include "nat64/unit/unit_test.h"
+#include "nat64/mod/pool6.h"
+#include "nat64/mod/bib.h"
+#include "nat64/mod/session.h"
+#include "nat64/comm/constants.h"
+
+/**
+ * @file
+ * Session creation scalability benchmark.
+ *
+ * Creates the same number of BIB and session entries (the way Filtering does when the first packet
+ * of an IPv6 UDP flow arrives) using 1, 2, 4... threads, each bound to its own CPU, and reports the
+ * creation rate each time. Flows from different BIB entries take different locks, so the rate
+ * should grow with the number of threads. Does so with both global and per-CPU session tables.
+ */
+
+
+/** Number of BIB and session entries created by every run, regardless of the number of threads. */
+#define BENCH_SESSION_COUNT (128 * 1024)
+
+/** State of a benchmark thread. */
+struct bench_thread {
+	/** Identifies the thread; used to come up with keys nobody else is using. */
+	unsigned int id;
+	/** Number of sessions this thread has to create. */
+	unsigned int count;
+	/** Whether the thread managed to create and insert all of its sessions. */
+	bool success;
+	/** Signaled when the thread is done. */
+	struct completion done;
+};
+
+/** Signaled when the threads can start (so they all do at roughly the same time). */
+static struct completion start;
+
+static bool session_expired_dummy(struct session_entry *session)
+{
+	/* The sessions won't live long enough. */
+	return true;
+}
+
+/** Computes the addresses of "thread"'s "index"th flow. */
+static void init_flow(unsigned int thread, unsigned int index, struct ipv6_pair *pair6,
+		struct ipv4_pair *pair4)
+{
+	memset(pair6, 0, sizeof(*pair6));
+	memset(pair4, 0, sizeof(*pair4));
+
+	pair6->remote.address.s6_addr32[0] = cpu_to_be32(0x20010db8);
+	pair6->remote.address.s6_addr32[2] = cpu_to_be32(thread);
+	pair6->remote.address.s6_addr32[3] = cpu_to_be32(index);
+	pair6->remote.l4_id = 1024 + (index & 0x3ff);
+	pair6->local.address.s6_addr32[0] = cpu_to_be32(0x0064ff9b);
+	pair6->local.address.s6_addr32[3] = cpu_to_be32(0xc6336401);
+	pair6->local.l4_id = 53;
+
+	pair4->local.address.s_addr = cpu_to_be32(0xc6120000 + thread);
+	pair4->local.l4_id = index;
+	pair4->remote.address.s_addr = cpu_to_be32(0xc6336401);
+	pair4->remote.l4_id = 53;
+}
+
+/** Creates and inserts a BIB entry and a session, like Filtering does for new IPv6 UDP flows. */
+static bool create_flow(struct ipv6_pair *pair6, struct ipv4_pair *pair4)
+{
+	struct bib_entry *bib;
+	struct session_entry *session;
+	spinlock_t *lock;
+
+	lock = bib_get_lock(&pair6->remote);
+	spin_lock_bh(lock);
+
+	bib = bib_create(&pair4->local, &pair6->remote, false);
+	if (!bib)
+		goto bib_failure;
+	if (bib_add(bib, IPPROTO_UDP) != 0) {
+		bib_kfree_rcu(bib);
+		goto bib_failure;
+	}
+
+	session = session_create(bib, &pair4->remote, &pair6->local.address, IPPROTO_UDP);
+	if (!session)
+		goto session_failure;
+	session->dying_time = jiffies_to_msecs(jiffies) + 3600 * 1000;
+	if (session_add(session) != 0) {
+		session_kfree_rcu(session);
+		goto session_failure;
+	}
+
+	session_link_to_bib(session);
+
+	spin_unlock_bh(lock);
+	return true;
+
+session_failure:
+	bib_remove(bib, IPPROTO_UDP);
+	bib_kfree_rcu(bib);
+	/* Fall through. */
+
+bib_failure:
+	spin_unlock_bh(lock);
+	return false;
+}
+
+static int bench_thread_function(void *arg)
+{
+	struct bench_thread *thread = arg;
+	struct ipv6_pair pair6;
+	struct ipv4_pair pair4;
+	unsigned int i;
+
+	wait_for_completion(&start);
+
+	thread->success = true;
+	for (i = 0; i < thread->count; i++) {
+		init_flow(thread->id, i, &pair6, &pair4);
+		if (!create_flow(&pair6, &pair4)) {
+			thread->success = false;
+			break;
+		}
+	}
+
+	complete(&thread->done);
+	return 0;
+}
+
+/**
+ * Asserts every session the threads created can be found.
+ */
+static bool validate_sessions(struct bench_thread *threads, unsigned int thread_count)
+{
+	struct ipv6_pair pair6;
+	struct ipv4_pair pair4;
+	unsigned int t, i, missing = 0;
+
+	rcu_read_lock();
+	for (t = 0; t < thread_count; t++) {
+		for (i = 0; i < threads[t].count; i++) {
+			init_flow(t, i, &pair6, &pair4);
+			if (!session_get_by_ipv6(&pair6, IPPROTO_UDP)
+					|| !session_get_by_ipv4(&pair4, IPPROTO_UDP))
+				missing++;
+		}
+	}
+	rcu_read_unlock();
+
+	return assert_equals_u32(0, missing, "Missing sessions");
+}
+
+/**
+ * Creates BENCH_SESSION_COUNT sessions using "thread_count" threads.
+ *
+ * @param sharded whether the session tables should be split into one shard per CPU.
+ * @param ns the time it took will be stored here, in nanoseconds.
+ */
+static bool bench_run(struct bench_thread *threads, unsigned int thread_count, bool sharded,
+		s64 *ns)
+{
+	struct task_struct *task;
+	ktime_t start_time;
+	unsigned int t, cpu;
+	bool success = true;
+
+	if (pool6_init(NULL, 0) != 0
+			|| bib_init(TABLES_DEF_RESERVE_RATE) != 0
+			|| session_init(session_expired_dummy, sharded, TABLES_DEF_RESERVE_RATE) != 0) {
+		log_warning("Could not initialize the tables.");
+		return false;
+	}
+
+	init_completion(&start);
+	cpu = cpumask_first(cpu_online_mask);
+	for (t = 0; t < thread_count; t++) {
+		threads[t].id = t;
+		threads[t].count = BENCH_SESSION_COUNT / thread_count;
+		threads[t].success = false;
+		init_completion(&threads[t].done);
+
+		task = kthread_create(bench_thread_function, &threads[t], "sessionbench/%u", t);
+		if (IS_ERR(task)) {
+			log_warning("Could not create benchmark thread %u.", t);
+			complete_all(&start);
+			thread_count = t;
+			success = false;
+			break;
+		}
+		kthread_bind(task, cpu);
+		wake_up_process(task);
+		cpu = cpumask_next(cpu, cpu_online_mask);
+	}
+
+	start_time = ktime_get();
+	complete_all(&start);
+	for (t = 0; t < thread_count; t++) {
+		wait_for_completion(&threads[t].done);
+		success &= assert_true(threads[t].success, "Thread created its sessions");
+	}
+	*ns = ktime_to_ns(ktime_sub(ktime_get(), start_time));
+
+	success &= validate_sessions(threads, thread_count);
+
+	session_destroy();
+	bib_destroy();
+	pool6_destroy();
+	return success;
+}
+
+static bool bench_scaling(bool sharded)
+{
+	struct bench_thread *threads;
+	unsigned int cpus = num_online_cpus();
+	unsigned int thread_count;
+	u64 rate, single_rate = 0;
+	s64 ns;
+	bool success = true;
+
+	threads = kmalloc(cpus * sizeof(*threads), GFP_KERNEL);
+	if (!threads) {
+		log_warning("Could not allocate the thread states.");
+		return false;
+	}
+
+	for (thread_count = 1; thread_count <= cpus; thread_count <<= 1) {
+		if (!bench_run(threads, thread_count, sharded, &ns)) {
+			success = false;
+			break;
+		}
+
+		rate = div64_u64((u64) BENCH_SESSION_COUNT * NSEC_PER_SEC, (ns > 0) ? ns : 1);
+		if (thread_count == 1)
+			single_rate = rate;
+		log_info("  %u thread(s): %u sessions in %lld us; %llu sessions/s (%llu%% of linear).",
+				thread_count, BENCH_SESSION_COUNT, ns / 1000, rate,
+				div64_u64(rate * 100, single_rate * thread_count));
+	}
+
+	kfree(threads);
+	return success;
+}
+
+int init_module(void)
+{
+	START_TESTS("Session creation benchmark");
+
+	CALL_TEST(bench_scaling(false), "Creation rate versus number of threads, global tables");
+	CALL_TEST(bench_scaling(true), "Creation rate versus number of threads, per-CPU tables");
+
+	END_TESTS;
+}
+
+void cleanup_module(void)
+{
+	/* No code. */
+}
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Alberto Leiva Popper <aleiva@nic.mx>");
+MODULE_DESCRIPTION("Session creation scalability benchmark.");
@@ -23,6 +23,7 @@
 #include "nat64/usr/session.h"
 #include "nat64/usr/filtering.h"
 #include "nat64/usr/translate.h"
+#include "nat64/usr/tables.h"
 
 
 const char *argp_program_version = "NAT64 userspace app 0.1";
@@ -41,6 +42,7 @@ struct arguments {
 
 	struct ipv6_prefix pool6_prefix;
 	bool pool6_prefix_set;
+	struct ipv4_prefix pool6_subset;
 
 	/* BIB, session */
 	bool tcp, udp, icmp;
@@ -51,9 +53,10 @@ struct arguments {
 	struct ipv4_tuple_address bib4;
 	bool bib4_set;
 
-	/* Filtering, translate */
+	/* Filtering, translate, tables */
 	struct filtering_config filtering;
 	struct translate_config translate;
+	struct tables_config tables;
 };
 
 /**
@@ -67,6 +70,7 @@ enum argp_flags {
 	ARGP_SESSION = 's',
 	ARGP_FILTERING = 'y',
 	ARGP_TRANSLATE = 'z',
+	ARGP_TABLES = 'x',
 
 	/* Operations */
 	ARGP_DISPLAY = 'd',
@@ -76,6 +80,7 @@ enum argp_flags {
 	/* Pools */
 	ARGP_PREFIX = 1000,
 	ARGP_ADDRESS = 1001,
+	ARGP_SUBSET = 1002,
 
 	/* BIB, session */
 	ARGP_TCP = 't',
@@ -109,15 +114,25 @@ enum argp_flags {
 	ARGP_BUILD_ID = 4006,
 	ARGP_LOWER_MTU_FAIL = 4007,
 	ARGP_PLATEAUS = 4010,
+
+	/* Tables */
+	ARGP_MAX_LOAD = 5000,
+	ARGP_MIN_LOAD = 5001,
+	ARGP_CLEANER_BATCH = 5002,
+	ARGP_UDP_SLOTS = 5003,
+	ARGP_TCP_SLOTS = 5004,
+	ARGP_ICMP_SLOTS = 5005,
 };
 
 #define NUM_FORMAT "NUM"
 #define PREFIX_FORMAT "ADDR6/NUM"
+#define PREFIX4_FORMAT "ADDR4/NUM"
 #define IPV6_TRANSPORT_FORMAT "ADDR6#NUM"
 #define IPV4_TRANSPORT_FORMAT "ADDR4#NUM"
 #define IPV4_ADDR_FORMAT "ADDR4"
 #define BOOL_FORMAT "BOOL"
 #define NUM_ARR_FORMAT "NUM[,NUM]*"
+#define NUM_PAIR_FORMAT "NUM,NUM"
 
 
 /*
@@ -133,6 +148,9 @@ static struct argp_option options[] =
 	{ "remove",		ARGP_REMOVE,	0, 0, "(Operation) Remove a prefix from the pool." },
 	{ "prefix",		ARGP_PREFIX,	PREFIX_FORMAT, 0,
 			"The prefix to be added or removed. Available on add and remove operations only." },
+	{ "subset",		ARGP_SUBSET,	PREFIX4_FORMAT, 0,
+			"The pool4 addresses the prefix's flows should be masked with (default: any). "
+			"Available on add operations only." },
 
 	{ 0, 0, 0, 0, "IPv4 Pool options:", 11 },
 	{ "pool4",		ARGP_POOL4,		0, 0, "The command will operate on the IPv4 pool." },
@@ -215,6 +233,23 @@ static struct argp_option options[] =
 	{ LOWER_MTU_FAIL_OPT,	ARGP_LOWER_MTU_FAIL,BOOL_FORMAT, 0, "Decrease MTU failure rate." },
 	{ MTU_PLATEAUS_OPT,		ARGP_PLATEAUS,		NUM_ARR_FORMAT,0, "MTU plateaus." },
 
+	{ 0, 0, 0, 0, "BIB and session tables options:", 32 },
+	{ "tables",				ARGP_TABLES,		0, 0,
+				"Command is hash tables related. Use alone to display configuration. "
+				"Will be implicit if any other tables command is entered." },
+	{ MAX_LOAD_OPT,			ARGP_MAX_LOAD,		NUM_FORMAT, 0,
+				"Grow the tables when they hold more than this many entries per 100 slots." },
+	{ MIN_LOAD_OPT,			ARGP_MIN_LOAD,		NUM_FORMAT, 0,
+				"Shrink the tables when they hold less than this many entries per 100 slots." },
+	{ CLEANER_BATCH_OPT,	ARGP_CLEANER_BATCH,	NUM_FORMAT, 0,
+				"Let the session cleaner take a break after deleting this many expired sessions." },
+	{ UDP_SLOTS_OPT,		ARGP_UDP_SLOTS,		NUM_PAIR_FORMAT, 0,
+				"Minimum and maximum number of slots of the UDP tables (powers of two)." },
+	{ TCP_SLOTS_OPT,		ARGP_TCP_SLOTS,		NUM_PAIR_FORMAT, 0,
+				"Minimum and maximum number of slots of the TCP tables (powers of two)." },
+	{ ICMP_SLOTS_OPT,		ARGP_ICMP_SLOTS,	NUM_PAIR_FORMAT, 0,
+				"Minimum and maximum number of slots of the ICMP tables (powers of two)." },
+
 	{ 0 },
 };
 
@@ -246,6 +281,9 @@ static int parse_opt(int key, char *arg, struct argp_state *state)
 	case ARGP_TRANSLATE:
 		arguments->mode = MODE_TRANSLATE;
 		break;
+	case ARGP_TABLES:
+		arguments->mode = MODE_TABLES;
+		break;
 
 	case ARGP_DISPLAY:
 		arguments->operation = OP_DISPLAY;
@@ -275,6 +313,9 @@ static int parse_opt(int key, char *arg, struct argp_state *state)
 		error = str_to_prefix(arg, &arguments->pool6_prefix);
 		arguments->pool6_prefix_set = true;
 		break;
+	case ARGP_SUBSET:
+		error = str_to_prefix4(arg, &arguments->pool6_subset);
+		break;
 	/*
 	case ARGP_STATIC:
 		arguments->static_entries = true;
@@ -380,6 +421,40 @@ static int parse_opt(int key, char *arg, struct argp_state *state)
 				&arguments->translate.mtu_plateau_count);
 		break;
 
+	case ARGP_MAX_LOAD:
+		arguments->mode = MODE_TABLES;
+		arguments->operation |= MAX_LOAD_MASK;
+		error = str_to_u16(arg, &arguments->tables.max_load, 1, 0xFFFF);
+		break;
+	case ARGP_MIN_LOAD:
+		arguments->mode = MODE_TABLES;
+		arguments->operation |= MIN_LOAD_MASK;
+		error = str_to_u16(arg, &arguments->tables.min_load, 0, 0xFFFF);
+		break;
+	case ARGP_CLEANER_BATCH:
+		arguments->mode = MODE_TABLES;
+		arguments->operation |= CLEANER_BATCH_MASK;
+		error = str_to_u16(arg, &arguments->tables.cleaner_batch, 1, 0xFFFF);
+		break;
+	case ARGP_UDP_SLOTS:
+		arguments->mode = MODE_TABLES;
+		arguments->operation |= UDP_SLOTS_MASK;
+		error = str_to_u32_pair(arg, &arguments->tables.udp_slots.min,
+				&arguments->tables.udp_slots.max, TABLES_MIN_SLOTS, TABLES_MAX_SLOTS);
+		break;
+	case ARGP_TCP_SLOTS:
+		arguments->mode = MODE_TABLES;
+		arguments->operation |= TCP_SLOTS_MASK;
+		error = str_to_u32_pair(arg, &arguments->tables.tcp_slots.min,
+				&arguments->tables.tcp_slots.max, TABLES_MIN_SLOTS, TABLES_MAX_SLOTS);
+		break;
+	case ARGP_ICMP_SLOTS:
+		arguments->mode = MODE_TABLES;
+		arguments->operation |= ICMP_SLOTS_MASK;
+		error = str_to_u32_pair(arg, &arguments->tables.icmp_slots.min,
+				&arguments->tables.icmp_slots.max, TABLES_MIN_SLOTS, TABLES_MAX_SLOTS);
+		break;
+
 	default:
 		return ARGP_ERR_UNKNOWN;
 	}
@@ -451,7 +526,7 @@ int main(int argc, char **argv)
 				log_err(ERR_MISSING_PARAM, "Please enter the prefix to be added (--prefix).");
 				return -EINVAL;
 			}
-			return pool6_add(&args.pool6_prefix);
+			return pool6_add(&args.pool6_prefix, &args.pool6_subset);
 		case OP_REMOVE:
 			if (!args.pool6_prefix_set) {
 				log_err(ERR_MISSING_PARAM, "Please enter the prefix to be removed (--prefix).");
@@ -540,6 +615,9 @@ int main(int argc, char **argv)
 			free(args.translate.mtu_plateaus);
 		return error;
 
+	case MODE_TABLES:
+		return tables_request(args.operation, &args.tables);
+
 	default:
 		log_err(ERR_EMPTY_COMMAND, "Command seems empty; --help or --usage for info.");
 		return -EINVAL;
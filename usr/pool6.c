@@ -12,17 +12,24 @@
 static int pool6_display_response(struct nl_msg *msg, void *arg)
 {
 	struct nlmsghdr *hdr;
-	struct ipv6_prefix *prefixes;
+	struct pool6_entry_us *entries;
 	int pref_count, i;
 	char addr_str[INET6_ADDRSTRLEN];
+	char pool4_str[INET_ADDRSTRLEN];
 
 	hdr = nlmsg_hdr(msg);
-	prefixes = nlmsg_data(hdr);
-	pref_count = nlmsg_datalen(hdr) / sizeof(*prefixes);
+	entries = nlmsg_data(hdr);
+	pref_count = nlmsg_datalen(hdr) / sizeof(*entries);
 
 	for (i = 0; i < pref_count; i++) {
-		inet_ntop(AF_INET6, &prefixes[i].address, addr_str, INET6_ADDRSTRLEN);
-		printf("%s/%u\n", addr_str, prefixes[i].len);
+		inet_ntop(AF_INET6, &entries[i].prefix.address, addr_str, INET6_ADDRSTRLEN);
+		if (entries[i].pool4.len == 0) {
+			printf("%s/%u\n", addr_str, entries[i].prefix.len);
+			continue;
+		}
+		inet_ntop(AF_INET, &entries[i].pool4.address, pool4_str, INET_ADDRSTRLEN);
+		printf("%s/%u (masked with %s/%u)\n", addr_str, entries[i].prefix.len, pool4_str,
+				entries[i].pool4.len);
 	}
 
 	*((int *) arg) += pref_count;
@@ -56,7 +63,7 @@ static int pool6_add_response(struct nl_msg *msg, void *arg)
 	return 0;
 }
 
-int pool6_add(struct ipv6_prefix *prefix)
+int pool6_add(struct ipv6_prefix *prefix, struct ipv4_prefix *pool4)
 {
 	unsigned char request[HDR_LEN + PAYLOAD_LEN];
 	struct request_hdr *hdr = (struct request_hdr *) request;
@@ -66,6 +73,7 @@ int pool6_add(struct ipv6_prefix *prefix)
 	hdr->mode = MODE_POOL6;
 	hdr->operation = OP_ADD;
 	payload->update.prefix = *prefix;
+	payload->update.pool4 = *pool4;
 
 	return netlink_request(request, hdr->length, pool6_add_response, NULL);
 }
@@ -60,6 +60,52 @@ int str_to_u16(const char *str, __u16 *u16_out, __u16 min, __u16 max)
 	return 0;
 }
 
+int str_to_u32(const char *str, __u32 *u32_out, __u32 min, __u32 max)
+{
+	unsigned long long result;
+	char *endptr;
+
+	errno = 0;
+	result = strtoull(str, &endptr, 10);
+	if (errno != 0 || str == endptr) {
+		log_err(ERR_PARSE_INT, "Cannot parse '%s' as an integer value.", str);
+		return -EINVAL;
+	}
+	if (result < min || max < result) {
+		log_err(ERR_INT_OUT_OF_BOUNDS, "'%s' is out of bounds (%u-%u).", str, min, max);
+		return -EINVAL;
+	}
+
+	*u32_out = result;
+	return 0;
+}
+
+int str_to_u32_pair(const char *str, __u32 *first_out, __u32 *second_out, __u32 min, __u32 max)
+{
+	const unsigned int str_max_len = 64;
+	char str_copy[str_max_len];
+	char *comma;
+	int error;
+
+	if (strlen(str) + 1 > str_max_len) {
+		log_err(ERR_PARSE_INTARRAY, "'%s' is too long for this poor, limited parser...", str);
+		return -EINVAL;
+	}
+	strcpy(str_copy, str);
+
+	comma = strchr(str_copy, ',');
+	if (!comma) {
+		log_err(ERR_PARSE_INTARRAY, "'%s' should be two comma-separated integers.", str);
+		return -EINVAL;
+	}
+	*comma = '\0';
+
+	error = str_to_u32(str_copy, first_out, min, max);
+	if (error)
+		return error; /* Error msg already printed. */
+	return str_to_u32(comma + 1, second_out, min, max);
+}
+
 int str_to_u16_array(const char *str, __u16 **array_out, __u16 *array_len_out)
 {
 	const unsigned int str_max_len = 2048;
@@ -260,6 +306,41 @@ int str_to_prefix(const char *str, struct ipv6_prefix *prefix_out)
 	return -EINVAL;
 }
 
+int str_to_prefix4(const char *str, struct ipv4_prefix *prefix_out)
+{
+	const char *FORMAT = "<IPv4 address>/<length> (eg. 192.0.2.0/24)";
+	/* [addr + null chara] + / + pref len */
+	const unsigned int STR_MAX_LEN = INET_ADDRSTRLEN + 1 + 2;
+	/* strtok corrupts the string, so we'll be using this copy instead. */
+	char str_copy[STR_MAX_LEN];
+	char *token;
+	int error;
+
+	if (strlen(str) + 1 > STR_MAX_LEN) {
+		log_err(ERR_PARSE_PREFIX, "'%s' is too long for this poor, limited parser...", str);
+		return -EINVAL;
+	}
+	strcpy(str_copy, str);
+
+	token = strtok(str_copy, "/");
+	if (!token) {
+		log_err(ERR_PARSE_PREFIX, "Cannot parse '%s' as a %s.", str, FORMAT);
+		return -EINVAL;
+	}
+
+	error = str_to_addr4(token, &prefix_out->address);
+	if (error)
+		return error;
+
+	token = strtok(NULL, "/");
+	if (!token) {
+		log_err(ERR_PARSE_PREFIX, "'%s' does not seem to contain a mask (format: %s).", str, FORMAT);
+		return -EINVAL;
+	}
+
+	return str_to_u8(token, &prefix_out->len, 0, 32); /* Error msg already printed. */
+}
+
 static char *get_error_msg(enum error_code code)
 {
 	switch (code) {
@@ -325,12 +406,30 @@ static char *get_error_msg(enum error_code code)
 		return "The entry you just tried to remove does not exist in the table.";
 	case ERR_BIB_REINSERT:
 		return "There's a mapping in the table that conflicts with the one being inserted.";
+	case ERR_LOAD_LIMITS:
+		return "The minimum load factor has to be less than half of the maximum load factor.";
+	case ERR_CLEANER_BATCH:
+		return "The session cleaner's batch size cannot be zero.";
+	case ERR_POOL6_FULL:
+		return "The IPv6 pool has seen too many different prefixes; reload the module.";
+	case ERR_POOL6_REINSERT:
+		return "The prefix is already part of the IPv6 pool.";
+	case ERR_POOL6_SUBSET:
+		return "The prefix's IPv4 subset is invalid (try a /24 or longer).";
+	case ERR_TABLE_SLOTS:
+		return "Table sizes have to be powers of two, and the minimum cannot exceed the maximum.";
 
 	case ERR_INVALID_ITERATOR:
 		return "A internal iterator is corrupted.";
 
 	case ERR_POOL4_EMPTY:
 		return "The IPv4 is empty! Please throw in addresses, so the NAT64 can translate.";
+	case ERR_POOL4_SELECT:
+		return "Unknown IPv4 address selection mode.";
+	case ERR_POOL4_BLOCK_SIZE:
+		return "Port block sizes have to be zero (disabled) or powers of two, from 2 to 64.";
+	case ERR_POOL4_DETERM:
+		return "The address belongs to the deterministic NAT's IPv4 range.";
 	case ERR_POOL6_EMPTY:
 		return "The IPv6 is empty! Please throw in prefixes, so the NAT64 can translate.";
 	case ERR_INCOMPLETE_INDEX_BIB:
@@ -341,6 +440,12 @@ static char *get_error_msg(enum error_code code)
 		return "Cannot store a session that has no BIB entry.";
 	case ERR_INCOMPLETE_REMOVE:
 		return "Could not de-index the session correctly.";
+	case ERR_PORT_REUSE_SHARDED:
+		return "Port reuse cannot be combined with sharded session tables.";
+	case ERR_RSS_CONFIG:
+		return "The RSS key or indirection table is invalid.";
+	case ERR_DETERM_CONFIG:
+		return "The deterministic NAT configuration is invalid.";
 
 	case ERR_CONNTRACK:
 		return "Conntrack did not build a tuple for the current packet.";
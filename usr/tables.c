@@ -0,0 +1,91 @@
+#include "nat64/usr/tables.h"
+#include "nat64/comm/str_utils.h"
+#include "nat64/usr/netlink.h"
+#include <errno.h>
+
+
+#define HDR_LEN sizeof(struct request_hdr)
+#define PAYLOAD_LEN sizeof(struct tables_config)
+
+static void print_cache_stats(char *name, struct cache_stats *stats)
+{
+	printf("%s entries in use: %llu (%llu bytes)\n", name, (unsigned long long) stats->in_use,
+			(unsigned long long) stats->in_use * stats->object_size);
+	printf("  Capacity: %llu (%llu bytes)\n", (unsigned long long) stats->capacity,
+			(unsigned long long) stats->capacity * stats->object_size);
+	printf("  Allocated: %llu\n", (unsigned long long) stats->allocs);
+	printf("  Failed allocations: %llu\n", (unsigned long long) stats->failures);
+	printf("  Kept free in advance: %u\n", stats->reserve_size);
+	printf("  Served from the reserve: %llu\n", (unsigned long long) stats->reserve_draws);
+	printf("  Served from other NUMA nodes: %llu\n", (unsigned long long) stats->remote_draws);
+}
+
+static void print_magazine_stats(struct magazine_stats *stats)
+{
+	unsigned long long total = stats->hits + stats->misses;
+
+	printf("Pool4 CPU cache hit rate: %llu%% (%llu of %llu)\n",
+			total ? (unsigned long long) stats->hits * 100 / total : 0,
+			(unsigned long long) stats->hits, total);
+	printf("  Transport addresses cached: %llu\n", (unsigned long long) stats->cached);
+}
+
+static int handle_display_response(struct nl_msg *msg, void *arg)
+{
+	struct tables_config *conf = nlmsg_data(nlmsg_hdr(msg));
+	struct cleaner_stats *stats = &conf->cleaner_stats;
+
+	printf("Maximum load factor (%s): %u%%\n", MAX_LOAD_OPT, conf->max_load);
+	printf("Minimum load factor (%s): %u%%\n", MIN_LOAD_OPT, conf->min_load);
+	printf("Session cleaner batch size (%s): %u\n", CLEANER_BATCH_OPT, conf->cleaner_batch);
+	printf("UDP table slots (%s): %u-%u\n", UDP_SLOTS_OPT, conf->udp_slots.min,
+			conf->udp_slots.max);
+	printf("TCP table slots (%s): %u-%u\n", TCP_SLOTS_OPT, conf->tcp_slots.min,
+			conf->tcp_slots.max);
+	printf("ICMP table slots (%s): %u-%u\n", ICMP_SLOTS_OPT, conf->icmp_slots.min,
+			conf->icmp_slots.max);
+
+	printf("Session cleaner runs: %llu\n", (unsigned long long) stats->runs);
+	printf("  Sessions deleted: %llu\n", (unsigned long long) stats->sessions);
+	printf("  Breaks taken: %llu\n", (unsigned long long) stats->yields);
+	printf("  Last run: %llu us\n", (unsigned long long) stats->last_ns / 1000);
+	printf("  Longest run: %llu us\n", (unsigned long long) stats->max_ns / 1000);
+	printf("  Average run: %llu us\n", (unsigned long long)
+			(stats->runs ? (stats->total_ns / stats->runs / 1000) : 0));
+
+	print_cache_stats("BIB", &conf->bib_cache);
+	print_cache_stats("Session", &conf->session_cache);
+	print_magazine_stats(&conf->pool4_magazines);
+
+	return 0;
+}
+
+static int handle_update_response(struct nl_msg *msg, void *arg)
+{
+	log_info("Value changed successfully.");
+	return 0;
+}
+
+int tables_request(__u32 operation, struct tables_config *config)
+{
+	if (operation == 0) {
+		struct request_hdr request;
+
+		request.length = sizeof(request);
+		request.mode = MODE_TABLES;
+		request.operation = 0;
+
+		return netlink_request(&request, request.length, handle_display_response, NULL);
+	} else {
+		unsigned char request[HDR_LEN + PAYLOAD_LEN];
+		struct request_hdr *hdr = (struct request_hdr *) request;
+		struct tables_config *payload = (struct tables_config *) (request + HDR_LEN);
+
+		hdr->length = sizeof(request);
+		hdr->mode = MODE_TABLES;
+		hdr->operation = operation;
+		*payload = *config;
+
+		return netlink_request(request, hdr->length, handle_update_response, NULL);
+	}
+}